@@ -0,0 +1,30 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Huge-page arena for per-connection memory: buffer data, mempool chunks
+// and slabs. One region is reserved at startup, from the huge pages set
+// aside for MAP_HUGETLB when there are enough of them, otherwise as ordinary
+// memory marked for transparent huge pages (MADV_HUGEPAGE). Blocks are
+// carved from the region in 512-byte size classes and recycled per class,
+// so the state the reactor touches for each connection sits in a few 2 MB
+// pages instead of being scattered over the heap (fewer TLB misses at high
+// connection counts).
+// Until arena_init is called, for blocks over 64 KB and once the region is
+// used up, blocks come from malloc; arena_free tells them apart.
+
+// Reserve a region of size bytes (rounded up to 2 MB). Call once at
+// startup, before any thread allocates.
+// Returns 0 on success, -1 on error (blocks keep coming from malloc)
+int arena_init(size_t size);
+
+// Allocate size bytes, 16-byte aligned at least. Returns NULL when out of
+// memory
+void *arena_alloc(size_t size);
+
+// Free a block of arena_alloc; size is the size it was allocated with
+// (NULL is ignored)
+void arena_free(void *ptr, size_t size);
+
+#endif // ARENA_H
@@ -0,0 +1,82 @@
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include "rate_limit.h"
+#include <time.h>
+
+// Load balancing across the gateways of a route.
+// Picks use power-of-two-choices on weight, in-flight count and a latency
+// EWMA. Each gateway has a circuit breaker: repeated failures open it (no
+// traffic), after a cooldown (or a successful health probe) one trial
+// delivery is let through (half-open), and once that succeeds the gateway
+// is eased back in with a slow-start weight.
+
+struct route;
+struct route_table;
+
+typedef enum {
+  CIRCUIT_CLOSED = 0, // Healthy, full traffic
+  CIRCUIT_OPEN,       // Failing, no traffic until the cooldown ends
+  CIRCUIT_HALF_OPEN   // One trial delivery at a time
+} circuit_state_t;
+
+// Outcome of a delivery attempt, as seen from the gateway
+typedef enum {
+  UPSTREAM_OK = 0, // The gateway answered (even if it refused the mail)
+  UPSTREAM_FAIL,   // Connect failure, timeout, I/O error or 421
+  UPSTREAM_NEUTRAL // Not the gateway's fault (e.g. stale pooled session)
+} upstream_outcome_t;
+
+// One gateway of a route. Runtime fields are guarded by the route's lock.
+typedef struct upstream {
+  char host[256];
+  int port;
+  int weight;
+  int max_concurrency; // Deliveries in flight, 0: unlimited
+  rate_limit_t rate;   // Deliveries started per second
+
+  int inflight;   // Deliveries in progress
+  double ewma_ms; // Smoothed delivery latency, 0 until the first sample
+  circuit_state_t circuit;
+  int failures;     // Consecutive failures
+  time_t opened_at; // Circuit last opened
+  time_t closed_at; // Circuit last closed again (slow start), 0: never
+  int trial;        // Half-open trial in progress
+} upstream_t;
+
+// Health probe: returns 0 if host:port is healthy.
+// The default probe connects, expects the 220 greeting and a 250 reply to
+// NOOP, then says QUIT.
+typedef int (*balancer_probe_pt)(const char *host, int port, int timeout_ms);
+
+// Choose a gateway for one delivery, count it in flight and take one of its
+// rate tokens. Gateways at their concurrency or rate limit are skipped.
+// exclude: gateway that just failed this delivery (NULL for none), only
+// used again if it is the sole candidate.
+// Returns NULL if no gateway can take the delivery: *wait is -1 if every
+// circuit is open, else the seconds until a rate token is due (0: waiting
+// for a concurrency slot)
+upstream_t *balancer_pick(struct route *route, const upstream_t *exclude,
+                          time_t now, double *wait);
+
+// Report the outcome of a delivery picked with balancer_pick.
+// latency_ms < 0: no latency sample
+void balancer_report(struct route *route, upstream_t *u,
+                     upstream_outcome_t outcome, double latency_ms,
+                     time_t now);
+
+// Mean delivery latency over the table's gateways, in milliseconds
+// Returns 0 before the first sample
+double balancer_latency(struct route_table *table);
+
+// Replace the health probe (NULL restores the default NOOP probe)
+void balancer_set_probe(balancer_probe_pt probe);
+
+// Start probing every gateway of the table every interval_sec seconds
+// Returns 0 on success, -1 on error
+int balancer_start(struct route_table *table, int interval_sec);
+
+// Stop the health probe thread
+void balancer_stop(void);
+
+#endif // BALANCER_H
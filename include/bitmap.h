@@ -0,0 +1,41 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Growable bit set, e.g. the recipients of a message that are done with
+// A zero-filled bitmap_t is a valid empty set; words are allocated on the
+// first bit set beyond the current size.
+typedef struct {
+  uint64_t *words;
+  size_t nwords;
+} bitmap_t;
+
+// Set a bit, growing the set as needed
+// Returns 0 on success, -1 when out of memory
+int bitmap_set(bitmap_t *b, size_t bit);
+
+// Test a bit; bits past the end are clear
+int bitmap_test(const bitmap_t *b, size_t bit);
+
+// Whether no bit is set
+int bitmap_empty(const bitmap_t *b);
+
+// Replace dst with a copy of src
+// Returns 0 on success, -1 when out of memory (dst is left unchanged)
+int bitmap_copy(bitmap_t *dst, const bitmap_t *src);
+
+// Replace b with the little-endian bytes in data (the bitmap_bytes layout)
+// Returns 0 on success, -1 when out of memory (b is left unchanged)
+int bitmap_load(bitmap_t *b, const void *data, size_t len);
+
+// Little-endian byte image of b for storage, trailing zero words trimmed;
+// fills *len and returns a buffer to free(), NULL when empty or out of
+// memory (*len is 0 when empty)
+void *bitmap_bytes(const bitmap_t *b, size_t *len);
+
+// Release the words, leaving an empty set
+void bitmap_free(bitmap_t *b);
+
+#endif // BITMAP_H
@@ -1,6 +1,7 @@
 #ifndef BUFFER_H
 #define BUFFER_H
 
+#include "stats.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -12,7 +13,7 @@ typedef struct {
   size_t count; // Current usage
 } buffer_t;
 
-// Create a new ring buffer
+// Create a new ring buffer, accounted to STATS_MEM_BUFFERS
 buffer_t *buffer_create(size_t size);
 
 // Destroy buffer
@@ -38,4 +39,9 @@ size_t buffer_used(buffer_t *buf);
 // Reset buffer logic
 void buffer_reset(buffer_t *buf);
 
+#ifdef STATS_MEM_DEBUG
+// Record the caller as the allocation site
+#define buffer_create(size) STATS_MEM_SITE(buffer_create(size))
+#endif
+
 #endif // BUFFER_H
@@ -3,12 +3,39 @@
 
 #include <stdint.h>
 
+// Upstream gateway of a route
+typedef struct {
+  char *address;       // "host:port"
+  int weight;          // Relative share of the route's traffic
+  int max_concurrency; // Deliveries in flight to this gateway, 0: unlimited
+  double rate;         // Messages per second to this gateway, 0: unlimited
+} config_gateway_t;
+
+// Relay route: recipients in `domain` (and its subdomains) are relayed
+// through its gateways (`gateway: "host:port"` or a weighted `gateways` list)
+typedef struct {
+  char *domain; // "*" for the default route
+  config_gateway_t *gateways;
+  int gateway_count;
+  int max_concurrency; // Deliveries in flight on this route, 0: unlimited
+  double rate;         // Messages per second on this route, 0: unlimited
+  int burst;           // Messages sent at once after a quiet spell (0: rate)
+  char *priority;      // Relay queue lane: high, normal or low (NULL: normal)
+} config_route_t;
+
+// Share of the relay queues of one flow (policy.fair_weights)
+typedef struct {
+  char *flow; // Sender address, domain or client IP (as policy.fair_key)
+  int weight; // Messages taken per round, relative to unlisted flows' 1
+} config_fair_weight_t;
+
 typedef struct {
   struct {
     int port;
     int ssl_port;
     char *bind_address;
     int max_connections;
+    int arena_mb; // Huge-page arena for connection memory (0: malloc)
     char *cert_file;
     char *key_file;
   } server;
@@ -16,6 +43,8 @@ typedef struct {
   struct {
     char *path;
     int max_size_mb;
+    int hot_max_kb;   // Largest message kept in the memory tier (0: off)
+    int hot_cache_mb; // Memory tier budget
   } storage;
 
   struct {
@@ -26,9 +55,34 @@ typedef struct {
   struct {
     char *host;
     int port;
-    int relay_threads;
+    int relay_threads;      // Relay threads at startup (and after reload)
+    int relay_threads_min;  // Scale down to this many when idle (0: fixed)
+    int relay_threads_max;  // Scale up to this many on backlog (0: fixed)
+    int max_inflight;       // Concurrent deliveries per relay thread
+    int large_msg_kb;       // Larger messages use the large lane (0: none)
+    int large_max_inflight; // Large-lane deliveries per relay thread
+    int pool_max_idle;      // Idle sessions kept per upstream (0: no reuse)
+    int pool_idle_timeout;  // Seconds before an idle session is closed
+    int pool_max_msgs;      // Messages per session before reconnecting
+    int health_interval;    // Seconds between gateway health probes (0: off)
+    int retry_interval;     // First retry delay in seconds, doubled per attempt
+    int retry_max_interval; // Longest retry delay
+    int retry_max_age;      // Seconds before an undelivered message expires
+    char *tls;              // STARTTLS: none, opportunistic or required
+    int tls_verify;         // Verify the upstream certificate and host name
+    char *tls_ca_file;      // CA bundle for tls_verify (default: system)
   } upstream;
 
+  struct {
+    config_route_t *routes;
+    int route_count;
+    char **priority_senders; // Addresses or domains relayed in the high lane
+    int priority_sender_count;
+    char *fair_key; // Relay queue flows: sender, sender_domain, client, none
+    config_fair_weight_t *fair_weights;
+    int fair_weight_count;
+  } policy;
+
 } config_t;
 
 // Configuration validation result
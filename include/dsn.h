@@ -0,0 +1,20 @@
+#ifndef DSN_H
+#define DSN_H
+
+// Delivery status notifications (RFC 3464) for recipients the relay gives
+// up on. The report is committed to the spool like received mail and goes
+// back to the envelope sender from the null sender, so it never bounces.
+
+typedef struct {
+  const char *rcpt; // Failed recipient
+  int code;         // Last SMTP reply for it, 0: no reply (unreachable)
+  int expired;      // Given up after retry_max_age rather than refused
+} dsn_rcpt_t;
+
+// Report count failed recipients of message `msg_id` (its spool file name)
+// to sender. Nothing is sent for a null sender.
+// Returns 0 if committed (or not needed), -1 on error
+int dsn_send(const char *sender, const char *msg_id, const dsn_rcpt_t *rcpts,
+             int count);
+
+#endif // DSN_H
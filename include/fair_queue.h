@@ -0,0 +1,47 @@
+#ifndef FAIR_QUEUE_H
+#define FAIR_QUEUE_H
+
+#include "stats.h"
+
+// Bounded queue of pointers shared fairly between flows (senders, tenants,
+// clients...). Each flow keeps its own FIFO and pops serve the flows with
+// items queued by deficit round robin: up to `weight` items from a flow per
+// round. A flow with a deep backlog delays the others by at most a round,
+// yet gets all the capacity they leave unused.
+// Thread-safe behind one lock; nothing blocks: a push to a full queue or
+// flow is refused, and the producer decides how to back off.
+typedef struct fair_queue fair_queue_t;
+
+// capacity items in all, at most flow_capacity of them in one flow
+// (0: capacity), memory accounted to tag. Returns NULL on error
+fair_queue_t *fair_queue_create(int capacity, int flow_capacity,
+                                stats_mem_tag_t tag);
+void fair_queue_destroy(fair_queue_t *fq); // Items still queued are not freed
+
+// Queue an item at the tail of flow `key` (any string, "" included). The
+// flow takes up to `weight` items per round (as of its latest push).
+// Returns 0 if queued, -1 if the queue or the flow is full, or stopped
+int fair_queue_try_push(fair_queue_t *fq, const char *key, int weight,
+                        void *item);
+
+// Queue count items in order under one lock, those that fit: an item is
+// refused if the queue or its flow is full (or out of memory for a new
+// flow), without holding back the other flows' items. The refused items
+// are moved to the front of items, in order.
+// Returns the number queued (none once stopped)
+int fair_queue_push_batch(fair_queue_t *fq, const char **keys,
+                          const int *weights, void **items, int count);
+
+// Take up to max items without blocking, in round robin order of flows
+// Returns the number taken
+int fair_queue_pop_batch(fair_queue_t *fq, void **items, int max);
+
+// Take up to max of the newest items of the longest flow, oldest first,
+// for another consumer to work on: the end its owner reaches last, and the
+// flow that is backing up. Returns the number taken
+int fair_queue_steal_batch(fair_queue_t *fq, void **items, int max);
+
+void fair_queue_stop(fair_queue_t *fq); // Refuse pushes from now on
+int fair_queue_size(fair_queue_t *fq);  // Items queued (without locking)
+
+#endif // FAIR_QUEUE_H
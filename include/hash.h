@@ -0,0 +1,15 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+// FNV-1a string hashes for the small open hash tables (routes, flows,
+// spool ids, TLS session cache). Not for untrusted keys at large scale.
+
+// 32-bit FNV-1a of a NUL-terminated string
+uint32_t hash_fnv1a(const char *s);
+
+// 64-bit FNV-1a of a NUL-terminated string
+uint64_t hash_fnv1a64(const char *s);
+
+#endif // HASH_H
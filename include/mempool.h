@@ -1,13 +1,16 @@
 #ifndef MEMPOOL_H
 #define MEMPOOL_H
 
+#include "stats.h"
 #include <stddef.h>
 
 typedef struct mempool mempool_t;
 
 // Create a new memory pool
-// size_hint: Initial size of the pool (0 for default)
-mempool_t *mempool_create(size_t size_hint);
+// size_hint: Initial size of the pool (0 for default). The pool and its
+// first chunk are a single allocation.
+// tag: Subsystem the pool's memory is accounted to (stats.h)
+mempool_t *mempool_create(size_t size_hint, stats_mem_tag_t tag);
 
 // Destroy the memory pool and free all allocated memory
 void mempool_destroy(mempool_t *pool);
@@ -21,11 +24,32 @@ void *mempool_alloc0(mempool_t *pool, size_t size);
 // Strdup using pool
 char *mempool_strdup(mempool_t *pool, const char *s);
 
-// Free is generally a no-op in simple pointer-bumping pools,
-// or allows reuse if using slab list.
-// For this v1 implementation, we assume pool lifecycle matches request
-// lifecycle, so individual free is not strictly required but provided for
-// interface compatibility.
+// Resize a block of old_size bytes. The most recent allocation grows (or
+// shrinks) in place while its chunk has room; other blocks are copied to a
+// new one, the old space being reclaimed by the next reset.
+// ptr NULL allocates. Returns NULL on failure, leaving ptr untouched.
+void *mempool_realloc(mempool_t *pool, void *ptr, size_t old_size,
+                      size_t size);
+
+// Release the most recent allocation; any other block is only reclaimed by
+// mempool_reset (or mempool_destroy)
 void mempool_free(mempool_t *pool, void *ptr);
 
+// Free everything allocated from the pool at once. The pool keeps its first
+// chunk; the others go to a process-wide free list that growing pools take
+// from before calling malloc.
+void mempool_reset(mempool_t *pool);
+
+#ifdef STATS_MEM_DEBUG
+// Record the caller as the allocation site
+#define mempool_create(size_hint, tag)                                         \
+  STATS_MEM_SITE(mempool_create((size_hint), (tag)))
+#define mempool_alloc(pool, size) STATS_MEM_SITE(mempool_alloc((pool), (size)))
+#define mempool_alloc0(pool, size)                                             \
+  STATS_MEM_SITE(mempool_alloc0((pool), (size)))
+#define mempool_strdup(pool, s) STATS_MEM_SITE(mempool_strdup((pool), (s)))
+#define mempool_realloc(pool, ptr, old_size, size)                             \
+  STATS_MEM_SITE(mempool_realloc((pool), (ptr), (old_size), (size)))
+#endif
+
 #endif // MEMPOOL_H
@@ -1,27 +1,33 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
-#include <pthread.h>
-
-typedef struct queue_node {
-  void *data;
-  struct queue_node *next;
-} queue_node_t;
-
-typedef struct {
-  queue_node_t *head;
-  queue_node_t *tail;
-  int count;
-  int stop;
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-} queue_t;
-
-queue_t *queue_create(void);
-void queue_destroy(queue_t *q);
-void queue_push(queue_t *q, void *data);
-void *queue_pop(queue_t *q);    // Blocking
-void queue_stop(queue_t *q);    // Unblock all pops
+#include <stddef.h>
+
+// Bounded multi-producer multi-consumer queue of pointers.
+// Push and pop are lock-free (a ring of sequence-numbered cells); only the
+// blocking calls sleep, on a futex, when the queue is empty or full.
+typedef struct queue queue_t;
+
+#define QUEUE_DEFAULT_CAPACITY 65536
+
+queue_t *queue_create(void); // QUEUE_DEFAULT_CAPACITY items
+queue_t *queue_create_bounded(size_t capacity); // Rounded up to a power of 2
+void queue_destroy(queue_t *q); // Items still queued are not freed
+int queue_push(queue_t *q, void *data);     // Blocks while full, -1 if stopped
+int queue_try_push(queue_t *q, void *data); // -1 if full or stopped
+void *queue_pop(queue_t *q);    // Blocking, NULL once stopped and empty
+void *queue_try_pop(queue_t *q); // Non-blocking, NULL if empty
+
+// Push count items in order, claiming as many cells as are free at once.
+// Blocks while full; returns the number pushed (short only once stopped).
+int queue_push_batch(queue_t *q, void **items, int count);
+
+// Pop up to max items at once, waiting up to timeout_ms for the first one
+// (0: don't wait, -1: wait until stopped). Returns the number popped.
+int queue_pop_batch(queue_t *q, void **items, int max, int timeout_ms);
+
+void queue_stop(queue_t *q);    // Unblock all pops and pushes
 int queue_is_empty(queue_t *q); // Check if queue is empty
+int queue_size(queue_t *q);     // Number of queued items
 
 #endif // QUEUE_H
@@ -0,0 +1,88 @@
+#ifndef QUEUE_INDEX_H
+#define QUEUE_INDEX_H
+
+#include "bitmap.h"
+#include <stddef.h>
+#include <time.h>
+
+// Persistent index of the relay queue (SQLite, WAL mode).
+// Keeps per-message delivery state so the scheduler and admin tools can
+// answer "what is due now" without touching the spool directories.
+// Writes are buffered and committed in batched transactions by a background
+// thread; every call is a no-op while the index is not open.
+
+typedef enum {
+  QINDEX_QUEUED = 0,   // Handed to the relay workers
+  QINDEX_DEFERRED = 1, // Waiting for next_attempt
+  QINDEX_FAILED = 2    // Given up on, kept in failed/ for inspection
+} qindex_status_t;
+
+typedef struct {
+  char id[256];           // Spool file name
+  char path[1024];        // Spool file path
+  size_t size;            // Spool file size
+  char sender[256];       // Envelope sender
+  char rcpt_domains[512]; // Distinct recipient domains, comma separated
+  time_t next_attempt;    // Next delivery attempt (deferred messages)
+  int attempts;           // Failed delivery attempts so far
+  qindex_status_t status;
+  time_t created;         // First time the message was indexed
+  bitmap_t rcpt_done;     // Recipients (bit i: i-th in the spool file)
+                          // delivered or permanently failed
+} qindex_entry_t;
+
+// Open (or create) the index database
+// Returns 0 on success, -1 on error
+int qindex_open(const char *db_path);
+
+// Flush pending writes and close the database
+void qindex_close(void);
+
+// Record a message handed to the workers (status QUEUED).
+// Attempts and creation time of an existing entry are preserved.
+void qindex_put_queued(const qindex_entry_t *entry);
+
+// Record a failed attempt: status DEFERRED, attempts + 1.
+// rcpt_done: recipients that must not be tried again (copied)
+void qindex_defer(const char *id, time_t next_attempt,
+                  const bitmap_t *rcpt_done);
+
+// Put a message back DEFERRED without counting an attempt (it was held
+// back, not refused)
+void qindex_postpone(const char *id, time_t next_attempt,
+                     const bitmap_t *rcpt_done);
+
+// Record a permanent failure (status FAILED); path: where the spool file
+// was moved to (failed/)
+void qindex_fail(const char *id, const char *path);
+
+// Drop a delivered message from the index
+void qindex_remove(const char *id);
+
+// Commit all pending writes now
+void qindex_flush(void);
+
+// Look up one message
+// Returns 0 if found, -1 otherwise
+int qindex_lookup(const char *id, qindex_entry_t *out);
+
+// Claim up to max deferred messages due at `now`, oldest first, and mark
+// them QUEUED. Returns the number of entries stored in out.
+int qindex_take_due(time_t now, qindex_entry_t *out, int max);
+
+// Call visit for every indexed message, in no particular order, until it
+// returns non-zero. The entry is released after the call; visit may take
+// over its rcpt_done by zeroing it. Meant for startup, as it holds the
+// index for the whole scan.
+// Returns 0 on success, -1 on error or if visit stopped the scan
+typedef int (*qindex_visit_t)(qindex_entry_t *entry, void *arg);
+int qindex_foreach(qindex_visit_t visit, void *arg);
+
+// Release what an entry filled by qindex_lookup/qindex_take_due owns
+// (its rcpt_done words)
+void qindex_entry_release(qindex_entry_t *entry);
+
+// Number of indexed messages with the given status, -1 on error
+long qindex_count(qindex_status_t status);
+
+#endif // QUEUE_INDEX_H
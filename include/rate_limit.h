@@ -0,0 +1,27 @@
+#ifndef RATE_LIMIT_H
+#define RATE_LIMIT_H
+
+// Token bucket: refills at `rate` tokens per second and holds at most
+// `burst` of them. Not thread-safe, callers guard it with their own lock.
+typedef struct {
+  double rate;   // Tokens per second, 0: unlimited
+  double burst;  // Bucket size
+  double tokens; // Tokens available at `last`
+  double last;   // Monotonic time of the last refill, in seconds
+} rate_limit_t;
+
+// Start with a full bucket. burst <= 0 defaults to one second of tokens
+// (at least one).
+void rate_limit_init(rate_limit_t *rl, double rate, double burst);
+
+// Seconds until a token is available at `now` (0: one is available now)
+double rate_limit_wait(rate_limit_t *rl, double now);
+
+// Take a token if one is available
+// Returns 0 if taken, else the seconds until one is available
+double rate_limit_take(rate_limit_t *rl, double now);
+
+// Monotonic clock in seconds, for `now`
+double rate_limit_now(void);
+
+#endif // RATE_LIMIT_H
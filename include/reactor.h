@@ -41,6 +41,11 @@ int event_loop_mod(event_loop_t *loop, reactor_event_t *event, int new_events);
 // Run the loop (blocks)
 void event_loop_run(event_loop_t *loop);
 
+// Wait up to timeout_ms for events and dispatch them once.
+// For threads that interleave the loop with other periodic work.
+// Returns the number of events dispatched, -1 on error
+int event_loop_run_once(event_loop_t *loop, int timeout_ms);
+
 // Stop the loop
 void event_loop_stop(event_loop_t *loop);
 
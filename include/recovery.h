@@ -0,0 +1,30 @@
+#ifndef RECOVERY_H
+#define RECOVERY_H
+
+#include "config.h"
+
+// Take the recovery cutoff and a snapshot of the queue index. Must be called
+// after relay_init and before relay_start: files the relay scanner moves to
+// queue/ afterwards are newer than the cutoff, and deferred messages the
+// scheduler claims afterwards still read deferred in the snapshot, so
+// neither is re-queued twice.
+// Returns 0 on success, -1 on error
+int recovery_prepare(void);
+
+// Start the spool recovery phase in the background.
+// Removes stale tmp/ files and re-queues every message left in queue/ by a
+// previous run (crash or restart). Messages the queue index knew as deferred
+// or failed are left to the relay scheduler. Only files older than the
+// cutoff are touched, so the listener and the relay can run while recovery
+// is still in progress. Must be called after recovery_prepare and
+// relay_start.
+// Returns 0 on success, -1 on error
+int recovery_start(const config_t *config);
+
+// Returns 1 once every spool directory has been scanned
+int recovery_done(void);
+
+// Abort an unfinished recovery and wait for its threads
+void recovery_stop(void);
+
+#endif // RECOVERY_H
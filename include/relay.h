@@ -2,6 +2,7 @@
 #define RELAY_H
 
 #include "config.h"
+#include "storage.h"
 
 // Initialize Relay Subsystem
 int relay_init(config_t *config);
@@ -12,4 +13,23 @@ void relay_start(void);
 // Stop Relay Worker
 void relay_stop(void);
 
+// Run `threads` workers now, then scale between min and max (0: threads)
+// with the backlog. Draining workers finish their deliveries first.
+void relay_set_threads(int threads, int min, int max);
+
+// Deliveries each worker runs at once (upstream.max_inflight), of which
+// large messages (upstream.large_max_inflight); applied from the workers'
+// next wakeup
+void relay_set_inflight(int max_inflight, int large_max_inflight);
+
+// Queue a message for delivery without blocking
+// Returns 0 if queued (msg is taken), -1 if its flow is full on every
+// worker or the relay is stopping: msg is still the caller's, to retry
+// after a backoff
+int relay_submit(storage_msg_t *msg);
+
+// Queue a committed message without blocking (the storage commit hook)
+// Returns 0 if queued (msg is taken), -1 if the queue is full
+int relay_offer(storage_msg_t *msg);
+
 #endif // RELAY_H
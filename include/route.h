@@ -0,0 +1,79 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include "balancer.h"
+#include "config.h"
+#include "rate_limit.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define ROUTE_DOMAIN_MAX 256
+
+// Relay queue lane of a message, by route or sender policy
+typedef enum {
+  ROUTE_PRIORITY_HIGH = 0,
+  ROUTE_PRIORITY_NORMAL,
+  ROUTE_PRIORITY_LOW
+} route_priority_t;
+
+// One relay route (policy.route entry)
+typedef struct route {
+  char domain[ROUTE_DOMAIN_MAX]; // Lower case, "*" for the default route
+  upstream_t *upstreams;         // Gateways, at least one
+  int upstream_count;
+  pthread_mutex_t lock; // Guards the upstreams' balancing state and rate
+  int max_concurrency;  // Deliveries in flight, 0: unlimited
+  atomic_int active;    // Deliveries in flight, all workers
+  rate_limit_t rate;    // Deliveries started per second
+  route_priority_t priority; // Lane of the route's mail
+} route_t;
+
+// Routing table compiled from the configuration. Lookups are read-only and
+// can run from any thread.
+typedef struct route_table route_table_t;
+
+// Compile policy.route into a table keyed by domain. Without a "*" route,
+// unmatched recipients use upstream.host:upstream.port.
+// Returns NULL on error
+route_table_t *route_table_create(const config_t *config);
+
+// Free the table
+void route_table_destroy(route_table_t *table);
+
+// Returns 1 if the parts of the configuration compiled into a route table
+// (policy.route, priority_senders, fair queuing, the default upstream)
+// differ. The table is built once at startup: such changes need a restart.
+int route_config_changed(const config_t *old_cfg, const config_t *new_cfg);
+
+// Route for a recipient domain: the longest matching domain suffix at a
+// label boundary ("a.internal.com" matches "internal.com"), else the
+// default route. Never returns NULL.
+route_t *route_lookup(route_table_t *table, const char *domain);
+
+// Priority of a message to the route from sender: high if the sender's
+// address or domain is in policy.priority_senders, else the route's own
+route_priority_t route_priority(route_table_t *table, const route_t *route,
+                                const char *sender);
+
+// Fair queuing flow of a message (policy.fair_key): its sender address,
+// the sender's domain or the client IP, in lower case, into flow ("" when
+// fair queuing is off). Returns the flow's weight in policy.fair_weights,
+// 1 if not listed.
+int route_flow(route_table_t *table, const char *sender, const char *client,
+               char *flow, size_t size);
+
+// Number of routes, including the default one
+int route_count(const route_table_t *table);
+
+// Route by index, 0 <= index < route_count (0 is the default route)
+route_t *route_at(route_table_t *table, int index);
+
+// Reserve a concurrency slot and a rate token on the route
+// Returns 1 if reserved, 0 if the route is at one of its limits; *wait is
+// then the seconds until a rate token is due (0: waiting for a slot)
+int route_acquire(route_t *route, double *wait);
+
+// Give back a slot reserved with route_acquire
+void route_release(route_t *route);
+
+#endif // ROUTE_H
@@ -0,0 +1,56 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "stats.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+
+// Object cache for one fixed-size type (connections, sessions, messages...)
+// Objects are carved from 64 KB slabs that are kept for reuse rather than
+// returned to malloc, so connection churn neither contends on the malloc
+// lock nor fragments the heap. Once a burst is over, slabs whose objects
+// are all free again are released, keeping a few for the next one.
+// Each thread keeps a magazine of free objects per cache and only takes the
+// cache's lock to trade half a magazine with the shared depot. Objects may
+// be freed by another thread than the one that allocated them; a thread's
+// magazines go back to the depot when it exits.
+//
+// Caches are statically initialized and live as long as the process; their
+// slabs are accounted to a stats.h subsystem tag:
+//   static slab_cache_t g_conn_cache = SLAB_CACHE_INIT(
+//       "connection", connection_t, STATS_MEM_CONNECTIONS);
+typedef struct slab_cache {
+  const char *name;
+  size_t size;          // Object size
+  stats_mem_tag_t tag;  // Subsystem its memory is accounted to
+  atomic_int id;        // Thread magazine index + 1, 0: not assigned yet
+  pthread_mutex_t lock; // Guards the depot and the slab list
+  void *depot;          // Free objects shared by all threads
+  size_t depot_count;
+  void *slabs; // Every slab carved and not released
+  size_t slab_count;
+  size_t trim_at; // Depot size that triggers releasing empty slabs
+} slab_cache_t;
+
+#define SLAB_CACHE_INIT(cache_name, type, mem_tag)                             \
+  {                                                                            \
+    .name = (cache_name), .size = sizeof(type), .tag = (mem_tag),              \
+    .lock = PTHREAD_MUTEX_INITIALIZER                                          \
+  }
+
+// Allocate an object, uninitialized (slab_zalloc: zero-filled)
+// Returns NULL when out of memory
+void *slab_alloc(slab_cache_t *cache);
+void *slab_zalloc(slab_cache_t *cache);
+
+// Give an object back to its cache (NULL is ignored)
+void slab_free(slab_cache_t *cache, void *obj);
+
+#ifdef STATS_MEM_DEBUG
+// Record the caller as the allocation site
+#define slab_alloc(cache) STATS_MEM_SITE(slab_alloc(cache))
+#define slab_zalloc(cache) STATS_MEM_SITE(slab_zalloc(cache))
+#endif
+
+#endif // SLAB_H
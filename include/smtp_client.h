@@ -0,0 +1,162 @@
+#ifndef SMTP_CLIENT_H
+#define SMTP_CLIENT_H
+
+#include "list.h"
+#include "reactor.h"
+#include <openssl/ssl.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define SMTP_CLIENT_HOST_MAX 256
+#define SMTP_CLIENT_RBUF_SIZE 4096
+
+// Extensions advertised in the EHLO reply
+#define SMTP_CAP_PIPELINING 0x01
+#define SMTP_CAP_8BITMIME 0x02
+#define SMTP_CAP_SIZE 0x04
+#define SMTP_CAP_STARTTLS 0x08
+
+// Outbound session state
+typedef enum {
+  SMTP_CLIENT_CONNECTING, // Non-blocking connect in progress
+  SMTP_CLIENT_BANNER,     // Waiting for the 220 greeting
+  SMTP_CLIENT_EHLO,
+  SMTP_CLIENT_STARTTLS, // Waiting for the reply to STARTTLS
+  SMTP_CLIENT_TLS,      // TLS handshake in progress
+  SMTP_CLIENT_READY,    // Idle, can start a transaction
+  SMTP_CLIENT_RSET,     // Resetting a reused session
+  SMTP_CLIENT_MAIL,
+  SMTP_CLIENT_RCPT,
+  SMTP_CLIENT_DATA,
+  SMTP_CLIENT_BODY, // Streaming the message body
+  SMTP_CLIENT_DOT,  // Waiting for the reply to the final "."
+  SMTP_CLIENT_BROKEN // Unusable, must be closed
+} smtp_client_state_t;
+
+typedef enum {
+  SMTP_TX_OK = 0,   // Message accepted
+  SMTP_TX_TEMPFAIL, // 4xx reply, I/O error or timeout
+  SMTP_TX_PERMFAIL  // 5xx reply
+} smtp_tx_result_t;
+
+typedef struct smtp_client smtp_client_t;
+typedef struct smtp_tx smtp_tx_t;
+
+// Transaction completion callback.
+// Called once per transaction from the event loop (or the timeout check);
+// the session may be released or closed from inside the callback.
+typedef void (*smtp_tx_done_pt)(smtp_client_t *c, smtp_tx_t *tx, void *arg);
+
+// One message transaction. Owned by the caller, must stay valid until the
+// done callback has run.
+struct smtp_tx {
+  // Envelope
+  const char *sender;
+  const char *const *rcpts;
+  int rcpt_count;
+  int *rcpt_codes; // Optional, rcpt_count entries: reply to each RCPT,
+                   // 0 if the transaction ended before it was answered
+
+  // Body in wire format (dot-stuffed, terminated by ".\r\n"), either in
+  // memory or as the byte range [body_offset, body_end) of body_fd
+  const char *body;
+  int body_fd;
+  off_t body_offset;
+  off_t body_end;
+
+  // Outcome
+  smtp_tx_result_t result;
+  int code;         // Last reply code, 0 if none
+  char reply[256];  // Last reply line
+  int stale;        // A reused session failed before MAIL: retry on a new one
+  int data_started; // DATA was accepted: the body may have reached the peer
+};
+
+// Outbound SMTP session to an upstream server, driven by an event loop
+struct smtp_client {
+  int fd;
+  char host[SMTP_CLIENT_HOST_MAX];
+  int port;
+  char helo_name[SMTP_CLIENT_HOST_MAX];
+  smtp_client_state_t state;
+  int caps; // SMTP_CAP_* flags
+
+  // STARTTLS (see smtp_client_set_tls)
+  SSL_CTX *tls_ctx; // NULL: plaintext only
+  int tls_required; // Fail instead of falling back to plaintext
+  SSL *ssl;         // Set once STARTTLS was accepted
+  int tls_failed;   // The handshake failed: do not try TLS here again
+
+  event_loop_t *loop;
+  reactor_event_t event;
+  int attached; // Registered with the loop
+
+  // Buffered reply reader (replies may span several reads and lines)
+  char rbuf[SMTP_CLIENT_RBUF_SIZE];
+  size_t rlen;
+
+  // Pending commands
+  char *wbuf;
+  size_t wlen;
+  size_t woff;
+  size_t wcap;
+
+  // Current transaction
+  smtp_tx_t *tx;
+  smtp_tx_done_pt done;
+  void *done_arg;
+  int rcpt_index;    // Next RCPT reply expected
+  int pipelined;     // Envelope sent as one PIPELINING batch
+  int rejected;      // First refused envelope reply, 0 if none
+  int mail_refused;  // MAIL was refused (pipelined: replies still pending)
+  int accepted;      // RCPTs accepted so far
+  int rcpt_tempfail; // A RCPT was refused with a 4xx reply
+
+  int timeout;      // Seconds without progress before the session fails
+  time_t deadline;  // Current operation must progress before this
+  int msgs_sent;    // Messages delivered over this session
+  time_t created;   // Session established
+  time_t last_used; // Last checkin to the pool
+
+  list_node_t node; // Pool list link
+  void *pool_ctx;   // Owning pool destination
+};
+
+// Start a non-blocking connect to addr. The banner and EHLO exchange run on
+// the loop as soon as a transaction is started.
+// Returns NULL on failure
+smtp_client_t *smtp_client_open(event_loop_t *loop, const struct sockaddr *addr,
+                                socklen_t addrlen, const char *host, int port,
+                                const char *helo_name, int timeout_sec);
+
+// Use STARTTLS when the server offers it. If required, a server without
+// STARTTLS (or a failed handshake) fails the transaction. Must be called
+// before the first transaction.
+void smtp_client_set_tls(smtp_client_t *c, SSL_CTX *ctx, int required);
+
+// Start a transaction. A reused session is reset (RSET) first.
+// done is never called from inside this function.
+// Returns 0 on success, -1 if the session cannot take a transaction
+int smtp_client_start(smtp_client_t *c, smtp_tx_t *tx, smtp_tx_done_pt done,
+                      void *arg);
+
+// Fail the current transaction if it made no progress before its deadline
+void smtp_client_check_timeout(smtp_client_t *c, time_t now);
+
+// Register/unregister the session with its event loop
+int smtp_client_attach(smtp_client_t *c);
+void smtp_client_detach(smtp_client_t *c);
+
+// Returns 1 if an idle session still looks usable: the peer has not closed
+// it or sent anything unsolicited (e.g. a 421 timeout notice)
+int smtp_client_idle_ok(smtp_client_t *c);
+
+// Say QUIT without waiting for the reply and close the session
+void smtp_client_quit(smtp_client_t *c);
+
+// Close the session without QUIT
+void smtp_client_close(smtp_client_t *c);
+
+#endif // SMTP_CLIENT_H
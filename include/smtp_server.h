@@ -41,6 +41,8 @@ typedef struct smtp_session {
 
   // Command buffer for line-based processing
   char cmd_buffer[1024];
+  int skip_line;  // Dropping the rest of an overlong line up to its newline
+  int data_error; // A DATA line was too long: refuse the message at "."
 
   // Flags
   int is_esmtp;
@@ -6,11 +6,33 @@
 #include <stdint.h>
 #include <time.h>
 
-// 原子计数器类型 (Thread-safe)
+// 计数器类型 (Thread-safe)
+// g_stats 中的计数器按线程分片: 每个线程更新自己的一份 (独占缓存行,
+// 无原子读改写), stats_get / stats_snapshot / stats_format_* 汇总各分片
 typedef struct {
   _Atomic uint64_t value;
 } atomic_counter_t;
 
+// 内存统计的子系统标签
+typedef enum {
+  STATS_MEM_CONNECTIONS = 0, // 连接对象 (connection_t)
+  STATS_MEM_BUFFERS,         // 连接读写缓冲区
+  STATS_MEM_SESSIONS,        // SMTP 会话及其内存池
+  STATS_MEM_STORAGE,         // 存储上下文与消息
+  STATS_MEM_RELAY_QUEUE,     // 中继队列 (各 worker 的 lane)
+  STATS_MEM_RELAY,           // 投递中的邮件
+  STATS_MEM_SPARE,           // 内存池回收待复用的 chunk
+  STATS_MEM_TAGS
+} stats_mem_tag_t;
+
+// 单个子系统的内存统计
+typedef struct {
+  atomic_counter_t bytes;  // 当前从 malloc 取得的字节数 (slab/chunk/缓冲区)
+  atomic_counter_t peak;   // bytes 的峰值
+  atomic_counter_t chunks; // 当前持有的内存块数
+  atomic_counter_t allocs; // 累计分配次数 (对象/池内分配), 用于计算速率
+} stats_mem_t;
+
 // 全局统计数据结构
 typedef struct {
   // === 连接统计 ===
@@ -33,6 +55,9 @@ typedef struct {
   atomic_counter_t tls_handshakes; // TLS 握手成功次数
   atomic_counter_t tls_errors;     // TLS 错误次数
 
+  // === 内存统计 (按子系统) ===
+  stats_mem_t memory[STATS_MEM_TAGS];
+
   // === 时间戳 ===
   time_t start_time; // 进程启动时间
   time_t last_reset; // 上次重置时间
@@ -46,24 +71,43 @@ int stats_init(void);
 // 销毁统计系统
 void stats_destroy(void);
 
-// 原子操作: 增加计数器
+// 增加计数器 (g_stats 的计数器: 只写本线程分片)
 void stats_inc(atomic_counter_t *counter);
 
-// 原子操作: 减少计数器
+// 减少计数器
 void stats_dec(atomic_counter_t *counter);
 
-// 原子操作: 增加指定值
+// 增加指定值
 void stats_add(atomic_counter_t *counter, uint64_t value);
 
-// 获取计数器当前值 (原子读取)
+// 获取计数器当前值 (g_stats 的计数器: 汇总所有分片, 较慢)
 uint64_t stats_get(const atomic_counter_t *counter);
 
-// 获取全局统计快照 (线程安全)
+// 获取全局统计快照, 一次汇总所有计数器 (线程安全)
 void stats_snapshot(stats_t *snapshot);
 
 // 重置统计数据 (保留 start_time)
 void stats_reset(void);
 
+// 内存统计: 子系统从 malloc 取得 / 归还一块内存 (chunk)
+void stats_mem_alloc(stats_mem_tag_t tag, size_t bytes);
+void stats_mem_free(stats_mem_tag_t tag, size_t bytes);
+
+// 内存统计: 子系统分配器完成一次分配 (size: 请求的字节数)
+void stats_mem_count(stats_mem_tag_t tag, size_t size);
+
+// 子系统标签名 (如 "connections")
+const char *stats_mem_name(stats_mem_tag_t tag);
+
+// 调试模式 (编译时定义 STATS_MEM_DEBUG, 即 cmake -DMEM_DEBUG=ON):
+// 分配器的公开接口被宏包装, 记录调用处的 __FILE__:__LINE__; 随后的
+// stats_mem_count 将分配计入该调用点, stats_format_text 列出分配字节
+// 最多的调用点。用于定位缓慢增长的泄漏。
+#ifdef STATS_MEM_DEBUG
+void stats_mem_site(const char *file, int line);
+#define STATS_MEM_SITE(call) (stats_mem_site(__FILE__, __LINE__), (call))
+#endif
+
 // 格式化输出 (文本格式, 用于 CLI)
 // buf: 输出缓冲区, size: 缓冲区大小
 void stats_format_text(char *buf, size_t size);
@@ -86,6 +130,8 @@ extern stats_t *g_stats;
 
 #define STATS_INC_RELAY_SUCCESS() stats_inc(&g_stats->relay_success)
 #define STATS_INC_RELAY_FAILED() stats_inc(&g_stats->relay_failed)
+#define STATS_INC_RELAY_RETRYING() stats_inc(&g_stats->relay_retrying)
+#define STATS_DEC_RELAY_RETRYING() stats_dec(&g_stats->relay_retrying)
 #define STATS_INC_QUEUE_DEPTH() stats_inc(&g_stats->relay_queue_depth)
 #define STATS_DEC_QUEUE_DEPTH() stats_dec(&g_stats->relay_queue_depth)
 
@@ -1,10 +1,31 @@
 #ifndef STORAGE_H
 #define STORAGE_H
 
+#include "bitmap.h"
 #include <stddef.h>
+#include <time.h>
 
 typedef struct storage_ctx storage_ctx_t;
 
+// Committed message handed to the relay.
+// Small messages are kept in memory (hot tier) next to their durable spool
+// copy, so the relay can deliver them without reading the file back.
+typedef struct storage_msg {
+  char *path;  // Committed spool file
+  char *data;  // Hot tier copy of the whole spool file, NULL when cold
+  size_t size; // Size of data (0 when cold)
+
+  // Relay retry state from the queue index (zero for a new message)
+  int attempts;       // Failed delivery attempts so far
+  time_t created;     // First queued
+  bitmap_t rcpt_done; // Recipients not to try again (qindex_entry_t)
+} storage_msg_t;
+
+// Called by storage_close for messages committed to the relay queue.
+// Returns 0 if the hook took ownership of msg (to be released with
+// storage_msg_free), -1 to refuse it: the message then goes to new/.
+typedef int (*storage_commit_hook_t)(storage_msg_t *msg);
+
 // Initialize storage subsystem (mkdir, etc)
 int storage_init(const char *base_path);
 
@@ -15,10 +36,37 @@ storage_ctx_t *storage_open(const char *queue_id);
 // Append data to the open storage file
 int storage_write(storage_ctx_t *ctx, const char *data, size_t len);
 
+// Terminate the envelope block and record where the message body starts.
+// Spool files are laid out as:
+//   X-Envelope-From/X-Envelope-Client/X-Envelope-To lines
+//   X-Body-Offset: <offset of first body byte>
+//   <empty line>
+//   body in SMTP wire format (CRLF, dot-stuffed, ending with ".\r\n")
+// so the relay can hand the body to the upstream socket verbatim.
+int storage_mark_body(storage_ctx_t *ctx);
+
 // Commit and close (move from tmp to new?)
 int storage_close(storage_ctx_t *ctx);
 
 // Abort and delete
 void storage_abort(storage_ctx_t *ctx);
 
+// Configure the hot tier: messages up to max_msg_size bytes are cached in
+// memory as long as the cache holds less than max_total bytes.
+// A zero max_msg_size disables the hot tier.
+void storage_set_hot_limits(size_t max_msg_size, size_t max_total);
+
+// Install (or clear with NULL) the commit hook.
+// While a hook is installed, messages are committed straight to queue/ and
+// handed to it; without one they are committed to new/ for the relay
+// scanner. Returns once no commit is still running the previous hook, so
+// whatever it uses can be torn down afterwards.
+void storage_set_commit_hook(storage_commit_hook_t hook);
+
+// Create a cold message handle for an existing spool file
+storage_msg_t *storage_msg_create(const char *path);
+
+// Release a message handle and its hot tier memory (the file is untouched)
+void storage_msg_free(storage_msg_t *msg);
+
 #endif // STORAGE_H
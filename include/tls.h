@@ -12,6 +12,19 @@ void tls_init_library(void);
 // Returns NULL on failure
 SSL_CTX *tls_create_context(const char *cert_file, const char *key_file);
 
+// Create SSL Context (Client Mode) for outbound STARTTLS.
+// verify: check the upstream certificate against ca_file (or the system
+// store when ca_file is NULL) and its host name.
+// Sessions are cached per upstream host:port and shared by all threads, so
+// reconnects resume instead of running a full handshake.
+// Returns NULL on failure
+SSL_CTX *tls_create_client_context(const char *ca_file, int verify);
+
+// Create a client SSL on a connected socket, offering the cached session
+// for host:port if there is one
+// Returns NULL on failure
+SSL *tls_client_new(SSL_CTX *ctx, int fd, const char *host, int port);
+
 // Cleanup Library
 void tls_cleanup(void);
 
@@ -0,0 +1,48 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include "reactor.h"
+#include "smtp_client.h"
+#include <time.h>
+
+// Pool of upstream SMTP sessions bound to one event loop, keyed by
+// host:port. A session is handed back after each message and reused for the
+// next one (RSET first), saving the TCP handshake, banner and EHLO round
+// trips. Not thread-safe: each relay worker owns its loop and its pool.
+typedef struct upstream_pool upstream_pool_t;
+
+// Create a pool.
+// max_idle: idle sessions kept per destination (0 disables reuse)
+// idle_timeout: seconds an idle session may stay open
+// max_msgs: messages per session before it is retired
+upstream_pool_t *upstream_pool_create(event_loop_t *loop, int max_idle,
+                                      int idle_timeout, int max_msgs,
+                                      const char *helo_name);
+
+// Use STARTTLS on new sessions (see smtp_client_set_tls). Unless TLS is
+// required, an upstream whose handshake failed gets plaintext sessions for
+// a while.
+void upstream_pool_set_tls(upstream_pool_t *pool, SSL_CTX *ctx, int required);
+
+// Close every session and free the pool
+void upstream_pool_destroy(upstream_pool_t *pool);
+
+// Get a session to host:port for the next transaction.
+// An idle session is reused if it still looks healthy; otherwise a new
+// non-blocking connect is started.
+// Returns NULL on failure
+smtp_client_t *upstream_pool_checkout(upstream_pool_t *pool, const char *host,
+                                      int port);
+
+// Return a session after its transaction finished. Broken sessions, or ones
+// that reached max_msgs, are closed.
+void upstream_pool_release(upstream_pool_t *pool, smtp_client_t *c);
+
+// Periodic maintenance: close idle sessions older than the idle timeout and
+// fail transactions that stopped making progress
+void upstream_pool_tick(upstream_pool_t *pool, time_t now);
+
+// Number of sessions currently running a transaction
+int upstream_pool_busy(upstream_pool_t *pool);
+
+#endif // UPSTREAM_POOL_H
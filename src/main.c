@@ -5,11 +5,14 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "config.h"
 #include "config_reload.h"
 #include "logger.h"
 #include "policy.h"
+#include "recovery.h"
 #include "relay.h"
+#include "route.h"
 #include "smtp_server.h"
 #include "stats.h"
 #include "storage.h"
@@ -35,10 +38,28 @@ void on_config_reloaded(const config_t *old_cfg, const config_t *new_cfg) {
     LOG_INFO("  server.port: %d -> %d (requires restart)", old_cfg->server.port,
              new_cfg->server.port);
   }
-  if (old_cfg->upstream.relay_threads != new_cfg->upstream.relay_threads) {
+  if (old_cfg->upstream.relay_threads != new_cfg->upstream.relay_threads ||
+      old_cfg->upstream.relay_threads_min !=
+          new_cfg->upstream.relay_threads_min ||
+      old_cfg->upstream.relay_threads_max !=
+          new_cfg->upstream.relay_threads_max) {
     LOG_INFO("  upstream.relay_threads: %d -> %d",
              old_cfg->upstream.relay_threads, new_cfg->upstream.relay_threads);
+    relay_set_threads(new_cfg->upstream.relay_threads,
+                      new_cfg->upstream.relay_threads_min,
+                      new_cfg->upstream.relay_threads_max);
   }
+  if (old_cfg->upstream.max_inflight != new_cfg->upstream.max_inflight ||
+      old_cfg->upstream.large_max_inflight !=
+          new_cfg->upstream.large_max_inflight) {
+    LOG_INFO("  upstream.max_inflight: %d -> %d",
+             old_cfg->upstream.max_inflight, new_cfg->upstream.max_inflight);
+    relay_set_inflight(new_cfg->upstream.max_inflight,
+                       new_cfg->upstream.large_max_inflight);
+  }
+  // Deliveries in flight hold on to their route: the table is not swapped
+  if (route_config_changed(old_cfg, new_cfg))
+    LOG_WARN("  policy.route: changed, routes are kept until a restart");
 }
 
 void print_usage(const char *prog_name) {
@@ -120,6 +141,12 @@ int main(int argc, char *argv[]) {
     LOG_WARN("Failed to initialize statistics module");
   }
 
+  // Reserve the huge-page arena before connections allocate from it
+  if (config->server.arena_mb > 0 &&
+      arena_init((size_t)config->server.arena_mb * 1024 * 1024) != 0) {
+    LOG_WARN("Huge-page arena unavailable, connection memory from malloc");
+  }
+
   // Daemonize if requested
   if (daemon_mode) {
     if (daemon(0, 0) == -1) {
@@ -137,6 +164,8 @@ int main(int argc, char *argv[]) {
     logger_destroy();
     return EXIT_FAILURE;
   }
+  storage_set_hot_limits((size_t)config->storage.hot_max_kb * 1024,
+                         (size_t)config->storage.hot_cache_mb * 1024 * 1024);
 
   // Initialize Policy
   policy_init(config);
@@ -158,7 +187,14 @@ int main(int argc, char *argv[]) {
     logger_destroy();
     return EXIT_FAILURE;
   }
+
+  // Re-queue mail left behind by the previous run without delaying startup.
+  // Its cutoff and index snapshot are taken before the relay moves files.
+  int recover = recovery_prepare() == 0;
   relay_start();
+  if (!recover || recovery_start(config) != 0) {
+    LOG_WARN("Spool recovery could not be started");
+  }
 
   // TODO: Initialize Reactor
   // TODO: Initialize Thread Pool
@@ -173,6 +209,7 @@ int main(int argc, char *argv[]) {
 
   LOG_INFO("Shutting down...");
 
+  recovery_stop();
   relay_stop();
   config_reload_stop();
   stats_destroy();
@@ -0,0 +1,410 @@
+#include "balancer.h"
+#include "logger.h"
+#include "route.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Consecutive failures that open a gateway's circuit
+#define BALANCER_FAIL_THRESHOLD 5
+// Seconds an open circuit stays open before a trial delivery
+#define BALANCER_COOLDOWN 30
+// Seconds over which a recovered gateway ramps from 10% to full weight
+#define BALANCER_SLOW_START 30
+// Weight of a new latency sample in the EWMA
+#define BALANCER_EWMA_ALPHA 0.2
+// Health probe connect/reply timeout
+#define BALANCER_PROBE_TIMEOUT_MS 5000
+
+static int default_probe(const char *host, int port, int timeout_ms);
+
+static balancer_probe_pt g_probe = default_probe;
+static pthread_t g_health_thread;
+static volatile int g_health_running = 0;
+static pthread_mutex_t g_health_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_health_cond = PTHREAD_COND_INITIALIZER;
+static route_table_t *g_health_table = NULL;
+static int g_health_interval = 0;
+
+// Per-thread state for the random picks
+static _Thread_local unsigned int g_seed = 0;
+
+static unsigned int pick_random(void) {
+  if (g_seed == 0)
+    g_seed = (unsigned int)time(NULL) ^ (unsigned int)(size_t)&g_seed;
+  return (unsigned int)rand_r(&g_seed);
+}
+
+// Helper: Move an open circuit to half-open once its cooldown is over.
+// Returns 1 if the gateway can take a delivery now
+static int upstream_available(upstream_t *u, time_t now) {
+  if (u->circuit == CIRCUIT_OPEN) {
+    if (now - u->opened_at < BALANCER_COOLDOWN)
+      return 0;
+    u->circuit = CIRCUIT_HALF_OPEN;
+    u->trial = 0;
+  }
+  if (u->circuit == CIRCUIT_HALF_OPEN)
+    return !u->trial;
+  return 1;
+}
+
+// Helper: Configured weight, scaled down while a gateway slow-starts
+static double effective_weight(const upstream_t *u, time_t now) {
+  double w = u->weight > 0 ? u->weight : 1;
+  if (u->closed_at > 0 && now - u->closed_at < BALANCER_SLOW_START) {
+    double f = (double)(now - u->closed_at) / BALANCER_SLOW_START;
+    w *= f < 0.1 ? 0.1 : f;
+  }
+  return w;
+}
+
+// Helper: Expected cost of sending one more delivery to the gateway
+static double upstream_score(const upstream_t *u, time_t now) {
+  return (u->ewma_ms + 1.0) * (u->inflight + 1) / effective_weight(u, now);
+}
+
+// Helper: Weighted random draw among candidates, skipping index skip
+static int weighted_draw(upstream_t **cand, int n, int skip, time_t now) {
+  double total = 0;
+  for (int i = 0; i < n; i++)
+    if (i != skip)
+      total += effective_weight(cand[i], now);
+
+  double x = (double)pick_random() / ((double)RAND_MAX + 1.0) * total;
+  int last = -1;
+  for (int i = 0; i < n; i++) {
+    if (i == skip)
+      continue;
+    last = i;
+    x -= effective_weight(cand[i], now);
+    if (x < 0)
+      return i;
+  }
+  return last;
+}
+
+// Helper: Seconds until the gateway is under its limits (0: now, -1: unknown,
+// waiting for a delivery in flight to finish)
+static double upstream_throttled(upstream_t *u, double mono) {
+  if (u->max_concurrency > 0 && u->inflight >= u->max_concurrency)
+    return -1;
+  return rate_limit_wait(&u->rate, mono);
+}
+
+upstream_t *balancer_pick(route_t *route, const upstream_t *exclude,
+                          time_t now, double *wait) {
+  upstream_t *stack[16];
+  upstream_t **cand = stack;
+  if (route->upstream_count > 16) {
+    cand = malloc((size_t)route->upstream_count * sizeof(upstream_t *));
+    if (!cand) {
+      *wait = -1;
+      return NULL;
+    }
+  }
+
+  pthread_mutex_lock(&route->lock);
+
+  double mono = rate_limit_now();
+  int n = 0, throttled = 0;
+  double soonest = 0;
+  upstream_t *excluded = NULL;
+  for (int i = 0; i < route->upstream_count; i++) {
+    upstream_t *u = &route->upstreams[i];
+    if (!upstream_available(u, now))
+      continue;
+    double w = upstream_throttled(u, mono);
+    if (w != 0) {
+      if (w > 0 && (soonest == 0 || w < soonest))
+        soonest = w; // Soonest rate token, if any
+      throttled = 1;
+      continue;
+    }
+    if (u == exclude)
+      excluded = u;
+    else
+      cand[n++] = u;
+  }
+  // The failed gateway is still better than nothing (but not better than
+  // waiting for a throttled one)
+  if (n == 0 && excluded && !throttled)
+    cand[n++] = excluded;
+
+  upstream_t *u = NULL;
+  if (n == 1) {
+    u = cand[0];
+  } else if (n > 1) {
+    // Power of two choices: draw two by weight, keep the cheaper one
+    int a = weighted_draw(cand, n, -1, now);
+    int b = weighted_draw(cand, n, a, now);
+    u = upstream_score(cand[a], now) <= upstream_score(cand[b], now) ? cand[a]
+                                                                      : cand[b];
+  }
+
+  if (u) {
+    u->inflight++;
+    rate_limit_take(&u->rate, mono);
+    if (u->circuit == CIRCUIT_HALF_OPEN)
+      u->trial = 1;
+  }
+  *wait = u ? 0 : throttled ? soonest : -1;
+
+  pthread_mutex_unlock(&route->lock);
+
+  if (cand != stack)
+    free(cand);
+  return u;
+}
+
+// Helper: Count a failure against a gateway. Caller holds the route lock
+static void upstream_failed(route_t *route, upstream_t *u, time_t now) {
+  u->failures++;
+  if (u->circuit == CIRCUIT_HALF_OPEN ||
+      (u->circuit == CIRCUIT_CLOSED &&
+       u->failures >= BALANCER_FAIL_THRESHOLD)) {
+    if (u->circuit == CIRCUIT_CLOSED)
+      LOG_WARN("Balancer: %s:%d failing on route %s, circuit opened", u->host,
+               u->port, route->domain);
+    u->circuit = CIRCUIT_OPEN;
+    u->trial = 0;
+    u->opened_at = now;
+  } else if (u->circuit == CIRCUIT_OPEN) {
+    u->opened_at = now;
+  }
+}
+
+void balancer_report(route_t *route, upstream_t *u, upstream_outcome_t outcome,
+                     double latency_ms, time_t now) {
+  pthread_mutex_lock(&route->lock);
+
+  if (u->inflight > 0)
+    u->inflight--;
+  if (u->circuit == CIRCUIT_HALF_OPEN)
+    u->trial = 0;
+
+  if (outcome == UPSTREAM_OK) {
+    u->failures = 0;
+    if (latency_ms >= 0)
+      u->ewma_ms = u->ewma_ms == 0
+                       ? latency_ms
+                       : u->ewma_ms + BALANCER_EWMA_ALPHA *
+                                          (latency_ms - u->ewma_ms);
+    if (u->circuit != CIRCUIT_CLOSED) {
+      LOG_INFO("Balancer: %s:%d recovered on route %s, circuit closed",
+               u->host, u->port, route->domain);
+      u->circuit = CIRCUIT_CLOSED;
+      u->closed_at = now;
+    }
+  } else if (outcome == UPSTREAM_FAIL) {
+    upstream_failed(route, u, now);
+  }
+
+  pthread_mutex_unlock(&route->lock);
+}
+
+double balancer_latency(route_table_t *table) {
+  double sum = 0;
+  int samples = 0;
+  for (int i = 0; i < route_count(table); i++) {
+    route_t *route = route_at(table, i);
+    pthread_mutex_lock(&route->lock);
+    for (int j = 0; j < route->upstream_count; j++) {
+      if (route->upstreams[j].ewma_ms > 0) {
+        sum += route->upstreams[j].ewma_ms;
+        samples++;
+      }
+    }
+    pthread_mutex_unlock(&route->lock);
+  }
+  return samples ? sum / samples : 0;
+}
+
+void balancer_set_probe(balancer_probe_pt probe) {
+  g_probe = probe ? probe : default_probe;
+}
+
+// Helper: Wait for fd to become ready for events
+// Returns 0 when ready, -1 on timeout or error
+static int probe_wait(int fd, short events, int timeout_ms) {
+  struct pollfd pfd = {.fd = fd, .events = events};
+  int rc;
+  do {
+    rc = poll(&pfd, 1, timeout_ms);
+  } while (rc < 0 && errno == EINTR);
+  return rc > 0 ? 0 : -1;
+}
+
+// Helper: Read one (possibly multi-line) reply
+// Returns the reply code, -1 on error
+static int probe_reply(int fd, int timeout_ms) {
+  char buf[1024];
+  size_t len = 0;
+
+  for (;;) {
+    // Look for the last line of the reply: "NNN " at a line start
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+      if (buf[i] != '\n')
+        continue;
+      if (i - start >= 3 && (start + 3 >= i || buf[start + 3] != '-'))
+        return atoi(buf + start);
+      start = i + 1;
+    }
+    if (start > 0) {
+      memmove(buf, buf + start, len - start);
+      len -= start;
+    }
+    if (len >= sizeof(buf) - 1 || probe_wait(fd, POLLIN, timeout_ms) != 0)
+      return -1;
+
+    ssize_t n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+    if (n <= 0)
+      return -1;
+    len += (size_t)n;
+  }
+}
+
+// Helper: Non-blocking connect with a timeout
+// Returns fd on success, -1 on error
+static int probe_connect(const char *host, int port, int timeout_ms) {
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", port);
+
+  struct addrinfo hints = {0}, *res = NULL;
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port_str, &hints, &res) != 0)
+    return -1;
+
+  int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd < 0) {
+    freeaddrinfo(res);
+    return -1;
+  }
+
+  int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+  freeaddrinfo(res);
+  if (rc < 0 && errno != EINPROGRESS)
+    goto fail;
+  if (rc < 0) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (probe_wait(fd, POLLOUT, timeout_ms) != 0 ||
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+      goto fail;
+  }
+  return fd;
+
+fail:
+  close(fd);
+  return -1;
+}
+
+static int default_probe(const char *host, int port, int timeout_ms) {
+  int fd = probe_connect(host, port, timeout_ms);
+  if (fd < 0)
+    return -1;
+
+  int ok = probe_reply(fd, timeout_ms) == 220 &&
+           send(fd, "NOOP\r\n", 6, MSG_NOSIGNAL) == 6 &&
+           probe_reply(fd, timeout_ms) == 250;
+  if (ok)
+    send(fd, "QUIT\r\n", 6, MSG_NOSIGNAL);
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+// Helper: Probe one gateway and feed the result to its circuit
+static void probe_upstream(route_t *route, upstream_t *u) {
+  char host[sizeof(u->host)];
+  int port;
+
+  pthread_mutex_lock(&route->lock);
+  memcpy(host, u->host, sizeof(host));
+  port = u->port;
+  pthread_mutex_unlock(&route->lock);
+
+  int healthy = g_probe(host, port, BALANCER_PROBE_TIMEOUT_MS) == 0;
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&route->lock);
+  if (healthy) {
+    // Let a trial delivery through without waiting out the cooldown
+    if (u->circuit == CIRCUIT_OPEN) {
+      LOG_INFO("Balancer: %s:%d answers probes again on route %s", u->host,
+               u->port, route->domain);
+      u->circuit = CIRCUIT_HALF_OPEN;
+      u->trial = 0;
+    }
+  } else {
+    LOG_DEBUG("Balancer: Health probe to %s:%d failed", u->host, u->port);
+    // A half-open gateway may have a trial in flight: leave it to decide
+    if (u->circuit != CIRCUIT_HALF_OPEN)
+      upstream_failed(route, u, now);
+  }
+  pthread_mutex_unlock(&route->lock);
+}
+
+static void *health_thread(void *arg) {
+  (void)arg;
+  LOG_INFO("Balancer: Health probes every %ds", g_health_interval);
+
+  pthread_mutex_lock(&g_health_lock);
+  while (g_health_running) {
+    pthread_mutex_unlock(&g_health_lock);
+
+    int n = route_count(g_health_table);
+    for (int i = 0; i < n && g_health_running; i++) {
+      route_t *r = route_at(g_health_table, i);
+      for (int j = 0; j < r->upstream_count && g_health_running; j++)
+        probe_upstream(r, &r->upstreams[j]);
+    }
+
+    pthread_mutex_lock(&g_health_lock);
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += g_health_interval;
+    while (g_health_running &&
+           pthread_cond_timedwait(&g_health_cond, &g_health_lock, &ts) == 0)
+      ;
+  }
+  pthread_mutex_unlock(&g_health_lock);
+  return NULL;
+}
+
+int balancer_start(route_table_t *table, int interval_sec) {
+  if (g_health_running || interval_sec <= 0)
+    return -1;
+
+  g_health_table = table;
+  g_health_interval = interval_sec;
+  g_health_running = 1;
+  if (pthread_create(&g_health_thread, NULL, health_thread, NULL) != 0) {
+    LOG_ERROR("Balancer: Failed to create health probe thread");
+    g_health_running = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void balancer_stop(void) {
+  pthread_mutex_lock(&g_health_lock);
+  if (!g_health_running) {
+    pthread_mutex_unlock(&g_health_lock);
+    return;
+  }
+  g_health_running = 0;
+  pthread_cond_signal(&g_health_cond);
+  pthread_mutex_unlock(&g_health_lock);
+
+  pthread_join(g_health_thread, NULL);
+}
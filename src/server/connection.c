@@ -1,6 +1,7 @@
 #include "connection.h"
 #include "logger.h"
 #include "policy.h"
+#include "slab.h"
 #include "socket_utils.h"
 #include <errno.h>
 #include <stdlib.h>
@@ -10,6 +11,9 @@
 // Assuming simple malloc based buffers for now, could be mempool later
 #define MAX_BUFFER_SIZE 16384
 
+static slab_cache_t g_connection_cache =
+    SLAB_CACHE_INIT("connection", connection_t, STATS_MEM_CONNECTIONS);
+
 connection_t *connection_accept(event_loop_t *loop, int server_fd) {
   struct sockaddr_in addr;
   socklen_t addrlen = sizeof(addr);
@@ -32,8 +36,7 @@ connection_t *connection_accept(event_loop_t *loop, int server_fd) {
 
   set_tcp_nodelay(fd);
 
-  // TODO: Use mempool for connection_t
-  connection_t *conn = calloc(1, sizeof(connection_t));
+  connection_t *conn = slab_zalloc(&g_connection_cache);
   if (!conn) {
     close(fd);
     return NULL;
@@ -115,7 +118,7 @@ connection_t *connection_accept(event_loop_t *loop, int server_fd) {
 
   set_tcp_nodelay(fd);
 
-  connection_t *conn = calloc(1, sizeof(connection_t));
+  connection_t *conn = slab_zalloc(&g_connection_cache);
   if (!conn) {
     close(fd);
     return NULL;
@@ -178,7 +181,7 @@ void connection_close(connection_t *conn) {
     SSL_free(conn->ssl);
   }
 
-  free(conn);
+  slab_free(&g_connection_cache, conn);
 }
 
 // Unified Event Handler
@@ -0,0 +1,119 @@
+#include "dsn.h"
+#include "logger.h"
+#include "storage.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Helper: Write one formatted line (CRLF added). Generated lines never
+// start with a dot, so the body needs no stuffing.
+static int dsn_printf(storage_ctx_t *ctx, const char *fmt, ...) {
+  char line[1024];
+  va_list ap;
+  va_start(ap, fmt);
+  int len = vsnprintf(line, sizeof(line) - 2, fmt, ap);
+  va_end(ap);
+  if (len < 0)
+    return -1;
+  if ((size_t)len > sizeof(line) - 3)
+    len = (int)sizeof(line) - 3; // Cut, still a valid line
+  memcpy(line + len, "\r\n", 2);
+  return storage_write(ctx, line, (size_t)len + 2);
+}
+
+// Helper: Enhanced status code (RFC 3463) for a recipient
+static const char *dsn_status(const dsn_rcpt_t *r) {
+  if (r->expired)
+    return "4.4.7"; // Delivery time expired
+  if (r->code == 550 || r->code == 551 || r->code == 553)
+    return "5.1.1"; // Bad destination mailbox
+  if (r->code == 552)
+    return "5.2.2"; // Mailbox full
+  return "5.0.0";
+}
+
+int dsn_send(const char *sender, const char *msg_id, const dsn_rcpt_t *rcpts,
+             int count) {
+  if (!sender || !sender[0] || count <= 0)
+    return 0; // Null sender: never bounce a bounce
+
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0)
+    snprintf(host, sizeof(host), "localhost");
+  host[sizeof(host) - 1] = '\0';
+
+  char date[64];
+  time_t now = time(NULL);
+  struct tm tm;
+  strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z",
+           localtime_r(&now, &tm));
+
+  char boundary[64];
+  snprintf(boundary, sizeof(boundary), "dsn.%ld.%d", (long)now, rand());
+
+  storage_ctx_t *ctx = storage_open(NULL);
+  if (!ctx) {
+    LOG_ERROR("DSN: Cannot spool a report for %s to %s", msg_id, sender);
+    return -1;
+  }
+
+  dsn_printf(ctx, "X-Envelope-From: <>");
+  dsn_printf(ctx, "X-Envelope-To: %s", sender);
+  storage_mark_body(ctx);
+
+  dsn_printf(ctx, "From: Mail Delivery System <MAILER-DAEMON@%s>", host);
+  dsn_printf(ctx, "To: <%s>", sender);
+  dsn_printf(ctx, "Subject: Undelivered Mail Returned to Sender");
+  dsn_printf(ctx, "Date: %s", date);
+  dsn_printf(ctx, "Auto-Submitted: auto-replied");
+  dsn_printf(ctx, "MIME-Version: 1.0");
+  dsn_printf(ctx, "Content-Type: multipart/report; "
+                  "report-type=delivery-status; boundary=\"%s\"",
+             boundary);
+  dsn_printf(ctx, "");
+
+  dsn_printf(ctx, "--%s", boundary);
+  dsn_printf(ctx, "Content-Type: text/plain; charset=us-ascii");
+  dsn_printf(ctx, "");
+  dsn_printf(ctx, "Your message %s could not be delivered to the following "
+                  "recipients:",
+             msg_id);
+  dsn_printf(ctx, "");
+  for (int i = 0; i < count; i++) {
+    if (rcpts[i].expired)
+      dsn_printf(ctx, "  <%s>: still failing when the retry period ended",
+                 rcpts[i].rcpt);
+    else
+      dsn_printf(ctx, "  <%s>: refused by the receiving server (%d)",
+                 rcpts[i].rcpt, rcpts[i].code);
+  }
+  dsn_printf(ctx, "");
+
+  dsn_printf(ctx, "--%s", boundary);
+  dsn_printf(ctx, "Content-Type: message/delivery-status");
+  dsn_printf(ctx, "");
+  dsn_printf(ctx, "Reporting-MTA: dns; %s", host);
+  for (int i = 0; i < count; i++) {
+    dsn_printf(ctx, "");
+    dsn_printf(ctx, "Final-Recipient: rfc822; %s", rcpts[i].rcpt);
+    dsn_printf(ctx, "Action: failed");
+    dsn_printf(ctx, "Status: %s", dsn_status(&rcpts[i]));
+    if (rcpts[i].code > 0)
+      dsn_printf(ctx, "Diagnostic-Code: smtp; %d", rcpts[i].code);
+  }
+  dsn_printf(ctx, "");
+  dsn_printf(ctx, "--%s--", boundary);
+  storage_write(ctx, ".\r\n", 3); // End of data
+
+  if (storage_close(ctx) != 0) {
+    LOG_ERROR("DSN: Failed to commit the report for %s to %s", msg_id,
+              sender);
+    return -1;
+  }
+  LOG_INFO("DSN: Reported %d failed recipients of %s to %s", count, msg_id,
+           sender);
+  return 0;
+}
@@ -0,0 +1,457 @@
+#include "queue_index.h"
+#include "logger.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pending writes are committed when this many accumulate, or after the
+// flush interval, whichever comes first
+#define QINDEX_BATCH_MAX 512
+#define QINDEX_FLUSH_INTERVAL_MS 50
+
+#define QINDEX_COLUMNS                                                         \
+  "id, path, size, sender, rcpt_domains, next_attempt, attempts, status, "     \
+  "created, rcpt_done"
+
+typedef enum {
+  QOP_PUT_QUEUED,
+  QOP_DEFER,
+  QOP_FAIL,
+  QOP_REMOVE
+} qindex_op_type_t;
+
+typedef struct {
+  qindex_op_type_t type;
+  qindex_entry_t entry; // Only id (next_attempt, attempts, rcpt_done, path)
+                        // for update ops
+} qindex_op_t;
+
+typedef struct {
+  qindex_op_t *ops;
+  int count;
+  int capacity;
+} qindex_batch_t;
+
+static sqlite3 *g_db = NULL;
+static pthread_mutex_t g_db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static sqlite3_stmt *st_put, *st_defer, *st_fail, *st_remove;
+static sqlite3_stmt *st_lookup, *st_due, *st_claim, *st_count;
+
+// Writes waiting for the next batch
+static qindex_batch_t g_pending;
+static qindex_batch_t g_applying;
+static pthread_mutex_t g_ops_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_ops_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_t g_flush_thread;
+static volatile int g_running = 0;
+
+static const char *schema_sql =
+    "PRAGMA journal_mode=WAL;"
+    "PRAGMA synchronous=NORMAL;"
+    "CREATE TABLE IF NOT EXISTS queue ("
+    "  id TEXT PRIMARY KEY,"
+    "  path TEXT NOT NULL,"
+    "  size INTEGER NOT NULL DEFAULT 0,"
+    "  sender TEXT,"
+    "  rcpt_domains TEXT,"
+    "  next_attempt INTEGER NOT NULL DEFAULT 0,"
+    "  attempts INTEGER NOT NULL DEFAULT 0,"
+    "  status INTEGER NOT NULL DEFAULT 0,"
+    "  created INTEGER NOT NULL,"
+    "  rcpt_done BLOB NOT NULL DEFAULT x''"
+    ");"
+    "CREATE INDEX IF NOT EXISTS queue_due ON queue(status, next_attempt);";
+
+static int prepare(const char *sql, sqlite3_stmt **stmt) {
+  if (sqlite3_prepare_v2(g_db, sql, -1, stmt, NULL) != SQLITE_OK) {
+    LOG_ERROR("Queue index: Failed to prepare \"%s\": %s", sql,
+              sqlite3_errmsg(g_db));
+    return -1;
+  }
+  return 0;
+}
+
+static void exec_sql(const char *sql) {
+  char *err = NULL;
+  if (sqlite3_exec(g_db, sql, NULL, NULL, &err) != SQLITE_OK) {
+    LOG_ERROR("Queue index: \"%s\" failed: %s", sql, err ? err : "?");
+    sqlite3_free(err);
+  }
+}
+
+static void copy_text(char *dst, size_t size, sqlite3_stmt *stmt, int col) {
+  const unsigned char *text = sqlite3_column_text(stmt, col);
+  snprintf(dst, size, "%s", text ? (const char *)text : "");
+}
+
+static void read_row(sqlite3_stmt *stmt, qindex_entry_t *e) {
+  copy_text(e->id, sizeof(e->id), stmt, 0);
+  copy_text(e->path, sizeof(e->path), stmt, 1);
+  e->size = (size_t)sqlite3_column_int64(stmt, 2);
+  copy_text(e->sender, sizeof(e->sender), stmt, 3);
+  copy_text(e->rcpt_domains, sizeof(e->rcpt_domains), stmt, 4);
+  e->next_attempt = (time_t)sqlite3_column_int64(stmt, 5);
+  e->attempts = sqlite3_column_int(stmt, 6);
+  e->status = (qindex_status_t)sqlite3_column_int(stmt, 7);
+  e->created = (time_t)sqlite3_column_int64(stmt, 8);
+
+  // rcpt_done is a bitmap_bytes image
+  memset(&e->rcpt_done, 0, sizeof(e->rcpt_done));
+  const void *data = sqlite3_column_blob(stmt, 9);
+  int len = sqlite3_column_bytes(stmt, 9);
+  if (data && len > 0 && bitmap_load(&e->rcpt_done, data, (size_t)len) != 0)
+    LOG_ERROR("Queue index: Out of memory reading recipients of %s", e->id);
+}
+
+static void step_reset(sqlite3_stmt *stmt) {
+  if (sqlite3_step(stmt) != SQLITE_DONE)
+    LOG_ERROR("Queue index: Write failed: %s", sqlite3_errmsg(g_db));
+  sqlite3_reset(stmt);
+}
+
+static void apply_op(const qindex_op_t *op) {
+  const qindex_entry_t *e = &op->entry;
+  switch (op->type) {
+  case QOP_PUT_QUEUED:
+    sqlite3_bind_text(st_put, 1, e->id, -1, SQLITE_STATIC);
+    sqlite3_bind_text(st_put, 2, e->path, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st_put, 3, (sqlite3_int64)e->size);
+    sqlite3_bind_text(st_put, 4, e->sender, -1, SQLITE_STATIC);
+    sqlite3_bind_text(st_put, 5, e->rcpt_domains, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st_put, 6, (sqlite3_int64)e->created);
+    step_reset(st_put);
+    break;
+  case QOP_DEFER: {
+    size_t len;
+    void *done = bitmap_bytes(&e->rcpt_done, &len);
+    if (!done && !bitmap_empty(&e->rcpt_done)) {
+      LOG_ERROR("Queue index: Out of memory, dropping update for %s", e->id);
+      break;
+    }
+    sqlite3_bind_text(st_defer, 1, e->id, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st_defer, 2, (sqlite3_int64)e->next_attempt);
+    if (done)
+      sqlite3_bind_blob(st_defer, 3, done, (int)len, SQLITE_STATIC);
+    else
+      sqlite3_bind_zeroblob(st_defer, 3, 0);
+    sqlite3_bind_int(st_defer, 4, e->attempts); // Attempts to add
+    step_reset(st_defer);
+    free(done);
+    break;
+  }
+  case QOP_FAIL:
+    sqlite3_bind_text(st_fail, 1, e->id, -1, SQLITE_STATIC);
+    sqlite3_bind_text(st_fail, 2, e->path, -1, SQLITE_STATIC);
+    step_reset(st_fail);
+    break;
+  case QOP_REMOVE:
+    sqlite3_bind_text(st_remove, 1, e->id, -1, SQLITE_STATIC);
+    step_reset(st_remove);
+    break;
+  }
+}
+
+// Commit everything queued so far in one transaction.
+// Caller holds g_db_lock, which also keeps batches in order.
+static void apply_pending_locked(void) {
+  pthread_mutex_lock(&g_ops_lock);
+  qindex_batch_t tmp = g_applying;
+  g_applying = g_pending;
+  g_pending = tmp;
+  g_pending.count = 0;
+  pthread_mutex_unlock(&g_ops_lock);
+
+  if (g_applying.count == 0)
+    return;
+
+  exec_sql("BEGIN");
+  for (int i = 0; i < g_applying.count; i++)
+    apply_op(&g_applying.ops[i]);
+  exec_sql("COMMIT");
+  for (int i = 0; i < g_applying.count; i++)
+    bitmap_free(&g_applying.ops[i].entry.rcpt_done);
+  g_applying.count = 0;
+}
+
+static void push_op(qindex_op_type_t type, const qindex_entry_t *entry) {
+  if (!g_db)
+    return;
+
+  // Ops own a copy of the recipients, only defers carry them
+  bitmap_t done = {0};
+  if (type == QOP_DEFER && bitmap_copy(&done, &entry->rcpt_done) != 0) {
+    LOG_ERROR("Queue index: Out of memory, dropping update for %s",
+              entry->id);
+    return;
+  }
+
+  pthread_mutex_lock(&g_ops_lock);
+  if (g_pending.count == g_pending.capacity) {
+    int cap = g_pending.capacity ? g_pending.capacity * 2 : 64;
+    qindex_op_t *ops = realloc(g_pending.ops, sizeof(qindex_op_t) * cap);
+    if (!ops) {
+      pthread_mutex_unlock(&g_ops_lock);
+      bitmap_free(&done);
+      LOG_ERROR("Queue index: Out of memory, dropping update for %s",
+                entry->id);
+      return;
+    }
+    g_pending.ops = ops;
+    g_pending.capacity = cap;
+  }
+  qindex_op_t *op = &g_pending.ops[g_pending.count++];
+  op->type = type;
+  op->entry = *entry;
+  op->entry.rcpt_done = done;
+  if (g_pending.count >= QINDEX_BATCH_MAX)
+    pthread_cond_signal(&g_ops_cond);
+  pthread_mutex_unlock(&g_ops_lock);
+}
+
+static void *qindex_flush_thread(void *arg) {
+  (void)arg;
+  while (g_running) {
+    pthread_mutex_lock(&g_ops_lock);
+    if (g_pending.count < QINDEX_BATCH_MAX && g_running) {
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += QINDEX_FLUSH_INTERVAL_MS * 1000000L;
+      if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+      }
+      pthread_cond_timedwait(&g_ops_cond, &g_ops_lock, &ts);
+    }
+    pthread_mutex_unlock(&g_ops_lock);
+
+    pthread_mutex_lock(&g_db_lock);
+    apply_pending_locked();
+    pthread_mutex_unlock(&g_db_lock);
+  }
+  return NULL;
+}
+
+int qindex_open(const char *db_path) {
+  if (g_db)
+    return 0;
+
+  if (sqlite3_open_v2(db_path, &g_db,
+                      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE |
+                          SQLITE_OPEN_NOMUTEX,
+                      NULL) != SQLITE_OK) {
+    LOG_ERROR("Queue index: Cannot open %s: %s", db_path,
+              g_db ? sqlite3_errmsg(g_db) : "out of memory");
+    sqlite3_close(g_db);
+    g_db = NULL;
+    return -1;
+  }
+  sqlite3_busy_timeout(g_db, 5000);
+
+  char *err = NULL;
+  if (sqlite3_exec(g_db, schema_sql, NULL, NULL, &err) != SQLITE_OK) {
+    LOG_ERROR("Queue index: Schema setup failed: %s", err ? err : "?");
+    sqlite3_free(err);
+    sqlite3_close(g_db);
+    g_db = NULL;
+    return -1;
+  }
+
+  if (prepare("INSERT INTO queue (" QINDEX_COLUMNS ") "
+              "VALUES (?1, ?2, ?3, ?4, ?5, 0, 0, 0, ?6, x'') "
+              "ON CONFLICT(id) DO UPDATE SET path = excluded.path, "
+              "size = excluded.size, sender = excluded.sender, "
+              "rcpt_domains = excluded.rcpt_domains, status = 0",
+              &st_put) != 0 ||
+      prepare("UPDATE queue SET status = 1, attempts = attempts + ?4, "
+              "next_attempt = ?2, rcpt_done = ?3 WHERE id = ?1",
+              &st_defer) != 0 ||
+      prepare("UPDATE queue SET status = 2, attempts = attempts + 1, "
+              "path = ?2 WHERE id = ?1",
+              &st_fail) != 0 ||
+      prepare("DELETE FROM queue WHERE id = ?1", &st_remove) != 0 ||
+      prepare("SELECT " QINDEX_COLUMNS " FROM queue WHERE id = ?1",
+              &st_lookup) != 0 ||
+      prepare("SELECT " QINDEX_COLUMNS " FROM queue "
+              "WHERE status = 1 AND next_attempt <= ?1 "
+              "ORDER BY next_attempt LIMIT ?2",
+              &st_due) != 0 ||
+      prepare("UPDATE queue SET status = 0 WHERE id = ?1", &st_claim) != 0 ||
+      prepare("SELECT COUNT(*) FROM queue WHERE status = ?1", &st_count) !=
+          0) {
+    qindex_close();
+    return -1;
+  }
+
+  g_running = 1;
+  if (pthread_create(&g_flush_thread, NULL, qindex_flush_thread, NULL) != 0) {
+    LOG_ERROR("Queue index: Failed to start flush thread: %s",
+              strerror(errno));
+    g_running = 0;
+    qindex_close();
+    return -1;
+  }
+
+  LOG_INFO("Queue index opened: %s (WAL)", db_path);
+  return 0;
+}
+
+void qindex_close(void) {
+  if (!g_db)
+    return;
+
+  if (g_running) {
+    pthread_mutex_lock(&g_ops_lock);
+    g_running = 0;
+    pthread_cond_signal(&g_ops_cond);
+    pthread_mutex_unlock(&g_ops_lock);
+    pthread_join(g_flush_thread, NULL);
+  }
+
+  pthread_mutex_lock(&g_db_lock);
+  apply_pending_locked();
+  sqlite3_stmt **stmts[] = {&st_put,    &st_defer, &st_fail,  &st_remove,
+                            &st_lookup, &st_due,   &st_claim, &st_count};
+  for (size_t i = 0; i < sizeof(stmts) / sizeof(stmts[0]); i++) {
+    sqlite3_finalize(*stmts[i]);
+    *stmts[i] = NULL;
+  }
+  sqlite3_close(g_db);
+  g_db = NULL;
+  pthread_mutex_unlock(&g_db_lock);
+
+  free(g_pending.ops);
+  free(g_applying.ops);
+  memset(&g_pending, 0, sizeof(g_pending));
+  memset(&g_applying, 0, sizeof(g_applying));
+  LOG_INFO("Queue index closed");
+}
+
+void qindex_put_queued(const qindex_entry_t *entry) {
+  push_op(QOP_PUT_QUEUED, entry);
+}
+
+void qindex_defer(const char *id, time_t next_attempt,
+                  const bitmap_t *rcpt_done) {
+  qindex_entry_t e;
+  snprintf(e.id, sizeof(e.id), "%s", id);
+  e.next_attempt = next_attempt;
+  e.attempts = 1;
+  e.rcpt_done = *rcpt_done; // Copied by push_op
+  push_op(QOP_DEFER, &e);
+}
+
+void qindex_postpone(const char *id, time_t next_attempt,
+                     const bitmap_t *rcpt_done) {
+  qindex_entry_t e;
+  snprintf(e.id, sizeof(e.id), "%s", id);
+  e.next_attempt = next_attempt;
+  e.attempts = 0;
+  e.rcpt_done = *rcpt_done; // Copied by push_op
+  push_op(QOP_DEFER, &e);
+}
+
+void qindex_fail(const char *id, const char *path) {
+  qindex_entry_t e;
+  snprintf(e.id, sizeof(e.id), "%s", id);
+  snprintf(e.path, sizeof(e.path), "%s", path);
+  push_op(QOP_FAIL, &e);
+}
+
+void qindex_remove(const char *id) {
+  qindex_entry_t e;
+  snprintf(e.id, sizeof(e.id), "%s", id);
+  push_op(QOP_REMOVE, &e);
+}
+
+void qindex_entry_release(qindex_entry_t *entry) {
+  bitmap_free(&entry->rcpt_done);
+}
+
+void qindex_flush(void) {
+  pthread_mutex_lock(&g_db_lock);
+  if (g_db)
+    apply_pending_locked();
+  pthread_mutex_unlock(&g_db_lock);
+}
+
+int qindex_lookup(const char *id, qindex_entry_t *out) {
+  int ret = -1;
+  pthread_mutex_lock(&g_db_lock);
+  if (g_db) {
+    apply_pending_locked();
+    sqlite3_bind_text(st_lookup, 1, id, -1, SQLITE_STATIC);
+    if (sqlite3_step(st_lookup) == SQLITE_ROW) {
+      read_row(st_lookup, out);
+      ret = 0;
+    }
+    sqlite3_reset(st_lookup);
+  }
+  pthread_mutex_unlock(&g_db_lock);
+  return ret;
+}
+
+int qindex_take_due(time_t now, qindex_entry_t *out, int max) {
+  int n = 0;
+  pthread_mutex_lock(&g_db_lock);
+  if (g_db && max > 0) {
+    apply_pending_locked();
+    exec_sql("BEGIN");
+    sqlite3_bind_int64(st_due, 1, (sqlite3_int64)now);
+    sqlite3_bind_int(st_due, 2, max);
+    while (n < max && sqlite3_step(st_due) == SQLITE_ROW)
+      read_row(st_due, &out[n++]);
+    sqlite3_reset(st_due);
+
+    for (int i = 0; i < n; i++) {
+      out[i].status = QINDEX_QUEUED;
+      sqlite3_bind_text(st_claim, 1, out[i].id, -1, SQLITE_STATIC);
+      step_reset(st_claim);
+    }
+    exec_sql("COMMIT");
+  }
+  pthread_mutex_unlock(&g_db_lock);
+  return n;
+}
+
+int qindex_foreach(qindex_visit_t visit, void *arg) {
+  int ret = 0;
+  pthread_mutex_lock(&g_db_lock);
+  if (g_db) {
+    apply_pending_locked();
+    sqlite3_stmt *stmt = NULL;
+    ret = prepare("SELECT " QINDEX_COLUMNS " FROM queue", &stmt);
+    int rc = SQLITE_DONE;
+    while (ret == 0 && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      qindex_entry_t e;
+      read_row(stmt, &e);
+      ret = visit(&e, arg) != 0 ? -1 : 0;
+      qindex_entry_release(&e);
+    }
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+      LOG_ERROR("Queue index: Scan failed: %s", sqlite3_errmsg(g_db));
+      ret = -1;
+    }
+    sqlite3_finalize(stmt);
+  }
+  pthread_mutex_unlock(&g_db_lock);
+  return ret;
+}
+
+long qindex_count(qindex_status_t status) {
+  long count = -1;
+  pthread_mutex_lock(&g_db_lock);
+  if (g_db) {
+    apply_pending_locked();
+    sqlite3_bind_int(st_count, 1, (int)status);
+    if (sqlite3_step(st_count) == SQLITE_ROW)
+      count = (long)sqlite3_column_int64(st_count, 0);
+    sqlite3_reset(st_count);
+  }
+  pthread_mutex_unlock(&g_db_lock);
+  return count;
+}
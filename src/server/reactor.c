@@ -89,34 +89,40 @@ int event_loop_mod(event_loop_t *loop, reactor_event_t *event, int new_events) {
   return 0;
 }
 
-void event_loop_run(event_loop_t *loop) {
-  while (!loop->stop) {
-    int nfds = epoll_wait(loop->epoll_fd, loop->events, MAX_EVENTS, 100);
+int event_loop_run_once(event_loop_t *loop, int timeout_ms) {
+  int nfds = epoll_wait(loop->epoll_fd, loop->events, MAX_EVENTS, timeout_ms);
 
-    if (nfds == -1) {
-      if (errno == EINTR)
-        continue;
-      LOG_FATAL("epoll_wait failed: %s", strerror(errno));
-      return;
-    }
+  if (nfds == -1) {
+    if (errno == EINTR)
+      return 0;
+    LOG_FATAL("epoll_wait failed: %s", strerror(errno));
+    return -1;
+  }
+
+  for (int i = 0; i < nfds; i++) {
+    reactor_event_t *event = (reactor_event_t *)loop->events[i].data.ptr;
+    int native_events = loop->events[i].events;
+    int mask = 0;
 
-    for (int i = 0; i < nfds; i++) {
-      reactor_event_t *event = (reactor_event_t *)loop->events[i].data.ptr;
-      int native_events = loop->events[i].events;
-      int mask = 0;
-
-      if (native_events & EPOLLIN)
-        mask |= EVENT_READ;
-      if (native_events & EPOLLOUT)
-        mask |= EVENT_WRITE;
-      if (native_events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
-        mask |= EVENT_ERROR;
-
-      if (event && event->handler) {
-        event->handler(event->fd, mask, event->arg);
-      }
+    if (native_events & EPOLLIN)
+      mask |= EVENT_READ;
+    if (native_events & EPOLLOUT)
+      mask |= EVENT_WRITE;
+    if (native_events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+      mask |= EVENT_ERROR;
+
+    if (event && event->handler) {
+      event->handler(event->fd, mask, event->arg);
     }
   }
+  return nfds;
+}
+
+void event_loop_run(event_loop_t *loop) {
+  while (!loop->stop) {
+    if (event_loop_run_once(loop, 100) == -1)
+      return;
+  }
 }
 
 void event_loop_stop(event_loop_t *loop) { loop->stop = 1; }
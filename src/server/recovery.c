@@ -0,0 +1,459 @@
+#include "recovery.h"
+#include "hash.h"
+#include "logger.h"
+#include "queue.h"
+#include "queue_index.h"
+#include "relay.h"
+#include "storage.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// One getdents64 call returns tens of thousands of entries at once
+#define RECOVERY_DENTS_BUF_SIZE (1024 * 1024)
+#define RECOVERY_MAX_DIRS 2
+#define RECOVERY_SHARDS 4       // Threads handling each directory's entries
+#define RECOVERY_RING_SIZE 4096 // Entries listed ahead of the shards
+#define RECOVERY_BATCH 64       // Entries moved through the ring at once
+#define RECOVERY_BACKOFF_MS 100      // First wait on refused messages
+#define RECOVERY_BACKOFF_MAX_MS 5000 // Doubling up to this
+
+// Record layout returned by getdents64(2)
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+typedef enum {
+  RECOVERY_CLEAN_TMP, // Unlink interrupted transactions
+  RECOVERY_REQUEUE    // Hand leftover messages back to the relay
+} recovery_action_t;
+
+typedef struct recovery_dir recovery_dir_t;
+
+// A thread handling its share of a directory's entries
+typedef struct {
+  recovery_dir_t *dir;
+  pthread_t thread;
+  size_t files; // Files cleaned or re-queued
+
+  // Messages the relay refused (their flow was full), retried after the
+  // scan so one busy flow does not hold up the others
+  storage_msg_t **overflow;
+  size_t overflow_count;
+  size_t overflow_cap;
+} recovery_shard_t;
+
+// A spool directory. One thread lists it with getdents64 and hands the
+// names through a ring to the directory's shards, which do the per-file
+// work (stat, index lookup, unlink or re-queue): a large queue/ is split
+// between RECOVERY_SHARDS threads, whichever is free taking the next batch.
+struct recovery_dir {
+  char path[1024];
+  recovery_action_t action;
+  int dfd;
+  queue_t *names; // strdup'ed entry names, stopped once listed
+  pthread_t lister;
+  recovery_shard_t shards[RECOVERY_SHARDS];
+  int num_shards;
+  _Atomic int running;    // Shards not done yet
+  _Atomic size_t files;   // Files cleaned or re-queued by finished shards
+};
+
+// Queue index entry as of recovery_prepare
+typedef struct {
+  char *id; // Spool file name, NULL: free slot
+  qindex_status_t status;
+  int attempts;
+  time_t created;
+  bitmap_t rcpt_done;
+} recovery_known_t;
+
+static recovery_dir_t g_dirs[RECOVERY_MAX_DIRS];
+static int g_num_dirs = 0;
+static struct timespec g_cutoff;
+static _Atomic int g_stop = 0;
+static _Atomic int g_pending = 0;
+
+// Snapshot of the queue index taken before the relay starts, read-only
+// while the shards run (open addressing, linear probing)
+static recovery_known_t *g_known = NULL;
+static size_t g_known_cap = 0; // Power of two
+static size_t g_known_count = 0;
+
+static recovery_known_t *known_slot(recovery_known_t *table, size_t cap,
+                                    const char *id) {
+  size_t i = (size_t)hash_fnv1a64(id) & (cap - 1);
+  while (table[i].id && strcmp(table[i].id, id) != 0)
+    i = (i + 1) & (cap - 1);
+  return &table[i];
+}
+
+static const recovery_known_t *known_find(const char *id) {
+  if (!g_known)
+    return NULL;
+  recovery_known_t *k = known_slot(g_known, g_known_cap, id);
+  return k->id ? k : NULL;
+}
+
+static void known_free(void) {
+  for (size_t i = 0; i < g_known_cap; i++) {
+    free(g_known[i].id);
+    bitmap_free(&g_known[i].rcpt_done);
+  }
+  free(g_known);
+  g_known = NULL;
+  g_known_cap = g_known_count = 0;
+}
+
+// qindex_foreach visitor: add an entry to the snapshot, kept at most half
+// full. Returns 0 to go on, -1 when out of memory.
+static int known_add(qindex_entry_t *entry, void *arg) {
+  (void)arg;
+  if ((g_known_count + 1) * 2 > g_known_cap) {
+    size_t cap = g_known_cap ? g_known_cap * 2 : 1024;
+    recovery_known_t *table = calloc(cap, sizeof(recovery_known_t));
+    if (!table)
+      return -1;
+    for (size_t i = 0; i < g_known_cap; i++) {
+      if (g_known[i].id)
+        *known_slot(table, cap, g_known[i].id) = g_known[i];
+    }
+    free(g_known);
+    g_known = table;
+    g_known_cap = cap;
+  }
+
+  recovery_known_t *k = known_slot(g_known, g_known_cap, entry->id);
+  if (k->id)
+    return 0; // id is the primary key, cannot happen
+  k->id = strdup(entry->id);
+  if (!k->id)
+    return -1;
+  k->status = entry->status;
+  k->attempts = entry->attempts;
+  k->created = entry->created;
+  k->rcpt_done = entry->rcpt_done; // Taken over
+  memset(&entry->rcpt_done, 0, sizeof(entry->rcpt_done));
+  g_known_count++;
+  return 0;
+}
+
+// A directory is done; the last one releases the snapshot
+static void dir_exit(void) {
+  if (atomic_fetch_sub(&g_pending, 1) == 1)
+    known_free();
+}
+
+// Everything committed by this process is renamed into place after the
+// cutoff, and rename updates ctime, so an older ctime marks a leftover from a
+// previous run. The cutoff comes from the coarse clock that also stamps
+// inodes, which keeps the comparison exact.
+static int is_leftover(const struct stat *st) {
+  if (st->st_ctim.tv_sec != g_cutoff.tv_sec)
+    return st->st_ctim.tv_sec < g_cutoff.tv_sec;
+  return st->st_ctim.tv_nsec < g_cutoff.tv_nsec;
+}
+
+static void recovery_handle_entry(recovery_shard_t *shard, const char *name) {
+  recovery_dir_t *dir = shard->dir;
+  int dfd = dir->dfd;
+  struct stat st;
+  if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+      !S_ISREG(st.st_mode) || !is_leftover(&st))
+    return;
+
+  if (dir->action == RECOVERY_CLEAN_TMP) {
+    if (unlinkat(dfd, name, 0) == 0) {
+      shard->files++;
+      LOG_DEBUG("Recovery: Removed stale %s/%s", dir->path, name);
+    }
+    return;
+  }
+
+  // Deferred and failed messages are tracked by the queue index, the relay
+  // scheduler re-queues them when they are due. The snapshot predates the
+  // scheduler, so an entry it has claimed since still reads deferred here.
+  const recovery_known_t *known = known_find(name);
+  if (known && known->status != QINDEX_QUEUED)
+    return;
+
+  char path[PATH_MAX];
+  int len = snprintf(path, sizeof(path), "%s/%s", dir->path, name);
+  if (len < 0 || (size_t)len >= sizeof(path)) {
+    LOG_ERROR("Recovery: Path too long: %s/%s", dir->path, name);
+    return;
+  }
+  storage_msg_t *msg = storage_msg_create(path);
+  if (!msg) {
+    LOG_ERROR("Recovery: Failed to allocate queue item for %s", path);
+    return;
+  }
+  if (known) {
+    msg->attempts = known->attempts;
+    msg->created = known->created;
+    if (bitmap_copy(&msg->rcpt_done, &known->rcpt_done) != 0) {
+      LOG_ERROR("Recovery: Failed to allocate queue item for %s", path);
+      storage_msg_free(msg);
+      return;
+    }
+  }
+  if (relay_submit(msg) == 0) {
+    shard->files++;
+    return;
+  }
+
+  if (shard->overflow_count == shard->overflow_cap) {
+    size_t cap = shard->overflow_cap ? shard->overflow_cap * 2 : 256;
+    storage_msg_t **overflow =
+        realloc(shard->overflow, cap * sizeof(storage_msg_t *));
+    if (!overflow) {
+      LOG_ERROR("Recovery: Out of memory, %s left for the next run", path);
+      storage_msg_free(msg);
+      return;
+    }
+    shard->overflow = overflow;
+    shard->overflow_cap = cap;
+  }
+  shard->overflow[shard->overflow_count++] = msg;
+}
+
+// Submit the refused messages again, backing off while the relay refuses
+// them all. Those left on stop stay in queue/ for the next run.
+static void recovery_drain_overflow(recovery_shard_t *shard) {
+  long backoff_ms = RECOVERY_BACKOFF_MS;
+  while (shard->overflow_count > 0 && !g_stop) {
+    for (long waited = 0; waited < backoff_ms && !g_stop; waited += 100) {
+      struct timespec ts = {0, 100 * 1000000L};
+      nanosleep(&ts, NULL);
+    }
+
+    size_t left = 0;
+    for (size_t i = 0; i < shard->overflow_count; i++) {
+      if (!g_stop && relay_submit(shard->overflow[i]) == 0)
+        shard->files++;
+      else
+        shard->overflow[left++] = shard->overflow[i];
+    }
+    if (left < shard->overflow_count)
+      backoff_ms = RECOVERY_BACKOFF_MS;
+    else if (backoff_ms < RECOVERY_BACKOFF_MAX_MS)
+      backoff_ms *= 2;
+    shard->overflow_count = left;
+  }
+
+  for (size_t i = 0; i < shard->overflow_count; i++)
+    storage_msg_free(shard->overflow[i]);
+  free(shard->overflow);
+  shard->overflow = NULL;
+  shard->overflow_count = shard->overflow_cap = 0;
+}
+
+// Hand a batch of names to the shards, waiting for room. Returns 0, or -1
+// once stopped (the names not taken are freed)
+static int recovery_push_names(recovery_dir_t *dir, char **names, int count) {
+  int n = queue_push_batch(dir->names, (void **)names, count);
+  for (int i = n; i < count; i++)
+    free(names[i]);
+  return n == count ? 0 : -1;
+}
+
+static void *recovery_lister_thread(void *arg) {
+  recovery_dir_t *dir = arg;
+  char *names[RECOVERY_BATCH];
+  int count = 0;
+
+  char *buf = malloc(RECOVERY_DENTS_BUF_SIZE);
+  if (!buf) {
+    LOG_ERROR("Recovery: Cannot scan %s: %s", dir->path, strerror(ENOMEM));
+    goto out;
+  }
+
+  while (!g_stop) {
+    long n = syscall(SYS_getdents64, dir->dfd, buf, RECOVERY_DENTS_BUF_SIZE);
+    if (n < 0) {
+      LOG_ERROR("Recovery: getdents64 on %s failed: %s", dir->path,
+                strerror(errno));
+      break;
+    }
+    if (n == 0)
+      break; // End of directory
+
+    for (long pos = 0; pos < n && !g_stop;) {
+      struct linux_dirent64 *d = (struct linux_dirent64 *)(buf + pos);
+      pos += d->d_reclen;
+
+      if (d->d_type != DT_REG && d->d_type != DT_UNKNOWN)
+        continue;
+      char *name = strdup(d->d_name);
+      if (!name) {
+        LOG_ERROR("Recovery: Out of memory, %s/%s left for the next run",
+                  dir->path, d->d_name);
+        continue;
+      }
+      names[count++] = name;
+      if (count == RECOVERY_BATCH) {
+        count = 0;
+        if (recovery_push_names(dir, names, RECOVERY_BATCH) != 0)
+          goto out;
+      }
+    }
+  }
+  if (count > 0)
+    recovery_push_names(dir, names, count);
+
+out:
+  free(buf);
+  queue_stop(dir->names); // Shards finish what is queued, then exit
+  return NULL;
+}
+
+static void *recovery_shard_thread(void *arg) {
+  recovery_shard_t *shard = arg;
+  recovery_dir_t *dir = shard->dir;
+  void *names[RECOVERY_BATCH];
+
+  int n;
+  while ((n = queue_pop_batch(dir->names, names, RECOVERY_BATCH, -1)) > 0) {
+    for (int i = 0; i < n; i++) {
+      if (!g_stop)
+        recovery_handle_entry(shard, names[i]);
+      free(names[i]);
+    }
+  }
+  recovery_drain_overflow(shard);
+
+  atomic_fetch_add(&dir->files, shard->files);
+  if (atomic_fetch_sub(&dir->running, 1) == 1) {
+    LOG_INFO("Recovery: %s %zu files in %s",
+             dir->action == RECOVERY_CLEAN_TMP ? "removed" : "re-queued",
+             atomic_load(&dir->files), dir->path);
+    dir_exit();
+  }
+  return NULL;
+}
+
+static void add_dir(const char *base, const char *name,
+                    recovery_action_t action) {
+  recovery_dir_t *dir = &g_dirs[g_num_dirs++];
+  memset(dir, 0, sizeof(*dir));
+  snprintf(dir->path, sizeof(dir->path), "%s/%s", base, name);
+  dir->action = action;
+  dir->dfd = -1;
+}
+
+// Open a directory and start its lister and shards
+// Returns 0 on success, -1 if nothing was started
+static int start_dir(recovery_dir_t *dir) {
+  dir->dfd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir->dfd < 0) {
+    LOG_ERROR("Recovery: Cannot scan %s: %s", dir->path, strerror(errno));
+    return -1;
+  }
+  dir->names = queue_create_bounded(RECOVERY_RING_SIZE);
+  if (!dir->names) {
+    LOG_ERROR("Recovery: Cannot scan %s: %s", dir->path, strerror(ENOMEM));
+    return -1;
+  }
+
+  // running covers the shards being started, until all of them are
+  atomic_store(&dir->running, RECOVERY_SHARDS + 1);
+  for (int i = 0; i < RECOVERY_SHARDS; i++) {
+    recovery_shard_t *shard = &dir->shards[dir->num_shards];
+    shard->dir = dir;
+    if (pthread_create(&shard->thread, NULL, recovery_shard_thread, shard) ==
+        0)
+      dir->num_shards++;
+  }
+  if (dir->num_shards == 0) {
+    LOG_ERROR("Recovery: Failed to start threads for %s", dir->path);
+    return -1;
+  }
+  atomic_fetch_sub(&dir->running, RECOVERY_SHARDS - dir->num_shards);
+
+  if (pthread_create(&dir->lister, NULL, recovery_lister_thread, dir) != 0) {
+    LOG_ERROR("Recovery: Failed to start thread for %s", dir->path);
+    queue_stop(dir->names); // The shards exit right away
+    dir->lister = 0;
+  }
+  // Last reference: finishing the directory is up to its shards now
+  if (atomic_fetch_sub(&dir->running, 1) == 1)
+    dir_exit();
+  return 0;
+}
+
+int recovery_prepare(void) {
+  // Files the relay moves into queue/ from now on are newer than the cutoff
+  clock_gettime(CLOCK_REALTIME_COARSE, &g_cutoff);
+  known_free();
+  if (qindex_foreach(known_add, NULL) != 0) {
+    LOG_ERROR("Recovery: Failed to load the queue index");
+    known_free();
+    return -1;
+  }
+  LOG_INFO("Recovery: %zu messages in the queue index", g_known_count);
+  return 0;
+}
+
+int recovery_start(const config_t *config) {
+  if (!config || !config->storage.path)
+    return -1;
+
+  g_stop = 0;
+  g_num_dirs = 0;
+
+  // new/ is not listed: the relay scanner claims it on startup
+  add_dir(config->storage.path, "tmp", RECOVERY_CLEAN_TMP);
+  add_dir(config->storage.path, "queue", RECOVERY_REQUEUE);
+
+  atomic_store(&g_pending, g_num_dirs);
+  for (int i = 0; i < g_num_dirs; i++) {
+    if (start_dir(&g_dirs[i]) != 0)
+      dir_exit();
+  }
+
+  LOG_INFO("Spool recovery started on %s (%d directories, %d threads each)",
+           config->storage.path, g_num_dirs, RECOVERY_SHARDS);
+  return 0;
+}
+
+int recovery_done(void) { return atomic_load(&g_pending) == 0; }
+
+void recovery_stop(void) {
+  g_stop = 1;
+  for (int i = 0; i < g_num_dirs; i++) {
+    recovery_dir_t *dir = &g_dirs[i];
+    if (dir->names)
+      queue_stop(dir->names); // Wakes the lister and the shards
+    if (dir->lister)
+      pthread_join(dir->lister, NULL);
+    for (int j = 0; j < dir->num_shards; j++)
+      pthread_join(dir->shards[j].thread, NULL);
+    if (dir->names) {
+      // Names the lister published as the shards were exiting
+      void *name;
+      while ((name = queue_try_pop(dir->names)) != NULL)
+        free(name);
+      queue_destroy(dir->names);
+    }
+    if (dir->dfd >= 0)
+      close(dir->dfd);
+    memset(dir, 0, sizeof(*dir));
+  }
+  g_num_dirs = 0;
+  known_free(); // Left over if recovery never started
+}
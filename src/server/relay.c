@@ -1,84 +1,192 @@
 #include "relay.h"
+#include "balancer.h"
 #include "config.h"
+#include "dsn.h"
 #include "logger.h"
-#include "queue.h"
+#include "fair_queue.h"
+#include "queue_index.h"
+#include "rate_limit.h"
+#include "reactor.h"
+#include "route.h"
+#include "slab.h"
 #include "socket_utils.h"
+#include "stats.h"
+#include "storage.h"
+#include "tls.h"
+#include "upstream_pool.h"
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#define RELAY_INOTIFY_BUF_LEN (64 * (sizeof(struct inotify_event) + 256))
+#define RELAY_DUE_BATCH RELAY_PUSH_BATCH // Deferred messages per index query
+#define RELAY_WORKER_TICK_MS 100 // Worker loop wakeup for timeouts and stop
+#define RELAY_THROTTLE_WAIT 5    // Seconds a part waits on a limit in memory
+#define RELAY_MAX_WORKERS 64     // Largest upstream.relay_threads_max
+#define RELAY_SCALE_UP_DRAIN 2.0 // Seconds of backlog per extra worker added
+#define RELAY_SCALE_DOWN_IDLE 30 // Quiet seconds before a worker is retired
+#define RELAY_PUSH_BATCH 64      // Messages queued at once (scanner, scheduler)
+#define RELAY_ENVELOPE_PEEK 4096 // Spool bytes read to route a message
+#define RELAY_POP_BATCH 16       // Messages a worker takes from the queue at once
+#define RELAY_CHAIN_LEN 4        // Batched parts sharing one upstream session
+#define RELAY_CHAINS 64          // Session chains started per batch
+#define RELAY_BACKOFF_MAX 30     // Seconds producers back off on full queues
 
 static config_t *g_config = NULL;
 static volatile int g_running = 0;
 static pthread_t g_relay_thread;
-static queue_t *g_work_queue = NULL;
-static pthread_t *g_worker_threads = NULL;
-static int g_num_workers = 0;
+static int g_num_workers = 0;  // Running workers (owned by the scaler)
+static atomic_int g_max_inflight = 0; // Concurrent deliveries per worker
+static size_t g_large_msg_size = 0; // Larger messages use the large lane
+static atomic_int g_large_max_inflight = 0; // Large-lane deliveries/worker
+static int g_pool_max_idle = 0;
+static int g_pool_idle_timeout = 0;
+static int g_pool_max_msgs = 0;
 static pthread_t g_scanner_thread;
+static pthread_t g_scheduler_thread;
+static route_table_t *g_routes = NULL;
+static SSL_CTX *g_tls_ctx = NULL; // Outbound STARTTLS, NULL: plaintext
+static int g_tls_required = 0;
 
-// Helper: Connect to upstream
-static int connect_upstream() {
-  if (!g_config || !g_config->upstream.host)
-    return -1;
+// Worker scaling, guarded by g_scale_lock
+static pthread_t g_scaler_thread;
+static pthread_mutex_t g_scale_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_scale_cond = PTHREAD_COND_INITIALIZER;
+static int g_threads = 0;     // Workers at startup
+static int g_threads_min = 0; // Scaling range
+static int g_threads_max = 0;
+static int g_threads_set = 0; // Worker count requested by a reload, 0: none
 
-  struct hostent *he = gethostbyname(g_config->upstream.host);
-  if (!he) {
-    LOG_ERROR("Relay: Failed to resolve host %s", g_config->upstream.host);
-    return -1;
-  }
+typedef enum {
+  RELAY_WORKER_OFF = 0,  // Free slot
+  RELAY_WORKER_RUNNING,  // Taking new messages
+  RELAY_WORKER_DRAINING, // Finishing its deliveries before it exits
+  RELAY_WORKER_EXITED    // Thread done, waiting to be joined
+} relay_worker_state_t;
 
-  int fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (fd == -1)
-    return -1;
+// Relay queue lanes; stealing looks at them in this order
+typedef enum {
+  RELAY_LANE_HIGH = 0, // Priority senders and routes (ROUTE_PRIORITY_*)
+  RELAY_LANE_NORMAL,
+  RELAY_LANE_LOW,
+  RELAY_LANE_LARGE, // Over upstream.large_msg_kb, whatever their priority
+  RELAY_LANES
+} relay_lane_t;
 
-  struct sockaddr_in addr;
-  addr.sin_family = AF_INET;
-  addr.sin_port = htons(g_config->upstream.port);
-  memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
+// Share of a worker's picks when every lane is backed up, and messages
+// each worker queues per lane (at most half of them from one flow)
+static const int g_lane_weight[RELAY_LANES] = {8, 4, 2, 1};
+static const int g_lane_capacity[RELAY_LANES] = {1024, 2048, 1024, 256};
+#define RELAY_FLOW_SHARE 2 // Lane capacity / most messages from one flow
 
-  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-    LOG_ERROR("Relay: Connect failed to %s:%d: %s", g_config->upstream.host,
-              g_config->upstream.port, strerror(errno));
-    close(fd);
-    return -1;
-  }
+// Delivery engine: each worker thread runs an event loop driving many
+// non-blocking upstream sessions, so a slow upstream only costs a socket.
+// Messages are queued on the worker their route hashes to, which keeps a
+// route's sessions warm in one pool; idle workers steal from backed up ones.
+// Within a lane, senders (policy.fair_key) take turns by weight, so a bulk
+// run only delays other senders' mail by a round.
+// The queues and wakeup of a slot live as long as the relay, so producers
+// never race a worker starting or exiting.
+typedef struct relay_worker {
+  pthread_t thread;
+  event_loop_t *loop;
+  upstream_pool_t *pool; // Sessions bound to this worker's loop
+  fair_queue_t *lanes[RELAY_LANES]; // Messages routed to this worker
+  int lane_credit[RELAY_LANES]; // Smooth weighted round robin over lanes
+  atomic_int large_inflight;    // Large-lane messages in flight
+  int wake_fd;           // eventfd: work queued or relay stopping
+  reactor_event_t wake_event;
+  atomic_int state;    // relay_worker_state_t
+  atomic_int inflight; // Messages in flight
+  list_t waiting;      // Parts waiting on their route's or gateway's limits
+} relay_worker_t;
 
-  return fd;
-}
+static relay_worker_t *g_workers = NULL;
 
-// Helper: Read line from socket
-static int read_reply(int fd, char *buf, size_t size) {
-  // Simple blocking read for prototype
-  ssize_t n = read(fd, buf, size - 1);
-  if (n > 0) {
-    buf[n] = 0;
-    return atoi(buf);
-  }
-  return 0;
-}
+struct relay_delivery;
 
-// Helper: Send command
-static void send_cmd(int fd, const char *fmt, ...) {
-  char buf[1024];
-  va_list args;
-  va_start(args, fmt);
-  vsnprintf(buf, sizeof(buf), fmt, args);
-  va_end(args);
+// One upstream transaction: the recipients of a message sharing a route
+typedef struct relay_part {
+  struct relay_delivery *delivery;
+  route_t *route;
+  const char **rcpt_ptrs; // Slices of the delivery's part arrays
+  int *rcpt_codes;
+  int *rcpt_index; // Position in the delivery's recipients
+  int rcpt_count;
+  smtp_tx_t tx;
+  int has_slot;            // Holds a concurrency slot on the route
+  int retried;             // Restarted once after a stale pooled session
+  int held;                // Deferred by a limit rather than a failure
+  double waiting_since;    // Started waiting on a limit (monotonic), 0: not
+  upstream_t *upstream;    // Gateway picked for the current attempt
+  int attempts;            // Gateways tried
+  struct timespec started; // Current attempt start, for latency
+  list_node_t node;        // Worker wait list link
+  struct relay_part *chain_next; // Same-route part of the batch started
+                                 // once this one is done, NULL: none
+} relay_part_t;
 
-  write(fd, buf, strlen(buf));
-  // Log debug?
-}
+// One message in flight
+typedef struct relay_delivery {
+  relay_worker_t *worker;
+  relay_lane_t lane;
+  storage_msg_t *msg;
+  FILE *fp;       // Spool file, kept open while cold bodies are sent
+  char *body_buf; // Legacy spool body converted to wire format
+  const char *body;
+  int body_fd;
+  off_t body_start;
+  off_t body_end;
+  char sender[256];
+  char **recipients; // X-Envelope-To addresses, in spool file order
+  int rcpt_count;
+  int rcpt_cap;
+  relay_part_t *parts; // One per route, in part_mem
+  int part_count;
+  void *part_mem; // Parts, their recipient arrays and rcpt_state
+  int pending;             // Parts not finished yet
+  smtp_tx_result_t result; // Message-level failure (e.g. unreadable spool)
+
+  // Per-recipient state (RELAY_RCPT_*), rcpt_state[i] for recipients[i]
+  unsigned char *rcpt_state;
+  int rcpt_temp;    // Recipients failed temporarily in this attempt
+  int rcpt_perm;    // Recipients failed permanently in this attempt
+  int rcpt_held;    // Temporary failures deferred by a route or gateway limit
+  int rcpt_settled; // Recipients delivered or failed for good this attempt
+  double held_wait; // Seconds until the limits should allow them
+} relay_delivery_t;
+
+#define RELAY_RCPT_DONE 0x01 // Delivered or permanently failed, any attempt
+#define RELAY_RCPT_TEMP 0x02 // Failed temporarily in this attempt
+#define RELAY_RCPT_PERM 0x04 // Failed permanently in this attempt
+
+static slab_cache_t g_delivery_cache =
+    SLAB_CACHE_INIT("relay_delivery", relay_delivery_t, STATS_MEM_RELAY);
+
+// Where a message is queued
+typedef struct {
+  route_t *route; // Route of its first recipient left to deliver
+  relay_lane_t lane;
+  char flow[256]; // Sender, sender domain or client (policy.fair_key)
+  int weight;     // The flow's share of its lane (policy.fair_weights)
+} relay_class_t;
 
 // Helper: Extract envelope from file (old, now integrated into
 // relay_process_file) static int parse_envelope(FILE *fp, char *sender, char
@@ -129,29 +237,190 @@ static void send_cmd(int fd, const char *fmt, ...) {
 //   return 0;
 // }
 
-// New relay_process_file function
-static int relay_process_file(const char *filepath) {
-  LOG_INFO("Relay: Processing %s", filepath);
+// Helper: Message ID used by the queue index (spool file name)
+static const char *relay_msg_id(const char *path) {
+  const char *name = strrchr(path, '/');
+  return name ? name + 1 : path;
+}
+
+// Helper: Record a message picked up by a worker in the queue index
+static void relay_index_queued(const storage_msg_t *msg, FILE *fp,
+                               const char *sender, char *const *recipients,
+                               int rcpt_count) {
+  qindex_entry_t e;
+  memset(&e, 0, sizeof(e));
+  snprintf(e.id, sizeof(e.id), "%s", relay_msg_id(msg->path));
+  snprintf(e.path, sizeof(e.path), "%s", msg->path);
+  snprintf(e.sender, sizeof(e.sender), "%s", sender);
+  e.created = time(NULL);
+
+  struct stat st;
+  if (msg->data)
+    e.size = msg->size;
+  else if (fstat(fileno(fp), &st) == 0)
+    e.size = (size_t)st.st_size;
+
+  // Distinct recipient domains, comma separated
+  size_t len = 0;
+  for (int i = 0; i < rcpt_count; i++) {
+    const char *domain = strchr(recipients[i], '@');
+    domain = domain ? domain + 1 : recipients[i];
+    int seen = 0;
+    for (int j = 0; j < i && !seen; j++) {
+      const char *d = strchr(recipients[j], '@');
+      seen = strcasecmp(d ? d + 1 : recipients[j], domain) == 0;
+    }
+    if (seen)
+      continue;
+    int n = snprintf(e.rcpt_domains + len, sizeof(e.rcpt_domains) - len,
+                     "%s%s", len ? "," : "", domain);
+    if (n < 0 || (size_t)n >= sizeof(e.rcpt_domains) - len)
+      break;
+    len += (size_t)n;
+  }
+
+  qindex_put_queued(&e);
+}
 
-  FILE *fp = fopen(filepath, "rb");
-  if (!fp) {
+// Helper: Convert a legacy spool file (no X-Body-Offset) to a wire-format
+// body, including the X-Envelope headers, which the upstream server treats
+// as regular headers.
+static char *relay_legacy_body(FILE *fp, size_t *len_out) {
+  size_t cap = 8192, len = 0;
+  char *body = malloc(cap);
+  if (!body)
+    return NULL;
+
+  char line[1024];
+  rewind(fp);
+  while (fgets(line, sizeof(line), fp)) {
+    size_t n = strlen(line);
+    if (len + n + 8 > cap) {
+      while (len + n + 8 > cap)
+        cap *= 2;
+      char *nb = realloc(body, cap);
+      if (!nb) {
+        free(body);
+        return NULL;
+      }
+      body = nb;
+    }
+    // transparency stuffing: if line starts with .
+    if (line[0] == '.')
+      body[len++] = '.';
+    memcpy(body + len, line, n);
+    len += n;
+  }
+  memcpy(body + len, "\r\n.\r\n", 5); // End of data
+  len += 5;
+
+  *len_out = len;
+  return body;
+}
+
+// Helper: Append an envelope recipient
+// Returns 0 on success, -1 when out of memory
+static int relay_add_rcpt(relay_delivery_t *d, const char *rcpt) {
+  if (d->rcpt_count == d->rcpt_cap) {
+    int cap = d->rcpt_cap ? d->rcpt_cap * 2 : 8;
+    char **recipients = realloc(d->recipients, sizeof(char *) * cap);
+    if (!recipients)
+      return -1;
+    d->recipients = recipients;
+    d->rcpt_cap = cap;
+  }
+  char *copy = strdup(rcpt);
+  if (!copy)
+    return -1;
+  d->recipients[d->rcpt_count++] = copy;
+  return 0;
+}
+
+// Helper: Split the recipients left to deliver by route, one part (upstream
+// transaction) per route. The parts, their recipient arrays and the
+// recipients' state share one block: a first pass counts each route's
+// recipients, the second fills the parts' slices of the arrays.
+// Returns 0 on success, -1 when out of memory
+static int relay_split_rcpts(relay_delivery_t *d) {
+  size_t n = (size_t)d->rcpt_count;
+  char *mem = calloc(1, n * (sizeof(relay_part_t) + sizeof(const char *) +
+                             2 * sizeof(int) + 1));
+  if (!mem)
+    return -1;
+  d->part_mem = mem;
+  d->parts = (relay_part_t *)mem;
+  const char **ptrs = (const char **)(d->parts + n);
+  int *codes = (int *)(ptrs + n);
+  int *index = codes + n;
+  d->rcpt_state = (unsigned char *)(index + n);
+
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < d->rcpt_count; i++) {
+      if (bitmap_test(&d->msg->rcpt_done, (size_t)i)) {
+        d->rcpt_state[i] = RELAY_RCPT_DONE;
+        continue;
+      }
+      const char *domain = strrchr(d->recipients[i], '@');
+      route_t *route = route_lookup(g_routes, domain ? domain + 1 : "");
+
+      relay_part_t *part = NULL;
+      for (int j = 0; j < d->part_count && !part; j++) {
+        if (d->parts[j].route == route)
+          part = &d->parts[j];
+      }
+      if (pass == 0 && !part) {
+        part = &d->parts[d->part_count++];
+        part->delivery = d;
+        part->route = route;
+      }
+      if (pass == 0) {
+        part->rcpt_count++;
+        continue;
+      }
+      part->rcpt_index[part->rcpt_count] = i;
+      part->rcpt_ptrs[part->rcpt_count++] = d->recipients[i];
+    }
+
+    for (int j = 0; pass == 0 && j < d->part_count; j++) {
+      relay_part_t *part = &d->parts[j];
+      part->rcpt_ptrs = ptrs;
+      part->rcpt_codes = codes;
+      part->rcpt_index = index;
+      ptrs += part->rcpt_count;
+      codes += part->rcpt_count;
+      index += part->rcpt_count;
+      part->rcpt_count = 0;
+    }
+  }
+  return 0;
+}
+
+// Helper: Parse the envelope and set up the transaction
+// Hot messages are parsed and sent from memory, cold ones from the spool file.
+static int relay_delivery_prepare(relay_delivery_t *d) {
+  const char *filepath = d->msg->path;
+  LOG_INFO("Relay: Processing %s%s", filepath, d->msg->data ? " (hot)" : "");
+
+  d->fp = d->msg->data ? fmemopen(d->msg->data, d->msg->size, "rb")
+                       : fopen(filepath, "rb");
+  if (!d->fp) {
     LOG_ERROR("Relay: Failed to open file %s: %s", filepath, strerror(errno));
     return -1;
   }
 
   // 1. Parse Envelope (X-Envelope-From/To)
-  char sender[256] = {0};
-  char recipients[10][256]; // Max 10 recipients
-  int rcpt_count = 0;
-
+  off_t body_offset = -1; // -1: legacy spool file without wire-format body
+  int have_sender = 0;
   char line[1024];
 
   // Read headers to extract X-Envelope-From and X-Envelope-To
-  while (fgets(line, sizeof(line), fp)) {
+  while (fgets(line, sizeof(line), d->fp)) {
     if (line[0] == '\r' || line[0] == '\n') { // End of headers
       break;
     }
-    if (strncasecmp(line, "X-Envelope-From:", 16) == 0) {
+    if (strncasecmp(line, "X-Body-Offset:", 14) == 0) {
+      body_offset = (off_t)strtoll(line + 14, NULL, 10);
+    } else if (strncasecmp(line, "X-Envelope-From:", 16) == 0) {
       char *p = line + 16;
       while (*p && (*p == ' ' || *p == '<'))
         p++;
@@ -163,119 +432,869 @@ static int relay_process_file(const char *filepath) {
         if (end)
           *end = 0;
       }
-      strncpy(sender, p, sizeof(sender) - 1);
-      sender[sizeof(sender) - 1] = '\0';
+      strncpy(d->sender, p, sizeof(d->sender) - 1);
+      d->sender[sizeof(d->sender) - 1] = '\0';
+      have_sender = 1; // Empty for the null sender (<>) of a DSN
     } else if (strncasecmp(line, "X-Envelope-To:", 14) == 0) {
-      if (rcpt_count < 10) {
-        char *p = line + 14;
-        while (*p && (*p == ' ' || *p == '<'))
-          p++;
-        char *end = strchr(p, '>');
+      char *p = line + 14;
+      while (*p && (*p == ' ' || *p == '<'))
+        p++;
+      char *end = strchr(p, '>');
+      if (end)
+        *end = 0;
+      else {
+        end = strpbrk(p, "\r\n");
         if (end)
           *end = 0;
-        else {
-          end = strpbrk(p, "\r\n");
-          if (end)
-            *end = 0;
-        }
-        strncpy(recipients[rcpt_count], p, sizeof(recipients[0]) - 1);
-        recipients[rcpt_count][sizeof(recipients[0]) - 1] = '\0';
-        rcpt_count++;
+      }
+      if (relay_add_rcpt(d, p) != 0) {
+        LOG_ERROR("Relay: Out of memory reading the recipients of %s",
+                  filepath);
+        return -1;
       }
     }
   }
-  rewind(fp); // Reset file pointer to the beginning for streaming
 
-  if (sender[0] == 0 || rcpt_count == 0) {
+  if (!have_sender || d->rcpt_count == 0) {
     LOG_WARN("Relay: No sender or recipients found in %s", filepath);
-    fclose(fp);
+    d->result = SMTP_TX_PERMFAIL; // Retrying cannot fix the envelope
     return -1;
   }
 
-  // 2. Connect Upstream
-  int fd = connect_upstream();
-  if (fd == -1) {
-    fclose(fp);
-    return -1; // Retry later
+  relay_index_queued(d->msg, d->fp, d->sender, d->recipients, d->rcpt_count);
+
+  if (body_offset >= 0 && d->msg->data) {
+    // Hot tier: the wire-format body is already in memory
+    if ((size_t)body_offset > d->msg->size) {
+      LOG_ERROR("Relay: Invalid body offset %ld in %s", (long)body_offset,
+                filepath);
+      return -1;
+    }
+    d->body = d->msg->data;
+    d->body_end = (off_t)d->msg->size;
+  } else if (body_offset >= 0) {
+    // Wire-format body, already dot-stuffed and terminated by ".\r\n"
+    struct stat st;
+    if (fstat(fileno(d->fp), &st) != 0 || body_offset > st.st_size) {
+      LOG_ERROR("Relay: Invalid body offset %ld in %s", (long)body_offset,
+                filepath);
+      return -1;
+    }
+    d->body_fd = fileno(d->fp);
+    d->body_end = st.st_size;
+  } else {
+    size_t len = 0;
+    d->body_buf = relay_legacy_body(d->fp, &len);
+    if (!d->body_buf) {
+      LOG_ERROR("Relay: Failed to load legacy spool file %s", filepath);
+      return -1;
+    }
+    d->body = d->body_buf;
+    d->body_end = (off_t)len;
+    body_offset = 0;
   }
+  d->body_start = body_offset;
 
-  // Helper macros for sending/receiving
-  char buf[4096];
-#define RECV()                                                                 \
-  {                                                                            \
-    ssize_t n = read(fd, buf, sizeof(buf) - 1);                                \
-    if (n < 0) {                                                               \
-      LOG_ERROR("Relay: Read error: %s", strerror(errno));                     \
-      goto err;                                                                \
-    }                                                                          \
-    buf[n] = 0;                                                                \
+  // 2. Split the recipients by route, one transaction per route. Recipients
+  // finished by an earlier attempt are left out of the envelope.
+  if (relay_split_rcpts(d) != 0) {
+    LOG_ERROR("Relay: Out of memory splitting the recipients of %s",
+              filepath);
+    return -1;
   }
-#define SEND(str)                                                              \
-  {                                                                            \
-    if (write(fd, str, strlen(str)) < 0) {                                     \
-      LOG_ERROR("Relay: Write error: %s", strerror(errno));                    \
-      goto err;                                                                \
-    }                                                                          \
+
+  for (int i = 0; i < d->part_count; i++) {
+    relay_part_t *part = &d->parts[i];
+    smtp_tx_t *tx = &part->tx;
+    tx->sender = d->sender;
+    tx->rcpts = part->rcpt_ptrs;
+    tx->rcpt_count = part->rcpt_count;
+    tx->rcpt_codes = part->rcpt_codes;
+    tx->body = d->body;
+    tx->body_fd = d->body_fd;
+    tx->body_end = d->body_end;
   }
-#define EXPECT(code)                                                           \
-  {                                                                            \
-    RECV();                                                                    \
-    if (strncmp(buf, #code, 3) != 0) {                                         \
-      LOG_ERROR("Relay: Expected %s, got %s", #code, buf);                     \
-      goto err;                                                                \
-    }                                                                          \
+  return 0;
+}
+
+// Helper: Random jitter in [0, max]
+static int relay_jitter(int max) {
+  static _Thread_local unsigned int seed = 0;
+  if (seed == 0)
+    seed = (unsigned int)time(NULL) ^ (unsigned int)pthread_self();
+  return rand_r(&seed) % (max + 1);
+}
+
+// Helper: Retry delay after `attempts` failed attempts: retry_interval,
+// doubled per attempt up to retry_max_interval, plus up to 25% jitter so
+// messages deferred together do not all come back at once
+static int relay_retry_delay(int attempts) {
+  int delay = g_config->upstream.retry_interval;
+  int max = g_config->upstream.retry_max_interval;
+  for (int i = 1; i < attempts && delay < max; i++)
+    delay = delay > max / 2 ? max : delay * 2;
+  if (delay > max)
+    delay = max;
+  return delay + relay_jitter(delay / 4);
+}
+
+// Helper: Give up on a message: its spool file moves from queue/ to
+// failed/, where it is kept for inspection, marked failed in the queue index
+static void relay_give_up(const storage_msg_t *msg) {
+  const char *id = relay_msg_id(msg->path);
+  char failed_path[1024];
+  int len = snprintf(failed_path, sizeof(failed_path), "%s/failed/%s",
+                     g_config->storage.path, id);
+  if (len < 0 || (size_t)len >= sizeof(failed_path) ||
+      rename(msg->path, failed_path) != 0) {
+    LOG_ERROR("Relay: Failed to move %s to failed/: %s", msg->path,
+              strerror(errno));
+    qindex_fail(id, msg->path);
+    return;
   }
+  qindex_fail(id, failed_path);
+}
+
+// Helper: Schedule the next attempt of a failed message, or give up on it
+// if the failure is permanent or the message is too old.
+// Returns 1 if given up, 0 if rescheduled
+static int relay_reschedule(const storage_msg_t *msg, smtp_tx_result_t result,
+                            const bitmap_t *rcpt_done) {
+  const char *id = relay_msg_id(msg->path);
+  time_t now = time(NULL);
+  int attempts = msg->attempts + 1;
+  time_t created = msg->created ? msg->created : now;
 
-  EXPECT(220); // Banner
+  if (result == SMTP_TX_PERMFAIL) {
+    relay_give_up(msg);
+    STATS_INC_RELAY_FAILED();
+    LOG_ERROR("Relay: %s failed permanently, not retried", msg->path);
+    return 1;
+  }
+  if (now - created >= g_config->upstream.retry_max_age) {
+    relay_give_up(msg);
+    STATS_INC_RELAY_FAILED();
+    LOG_ERROR("Relay: Giving up on %s after %d attempts over %lds", msg->path,
+              attempts, (long)(now - created));
+    return 1;
+  }
 
-  SEND("EHLO relay.local\r\n");
-  EXPECT(250);
+  int delay = relay_retry_delay(attempts);
+  qindex_defer(id, now + delay, rcpt_done);
+  STATS_INC_RELAY_RETRYING();
+  LOG_WARN("Relay: Failed to relay %s (attempt %d), retry in %ds", msg->path,
+           attempts, delay);
+  return 0;
+}
 
-  // MAIL FROM
-  snprintf(buf, sizeof(buf), "MAIL FROM: <%s>\r\n", sender);
-  SEND(buf);
-  EXPECT(250);
+// Helper: Report to the sender the recipients refused for good in this
+// attempt and, once the message expired, those still failing
+static void relay_report_failed(const relay_delivery_t *d, int expired) {
+  int count = d->rcpt_perm + (expired ? d->rcpt_temp : 0);
+  if (count == 0 || !d->sender[0])
+    return; // Nothing to report, or a bounce itself
 
-  // RCPT TO
-  for (int i = 0; i < rcpt_count; i++) {
-    snprintf(buf, sizeof(buf), "RCPT TO: <%s>\r\n", recipients[i]);
-    SEND(buf);
-    EXPECT(250);
+  dsn_rcpt_t *rcpts = malloc(sizeof(dsn_rcpt_t) * (size_t)count);
+  if (!rcpts) {
+    LOG_ERROR("Relay: Out of memory, no failure report for %s", d->msg->path);
+    return;
   }
+  int n = 0;
+  for (int j = 0; j < d->part_count; j++) {
+    const relay_part_t *part = &d->parts[j];
+    for (int i = 0; i < part->rcpt_count && n < count; i++) {
+      unsigned char state = d->rcpt_state[part->rcpt_index[i]];
+      if (!(state & RELAY_RCPT_PERM) &&
+          !(expired && (state & RELAY_RCPT_TEMP)))
+        continue;
+      rcpts[n].rcpt = part->rcpt_ptrs[i];
+      rcpts[n].code = part->rcpt_codes[i];
+      rcpts[n++].expired = !(state & RELAY_RCPT_PERM);
+    }
+  }
+  dsn_send(d->sender, relay_msg_id(d->msg->path), rcpts, n);
+  free(rcpts);
+}
 
-  SEND("DATA\r\n");
-  EXPECT(354);
+// Helper: Put back a message held back by route or gateway limits. That is
+// not a failed attempt; it comes back once the limits should let it through,
+// spread over as long again so a backlog does not return all at once.
+static void relay_postpone(const storage_msg_t *msg, const bitmap_t *rcpt_done,
+                           double wait) {
+  int delay = (int)wait + 1;
+  delay += relay_jitter(delay);
+  qindex_postpone(relay_msg_id(msg->path), time(NULL) + delay, rcpt_done);
+  STATS_INC_RELAY_RETRYING();
+  LOG_INFO("Relay: %s held back by delivery limits, retry in %ds", msg->path,
+           delay);
+}
 
-  // Stream File
-  // The file content includes the X-Envelope headers.
-  // These will be treated as regular headers by the upstream server.
-  while (fgets(line, sizeof(line), fp)) {
-    // transparency stuffing: if line starts with .
-    if (line[0] == '.')
-      write(fd, ".", 1);
-    write(fd, line, strlen(line));
+// Helper: Record the outcome and free the delivery. The message is retried
+// for its temporarily failed recipients only; it is done once every
+// recipient was delivered or failed permanently.
+static void relay_delivery_finish(relay_delivery_t *d) {
+  const char *filepath = d->msg->path;
+
+  smtp_tx_result_t result = d->result;
+  if (result == SMTP_TX_OK && d->rcpt_temp > 0)
+    result = SMTP_TX_TEMPFAIL;
+  else if (result == SMTP_TX_OK && d->rcpt_perm > 0)
+    result = SMTP_TX_PERMFAIL;
+
+  if (result == SMTP_TX_OK) {
+    LOG_INFO("Relay: Successfully delivered %s", filepath);
+    unlink(filepath); // Success, delete the file
+    qindex_remove(relay_msg_id(filepath));
+    STATS_INC_RELAY_SUCCESS();
+    LOG_DEBUG("Relay worker: Deleted %s after successful delivery.", filepath);
+  } else if (access(filepath, F_OK) != 0 && errno == ENOENT) {
+    // Spool file removed behind our back, nothing left to retry
+    qindex_remove(relay_msg_id(filepath));
+  } else {
+    // Failed. Leave it in the queue directory, the scheduler picks it
+    // up again from the queue index once it is due.
+    if (result == SMTP_TX_TEMPFAIL && d->rcpt_settled > 0)
+      LOG_INFO("Relay: %s partially delivered, retrying the remaining "
+               "recipients",
+               filepath);
+
+    // Recipients done with so far; out of memory, some may be tried again
+    // rather than lost
+    bitmap_t done = {0};
+    if (bitmap_copy(&done, &d->msg->rcpt_done) == 0) {
+      for (int i = 0; i < d->rcpt_count && d->rcpt_state; i++) {
+        if ((d->rcpt_state[i] & RELAY_RCPT_DONE) &&
+            bitmap_set(&done, (size_t)i) != 0)
+          break;
+      }
+    }
+    int expired = 0;
+    if (d->result == SMTP_TX_OK && d->rcpt_temp > 0 &&
+        d->rcpt_temp == d->rcpt_held)
+      relay_postpone(d->msg, &done, d->held_wait);
+    else
+      expired = relay_reschedule(d->msg, result, &done) &&
+                result == SMTP_TX_TEMPFAIL;
+    bitmap_free(&done);
+    relay_report_failed(d, expired);
   }
 
-  SEND("\r\n.\r\n"); // End of data
-  EXPECT(250);
+  d->worker->inflight--;
+  if (d->lane == RELAY_LANE_LARGE)
+    d->worker->large_inflight--;
+  if (d->fp)
+    fclose(d->fp);
+  free(d->body_buf);
+  for (int i = 0; i < d->rcpt_count; i++)
+    free(d->recipients[i]);
+  free(d->recipients);
+  free(d->part_mem);
+  storage_msg_free(d->msg);
+  slab_free(&g_delivery_cache, d);
+}
 
-  SEND("QUIT\r\n");
-  // EXPECT(221); // QUIT response is often 221, but not strictly necessary to
-  // check for success.
+static void relay_part_done(smtp_client_t *c, smtp_tx_t *tx, void *arg);
+static void relay_part_start(relay_part_t *part, const upstream_t *exclude);
 
-  close(fd);
-  fclose(fp);
-  LOG_INFO("Relay: Successfully delivered %s", filepath);
-  return 0;
+// Helper: Feed the outcome of the current attempt to the route's balancer
+static void relay_part_report(relay_part_t *part, upstream_outcome_t outcome) {
+  if (!part->upstream)
+    return;
+
+  double latency_ms = -1;
+  if (outcome == UPSTREAM_OK) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    latency_ms = (double)(now.tv_sec - part->started.tv_sec) * 1000.0 +
+                 (double)(now.tv_nsec - part->started.tv_nsec) / 1e6;
+  }
+  balancer_report(part->route, part->upstream, outcome, latency_ms,
+                  time(NULL));
+  part->upstream = NULL;
+}
+
+// Helper: One part finished; the message is done once every part is.
+// Each recipient's fate follows its own RCPT reply if that was a refusal,
+// else the outcome of the transaction.
+static void relay_part_finish(relay_part_t *part, smtp_tx_result_t result) {
+  relay_delivery_t *d = part->delivery;
+  relay_part_t *next = part->chain_next;
+  part->chain_next = NULL;
+  relay_part_report(part, UPSTREAM_NEUTRAL);
+  if (part->has_slot) {
+    route_release(part->route);
+    part->has_slot = 0;
+  }
+
+  for (int i = 0; i < part->rcpt_count; i++) {
+    unsigned char *state = &d->rcpt_state[part->rcpt_index[i]];
+    int code = part->rcpt_codes[i];
+    if (code / 100 == 5 || (code / 100 != 4 && result == SMTP_TX_PERMFAIL)) {
+      if (code / 100 != 5)
+        part->rcpt_codes[i] = code = part->tx.code; // For the report
+      LOG_WARN("Relay: <%s> of %s failed permanently (%d)",
+               part->rcpt_ptrs[i], d->msg->path, code);
+      *state |= RELAY_RCPT_DONE | RELAY_RCPT_PERM;
+      d->rcpt_perm++;
+      d->rcpt_settled++;
+    } else if (code / 100 == 4 || result != SMTP_TX_OK) {
+      if (code / 100 != 4)
+        part->rcpt_codes[i] = part->tx.code;
+      *state |= RELAY_RCPT_TEMP;
+      d->rcpt_temp++;
+      if (part->held)
+        d->rcpt_held++;
+    } else {
+      *state |= RELAY_RCPT_DONE;
+      d->rcpt_settled++;
+    }
+  }
+
+  if (--d->pending == 0)
+    relay_delivery_finish(d);
+
+  // The session this part used is back in the pool for the next link
+  if (next)
+    relay_part_start(next, NULL);
+}
+
+// Helper: The picked gateway failed the part: count it against the gateway
+// and try another one of the route, if any is left
+static void relay_part_failover(relay_part_t *part) {
+  upstream_t *failed = part->upstream;
+  relay_part_report(part, UPSTREAM_FAIL);
+
+  if (part->attempts >= part->route->upstream_count) {
+    relay_part_finish(part, SMTP_TX_TEMPFAIL); // Retry later
+    return;
+  }
+  LOG_DEBUG("Relay: %s:%d failed, trying another gateway for %s",
+            failed->host, failed->port, part->route->domain);
+  relay_part_start(part, failed);
+}
+
+// Helper: The part is over its route's or gateway's limits (wait: seconds
+// until they should allow it, 0 if unknown). It waits on the worker for a
+// while; past RELAY_THROTTLE_WAIT, or when waiting parts would take half of
+// the worker's deliveries, it is deferred instead.
+static void relay_part_hold(relay_part_t *part, double wait) {
+  relay_delivery_t *d = part->delivery;
+  relay_worker_t *w = d->worker;
+  double now = rate_limit_now();
+
+  if (part->waiting_since == 0)
+    part->waiting_since = now;
+  if (now + wait - part->waiting_since < RELAY_THROTTLE_WAIT &&
+      list_size(&w->waiting) * 2 < (size_t)g_max_inflight) {
+    list_push_back(&w->waiting, &part->node);
+    return;
+  }
+
+  LOG_DEBUG("Relay: Route %s over its limits, deferring %s",
+            part->route->domain, d->msg->path);
+  part->held = 1;
+  if (wait > d->held_wait)
+    d->held_wait = wait;
+  relay_part_finish(part, SMTP_TX_TEMPFAIL);
+}
+
+// Helper: Run a part on a pooled session to a gateway of its route. If the
+// route or its gateways are at their limits, the part is held back.
+static void relay_part_start(relay_part_t *part, const upstream_t *exclude) {
+  relay_worker_t *w = part->delivery->worker;
+  route_t *route = part->route;
+  double wait;
+
+  if (!part->has_slot) {
+    if (!route_acquire(route, &wait)) {
+      relay_part_hold(part, wait);
+      return;
+    }
+    part->has_slot = 1;
+  }
+
+  // A stale session retry stays on the gateway already picked
+  if (!part->upstream) {
+    part->upstream = balancer_pick(route, exclude, time(NULL), &wait);
+    if (!part->upstream && wait >= 0) {
+      relay_part_hold(part, wait); // Keeps its slot on the route
+      return;
+    }
+    if (!part->upstream) {
+      LOG_WARN("Relay: No healthy gateway for route %s, deferring %s",
+               route->domain, part->delivery->msg->path);
+      relay_part_finish(part, SMTP_TX_TEMPFAIL);
+      return;
+    }
+    part->attempts++;
+  }
+  part->waiting_since = 0;
+  clock_gettime(CLOCK_MONOTONIC, &part->started);
+
+  upstream_t *u = part->upstream;
+  smtp_client_t *c = upstream_pool_checkout(w->pool, u->host, u->port);
+  if (!c) {
+    relay_part_failover(part);
+    return;
+  }
+
+  part->tx.body_offset = part->delivery->body_start;
+  if (smtp_client_start(c, &part->tx, relay_part_done, part) != 0) {
+    upstream_pool_release(w->pool, c);
+    relay_part_finish(part, SMTP_TX_TEMPFAIL);
+  }
+}
+
+// Transaction finished (called from the worker's event loop)
+static void relay_part_done(smtp_client_t *c, smtp_tx_t *tx, void *arg) {
+  relay_part_t *part = (relay_part_t *)arg;
+  relay_delivery_t *d = part->delivery;
+  upstream_pool_release(d->worker->pool, c);
 
-err:
-  LOG_ERROR("Relay: Failed to deliver %s", filepath);
-  close(fd);
-  fclose(fp);
+  if (tx->stale && !part->retried) {
+    // The pooled session had gone away; nothing was sent yet
+    part->retried = 1;
+    LOG_DEBUG("Relay: Stale upstream session, retrying %s", d->msg->path);
+    relay_part_start(part, NULL);
+    return;
+  }
+
+  // No reply at all (connect failure, timeout, I/O error) or 421 means the
+  // gateway itself is in trouble. Another gateway may take the message, as
+  // long as the body cannot have been accepted already.
+  if (tx->result != SMTP_TX_OK && (tx->code == 0 || tx->code == 421)) {
+    LOG_WARN("Relay: Gateway %s:%d failed for %s: %s", part->upstream->host,
+             part->upstream->port, d->msg->path,
+             tx->code ? tx->reply : "no reply");
+    if (!tx->data_started) {
+      relay_part_failover(part);
+      return;
+    }
+    relay_part_report(part, UPSTREAM_FAIL);
+    relay_part_finish(part, SMTP_TX_TEMPFAIL);
+    return;
+  }
+
+  if (tx->result != SMTP_TX_OK)
+    LOG_ERROR("Relay: Failed to deliver %s via %s:%d: %s", d->msg->path,
+              part->upstream->host, part->upstream->port, tx->reply);
+  relay_part_report(part, UPSTREAM_OK);
+  relay_part_finish(part, tx->result);
+}
+
+// Helper: Try the held parts again; those still over a limit queue up
+// again behind the others
+static void relay_start_waiting(relay_worker_t *w) {
+  list_t held = w->waiting;
+  list_init(&w->waiting);
+
+  list_node_t *node;
+  while ((node = list_pop_front(&held)) != NULL)
+    relay_part_start(list_entry(node, relay_part_t, node), NULL);
+}
+
+// Helper: Set up one message on this worker
+// Returns the delivery with its parts ready to start, NULL if it is over
+// already (failed, or nothing left to send)
+static relay_delivery_t *relay_deliver(relay_worker_t *w, storage_msg_t *msg,
+                                       relay_lane_t lane) {
+  relay_delivery_t *d = slab_zalloc(&g_delivery_cache);
+  if (!d) {
+    LOG_ERROR("Relay worker: Failed to allocate delivery for %s", msg->path);
+    relay_reschedule(msg, SMTP_TX_TEMPFAIL, &msg->rcpt_done);
+    storage_msg_free(msg);
+    return NULL;
+  }
+  d->worker = w;
+  d->lane = lane;
+  d->msg = msg;
+  d->body_fd = -1;
+  w->inflight++;
+  if (lane == RELAY_LANE_LARGE)
+    w->large_inflight++;
+
+  LOG_DEBUG("Relay worker: Processing %s", msg->path);
+  if (relay_delivery_prepare(d) != 0) {
+    if (d->result == SMTP_TX_OK)
+      d->result = SMTP_TX_TEMPFAIL;
+    relay_delivery_finish(d);
+    return NULL;
+  }
+
+  if (d->part_count == 0) {
+    relay_delivery_finish(d); // Every recipient was done already
+    return NULL;
+  }
+  d->pending = d->part_count;
+  return d;
+}
+
+// Helper: Start a batch of messages taken from the queue together. Parts
+// bound for the same route are chained up to RELAY_CHAIN_LEN long: each one
+// starts when the previous is done, on the session it hands back to the
+// pool, instead of every message opening a connection of its own. Past
+// RELAY_CHAINS chains, parts queue behind the shortest one whatever its
+// route; they still start, just later.
+static void relay_deliver_batch(relay_worker_t *w, void **msgs, int count,
+                                relay_lane_t lane) {
+  relay_part_t *heads[RELAY_CHAINS];
+  relay_part_t *tails[RELAY_CHAINS];
+  int lengths[RELAY_CHAINS];
+  int chains = 0;
+
+  for (int i = 0; i < count; i++) {
+    relay_delivery_t *d = relay_deliver(w, msgs[i], lane);
+    if (!d)
+      continue;
+    for (int j = 0; j < d->part_count; j++) {
+      relay_part_t *part = &d->parts[j];
+      int k = 0;
+      while (k < chains && (tails[k]->route != part->route ||
+                            lengths[k] >= RELAY_CHAIN_LEN))
+        k++;
+      if (k == chains && chains == RELAY_CHAINS) {
+        k = 0;
+        for (int c = 1; c < chains; c++) {
+          if (lengths[c] < lengths[k])
+            k = c;
+        }
+      }
+      if (k < chains) {
+        tails[k]->chain_next = part;
+        tails[k] = part;
+        lengths[k]++;
+      } else {
+        heads[chains] = tails[chains] = part;
+        lengths[chains++] = 1;
+      }
+    }
+  }
+
+  // The last part of a message to finish frees it, possibly right here,
+  // but only after its successor in the chain was started
+  for (int k = 0; k < chains; k++)
+    relay_part_start(heads[k], NULL);
+}
+
+// Helper: Wake one worker loop
+static void relay_wake_worker(relay_worker_t *w) {
+  uint64_t one = 1;
+  if (write(w->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    LOG_ERROR("Relay: Failed to wake a worker: %s", strerror(errno));
+}
+
+// Helper: Wake every worker loop
+static void relay_wake_workers(void) {
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++)
+    relay_wake_worker(&g_workers[i]);
+}
+
+// Helper: Messages queued on all workers
+static int relay_queued(void) {
+  int queued = 0;
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    for (int l = 0; l < RELAY_LANES; l++)
+      queued += fair_queue_size(g_workers[i].lanes[l]);
+  }
+  return queued;
+}
+
+// Helper: Where a message is queued, from the envelope at the top of the
+// spool file (or of its hot copy): the route of its first recipient left
+// to deliver, its lane (by size, then sender or route policy) and its flow
+static void relay_msg_class(const storage_msg_t *msg, relay_class_t *cls) {
+  char head[RELAY_ENVELOPE_PEEK];
+  ssize_t len = 0;
+  size_t size = msg->size;
+  if (msg->data) {
+    len = (ssize_t)(msg->size < sizeof(head) ? msg->size : sizeof(head) - 1);
+    memcpy(head, msg->data, (size_t)len);
+  } else {
+    int fd = open(msg->path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+      struct stat st;
+      if (fstat(fd, &st) == 0)
+        size = (size_t)st.st_size;
+      len = pread(fd, head, sizeof(head) - 1, 0);
+      close(fd);
+    }
+    if (len < 0)
+      len = 0;
+  }
+  head[len] = '\0';
+
+  char sender[256] = "", client[64] = "";
+  size_t index = 0;
+  char *line = head;
+  cls->route = NULL;
+  while (*line && *line != '\r' && *line != '\n') { // Up to the headers' end
+    char *next = strchr(line, '\n');
+    if (!next)
+      break; // Cut off by the peek
+    *next++ = '\0';
+    if (strncasecmp(line, "X-Envelope-From:", 16) == 0) {
+      char *p = line + 16 + strspn(line + 16, " <");
+      p[strcspn(p, ">\r")] = '\0';
+      snprintf(sender, sizeof(sender), "%s", p);
+    } else if (strncasecmp(line, "X-Envelope-Client:", 18) == 0) {
+      char *p = line + 18 + strspn(line + 18, " ");
+      p[strcspn(p, "\r ")] = '\0';
+      snprintf(client, sizeof(client), "%s", p);
+    } else if (!cls->route && strncasecmp(line, "X-Envelope-To:", 14) == 0 &&
+               !bitmap_test(&msg->rcpt_done, index++)) {
+      char *domain = strrchr(line, '@');
+      if (domain)
+        domain[strcspn(domain, ">\r ")] = '\0';
+      cls->route = route_lookup(g_routes, domain ? domain + 1 : "");
+    }
+    line = next;
+  }
+  if (!cls->route)
+    cls->route = route_lookup(g_routes, "");
+
+  if (g_large_msg_size > 0 && size > g_large_msg_size)
+    cls->lane = RELAY_LANE_LARGE;
+  else
+    cls->lane = (relay_lane_t)route_priority(g_routes, cls->route, sender);
+  cls->weight =
+      route_flow(g_routes, sender, client, cls->flow, sizeof(cls->flow));
+}
+
+// Helper: Worker a route's messages are queued on: the running worker
+// ranking highest for the route (rendezvous hashing), so a route only
+// moves when its worker is retired. NULL if none is running.
+static relay_worker_t *relay_home_worker(const route_t *route) {
+  relay_worker_t *home = NULL;
+  uint64_t best = 0;
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    if (atomic_load(&g_workers[i].state) != RELAY_WORKER_RUNNING)
+      continue;
+    // splitmix64 finalizer over the route and the slot
+    uint64_t h = (uint64_t)(uintptr_t)route ^ ((uint64_t)i << 48);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    if (!home || h > best) {
+      home = &g_workers[i];
+      best = h;
+    }
+  }
+  return home;
+}
+
+// Helper: Queue a message its route's worker refused on any other running
+// worker with room in its lane and flow
+// Returns 0 if queued (msg is taken), -1 if full everywhere or stopping
+static int relay_spill(storage_msg_t *msg, const relay_class_t *cls,
+                       const relay_worker_t *home) {
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    relay_worker_t *w = &g_workers[i];
+    if (w != home && atomic_load(&w->state) == RELAY_WORKER_RUNNING &&
+        fair_queue_try_push(w->lanes[cls->lane], cls->flow, cls->weight,
+                            msg) == 0) {
+      relay_wake_worker(w);
+      return 0;
+    }
+  }
   return -1;
 }
 
+// Helper: Queue a message in its lane on the worker of its route, or on
+// any running worker with room if that one (or its flow there) is full.
+// Never waits: a full flow is the producer's to back off on.
+// Returns 0 if queued (msg is taken), -1 if full or stopping
+static int relay_enqueue(storage_msg_t *msg) {
+  relay_class_t cls;
+  relay_msg_class(msg, &cls);
+  relay_worker_t *home = relay_home_worker(cls.route);
+  if (!home)
+    home = &g_workers[0]; // Between scaling steps, stolen from there
+
+  if (fair_queue_try_push(home->lanes[cls.lane], cls.flow, cls.weight, msg) ==
+      0) {
+    relay_wake_worker(home);
+    return 0;
+  }
+  return relay_spill(msg, &cls, home);
+}
+
+// Helper: Queue up to RELAY_PUSH_BATCH messages, those bound for the same
+// lane of the same worker at once, without waiting. Messages whose flow is
+// full on their route's worker spill over to other workers; those refused
+// everywhere (or because the relay is stopping) are moved to the end of
+// msgs, for the caller to back off on.
+// Returns the number queued
+static int relay_enqueue_batch(void **msgs, int count) {
+  relay_worker_t *homes[RELAY_PUSH_BATCH];
+  relay_class_t cls[RELAY_PUSH_BATCH];
+  void *group[RELAY_PUSH_BATCH];
+  int members[RELAY_PUSH_BATCH];
+  const char *flows[RELAY_PUSH_BATCH];
+  int weights[RELAY_PUSH_BATCH];
+  void *refused[RELAY_PUSH_BATCH];
+  int pushed = 0, left = 0;
+
+  for (int i = 0; i < count; i++) {
+    relay_msg_class(msgs[i], &cls[i]);
+    homes[i] = relay_home_worker(cls[i].route);
+    if (!homes[i])
+      homes[i] = &g_workers[0];
+  }
+  for (int i = 0; i < count; i++) {
+    relay_worker_t *home = homes[i];
+    relay_lane_t lane = cls[i].lane;
+    if (!home)
+      continue; // Queued with an earlier group
+    int n = 0;
+    for (int j = i; j < count; j++) {
+      if (homes[j] == home && cls[j].lane == lane) {
+        group[n] = msgs[j];
+        members[n] = j;
+        flows[n] = cls[j].flow;
+        weights[n++] = cls[j].weight;
+        homes[j] = NULL;
+      }
+    }
+    int k = fair_queue_push_batch(home->lanes[lane], flows, weights, group, n);
+    if (k > 0)
+      relay_wake_worker(home);
+    pushed += k;
+
+    // The refused ones are at the front of group, in order
+    for (int j = 0, r = 0; j < n && r < n - k; j++) {
+      if (msgs[members[j]] != group[r])
+        continue;
+      if (relay_spill(group[r], &cls[members[j]], home) == 0)
+        pushed++;
+      else
+        refused[left++] = group[r];
+      r++;
+    }
+  }
+  memcpy(msgs + pushed, refused, (size_t)left * sizeof(void *));
+  return pushed;
+}
+
+// Helper: Seconds a producer backs off for after its messages were refused
+// `refusals` times in a row: 1, doubling up to RELAY_BACKOFF_MAX
+static int relay_backoff_delay(int refusals) {
+  int delay = 1;
+  for (int i = 1; i < refusals && delay < RELAY_BACKOFF_MAX; i++)
+    delay *= 2;
+  return delay < RELAY_BACKOFF_MAX ? delay : RELAY_BACKOFF_MAX;
+}
+
+// Scheduler: queue a batch of due messages. Those refused because their
+// flow is full go back to the index, deferred without counting an attempt;
+// those refused while stopping are still in the index for the next run.
+static void relay_push_due(void **msgs, int count) {
+  int pushed = relay_enqueue_batch(msgs, count);
+  time_t now = time(NULL);
+  for (int i = pushed; i < count; i++) {
+    storage_msg_t *msg = msgs[i];
+    if (g_running) {
+      // Spread out, so the flow's backlog does not all come back at once
+      int delay = 1 + relay_jitter(RELAY_BACKOFF_MAX - 1);
+      qindex_postpone(relay_msg_id(msg->path), now + delay, &msg->rcpt_done);
+      STATS_INC_RELAY_RETRYING();
+      LOG_DEBUG("Relay scheduler: Work queues full, %s retried in %ds",
+                msg->path, delay);
+    }
+    storage_msg_free(msg);
+  }
+}
+
+// Scanner: queue the files claimed so far. The refused ones (their flow is
+// full, or stopping) are moved back to new/ for a later scan.
+// Returns the number refused
+static int relay_flush_claimed(const char *new_path, void **claimed,
+                               int *count) {
+  int pushed = relay_enqueue_batch(claimed, *count);
+  for (int i = pushed; i < *count; i++) {
+    storage_msg_t *msg = claimed[i];
+    char file_path[1024];
+    snprintf(file_path, sizeof(file_path), "%s/%s", new_path,
+             relay_msg_id(msg->path));
+    rename(msg->path, file_path);
+    storage_msg_free(msg);
+  }
+  int refused = *count - pushed;
+  *count = 0;
+  return refused;
+}
+
+// Scanner: move one file from new/ to queue/ and add it to the batch,
+// queued once full
+// Returns the number of files refused by queueing the batch
+static int relay_claim_file(const char *new_path, const char *queue_path,
+                            const char *name, void **claimed, int *count) {
+  char file_path[1024];
+  snprintf(file_path, sizeof(file_path), "%s/%s", new_path, name);
+
+  char new_file_in_queue_path[1024];
+  snprintf(new_file_in_queue_path, sizeof(new_file_in_queue_path), "%s/%s",
+           queue_path, name);
+
+  int refused = 0;
+  if (rename(file_path, new_file_in_queue_path) == 0) {
+    storage_msg_t *q_info = storage_msg_create(new_file_in_queue_path);
+    if (!q_info) {
+      LOG_ERROR("Relay scanner: Failed to allocate memory for queue item.");
+      // Attempt to move back or log for manual intervention
+      rename(new_file_in_queue_path, file_path); // Move back to new
+    } else {
+      claimed[(*count)++] = q_info;
+      LOG_DEBUG("Relay scanner: Claimed %s", new_file_in_queue_path);
+      if (*count == RELAY_PUSH_BATCH)
+        refused = relay_flush_claimed(new_path, claimed, count);
+    }
+  } else if (errno != ENOENT) {
+    LOG_ERROR("Relay scanner: Failed to move file %s to %s: %s", file_path,
+              new_file_in_queue_path, strerror(errno));
+  }
+  return refused;
+}
+
+// Scanner: claim every regular file currently in new/, queued in batches
+// Returns the number of files refused, left in new/
+static int relay_scan_new(const char *new_path, const char *queue_path) {
+  void *claimed[RELAY_PUSH_BATCH];
+  int count = 0, refused = 0;
+
+  DIR *dir = opendir(new_path);
+  if (!dir) {
+    LOG_ERROR("Relay scanner: Failed to open directory %s: %s", new_path,
+              strerror(errno));
+    return 0;
+  }
+
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (!g_running)
+      break;
+    if (entry->d_type == DT_REG) // Regular file
+      refused += relay_claim_file(new_path, queue_path, entry->d_name,
+                                  claimed, &count);
+  }
+  closedir(dir);
+  return refused + relay_flush_claimed(new_path, claimed, &count);
+}
+
+// Scanner: sleep up to `seconds`, waking up every second to notice
+// relay_stop()
+static void relay_scanner_sleep(int seconds) {
+  for (int i = 0; i < seconds && g_running; i++)
+    sleep(1);
+}
+
 // Scanner thread function
+// Locally received mail reaches the workers through the storage commit hook.
+// new/ only receives files dropped by external tools (or committed while the
+// relay was stopped), which are picked up from inotify events. Without
+// inotify the scanner falls back to polling new/ every second.
+// Files the work queues refuse (their flow is full) go back to new/; the
+// scanner then ignores events and rescans new/ after a backoff instead,
+// until a scan gets every file queued.
 static void *relay_scanner_thread(void *arg) {
   (void)arg;
   char new_path[1024];
@@ -287,123 +1306,621 @@ static void *relay_scanner_thread(void *arg) {
   // Ensure queue directory exists
   mkdir(queue_path, 0777);
 
-  LOG_INFO("Relay scanner started on %s, moving files to %s", new_path,
-           queue_path);
+  int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (ifd >= 0 &&
+      inotify_add_watch(ifd, new_path, IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+    LOG_WARN("Relay scanner: inotify watch on %s failed: %s", new_path,
+             strerror(errno));
+    close(ifd);
+    ifd = -1;
+  }
+
+  LOG_INFO("Relay scanner started on %s (%s), moving files to %s", new_path,
+           ifd >= 0 ? "inotify" : "polling", queue_path);
+
+  // Pick up whatever was dropped before the watch was in place
+  int refusals = relay_scan_new(new_path, queue_path) > 0;
+
+  char events[RELAY_INOTIFY_BUF_LEN]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
 
   while (g_running) {
-    DIR *dir = opendir(new_path);
-    if (dir) {
-      struct dirent *entry;
-      while ((entry = readdir(dir)) != NULL) {
-        if (!g_running)
-          break;
-        if (entry->d_type == DT_REG) { // Regular file
-          char file_path[1024];
-          snprintf(file_path, sizeof(file_path), "%s/%s", new_path,
-                   entry->d_name);
-
-          char new_file_in_queue_path[1024];
-          snprintf(new_file_in_queue_path, sizeof(new_file_in_queue_path),
-                   "%s/%s", queue_path, entry->d_name);
-
-          if (rename(file_path, new_file_in_queue_path) == 0) {
-            char *q_info = strdup(new_file_in_queue_path);
-            if (q_info) {
-              queue_push(g_work_queue, q_info);
-              LOG_DEBUG("Relay scanner: Queued %s", new_file_in_queue_path);
-            } else {
-              LOG_ERROR(
-                  "Relay scanner: Failed to allocate memory for queue item.");
-              // Attempt to move back or log for manual intervention
-              rename(new_file_in_queue_path, file_path); // Move back to new
-            }
-          } else {
-            LOG_ERROR("Relay scanner: Failed to move file %s to %s: %s",
-                      file_path, new_file_in_queue_path, strerror(errno));
-          }
-        }
+    if (ifd < 0 || refusals > 0) {
+      if (refusals > 0)
+        LOG_DEBUG("Relay scanner: Work queues full, rescanning %s in %ds",
+                  new_path, relay_backoff_delay(refusals));
+      // Poll interval, or backoff
+      relay_scanner_sleep(refusals > 0 ? relay_backoff_delay(refusals) : 1);
+      while (ifd >= 0 && read(ifd, events, sizeof(events)) > 0) {
+        // Covered by the rescan
       }
-      closedir(dir);
-    } else {
-      LOG_ERROR("Relay scanner: Failed to open directory %s: %s", new_path,
-                strerror(errno));
+      if (relay_scan_new(new_path, queue_path) > 0)
+        refusals++;
+      else
+        refusals = 0;
+      continue;
     }
-    sleep(1); // Poll interval
+
+    // Wake up periodically to notice relay_stop()
+    struct pollfd pfd = {.fd = ifd, .events = POLLIN};
+    int ret = poll(&pfd, 1, 1000);
+    if (ret <= 0) {
+      if (ret < 0 && errno != EINTR) {
+        LOG_ERROR("Relay scanner: poll failed: %s", strerror(errno));
+        sleep(1);
+      }
+      continue;
+    }
+
+    ssize_t len = read(ifd, events, sizeof(events));
+    if (len <= 0)
+      continue;
+
+    // Files of one read are queued together
+    void *claimed[RELAY_PUSH_BATCH];
+    int count = 0, refused = 0;
+    for (ssize_t i = 0; i < len;) {
+      struct inotify_event *ev = (struct inotify_event *)&events[i];
+      if (ev->mask & IN_Q_OVERFLOW) {
+        LOG_WARN("Relay scanner: inotify queue overflow, rescanning %s",
+                 new_path);
+        refused += relay_scan_new(new_path, queue_path);
+      } else if (ev->len > 0 && !(ev->mask & IN_ISDIR)) {
+        refused += relay_claim_file(new_path, queue_path, ev->name, claimed,
+                                    &count);
+      }
+      i += sizeof(struct inotify_event) + ev->len;
+    }
+    refused += relay_flush_claimed(new_path, claimed, &count);
+    refusals = refused > 0;
   }
+
+  if (ifd >= 0)
+    close(ifd);
   LOG_INFO("Relay scanner stopped.");
   return NULL;
 }
 
+// Scheduler thread function
+// Re-queues deferred messages from the queue index once they are due, so
+// retries never require a directory scan.
+static void *relay_scheduler_thread(void *arg) {
+  (void)arg;
+  qindex_entry_t *due = calloc(RELAY_DUE_BATCH, sizeof(qindex_entry_t));
+  if (!due) {
+    LOG_ERROR("Relay scheduler: Failed to allocate memory.");
+    return NULL;
+  }
+
+  LOG_INFO("Relay scheduler started.");
+  while (g_running) {
+    void *msgs[RELAY_DUE_BATCH];
+    int count = 0;
+    int n = qindex_take_due(time(NULL), due, RELAY_DUE_BATCH);
+    for (int i = 0; i < n; i++) {
+      storage_msg_t *msg = storage_msg_create(due[i].path);
+      STATS_DEC_RELAY_RETRYING();
+      if (msg) {
+        msg->attempts = due[i].attempts;
+        msg->created = due[i].created;
+        msg->rcpt_done = due[i].rcpt_done; // Taken over by the message
+        memset(&due[i].rcpt_done, 0, sizeof(due[i].rcpt_done));
+        LOG_DEBUG("Relay scheduler: Retrying %s (attempt %d)", due[i].path,
+                  due[i].attempts + 1);
+        msgs[count++] = msg;
+      }
+      qindex_entry_release(&due[i]);
+    }
+    relay_push_due(msgs, count);
+    if (n < RELAY_DUE_BATCH)
+      sleep(1); // Nothing else due right now
+  }
+
+  free(due);
+  LOG_INFO("Relay scheduler stopped.");
+  return NULL;
+}
+
+// Wakeup handler: drain the eventfd, the worker loop picks up the work
+static void relay_wake_handler(int fd, int events, void *arg) {
+  (void)events;
+  (void)arg;
+  uint64_t value;
+  while (read(fd, &value, sizeof(value)) > 0) {
+  }
+}
+
+// Helper: Whether a worker has work left. A draining worker only finishes
+// its own deliveries; on stop the others also empty every queue.
+static int relay_worker_busy(relay_worker_t *w) {
+  if (w->inflight > 0)
+    return 1;
+  if (atomic_load(&w->state) == RELAY_WORKER_DRAINING)
+    return 0;
+  return g_running || relay_queued() > 0;
+}
+
+// Helper: Messages a worker may take from a lane now, at most max: the
+// large lane is capped by upstream.large_max_inflight
+static int relay_lane_room(relay_worker_t *w, relay_lane_t lane, int max) {
+  if (lane != RELAY_LANE_LARGE)
+    return max;
+  int room = g_large_max_inflight - w->large_inflight;
+  return room < max ? (room > 0 ? room : 0) : max;
+}
+
+// Helper: Next lane of its own for a worker to take from, by smooth
+// weighted round robin over the lanes with messages it may take
+// Returns the lane, -1 if none
+static int relay_pick_lane(relay_worker_t *w) {
+  int best = -1, total = 0;
+  for (int l = 0; l < RELAY_LANES; l++) {
+    if (fair_queue_size(w->lanes[l]) == 0 || relay_lane_room(w, l, 1) == 0)
+      continue;
+    w->lane_credit[l] += g_lane_weight[l];
+    total += g_lane_weight[l];
+    if (best < 0 || w->lane_credit[l] > w->lane_credit[best])
+      best = l;
+  }
+  if (best >= 0)
+    w->lane_credit[best] -= total;
+  return best;
+}
+
+// Helper: Take up to max messages queued on other workers, highest lane
+// first. Anything left on a worker no longer running goes first; else up to
+// half of the longest lane its worker cannot take from (at its delivery
+// limit, or its large-lane quota), or any worker's on stop, taken from the
+// tail of that lane's longest flow.
+// Returns the number taken, *lane the lane they were queued in
+static int relay_steal(relay_worker_t *w, void **items, int max, int *lane) {
+  for (int l = 0; l < RELAY_LANES; l++) {
+    int room = relay_lane_room(w, l, max);
+    if (room == 0)
+      continue;
+
+    relay_worker_t *victim = NULL;
+    int most = 0;
+    for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+      relay_worker_t *v = &g_workers[i];
+      int queued = v != w ? fair_queue_size(v->lanes[l]) : 0;
+      if (queued == 0)
+        continue;
+      if (atomic_load(&v->state) != RELAY_WORKER_RUNNING) {
+        *lane = l;
+        return fair_queue_pop_batch(v->lanes[l], items, room);
+      }
+      if ((v->inflight >= g_max_inflight ||
+           relay_lane_room(v, l, 1) == 0 || !g_running) &&
+          queued > most) {
+        victim = v;
+        most = queued;
+      }
+    }
+    if (!victim)
+      continue;
+
+    // Newest first off the tail, the owner keeps the oldest
+    int n = fair_queue_steal_batch(victim->lanes[l], items,
+                                   (most + 1) / 2 < room ? (most + 1) / 2
+                                                         : room);
+    if (n > 0) {
+      LOG_DEBUG("Relay worker: Took %d messages from a backed up worker", n);
+      *lane = l;
+      return n;
+    }
+  }
+  return 0;
+}
+
 // Worker thread function
 static void *relay_worker_thread(void *arg) {
-  (void)arg;
+  relay_worker_t *w = (relay_worker_t *)arg;
   LOG_INFO("Relay worker thread started.");
-  while (g_running ||
-         !queue_is_empty(g_work_queue)) { // Keep running as long as there's
-                                          // work or g_running is true
-    char *filepath = (char *)queue_pop(g_work_queue); // Blocking pop
-
-    if (filepath) {
-      LOG_DEBUG("Relay worker: Processing %s", filepath);
-      if (relay_process_file(filepath) == 0) {
-        unlink(filepath); // Success, delete the file
-        LOG_DEBUG("Relay worker: Deleted %s after successful delivery.",
-                  filepath);
-      } else {
-        // Failed. Move to 'fail' directory or retry?
-        // For now, log and leave it in the queue directory.
-        // A more robust system would move it to a 'defer' or 'fail' directory.
-        LOG_ERROR("Relay worker: Failed to relay %s. File remains in queue "
-                  "directory.",
-                  filepath);
-      }
-      free(filepath);
+  while (relay_worker_busy(w)) {
+    relay_start_waiting(w);
+
+    // Take new messages, a batch at a time, while below the concurrency
+    // limit: from this worker's lanes by weight, then other workers' backlog
+    while (atomic_load(&w->state) == RELAY_WORKER_RUNNING &&
+           w->inflight < g_max_inflight) {
+      void *batch[RELAY_POP_BATCH];
+      int room = g_max_inflight - w->inflight;
+      if (room > RELAY_POP_BATCH)
+        room = RELAY_POP_BATCH;
+      int n = 0;
+      int lane = relay_pick_lane(w);
+      if (lane >= 0)
+        n = fair_queue_pop_batch(w->lanes[lane], batch,
+                                 relay_lane_room(w, lane, room));
+      if (n == 0)
+        n = relay_steal(w, batch, room, &lane);
+      if (n == 0)
+        break;
+      relay_deliver_batch(w, batch, n, lane);
     }
+
+    event_loop_run_once(w->loop, RELAY_WORKER_TICK_MS);
+    upstream_pool_tick(w->pool, time(NULL));
   }
+  atomic_store(&w->state, RELAY_WORKER_EXITED);
   LOG_INFO("Relay worker thread stopped.");
   return NULL;
 }
 
+int relay_submit(storage_msg_t *msg) {
+  if (!msg || relay_enqueue(msg) != 0)
+    return -1;
+  LOG_DEBUG("Relay: Queued %s%s", msg->path, msg->data ? " (hot)" : "");
+  return 0;
+}
+
+// Installed as the storage commit hook: never blocks the SMTP threads
+int relay_offer(storage_msg_t *msg) {
+  if (relay_enqueue(msg) != 0) {
+    LOG_WARN("Relay: Work queues full, %s goes through new/", msg->path);
+    return -1;
+  }
+  LOG_DEBUG("Relay: Queued %s%s", msg->path, msg->data ? " (hot)" : "");
+  return 0;
+}
+
+// Helper: Free the worker slots with their queues and wakeups
+static void relay_slots_destroy(void) {
+  if (!g_workers)
+    return;
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    for (int l = 0; l < RELAY_LANES; l++)
+      fair_queue_destroy(g_workers[i].lanes[l]);
+    if (g_workers[i].wake_fd >= 0)
+      close(g_workers[i].wake_fd);
+  }
+  free(g_workers);
+  g_workers = NULL;
+}
+
+// Helper: Allocate a slot for the most workers the scaler may run, each
+// with its lanes of messages and the eventfd waking its loop
+// Returns 0 on success, -1 on error
+static int relay_slots_create(void) {
+  g_workers = calloc(RELAY_MAX_WORKERS, sizeof(relay_worker_t));
+  if (!g_workers)
+    return -1;
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++)
+    g_workers[i].wake_fd = -1;
+
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    relay_worker_t *w = &g_workers[i];
+    int ok = 1;
+    for (int l = 0; l < RELAY_LANES; l++) {
+      w->lanes[l] = fair_queue_create(g_lane_capacity[l],
+                                      g_lane_capacity[l] / RELAY_FLOW_SHARE,
+                                      STATS_MEM_RELAY_QUEUE);
+      ok = ok && w->lanes[l];
+    }
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!ok || w->wake_fd == -1) {
+      relay_slots_destroy();
+      return -1;
+    }
+  }
+  return 0;
+}
+
 int relay_init(config_t *config) {
   if (!config)
     return -1;
   g_config = config;
 
-  // Create Queue
-  g_work_queue = queue_create();
-  if (!g_work_queue) {
-    LOG_FATAL("Failed to create relay work queue");
+  // Worker slots, with the queues messages are routed to
+  if (relay_slots_create() != 0) {
+    LOG_FATAL("Failed to create relay work queues: %s", strerror(errno));
     return -1;
   }
 
+  // Open the persistent queue index next to the spool
+  char db_path[1024];
+  snprintf(db_path, sizeof(db_path), "%s/queue.db", config->storage.path);
+  if (qindex_open(db_path) != 0) {
+    LOG_WARN("Relay: Queue index unavailable, failed mail is only retried "
+             "after a restart");
+  } else {
+    long deferred = qindex_count(QINDEX_DEFERRED);
+    if (deferred > 0)
+      stats_add(&g_stats->relay_retrying, (uint64_t)deferred);
+  }
+
   // Count workers
-  g_num_workers = config->upstream.relay_threads;
-  if (g_num_workers <= 0)
-    g_num_workers = 4; // Default to 4 workers
+  g_threads = config->upstream.relay_threads;
+  if (g_threads <= 0)
+    g_threads = 4; // Default to 4 workers
+  g_threads_min = config->upstream.relay_threads_min;
+  g_threads_max = config->upstream.relay_threads_max;
+  if (g_threads_min <= 0 || g_threads_min > g_threads)
+    g_threads_min = g_threads;
+  if (g_threads_max < g_threads)
+    g_threads_max = g_threads;
+  if (g_threads_max > RELAY_MAX_WORKERS)
+    g_threads_max = RELAY_MAX_WORKERS;
+  if (g_threads > g_threads_max)
+    g_threads = g_threads_max;
+
+  g_routes = route_table_create(config);
+  if (!g_routes) {
+    LOG_FATAL("Failed to compile the relay routing table");
+    relay_slots_destroy();
+    qindex_close();
+    return -1;
+  }
+
+  // Outbound STARTTLS; the context (and its session cache) is shared by
+  // every worker's pool
+  const char *tls = config->upstream.tls;
+  if (tls && strcasecmp(tls, "none") != 0) {
+    g_tls_required = strcasecmp(tls, "required") == 0;
+    g_tls_ctx = tls_create_client_context(config->upstream.tls_ca_file,
+                                          config->upstream.tls_verify);
+    if (!g_tls_ctx && g_tls_required) {
+      LOG_FATAL("Outbound TLS is required but unavailable");
+      route_table_destroy(g_routes);
+      g_routes = NULL;
+      relay_slots_destroy();
+      qindex_close();
+      return -1;
+    }
+    if (!g_tls_ctx)
+      LOG_WARN("Relay: Outbound TLS unavailable, relaying in plaintext");
+  }
+
+  g_max_inflight = config->upstream.max_inflight;
+  if (g_max_inflight <= 0)
+    g_max_inflight = 256;
+  g_large_msg_size = (size_t)config->upstream.large_msg_kb * 1024;
+  g_large_max_inflight = config->upstream.large_max_inflight;
+  if (g_large_max_inflight <= 0 || g_large_max_inflight > g_max_inflight)
+    g_large_max_inflight = g_max_inflight;
+  g_pool_max_idle = config->upstream.pool_max_idle;
+  g_pool_idle_timeout = config->upstream.pool_idle_timeout;
+  g_pool_max_msgs = config->upstream.pool_max_msgs;
 
-  LOG_INFO("Relay initialized with %d worker threads", g_num_workers);
+  LOG_INFO("Relay initialized with %d worker threads (%d to %d), up to %d "
+           "deliveries each",
+           g_threads, g_threads_min, g_threads_max, g_max_inflight);
   return 0;
 }
 
+// Helper: Set up a worker's event loop and upstream pool
+static int relay_worker_init(relay_worker_t *w) {
+  list_init(&w->waiting);
+  w->loop = event_loop_create(1024);
+  if (!w->loop)
+    return -1;
+
+  w->pool = upstream_pool_create(w->loop, g_pool_max_idle,
+                                 g_pool_idle_timeout, g_pool_max_msgs,
+                                 "relay.local");
+  if (!w->pool)
+    return -1;
+  upstream_pool_set_tls(w->pool, g_tls_ctx, g_tls_required);
+
+  w->wake_event.fd = w->wake_fd;
+  w->wake_event.events = EVENT_READ;
+  w->wake_event.handler = relay_wake_handler;
+  w->wake_event.arg = w;
+  return event_loop_add(w->loop, &w->wake_event);
+}
+
+// Helper: Release a worker's loop and pool (thread already joined)
+static void relay_worker_destroy(relay_worker_t *w) {
+  if (w->pool)
+    upstream_pool_destroy(w->pool);
+  if (w->loop)
+    event_loop_destroy(w->loop);
+  w->pool = NULL;
+  w->loop = NULL;
+}
+
+// Helper: Start a worker in a free slot
+// Returns 0 on success, -1 on error
+static int relay_worker_spawn(void) {
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    relay_worker_t *w = &g_workers[i];
+    if (atomic_load(&w->state) != RELAY_WORKER_OFF)
+      continue;
+    if (relay_worker_init(w) != 0) {
+      relay_worker_destroy(w);
+      return -1;
+    }
+    atomic_store(&w->state, RELAY_WORKER_RUNNING);
+    if (pthread_create(&w->thread, NULL, relay_worker_thread, w) != 0) {
+      atomic_store(&w->state, RELAY_WORKER_OFF);
+      relay_worker_destroy(w);
+      return -1;
+    }
+    g_num_workers++;
+    return 0;
+  }
+  return -1;
+}
+
+// Helper: Let the newest running worker finish its deliveries and exit
+// Returns 0 on success, -1 if no worker is running
+static int relay_worker_retire(void) {
+  for (int i = RELAY_MAX_WORKERS - 1; i >= 0; i--) {
+    int running = RELAY_WORKER_RUNNING;
+    if (atomic_compare_exchange_strong(&g_workers[i].state, &running,
+                                       RELAY_WORKER_DRAINING)) {
+      g_num_workers--;
+      relay_wake_workers();
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// Helper: Join the workers that finished draining and free their slots
+static void relay_reap_workers(void) {
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    relay_worker_t *w = &g_workers[i];
+    if (atomic_load(&w->state) != RELAY_WORKER_EXITED)
+      continue;
+    pthread_join(w->thread, NULL);
+    relay_worker_destroy(w);
+    atomic_store(&w->state, RELAY_WORKER_OFF);
+  }
+}
+
+// Helper: Worker count for the current load, within [min, max].
+// A backlog that outlasts a scaling round adds workers, more of them the
+// longer it would take to drain at the current upstream latency. Load that
+// fits on one worker less for RELAY_SCALE_DOWN_IDLE rounds retires one.
+static int relay_scale_target(int min, int max, int *backlog, int *idle) {
+  int cur = g_num_workers;
+  int depth = relay_queued();
+  int inflight = 0;
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++)
+    inflight += g_workers[i].inflight;
+
+  int target = cur;
+  if (depth > 0) {
+    *idle = 0;
+    if (++*backlog >= 2) {
+      // Without a latency sample yet, assume a second per delivery
+      double latency = balancer_latency(g_routes) / 1000.0;
+      if (latency <= 0)
+        latency = 1;
+      double slots = (double)(cur > 0 ? cur : 1) * g_max_inflight;
+      double drain = depth * latency / slots;
+      target = cur + 1 + (int)(drain / RELAY_SCALE_UP_DRAIN);
+    }
+  } else {
+    *backlog = 0;
+    if (inflight * 2 <= (cur - 1) * g_max_inflight) {
+      if (++*idle >= RELAY_SCALE_DOWN_IDLE) {
+        *idle = 0;
+        target = cur - 1;
+      }
+    } else {
+      *idle = 0;
+    }
+  }
+
+  if (target < min)
+    target = min;
+  if (target > max)
+    target = max;
+  return target;
+}
+
+// Scaler thread function
+// Applies relay_threads changes from config reloads, and otherwise follows
+// the backlog within relay_threads_min..relay_threads_max, once a second.
+static void *relay_scaler_thread(void *arg) {
+  (void)arg;
+  int backlog = 0, idle = 0;
+
+  pthread_mutex_lock(&g_scale_lock);
+  while (g_running) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    pthread_cond_timedwait(&g_scale_cond, &g_scale_lock, &ts);
+    if (!g_running)
+      break;
+
+    relay_reap_workers();
+
+    int target;
+    if (g_threads_set) {
+      target = g_threads_set;
+      g_threads_set = 0;
+      backlog = idle = 0;
+    } else {
+      target = relay_scale_target(g_threads_min, g_threads_max, &backlog,
+                                  &idle);
+    }
+    if (target == g_num_workers)
+      continue;
+
+    LOG_INFO("Relay: Scaling from %d to %d worker threads (%d queued)",
+             g_num_workers, target, relay_queued());
+    while (g_num_workers < target) {
+      if (relay_worker_spawn() != 0) {
+        LOG_ERROR("Relay: Failed to start a worker thread");
+        break;
+      }
+    }
+    while (g_num_workers > target) {
+      if (relay_worker_retire() != 0) {
+        LOG_ERROR("Relay: %d workers counted but none running",
+                  g_num_workers);
+        g_num_workers = 0;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&g_scale_lock);
+  return NULL;
+}
+
+void relay_set_inflight(int max_inflight, int large_max_inflight) {
+  if (max_inflight <= 0)
+    return;
+  if (large_max_inflight <= 0 || large_max_inflight > max_inflight)
+    large_max_inflight = max_inflight;
+  atomic_store(&g_max_inflight, max_inflight);
+  atomic_store(&g_large_max_inflight, large_max_inflight);
+  relay_wake_workers(); // Workers with room take more at once
+}
+
+void relay_set_threads(int threads, int min, int max) {
+  if (threads <= 0)
+    return;
+  pthread_mutex_lock(&g_scale_lock);
+  g_threads_min = min > 0 && min <= threads ? min : threads;
+  g_threads_max = max >= threads ? max : threads;
+  if (g_threads_max > RELAY_MAX_WORKERS)
+    g_threads_max = RELAY_MAX_WORKERS;
+  g_threads_set = threads < g_threads_max ? threads : g_threads_max;
+  pthread_cond_signal(&g_scale_cond);
+  pthread_mutex_unlock(&g_scale_lock);
+}
+
 void relay_start(void) {
   if (g_running)
     return;
-  g_running = 1;
 
   // Start Workers
-  g_worker_threads = calloc(g_num_workers, sizeof(pthread_t));
-  if (!g_worker_threads) {
-    LOG_FATAL("Failed to allocate memory for relay worker threads.");
+  g_running = 1;
+  for (int i = 0; i < g_threads; i++) {
+    if (relay_worker_spawn() != 0) {
+      LOG_ERROR("Failed to set up relay worker %d", i);
+      break;
+    }
+  }
+  if (g_num_workers == 0) {
+    LOG_FATAL("No relay worker could be started");
     g_running = 0;
     return;
   }
-  for (int i = 0; i < g_num_workers; i++) {
-    pthread_create(&g_worker_threads[i], NULL, relay_worker_thread, NULL);
-  }
+
+  // Start Scaler
+  pthread_create(&g_scaler_thread, NULL, relay_scaler_thread, NULL);
 
   // Start Scanner
   pthread_create(&g_scanner_thread, NULL, relay_scanner_thread, NULL);
 
+  // Start Scheduler
+  pthread_create(&g_scheduler_thread, NULL, relay_scheduler_thread, NULL);
+
+  // Probe route gateways so failed ones are taken out (and back in) even
+  // while no mail flows to them
+  if (g_config->upstream.health_interval > 0)
+    balancer_start(g_routes, g_config->upstream.health_interval);
+
+  // Receive hot tier messages directly from storage_close
+  storage_set_commit_hook(relay_offer);
+
   LOG_INFO("Relay service started");
 }
 
@@ -412,20 +1929,43 @@ void relay_stop(void) {
     return;
   g_running = 0;
 
-  // Signal queue to stop blocking and allow threads to exit
-  queue_stop(g_work_queue);
+  // New messages go back to new/ for the scanner of the next run. Returns
+  // after commits already in relay_offer are done with the worker slots.
+  storage_set_commit_hook(NULL);
+
+  // Signal the queues to stop blocking and allow threads to exit
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    for (int l = 0; l < RELAY_LANES; l++)
+      fair_queue_stop(g_workers[i].lanes[l]);
+  }
+  relay_wake_workers();
+
+  balancer_stop();
 
-  // Join Scanner
+  // Join Scaler, Scanner and Scheduler
+  pthread_mutex_lock(&g_scale_lock);
+  pthread_cond_signal(&g_scale_cond);
+  pthread_mutex_unlock(&g_scale_lock);
+  pthread_join(g_scaler_thread, NULL);
   pthread_join(g_scanner_thread, NULL);
+  pthread_join(g_scheduler_thread, NULL);
 
-  // Join Workers
-  for (int i = 0; i < g_num_workers; i++) {
-    pthread_join(g_worker_threads[i], NULL);
+  // Join Workers (they finish the deliveries in flight first)
+  for (int i = 0; i < RELAY_MAX_WORKERS; i++) {
+    if (atomic_load(&g_workers[i].state) == RELAY_WORKER_OFF)
+      continue;
+    pthread_join(g_workers[i].thread, NULL);
+    relay_worker_destroy(&g_workers[i]);
+    atomic_store(&g_workers[i].state, RELAY_WORKER_OFF);
   }
+  g_num_workers = 0;
 
-  free(g_worker_threads);
-  queue_destroy(g_work_queue);
-  g_work_queue = NULL; // Clear pointer after destruction
+  relay_slots_destroy();
+  route_table_destroy(g_routes);
+  g_routes = NULL;
+  SSL_CTX_free(g_tls_ctx);
+  g_tls_ctx = NULL;
+  qindex_close();
 
   LOG_INFO("Relay service stopped");
 }
@@ -0,0 +1,392 @@
+#include "route.h"
+#include "hash.h"
+#include "logger.h"
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+// What a relay queue flow is (policy.fair_key)
+typedef enum {
+  ROUTE_FAIR_NONE = 0,
+  ROUTE_FAIR_SENDER,
+  ROUTE_FAIR_SENDER_DOMAIN,
+  ROUTE_FAIR_CLIENT
+} route_fair_key_t;
+
+struct route_table {
+  route_t *routes; // routes[0] is the default route
+  int count;
+
+  // Open addressing hash: domain -> route index + 1 (0: empty slot)
+  int *slots;
+  size_t mask;
+
+  char **priority_senders; // Lower case addresses or domains
+  int priority_sender_count;
+
+  route_fair_key_t fair_key;
+  char **fair_flows; // Lower case flows of policy.fair_weights
+  int *fair_weights;
+  int fair_count;
+};
+
+// Helper: Copy a domain in lower case, without a trailing dot
+static void domain_normalize(char *dst, size_t size, const char *src) {
+  size_t i = 0;
+  for (; src[i] && i < size - 1; i++)
+    dst[i] = (char)tolower((unsigned char)src[i]);
+  dst[i] = '\0';
+  if (i > 1 && dst[i - 1] == '.')
+    dst[i - 1] = '\0';
+}
+
+// Helper: Entry of a lower-cased list matching a normalized address,
+// either the whole address or its domain. Returns the index, -1 if none
+static int find_address(char *const *list, int count, const char *address) {
+  const char *at = strrchr(address, '@');
+  for (int i = 0; i < count; i++) {
+    if (strcmp(address, list[i]) == 0 || (at && strcmp(at + 1, list[i]) == 0))
+      return i;
+  }
+  return -1;
+}
+
+// Helper: Split "host:port"
+static int parse_gateway(const char *gateway, char *host, size_t size,
+                         int *port) {
+  const char *colon = strrchr(gateway, ':');
+  if (!colon || colon == gateway || (size_t)(colon - gateway) >= size)
+    return -1;
+  memcpy(host, gateway, (size_t)(colon - gateway));
+  host[colon - gateway] = '\0';
+  *port = atoi(colon + 1);
+  return *port > 0 && *port <= 65535 ? 0 : -1;
+}
+
+// Helper: Find the table slot of a normalized domain
+static int *find_slot(route_table_t *t, const char *domain) {
+  size_t i = hash_fnv1a(domain) & t->mask;
+  while (t->slots[i] != 0 &&
+         strcmp(t->routes[t->slots[i] - 1].domain, domain) != 0)
+    i = (i + 1) & t->mask;
+  return &t->slots[i];
+}
+
+route_table_t *route_table_create(const config_t *config) {
+  route_table_t *t = calloc(1, sizeof(route_table_t));
+  if (!t)
+    return NULL;
+
+  int n = config->policy.route_count;
+  t->routes = calloc((size_t)n + 1, sizeof(route_t));
+
+  // Power of two, at least twice the number of routes
+  size_t cap = 8;
+  while (cap < (size_t)(n + 1) * 2)
+    cap *= 2;
+  t->slots = calloc(cap, sizeof(int));
+  t->mask = cap - 1;
+
+  if (!t->routes || !t->slots) {
+    route_table_destroy(t);
+    return NULL;
+  }
+
+  // Default route: upstream.host unless policy.route has a "*" entry
+  route_t *def = &t->routes[0];
+  snprintf(def->domain, sizeof(def->domain), "*");
+  def->upstreams = calloc(1, sizeof(upstream_t));
+  if (!def->upstreams) {
+    route_table_destroy(t);
+    return NULL;
+  }
+  snprintf(def->upstreams[0].host, sizeof(def->upstreams[0].host), "%s",
+           config->upstream.host ? config->upstream.host : "");
+  def->upstreams[0].port = config->upstream.port;
+  def->upstreams[0].weight = 1;
+  rate_limit_init(&def->upstreams[0].rate, 0, 0);
+  def->upstream_count = 1;
+  pthread_mutex_init(&def->lock, NULL);
+  rate_limit_init(&def->rate, 0, 0);
+  def->priority = ROUTE_PRIORITY_NORMAL;
+  t->count = 1;
+
+  for (int i = 0; i < n; i++) {
+    const config_route_t *cr = &config->policy.routes[i];
+    if (!cr->domain || cr->gateway_count <= 0)
+      continue;
+
+    char domain[ROUTE_DOMAIN_MAX];
+    domain_normalize(domain, sizeof(domain), cr->domain);
+    // "*.example.com" means the same as "example.com" here
+    const char *d = strncmp(domain, "*.", 2) == 0 ? domain + 2 : domain;
+
+    route_t *r = strcmp(d, "*") == 0 ? def : &t->routes[t->count];
+    if (r != def) {
+      int *slot = find_slot(t, d);
+      if (*slot != 0) {
+        LOG_WARN("Route: Duplicate route for %s ignored", d);
+        continue;
+      }
+      *slot = t->count + 1;
+      t->count++;
+      pthread_mutex_init(&r->lock, NULL);
+    }
+
+    upstream_t *ups = calloc((size_t)cr->gateway_count, sizeof(upstream_t));
+    if (!ups) {
+      route_table_destroy(t);
+      return NULL;
+    }
+    free(r->upstreams);
+    r->upstreams = ups;
+    r->upstream_count = cr->gateway_count;
+
+    snprintf(r->domain, sizeof(r->domain), "%s", d);
+    for (int j = 0; j < cr->gateway_count; j++) {
+      const config_gateway_t *gw = &cr->gateways[j];
+      if (parse_gateway(gw->address, ups[j].host, sizeof(ups[j].host),
+                        &ups[j].port) != 0) {
+        LOG_ERROR("Route: Invalid gateway \"%s\" for %s", gw->address, d);
+        route_table_destroy(t);
+        return NULL;
+      }
+      ups[j].weight = gw->weight > 0 ? gw->weight : 1;
+      ups[j].max_concurrency = gw->max_concurrency;
+      rate_limit_init(&ups[j].rate, gw->rate, 0);
+    }
+    r->max_concurrency = cr->max_concurrency;
+    rate_limit_init(&r->rate, cr->rate, cr->burst);
+    r->priority = ROUTE_PRIORITY_NORMAL;
+    if (cr->priority && strcasecmp(cr->priority, "high") == 0)
+      r->priority = ROUTE_PRIORITY_HIGH;
+    else if (cr->priority && strcasecmp(cr->priority, "low") == 0)
+      r->priority = ROUTE_PRIORITY_LOW;
+  }
+
+  int senders = config->policy.priority_sender_count;
+  if (senders > 0) {
+    t->priority_senders = calloc((size_t)senders, sizeof(char *));
+    if (!t->priority_senders) {
+      route_table_destroy(t);
+      return NULL;
+    }
+    for (int i = 0; i < senders; i++) {
+      char buf[ROUTE_DOMAIN_MAX];
+      domain_normalize(buf, sizeof(buf), config->policy.priority_senders[i]);
+      t->priority_senders[i] = strdup(buf);
+      if (!t->priority_senders[i]) {
+        route_table_destroy(t);
+        return NULL;
+      }
+      t->priority_sender_count++;
+    }
+  }
+
+  const char *fair_key = config->policy.fair_key;
+  if (fair_key && strcasecmp(fair_key, "sender") == 0)
+    t->fair_key = ROUTE_FAIR_SENDER;
+  else if (fair_key && strcasecmp(fair_key, "client") == 0)
+    t->fair_key = ROUTE_FAIR_CLIENT;
+  else if (!fair_key || strcasecmp(fair_key, "none") != 0)
+    t->fair_key = ROUTE_FAIR_SENDER_DOMAIN;
+
+  int flows = config->policy.fair_weight_count;
+  if (flows > 0) {
+    t->fair_flows = calloc((size_t)flows, sizeof(char *));
+    t->fair_weights = calloc((size_t)flows, sizeof(int));
+    if (!t->fair_flows || !t->fair_weights) {
+      route_table_destroy(t);
+      return NULL;
+    }
+    for (int i = 0; i < flows; i++) {
+      const config_fair_weight_t *fw = &config->policy.fair_weights[i];
+      char buf[ROUTE_DOMAIN_MAX];
+      domain_normalize(buf, sizeof(buf), fw->flow);
+      t->fair_flows[i] = strdup(buf);
+      if (!t->fair_flows[i]) {
+        route_table_destroy(t);
+        return NULL;
+      }
+      t->fair_weights[i] = fw->weight > 0 ? fw->weight : 1;
+      t->fair_count++;
+    }
+  }
+
+  for (int i = 0; i < t->count; i++) {
+    const route_t *r = &t->routes[i];
+    if (r->max_concurrency > 0 || r->rate.rate > 0)
+      LOG_INFO("Route: %s limited to %d in flight, %.1f/s (0: unlimited)",
+               r->domain, r->max_concurrency, r->rate.rate);
+    for (int j = 0; j < r->upstream_count; j++)
+      LOG_INFO("Route: %s -> %s:%d weight %d", r->domain,
+               r->upstreams[j].host, r->upstreams[j].port,
+               r->upstreams[j].weight);
+  }
+  if (t->fair_key != ROUTE_FAIR_NONE)
+    LOG_INFO("Route: Relay queues shared fairly per %s, %d weighted flows",
+             fair_key ? fair_key : "sender_domain", t->fair_count);
+  return t;
+}
+
+void route_table_destroy(route_table_t *table) {
+  if (!table)
+    return;
+  if (table->routes) {
+    for (int i = 0; i < table->count; i++) {
+      free(table->routes[i].upstreams);
+      pthread_mutex_destroy(&table->routes[i].lock);
+    }
+  }
+  for (int i = 0; i < table->priority_sender_count; i++)
+    free(table->priority_senders[i]);
+  free(table->priority_senders);
+  for (int i = 0; i < table->fair_count; i++)
+    free(table->fair_flows[i]);
+  free(table->fair_flows);
+  free(table->fair_weights);
+  free(table->routes);
+  free(table->slots);
+  free(table);
+}
+
+// Helper: Compare optional strings
+static int str_differs(const char *a, const char *b) {
+  if (!a || !b)
+    return a != b;
+  return strcmp(a, b) != 0;
+}
+
+// Helper: Returns 1 if two route entries differ
+static int route_differs(const config_route_t *a, const config_route_t *b) {
+  if (str_differs(a->domain, b->domain) ||
+      a->gateway_count != b->gateway_count ||
+      a->max_concurrency != b->max_concurrency || a->rate != b->rate ||
+      a->burst != b->burst || str_differs(a->priority, b->priority))
+    return 1;
+  for (int i = 0; i < a->gateway_count; i++) {
+    const config_gateway_t *x = &a->gateways[i], *y = &b->gateways[i];
+    if (str_differs(x->address, y->address) || x->weight != y->weight ||
+        x->max_concurrency != y->max_concurrency || x->rate != y->rate)
+      return 1;
+  }
+  return 0;
+}
+
+int route_config_changed(const config_t *old_cfg, const config_t *new_cfg) {
+  if (str_differs(old_cfg->upstream.host, new_cfg->upstream.host) ||
+      old_cfg->upstream.port != new_cfg->upstream.port ||
+      old_cfg->policy.route_count != new_cfg->policy.route_count ||
+      old_cfg->policy.priority_sender_count !=
+          new_cfg->policy.priority_sender_count ||
+      old_cfg->policy.fair_weight_count != new_cfg->policy.fair_weight_count ||
+      str_differs(old_cfg->policy.fair_key, new_cfg->policy.fair_key))
+    return 1;
+
+  for (int i = 0; i < old_cfg->policy.route_count; i++) {
+    if (route_differs(&old_cfg->policy.routes[i], &new_cfg->policy.routes[i]))
+      return 1;
+  }
+  for (int i = 0; i < old_cfg->policy.priority_sender_count; i++) {
+    if (str_differs(old_cfg->policy.priority_senders[i],
+                    new_cfg->policy.priority_senders[i]))
+      return 1;
+  }
+  for (int i = 0; i < old_cfg->policy.fair_weight_count; i++) {
+    const config_fair_weight_t *x = &old_cfg->policy.fair_weights[i];
+    const config_fair_weight_t *y = &new_cfg->policy.fair_weights[i];
+    if (str_differs(x->flow, y->flow) || x->weight != y->weight)
+      return 1;
+  }
+  return 0;
+}
+
+route_t *route_lookup(route_table_t *table, const char *domain) {
+  char buf[ROUTE_DOMAIN_MAX];
+  domain_normalize(buf, sizeof(buf), domain ? domain : "");
+
+  // Try "a.b.example.com", "b.example.com", "example.com", "com"
+  const char *d = buf;
+  while (*d) {
+    int idx = *find_slot(table, d);
+    if (idx != 0)
+      return &table->routes[idx - 1];
+    d = strchr(d, '.');
+    if (!d)
+      break;
+    d++;
+  }
+  return &table->routes[0];
+}
+
+route_priority_t route_priority(route_table_t *table, const route_t *route,
+                                const char *sender) {
+  if (table->priority_sender_count > 0 && sender && *sender) {
+    char buf[ROUTE_DOMAIN_MAX];
+    domain_normalize(buf, sizeof(buf), sender);
+    if (find_address(table->priority_senders, table->priority_sender_count,
+                     buf) >= 0)
+      return ROUTE_PRIORITY_HIGH;
+  }
+  return route->priority;
+}
+
+int route_flow(route_table_t *table, const char *sender, const char *client,
+               char *flow, size_t size) {
+  char buf[ROUTE_DOMAIN_MAX];
+  switch (table->fair_key) {
+  case ROUTE_FAIR_SENDER:
+  case ROUTE_FAIR_SENDER_DOMAIN:
+    domain_normalize(buf, sizeof(buf), sender ? sender : "");
+    break;
+  case ROUTE_FAIR_CLIENT:
+    domain_normalize(buf, sizeof(buf), client ? client : "");
+    break;
+  default:
+    buf[0] = '\0';
+    break;
+  }
+
+  const char *at = strrchr(buf, '@');
+  snprintf(flow, size, "%s",
+           table->fair_key == ROUTE_FAIR_SENDER_DOMAIN && at ? at + 1 : buf);
+
+  // Entries match by address or by domain, like priority_senders
+  int i = find_address(table->fair_flows, table->fair_count, flow);
+  return i >= 0 ? table->fair_weights[i] : 1;
+}
+
+int route_count(const route_table_t *table) { return table->count; }
+
+route_t *route_at(route_table_t *table, int index) {
+  return &table->routes[index];
+}
+
+int route_acquire(route_t *route, double *wait) {
+  *wait = 0;
+  if (route->max_concurrency <= 0) {
+    atomic_fetch_add(&route->active, 1);
+  } else {
+    int cur = atomic_load(&route->active);
+    do {
+      if (cur >= route->max_concurrency)
+        return 0;
+    } while (!atomic_compare_exchange_weak(&route->active, &cur, cur + 1));
+  }
+  if (route->rate.rate <= 0)
+    return 1;
+
+  pthread_mutex_lock(&route->lock);
+  *wait = rate_limit_take(&route->rate, rate_limit_now());
+  pthread_mutex_unlock(&route->lock);
+  if (*wait > 0) {
+    atomic_fetch_sub(&route->active, 1);
+    return 0;
+  }
+  return 1;
+}
+
+void route_release(route_t *route) { atomic_fetch_sub(&route->active, 1); }
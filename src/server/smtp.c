@@ -1,8 +1,10 @@
 #include "logger.h"
 #include "mempool.h"
 #include "policy.h"
+#include "slab.h"
 #include "smtp_server.h"
 #include "tls.h"
+#include <arpa/inet.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,28 +16,39 @@ static void send_reply(smtp_session_t *s, int code, const char *msg) {
   connection_send(s->conn, buf, len);
 }
 
+#define SMTP_INITIAL_RCPTS 10 // Recipient slots before the array grows
+
+static slab_cache_t g_session_cache =
+    SLAB_CACHE_INIT("smtp_session", smtp_session_t, STATS_MEM_SESSIONS);
+
+// Start a new envelope. The previous one's memory goes back to the
+// session's pool (its extra chunks to the shared free list).
+static void reset_envelope(smtp_session_t *s) {
+  mempool_reset(s->pool);
+  s->env.sender = NULL;
+  s->env.recipient_count = 0;
+  s->env.recipients =
+      mempool_alloc(s->pool, sizeof(char *) * SMTP_INITIAL_RCPTS);
+  s->env.recipient_capacity = s->env.recipients ? SMTP_INITIAL_RCPTS : 0;
+}
+
 smtp_session_t *smtp_session_create(connection_t *conn) {
-  // We can't use mempool for the session struct itself easily unless the conn
-  // manages it purely But for simplicity, we malloc session, but use mempool
-  // for its components.
-  smtp_session_t *s = calloc(1, sizeof(smtp_session_t));
+  // The session struct comes from its object cache, its components from the
+  // session's mempool
+  smtp_session_t *s = slab_zalloc(&g_session_cache);
   if (!s)
     return NULL;
 
   s->conn = conn;
 
   // Create Session Mempool (start small, grow as needed)
-  s->pool = mempool_create(4096);
+  s->pool = mempool_create(4096, STATS_MEM_SESSIONS);
   if (!s->pool) {
-    free(s);
+    slab_free(&g_session_cache, s);
     return NULL;
   }
 
-  // Initialize envelope
-  s->env.recipient_capacity = 10;
-  s->env.recipients =
-      mempool_alloc(s->pool, sizeof(char *) * s->env.recipient_capacity);
-  s->env.recipient_count = 0;
+  reset_envelope(s);
 
   // Initial State
   s->state = SMTP_STATE_CONNECT;
@@ -55,7 +68,7 @@ void smtp_session_destroy(smtp_session_t *s) {
     if (s->pool) {
       mempool_destroy(s->pool);
     }
-    free(s);
+    slab_free(&g_session_cache, s);
   }
 }
 
@@ -86,10 +99,7 @@ static void process_helo(smtp_session_t *s, char *arg, int is_esmtp) {
     send_reply(s, 250, "OK");
   }
   s->state = SMTP_STATE_MAIL;
-
-  // Reset Envelope
-  s->env.recipient_count = 0;
-  s->env.sender = NULL;
+  reset_envelope(s);
 }
 
 static void process_mail(smtp_session_t *s, char *arg) {
@@ -102,7 +112,8 @@ static void process_mail(smtp_session_t *s, char *arg) {
   }
   p++; // Skip ':'
 
-  // Save sender using mempool
+  // Save sender using mempool, dropping any previous envelope
+  reset_envelope(s);
   s->env.sender = mempool_strdup(s->pool, trim_whitespace(p));
   LOG_INFO("MAIL FROM: %s", s->env.sender);
 
@@ -163,13 +174,16 @@ static void process_rcpt(smtp_session_t *s, char *arg) {
   }
 
   if (s->env.recipient_count >= s->env.recipient_capacity) {
-    // In a real mempool impl, realloc is tricky.
-    // We'd allocate a new larger array and copy pointers.
-    int new_cap = s->env.recipient_capacity * 2;
-    char **new_list = mempool_alloc(s->pool, sizeof(char *) * new_cap);
+    // Grows in place unless recipients were allocated after the array; a
+    // moved array's old copy is reclaimed with the envelope
+    int new_cap = s->env.recipient_capacity > 0
+                      ? s->env.recipient_capacity * 2
+                      : SMTP_INITIAL_RCPTS;
+    char **new_list = mempool_realloc(
+        s->pool, s->env.recipients,
+        sizeof(char *) * (size_t)s->env.recipient_capacity,
+        sizeof(char *) * (size_t)new_cap);
     if (new_list) {
-      memcpy(new_list, s->env.recipients,
-             sizeof(char *) * s->env.recipient_count);
       s->env.recipients = new_list;
       s->env.recipient_capacity = new_cap;
     } else {
@@ -235,12 +249,20 @@ static void process_command(smtp_session_t *s, char *line) {
           snprintf(hdr, sizeof(hdr), "X-Envelope-From: %s\r\n", s->env.sender);
           storage_write(s->store_ctx, hdr, strlen(hdr));
         }
+        if (s->conn) { // Client address, for the relay's fair queuing
+          char ip[INET_ADDRSTRLEN], hdr[64];
+          if (inet_ntop(AF_INET, &s->conn->addr.sin_addr, ip, sizeof(ip))) {
+            snprintf(hdr, sizeof(hdr), "X-Envelope-Client: %s\r\n", ip);
+            storage_write(s->store_ctx, hdr, strlen(hdr));
+          }
+        }
         for (int i = 0; i < s->env.recipient_count; i++) {
           char hdr[512];
           snprintf(hdr, sizeof(hdr), "X-Envelope-To: %s\r\n",
                    s->env.recipients[i]);
           storage_write(s->store_ctx, hdr, strlen(hdr));
         }
+        storage_mark_body(s->store_ctx);
 
         send_reply(s, 354, "Start mail input; end with <CRLF>.<CRLF>");
         s->state = SMTP_STATE_DATA_CONTENT;
@@ -249,8 +271,7 @@ static void process_command(smtp_session_t *s, char *line) {
   } else if (strcasecmp(line, "RSET") == 0) {
     send_reply(s, 250, "Reset OK");
     s->state = SMTP_STATE_MAIL;
-    s->env.recipient_count = 0;
-    s->env.sender = NULL;
+    reset_envelope(s);
   } else if (strncasecmp(line, "RSET", 4) == 0) {
     send_reply(s, 250, "OK");
     s->state = SMTP_STATE_INIT; // Reset state
@@ -267,6 +288,47 @@ static void process_command(smtp_session_t *s, char *line) {
   }
 }
 
+// Append one DATA line to the spool in SMTP wire format.
+// The line is kept exactly as received (dot-stuffing included) with its
+// terminator normalized to CRLF, so the relay can send the stored body as is.
+static void process_data_line(smtp_session_t *s, const char *line,
+                              size_t len) {
+  // Strip a single LF or CRLF terminator
+  if (len > 0 && line[len - 1] == '\n')
+    len--;
+  if (len > 0 && line[len - 1] == '\r')
+    len--;
+
+  if (len == 1 && line[0] == '.') {
+    if (s->data_error) {
+      // The spool file is already gone, the message cannot be stored whole
+      send_reply(s, 500, "Line too long, message rejected");
+      s->data_error = 0;
+      s->state = SMTP_STATE_MAIL;
+      reset_envelope(s);
+      return;
+    }
+    // End of data: the terminator is part of the stored wire body
+    storage_write(s->store_ctx, ".\r\n", 3);
+    if (storage_close(s->store_ctx) == 0) {
+      send_reply(s, 250, "OK Message accepted");
+    } else {
+      send_reply(s, 451, "Failed to commit message");
+    }
+    s->store_ctx = NULL;
+    s->state = SMTP_STATE_MAIL;
+    reset_envelope(s);
+    LOG_INFO("Message transaction completed");
+    return;
+  }
+
+  if (s->data_error)
+    return;
+  // Write errors are latched in the storage context and fail the commit
+  storage_write(s->store_ctx, line, len);
+  storage_write(s->store_ctx, "\r\n", 2);
+}
+
 void smtp_process(smtp_session_t *s) {
   // Read loop
   while (1) {
@@ -277,20 +339,49 @@ void smtp_process(smtp_session_t *s) {
       return;
     temp[len] = 0;
 
-    char *nl = strstr(temp, "\n");
+    char *nl = memchr(temp, '\n', len);
     if (!nl) {
       // No full line yet
       if (len == sizeof(temp) - 1) {
-        // Line too long?
-        // Consume and clear? Or error?
-        buffer_read(s->conn->in_buf, NULL, len);
-        send_reply(s, 500, "Line too long");
+        // Line too long: drop it through its newline. In DATA the message
+        // would be stored mangled, so it is dropped and refused at "."
+        buffer_read(s->conn->in_buf, temp, len);
+        if (s->state != SMTP_STATE_DATA_CONTENT) {
+          if (!s->skip_line)
+            send_reply(s, 500, "Line too long");
+        } else if (!s->data_error) {
+          LOG_WARN("Line too long in DATA, message rejected");
+          storage_abort(s->store_ctx);
+          s->store_ctx = NULL;
+          s->data_error = 1;
+        }
+        s->skip_line = 1;
+        continue; // More of it may be buffered already
       }
       return;
     }
 
     size_t line_len = nl - temp + 1;
 
+    if (s->skip_line) {
+      // Tail of an overlong line, not a line of its own
+      buffer_read(s->conn->in_buf, temp, line_len);
+      s->skip_line = 0;
+      continue;
+    }
+
+    if (s->state == SMTP_STATE_DATA_CONTENT) {
+      buffer_read(s->conn->in_buf, temp, line_len);
+      process_data_line(s, temp, line_len);
+      continue;
+    }
+
+    if (line_len >= sizeof(s->cmd_buffer)) {
+      buffer_read(s->conn->in_buf, temp, line_len);
+      send_reply(s, 500, "Line too long");
+      continue;
+    }
+
     // Read the actual line
     buffer_read(s->conn->in_buf, s->cmd_buffer, line_len);
     s->cmd_buffer[line_len] = 0;
@@ -302,33 +393,6 @@ void smtp_process(smtp_session_t *s) {
       line_len--;
     }
 
-    if (s->state == SMTP_STATE_DATA_CONTENT) {
-      if (storage_close(s->store_ctx) == 0) {
-        send_reply(s, 250, "OK Message accepted");
-      } else {
-        send_reply(s, 451, "Failed to commit message");
-      }
-      s->store_ctx = NULL;
-      s->state = SMTP_STATE_MAIL;
-      s->env.sender = NULL;
-      s->env.recipient_count = 0;
-      LOG_INFO("Message transaction completed");
-    } else {
-      // Dot-stuffing handling: if line starts with "..", skip first dot.
-      char *data_to_write = s->cmd_buffer;
-      if (s->cmd_buffer[0] == '.' && s->cmd_buffer[1] == '.') {
-        data_to_write++;
-      }
-
-      // Write line + \n (since we stripped it)
-      // Ideally buffer write shouldn't rely on us adding \n back if we want
-      // exact preservation But for EML, \n is fine.
-      storage_write(s->store_ctx, data_to_write, strlen(data_to_write));
-      storage_write(s->store_ctx, "\n", 1);
-    }
-  }
-  else {
     process_command(s, s->cmd_buffer);
   }
 }
-}
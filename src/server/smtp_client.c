@@ -0,0 +1,749 @@
+#include "smtp_client.h"
+#include "logger.h"
+#include "socket_utils.h"
+#include "tls.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+// Outcome of feeding input/output to the state machine
+#define CLIENT_CONTINUE 0 // Keep going
+#define CLIENT_FAILED -1  // I/O or protocol error, transaction not finished
+#define CLIENT_FINISHED 1 // Done callback ran, the session may be gone
+
+// Body bytes read from the spool per TLS record batch (sendfile cannot
+// encrypt)
+#define CLIENT_TLS_CHUNK 16384
+
+static void client_event_handler(int fd, int events, void *arg);
+
+smtp_client_t *smtp_client_open(event_loop_t *loop, const struct sockaddr *addr,
+                                socklen_t addrlen, const char *host, int port,
+                                const char *helo_name, int timeout_sec) {
+  int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                  0);
+  if (fd == -1) {
+    LOG_ERROR("SMTP client: socket failed: %s", strerror(errno));
+    return NULL;
+  }
+
+  if (connect(fd, addr, addrlen) != 0 && errno != EINPROGRESS) {
+    LOG_ERROR("SMTP client: Connect failed to %s:%d: %s", host, port,
+              strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  set_tcp_nodelay(fd);
+
+  smtp_client_t *c = calloc(1, sizeof(smtp_client_t));
+  if (!c) {
+    close(fd);
+    return NULL;
+  }
+  c->fd = fd;
+  snprintf(c->host, sizeof(c->host), "%s", host);
+  c->port = port;
+  snprintf(c->helo_name, sizeof(c->helo_name), "%s", helo_name);
+  c->state = SMTP_CLIENT_CONNECTING;
+  c->loop = loop;
+  c->timeout = timeout_sec;
+  c->created = time(NULL);
+  c->last_used = c->created;
+  c->deadline = c->created + timeout_sec;
+
+  c->event.fd = fd;
+  c->event.events = EVENT_READ | EVENT_WRITE;
+  c->event.handler = client_event_handler;
+  c->event.arg = c;
+
+  return c;
+}
+
+int smtp_client_attach(smtp_client_t *c) {
+  if (c->attached)
+    return 0;
+  if (event_loop_add(c->loop, &c->event) != 0)
+    return -1;
+  c->attached = 1;
+  return 0;
+}
+
+void smtp_client_detach(smtp_client_t *c) {
+  if (!c->attached)
+    return;
+  event_loop_del(c->loop, &c->event);
+  c->attached = 0;
+}
+
+// Helper: Map an SSL_read/SSL_write result to read()/write() conventions:
+// -1 with errno EAGAIN while TLS waits for the socket, 0 at end of stream
+static ssize_t client_tls_result(smtp_client_t *c, int n) {
+  if (n > 0)
+    return n;
+  switch (SSL_get_error(c->ssl, n)) {
+  case SSL_ERROR_WANT_READ:
+  case SSL_ERROR_WANT_WRITE:
+    errno = EAGAIN;
+    return -1;
+  case SSL_ERROR_ZERO_RETURN:
+    return 0;
+  case SSL_ERROR_SYSCALL:
+    if (errno == 0)
+      return 0; // Unexpected EOF
+    return -1;
+  default:
+    LOG_ERROR("SMTP client: TLS error with %s: %s", c->host,
+              ERR_reason_error_string(ERR_get_error()));
+    errno = EPROTO;
+    return -1;
+  }
+}
+
+// Helper: read() through TLS once it is up
+static ssize_t client_io_read(smtp_client_t *c, void *buf, size_t len) {
+  if (!c->ssl)
+    return read(c->fd, buf, len);
+  ERR_clear_error();
+  errno = 0;
+  return client_tls_result(c, SSL_read(c->ssl, buf, (int)len));
+}
+
+// Helper: write() through TLS once it is up
+static ssize_t client_io_write(smtp_client_t *c, const void *buf, size_t len) {
+  if (!c->ssl)
+    return write(c->fd, buf, len);
+  ERR_clear_error();
+  errno = 0;
+  return client_tls_result(c, SSL_write(c->ssl, buf, (int)len));
+}
+
+// Helper: Append a formatted command to the write buffer
+static int client_queue(smtp_client_t *c, const char *fmt, ...) {
+  char line[1024];
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(line, sizeof(line), fmt, args);
+  va_end(args);
+
+  if (len < 0 || (size_t)len >= sizeof(line)) {
+    LOG_ERROR("SMTP client: Command too long for %s", c->host);
+    return -1;
+  }
+
+  // Compact, then grow if needed
+  if (c->woff == c->wlen) {
+    c->woff = c->wlen = 0;
+  }
+  if (c->wlen + (size_t)len > c->wcap) {
+    size_t cap = c->wcap ? c->wcap : 1024;
+    while (cap < c->wlen + (size_t)len)
+      cap *= 2;
+    char *nbuf = realloc(c->wbuf, cap);
+    if (!nbuf)
+      return -1;
+    c->wbuf = nbuf;
+    c->wcap = cap;
+  }
+  memcpy(c->wbuf + c->wlen, line, (size_t)len);
+  c->wlen += (size_t)len;
+  return 0;
+}
+
+// Helper: Write as much pending output (commands, then body) as the socket
+// takes without blocking
+static int client_flush(smtp_client_t *c) {
+  while (c->woff < c->wlen) {
+    ssize_t n = client_io_write(c, c->wbuf + c->woff, c->wlen - c->woff);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return CLIENT_CONTINUE;
+      LOG_ERROR("SMTP client: Write error to %s: %s", c->host,
+                strerror(errno));
+      return CLIENT_FAILED;
+    }
+    c->woff += (size_t)n;
+    c->deadline = time(NULL) + c->timeout;
+  }
+
+  if (c->state != SMTP_CLIENT_BODY)
+    return CLIENT_CONTINUE;
+
+  smtp_tx_t *tx = c->tx;
+  while (tx->body_offset < tx->body_end) {
+    ssize_t n;
+    if (tx->body) {
+      n = client_io_write(c, tx->body + tx->body_offset,
+                          (size_t)(tx->body_end - tx->body_offset));
+      if (n > 0)
+        tx->body_offset += n;
+    } else if (c->ssl) {
+      // A retried SSL_write must repeat the same bytes: reading the same
+      // offset and length again guarantees that
+      char chunk[CLIENT_TLS_CHUNK];
+      size_t want = (size_t)(tx->body_end - tx->body_offset);
+      if (want > sizeof(chunk))
+        want = sizeof(chunk);
+      ssize_t got = pread(tx->body_fd, chunk, want, tx->body_offset);
+      if (got <= 0) {
+        LOG_ERROR("SMTP client: Spool file read failed at offset %ld",
+                  (long)tx->body_offset);
+        return CLIENT_FAILED;
+      }
+      n = client_io_write(c, chunk, (size_t)got);
+      if (n > 0)
+        tx->body_offset += n;
+    } else {
+      // Wire-format spool body goes out straight from the page cache
+      n = sendfile(c->fd, tx->body_fd, &tx->body_offset,
+                   (size_t)(tx->body_end - tx->body_offset));
+      if (n == 0) {
+        LOG_ERROR("SMTP client: Spool file truncated at offset %ld",
+                  (long)tx->body_offset);
+        return CLIENT_FAILED;
+      }
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return CLIENT_CONTINUE;
+      LOG_ERROR("SMTP client: Body write error to %s: %s", c->host,
+                strerror(errno));
+      return CLIENT_FAILED;
+    }
+    c->deadline = time(NULL) + c->timeout;
+  }
+
+  c->state = SMTP_CLIENT_DOT;
+  return CLIENT_CONTINUE;
+}
+
+// Helper: Report the transaction outcome. Must be the last thing done with c.
+static int client_finish(smtp_client_t *c, smtp_tx_result_t result) {
+  smtp_tx_t *tx = c->tx;
+  smtp_tx_done_pt done = c->done;
+  void *arg = c->done_arg;
+
+  c->tx = NULL;
+  c->done = NULL;
+  c->done_arg = NULL;
+  if (!tx)
+    return CLIENT_FINISHED;
+
+  tx->result = result;
+  if (done)
+    done(c, tx, arg);
+  return CLIENT_FINISHED;
+}
+
+// Helper: Fail the session and its transaction (if any)
+static void client_fail(smtp_client_t *c) {
+  // Nothing was accepted on a reused session yet: the transaction is safe
+  // to retry right away on a fresh one
+  if (c->tx && c->state == SMTP_CLIENT_RSET)
+    c->tx->stale = 1;
+  c->state = SMTP_CLIENT_BROKEN;
+  client_finish(c, SMTP_TX_TEMPFAIL);
+}
+
+// Helper: Map a rejection to the transaction outcome, keep the session
+static int client_reject(smtp_client_t *c, int code) {
+  c->state = SMTP_CLIENT_READY;
+  return client_finish(c, code >= 500 ? SMTP_TX_PERMFAIL : SMTP_TX_TEMPFAIL);
+}
+
+// Helper: End a transaction in which no recipient was accepted, leaving
+// the session in `state`. It is retryable if MAIL or any RCPT got a 4xx.
+static int client_no_rcpts(smtp_client_t *c, smtp_client_state_t state) {
+  int temp = c->mail_refused ? c->rejected < 500 : c->rcpt_tempfail;
+  c->state = state;
+  return client_finish(c, temp ? SMTP_TX_TEMPFAIL : SMTP_TX_PERMFAIL);
+}
+
+// Helper: Move on to the next envelope reply. Without PIPELINING the
+// command is sent now; otherwise it went out with the whole envelope.
+static int client_next_rcpt(smtp_client_t *c) {
+  smtp_tx_t *tx = c->tx;
+  if (c->rcpt_index < tx->rcpt_count) {
+    c->state = SMTP_CLIENT_RCPT;
+    if (c->pipelined)
+      return CLIENT_CONTINUE;
+    return client_queue(c, "RCPT TO: <%s>\r\n", tx->rcpts[c->rcpt_index]) == 0
+               ? CLIENT_CONTINUE
+               : CLIENT_FAILED;
+  }
+  c->state = SMTP_CLIENT_DATA;
+  if (c->pipelined)
+    return CLIENT_CONTINUE;
+  if (c->accepted == 0)
+    return client_no_rcpts(c, SMTP_CLIENT_READY);
+  return client_queue(c, "DATA\r\n") == 0 ? CLIENT_CONTINUE : CLIENT_FAILED;
+}
+
+// Helper: Queue the envelope. If the server supports PIPELINING, MAIL, every
+// RCPT and DATA go out as one batch (RFC 2920) and the replies are matched
+// up in order as they arrive.
+static int client_queue_envelope(smtp_client_t *c) {
+  smtp_tx_t *tx = c->tx;
+  c->rcpt_index = 0;
+  c->rejected = 0;
+  c->mail_refused = 0;
+  c->accepted = 0;
+  c->rcpt_tempfail = 0;
+  c->pipelined = (c->caps & SMTP_CAP_PIPELINING) != 0;
+
+  if (client_queue(c, "MAIL FROM: <%s>\r\n", tx->sender) != 0)
+    return CLIENT_FAILED;
+  if (!c->pipelined)
+    return CLIENT_CONTINUE;
+
+  for (int i = 0; i < tx->rcpt_count; i++) {
+    if (client_queue(c, "RCPT TO: <%s>\r\n", tx->rcpts[i]) != 0)
+      return CLIENT_FAILED;
+  }
+  if (client_queue(c, "DATA\r\n") != 0)
+    return CLIENT_FAILED;
+  return CLIENT_CONTINUE;
+}
+
+// Helper: A RCPT was refused. The transaction goes on with the other
+// recipients; only the first refusal is remembered for the reply text.
+static void client_rcpt_refused(smtp_client_t *c, int code) {
+  if (!c->rejected)
+    c->rejected = code;
+  if (code / 100 == 4)
+    c->rcpt_tempfail = 1;
+}
+
+// Helper: Remember the extensions listed in an EHLO reply line
+static void client_parse_ehlo_line(smtp_client_t *c, const char *line) {
+  const char *kw = line + 4;
+  if (strncasecmp(kw, "PIPELINING", 10) == 0)
+    c->caps |= SMTP_CAP_PIPELINING;
+  else if (strncasecmp(kw, "8BITMIME", 8) == 0)
+    c->caps |= SMTP_CAP_8BITMIME;
+  else if (strncasecmp(kw, "SIZE", 4) == 0)
+    c->caps |= SMTP_CAP_SIZE;
+  else if (strncasecmp(kw, "STARTTLS", 8) == 0)
+    c->caps |= SMTP_CAP_STARTTLS;
+}
+
+// Helper: EHLO (and STARTTLS, if any) are through: start the pending
+// transaction or go idle
+static int client_session_ready(smtp_client_t *c) {
+  LOG_DEBUG("SMTP client: Session established to %s:%d (fd=%d%s)", c->host,
+            c->port, c->fd, c->ssl ? ", TLS" : "");
+  if (!c->tx) {
+    c->state = SMTP_CLIENT_READY;
+    return CLIENT_CONTINUE;
+  }
+  c->state = SMTP_CLIENT_MAIL;
+  return client_queue_envelope(c);
+}
+
+// Helper: Advance the state machine on a complete reply
+static int client_on_reply(smtp_client_t *c, int code, const char *text) {
+  smtp_tx_t *tx = c->tx;
+  // Keep the first refusal while it decides the outcome
+  if (tx && !(c->rejected && (c->mail_refused || c->accepted == 0))) {
+    tx->code = code;
+    snprintf(tx->reply, sizeof(tx->reply), "%s", text);
+  }
+
+  switch (c->state) {
+  case SMTP_CLIENT_BANNER:
+    if (code != 220) {
+      LOG_ERROR("SMTP client: Bad banner from %s:%d: %s", c->host, c->port,
+                text);
+      c->state = SMTP_CLIENT_BROKEN;
+      return client_finish(c, code >= 500 ? SMTP_TX_PERMFAIL
+                                          : SMTP_TX_TEMPFAIL);
+    }
+    c->state = SMTP_CLIENT_EHLO;
+    return client_queue(c, "EHLO %s\r\n", c->helo_name) == 0 ? CLIENT_CONTINUE
+                                                            : CLIENT_FAILED;
+
+  case SMTP_CLIENT_EHLO:
+    if (code != 250) {
+      LOG_ERROR("SMTP client: EHLO rejected by %s:%d: %s", c->host, c->port,
+                text);
+      c->state = SMTP_CLIENT_BROKEN;
+      return client_finish(c, code >= 500 ? SMTP_TX_PERMFAIL
+                                          : SMTP_TX_TEMPFAIL);
+    }
+    if (!c->ssl && c->tls_ctx && (c->caps & SMTP_CAP_STARTTLS)) {
+      c->state = SMTP_CLIENT_STARTTLS;
+      return client_queue(c, "STARTTLS\r\n") == 0 ? CLIENT_CONTINUE
+                                                  : CLIENT_FAILED;
+    }
+    if (!c->ssl && c->tls_required) {
+      LOG_ERROR("SMTP client: %s:%d does not offer STARTTLS", c->host,
+                c->port);
+      if (tx)
+        snprintf(tx->reply, sizeof(tx->reply), "STARTTLS not offered");
+      c->state = SMTP_CLIENT_BROKEN;
+      return client_finish(c, SMTP_TX_TEMPFAIL);
+    }
+    return client_session_ready(c);
+
+  case SMTP_CLIENT_STARTTLS:
+    if (code != 220) {
+      if (c->tls_required) {
+        LOG_ERROR("SMTP client: STARTTLS refused by %s:%d: %s", c->host,
+                  c->port, text);
+        c->state = SMTP_CLIENT_BROKEN;
+        return client_finish(c, SMTP_TX_TEMPFAIL);
+      }
+      LOG_WARN("SMTP client: STARTTLS refused by %s:%d, continuing in "
+               "plaintext",
+               c->host, c->port);
+      return client_session_ready(c);
+    }
+    // Anything the server sent behind the 220 would be injected plaintext
+    if (c->rlen > 0) {
+      LOG_ERROR("SMTP client: Unexpected data after STARTTLS from %s",
+                c->host);
+      return CLIENT_FAILED;
+    }
+    c->ssl = tls_client_new(c->tls_ctx, c->fd, c->host, c->port);
+    if (!c->ssl)
+      return CLIENT_FAILED;
+    c->state = SMTP_CLIENT_TLS;
+    return CLIENT_CONTINUE;
+
+  case SMTP_CLIENT_RSET:
+    if (code != 250) {
+      tx->stale = 1;
+      c->state = SMTP_CLIENT_BROKEN;
+      return client_finish(c, SMTP_TX_TEMPFAIL);
+    }
+    c->state = SMTP_CLIENT_MAIL;
+    // A pipelined envelope was sent right behind the RSET
+    return c->pipelined ? CLIENT_CONTINUE : client_queue_envelope(c);
+
+  case SMTP_CLIENT_MAIL:
+    if (code / 100 != 2) {
+      // Pipelined: the RCPT and DATA replies still have to be consumed
+      if (!c->pipelined)
+        return client_reject(c, code);
+      c->rejected = code;
+      c->mail_refused = 1;
+    }
+    return client_next_rcpt(c);
+
+  case SMTP_CLIENT_RCPT:
+    // After a refused MAIL the RCPT replies say nothing about the recipient
+    if (tx->rcpt_codes && !c->mail_refused)
+      tx->rcpt_codes[c->rcpt_index] = code;
+    if (code / 100 == 2)
+      c->accepted++;
+    else if (!c->mail_refused)
+      client_rcpt_refused(c, code);
+    c->rcpt_index++;
+    return client_next_rcpt(c);
+
+  case SMTP_CLIENT_DATA:
+    if (c->mail_refused || c->accepted == 0) {
+      if (code != 354)
+        return client_no_rcpts(c, SMTP_CLIENT_READY);
+      // Pipelined DATA was accepted without a valid envelope. Ending it
+      // with "." would deliver an empty message, and RSET is not allowed
+      // here: drop the session instead.
+      return client_no_rcpts(c, SMTP_CLIENT_BROKEN);
+    }
+    if (code != 354)
+      return client_reject(c, code);
+    tx->data_started = 1;
+    c->state = SMTP_CLIENT_BODY;
+    return CLIENT_CONTINUE;
+
+  case SMTP_CLIENT_DOT:
+    if (code / 100 != 2)
+      return client_reject(c, code);
+    c->msgs_sent++;
+    c->state = SMTP_CLIENT_READY;
+    return client_finish(c, SMTP_TX_OK);
+
+  default:
+    // Unsolicited reply (e.g. 421 before closing): session is unusable
+    LOG_WARN("SMTP client: Unexpected reply from %s:%d: %s", c->host, c->port,
+             text);
+    return CLIENT_FAILED;
+  }
+}
+
+// Helper: Parse every complete reply in the read buffer
+static int client_process_input(smtp_client_t *c) {
+  for (;;) {
+    char *nl = memchr(c->rbuf, '\n', c->rlen);
+    if (!nl)
+      return CLIENT_CONTINUE;
+
+    size_t len = (size_t)(nl - c->rbuf) + 1;
+    char line[1024];
+    size_t copy = len - 1;
+    if (copy > 0 && c->rbuf[copy - 1] == '\r')
+      copy--;
+    if (copy >= sizeof(line))
+      copy = sizeof(line) - 1;
+    memcpy(line, c->rbuf, copy);
+    line[copy] = '\0';
+    memmove(c->rbuf, c->rbuf + len, c->rlen - len);
+    c->rlen -= len;
+
+    if (copy < 3 || !isdigit((unsigned char)line[0]) ||
+        !isdigit((unsigned char)line[1]) || !isdigit((unsigned char)line[2])) {
+      LOG_ERROR("SMTP client: Malformed reply from %s: %s", c->host, line);
+      return CLIENT_FAILED;
+    }
+
+    if (c->state == SMTP_CLIENT_EHLO && copy > 4)
+      client_parse_ehlo_line(c, line);
+
+    // "250-..." continues, "250 ..." (or bare "250") ends the reply
+    if (line[3] == '-')
+      continue;
+
+    int rc = client_on_reply(c, atoi(line), line);
+    if (rc != CLIENT_CONTINUE)
+      return rc;
+  }
+}
+
+// Helper: Drive the TLS handshake. Once it is done the session starts over
+// with EHLO (RFC 3207), the extensions may differ under TLS.
+static int client_handshake(smtp_client_t *c) {
+  ERR_clear_error();
+  int rc = SSL_connect(c->ssl);
+  if (rc != 1) {
+    int err = SSL_get_error(c->ssl, rc);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+      return CLIENT_CONTINUE;
+    LOG_ERROR("SMTP client: TLS handshake with %s:%d failed: %s", c->host,
+              c->port, ERR_reason_error_string(ERR_get_error()));
+    return CLIENT_FAILED;
+  }
+
+  LOG_DEBUG("SMTP client: TLS with %s:%d: %s%s", c->host, c->port,
+            SSL_get_version(c->ssl), SSL_session_reused(c->ssl) ? ", resumed"
+                                                                : "");
+  c->caps = 0;
+  c->deadline = time(NULL) + c->timeout;
+  c->state = SMTP_CLIENT_EHLO;
+  return client_queue(c, "EHLO %s\r\n", c->helo_name) == 0 ? CLIENT_CONTINUE
+                                                          : CLIENT_FAILED;
+}
+
+// Helper: The handshake failed. Unless TLS is required, the transaction is
+// retried right away on a new (plaintext) session.
+static void client_tls_failed(smtp_client_t *c) {
+  c->tls_failed = 1;
+  if (c->tx && !c->tls_required)
+    c->tx->stale = 1;
+  c->state = SMTP_CLIENT_BROKEN;
+  client_finish(c, SMTP_TX_TEMPFAIL);
+}
+
+// Helper: Read everything available and process the complete replies.
+// The socket is edge-triggered, so it is read until EAGAIN (or the buffer
+// is full) before any reply is processed: a reply that ends the transaction
+// hands the session back, maybe closing it, and nothing may be left unread
+// behind it. Bytes past that reply stay buffered in rbuf.
+static int client_read(smtp_client_t *c) {
+  for (;;) {
+    // The handshake reads the socket itself
+    if (c->state == SMTP_CLIENT_TLS)
+      return CLIENT_CONTINUE;
+
+    int drained = 0, closed = 0;
+    while (!drained && !closed && c->rlen < sizeof(c->rbuf)) {
+      ssize_t n =
+          client_io_read(c, c->rbuf + c->rlen, sizeof(c->rbuf) - c->rlen);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          drained = 1;
+          break;
+        }
+        LOG_ERROR("SMTP client: Read error from %s: %s", c->host,
+                  strerror(errno));
+        closed = 1;
+      } else if (n == 0) {
+        if (c->tx)
+          LOG_ERROR("SMTP client: Connection closed by %s:%d", c->host,
+                    c->port);
+        closed = 1;
+      } else {
+        c->rlen += (size_t)n;
+        c->deadline = time(NULL) + c->timeout;
+      }
+    }
+
+    // Replies received before the connection went away still count
+    int rc = client_process_input(c);
+    if (rc != CLIENT_CONTINUE)
+      return rc;
+    if (closed)
+      return CLIENT_FAILED;
+    if (drained)
+      return CLIENT_CONTINUE;
+    if (c->rlen == sizeof(c->rbuf))
+      c->rlen = 0; // Overlong line: drop it
+  }
+}
+
+static void client_event_handler(int fd, int events, void *arg) {
+  smtp_client_t *c = (smtp_client_t *)arg;
+
+  if (c->state == SMTP_CLIENT_CONNECTING) {
+    if (!(events & (EVENT_WRITE | EVENT_ERROR)))
+      return;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+      err = errno;
+    if (err != 0) {
+      LOG_ERROR("SMTP client: Connect failed to %s:%d: %s", c->host, c->port,
+                strerror(err));
+      client_fail(c);
+      return;
+    }
+    c->state = SMTP_CLIENT_BANNER;
+    c->deadline = time(NULL) + c->timeout;
+  }
+
+  // Errors and hangups surface through read()
+  if (events & (EVENT_READ | EVENT_ERROR)) {
+    int rc = client_read(c);
+    if (rc == CLIENT_FINISHED)
+      return;
+    if (rc == CLIENT_FAILED) {
+      client_fail(c);
+      return;
+    }
+  }
+
+  if (c->state == SMTP_CLIENT_TLS) {
+    c->deadline = time(NULL) + c->timeout;
+    if (client_handshake(c) == CLIENT_FAILED) {
+      client_tls_failed(c);
+      return;
+    }
+    if (c->state == SMTP_CLIENT_TLS)
+      return; // Waiting for the server
+  }
+
+  // Replies may have queued commands or started the body
+  if (c->state != SMTP_CLIENT_BROKEN && client_flush(c) == CLIENT_FAILED)
+    client_fail(c);
+}
+
+int smtp_client_start(smtp_client_t *c, smtp_tx_t *tx, smtp_tx_done_pt done,
+                      void *arg) {
+  if (c->tx || c->state == SMTP_CLIENT_BROKEN)
+    return -1;
+
+  tx->result = SMTP_TX_TEMPFAIL;
+  tx->code = 0;
+  tx->reply[0] = '\0';
+  tx->stale = 0;
+  tx->data_started = 0;
+  if (tx->rcpt_codes)
+    memset(tx->rcpt_codes, 0, (size_t)tx->rcpt_count * sizeof(int));
+
+  c->tx = tx;
+  c->done = done;
+  c->done_arg = arg;
+  c->pipelined = 0;
+  c->rejected = 0;
+  c->mail_refused = 0;
+  c->accepted = 0;
+  c->rcpt_tempfail = 0;
+  c->deadline = time(NULL) + c->timeout;
+
+  if (c->state == SMTP_CLIENT_READY) {
+    // Reused session: reset it, which also proves it is alive. With
+    // PIPELINING the envelope follows in the same write.
+    c->state = SMTP_CLIENT_RSET;
+    if (client_queue(c, "RSET\r\n") != 0 ||
+        ((c->caps & SMTP_CAP_PIPELINING) &&
+         client_queue_envelope(c) != CLIENT_CONTINUE) ||
+        client_flush(c) == CLIENT_FAILED) {
+      c->tx = NULL;
+      c->done = NULL;
+      c->done_arg = NULL;
+      c->state = SMTP_CLIENT_BROKEN;
+      return -1;
+    }
+  }
+  // Otherwise the transaction starts once the greeting and EHLO are through
+
+  if (smtp_client_attach(c) != 0) {
+    c->tx = NULL;
+    c->done = NULL;
+    c->done_arg = NULL;
+    c->state = SMTP_CLIENT_BROKEN;
+    return -1;
+  }
+  return 0;
+}
+
+void smtp_client_check_timeout(smtp_client_t *c, time_t now) {
+  if (!c->tx || now < c->deadline)
+    return;
+
+  LOG_ERROR("SMTP client: Timeout talking to %s:%d (fd=%d)", c->host, c->port,
+            c->fd);
+  client_fail(c);
+}
+
+void smtp_client_set_tls(smtp_client_t *c, SSL_CTX *ctx, int required) {
+  c->tls_ctx = ctx;
+  c->tls_required = ctx ? required : 0;
+}
+
+int smtp_client_idle_ok(smtp_client_t *c) {
+  if (c->state != SMTP_CLIENT_READY || c->rlen > 0 ||
+      (c->ssl && SSL_pending(c->ssl) > 0))
+    return 0;
+
+  char probe;
+  ssize_t n = recv(c->fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+void smtp_client_quit(smtp_client_t *c) {
+  if (!c)
+    return;
+  if (c->state == SMTP_CLIENT_READY) {
+    // Best effort, the reply is not worth waiting for
+    ssize_t n = client_io_write(c, "QUIT\r\n", 6);
+    (void)n;
+  }
+  smtp_client_close(c);
+}
+
+void smtp_client_close(smtp_client_t *c) {
+  if (!c)
+    return;
+  smtp_client_detach(c);
+  if (c->ssl) {
+    // close_notify, without waiting for the peer's
+    if (SSL_is_init_finished(c->ssl))
+      SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+  }
+  if (c->fd != -1)
+    close(c->fd);
+  free(c->wbuf);
+  free(c);
+}
@@ -1,7 +1,10 @@
 #include "storage.h"
 #include "config.h"
 #include "logger.h"
+#include "slab.h"
 #include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,15 +13,87 @@
 #include <time.h>
 #include <unistd.h>
 
+#define STORAGE_PATH_MAX 1024 // Spool file paths, like the spool's buffers
+#define STORAGE_SLOT_PATH 128 // Path bytes kept in a message's own slot
 
 struct storage_ctx {
-  char *path;
+  char path[STORAGE_PATH_MAX];
   FILE *fh;
-  char *final_path;
+  char final_path[STORAGE_PATH_MAX];
+  size_t offset; // Bytes written so far
+  int error;     // Set when a write failed, commit is refused
+
+  // Hot tier copy, dropped once the message outgrows hot_max_msg_size
+  char *hot_buf;
+  size_t hot_cap;
 };
 
 static char *base_spool_path = NULL;
 
+// A committed message with room for a typical spool path
+// ("<spool>/new/<id>.eml"), so queueing one takes a single object from the
+// cache. Longer paths are allocated on their own.
+typedef struct {
+  storage_msg_t msg;
+  char path[STORAGE_SLOT_PATH];
+} storage_msg_slot_t;
+
+static slab_cache_t g_ctx_cache =
+    SLAB_CACHE_INIT("storage_ctx", storage_ctx_t, STATS_MEM_STORAGE);
+static slab_cache_t g_msg_cache =
+    SLAB_CACHE_INIT("storage_msg", storage_msg_slot_t, STATS_MEM_STORAGE);
+
+// Hot tier limits and accounting
+#define DEFAULT_HOT_MAX_MSG_SIZE (64 * 1024)
+#define DEFAULT_HOT_MAX_TOTAL (64 * 1024 * 1024)
+
+static size_t hot_max_msg_size = DEFAULT_HOT_MAX_MSG_SIZE;
+static size_t hot_max_total = DEFAULT_HOT_MAX_TOTAL;
+static _Atomic size_t hot_bytes = 0;
+static _Atomic(storage_commit_hook_t) commit_hook = NULL;
+static atomic_int commit_hook_users = 0; // Commits that may be in the hook
+
+// Reserve hot cache space, fails when the cache is full
+static int hot_reserve(size_t size) {
+  size_t cur = atomic_load(&hot_bytes);
+  do {
+    if (cur + size > hot_max_total)
+      return -1;
+  } while (!atomic_compare_exchange_weak(&hot_bytes, &cur, cur + size));
+  return 0;
+}
+
+static void hot_release(size_t size) { atomic_fetch_sub(&hot_bytes, size); }
+
+// Mirror written data into the hot buffer while the message is small enough
+static void hot_append(storage_ctx_t *ctx, const char *data, size_t len) {
+  if (!ctx->hot_buf)
+    return;
+
+  if (ctx->offset + len > hot_max_msg_size) {
+    free(ctx->hot_buf);
+    ctx->hot_buf = NULL;
+    return;
+  }
+
+  if (ctx->offset + len > ctx->hot_cap) {
+    size_t cap = ctx->hot_cap * 2;
+    while (cap < ctx->offset + len)
+      cap *= 2;
+    if (cap > hot_max_msg_size)
+      cap = hot_max_msg_size;
+    char *buf = realloc(ctx->hot_buf, cap);
+    if (!buf) {
+      free(ctx->hot_buf);
+      ctx->hot_buf = NULL;
+      return;
+    }
+    ctx->hot_buf = buf;
+    ctx->hot_cap = cap;
+  }
+  memcpy(ctx->hot_buf + ctx->offset, data, len);
+}
+
 static int mkdir_p(const char *path) {
   char tmp[1024];
   char *p = NULL;
@@ -57,16 +132,80 @@ int storage_init(const char *base_path) {
   if (mkdir_p(path) != 0)
     return -1;
 
+  // Hot tier messages are committed straight into the relay queue
+  snprintf(path, sizeof(path), "%s/queue", base_path);
+  if (mkdir_p(path) != 0)
+    return -1;
+
+  // Messages the relay gave up on, kept for inspection
+  snprintf(path, sizeof(path), "%s/failed", base_path);
+  if (mkdir_p(path) != 0)
+    return -1;
+
   return 0;
 }
 
+void storage_set_hot_limits(size_t max_msg_size, size_t max_total) {
+  hot_max_msg_size = max_msg_size;
+  hot_max_total = max_total;
+  LOG_INFO("Storage hot tier: max message %zu bytes, cache %zu bytes",
+           max_msg_size, max_total);
+}
+
+void storage_set_commit_hook(storage_commit_hook_t hook) {
+  atomic_store(&commit_hook, hook);
+  // Commits count themselves before loading the hook: once the count drops
+  // to zero, none can still be running the previous one
+  while (atomic_load(&commit_hook_users) > 0)
+    sched_yield();
+}
+
+storage_msg_t *storage_msg_create(const char *path) {
+  if (strlen(path) >= STORAGE_PATH_MAX) {
+    LOG_ERROR("Spool path too long: %s", path);
+    return NULL;
+  }
+  storage_msg_slot_t *slot = slab_alloc(&g_msg_cache);
+  if (!slot)
+    return NULL;
+  memset(&slot->msg, 0, sizeof(slot->msg));
+  size_t len = strlen(path);
+  if (len < sizeof(slot->path)) {
+    memcpy(slot->path, path, len + 1);
+    slot->msg.path = slot->path;
+  } else if (!(slot->msg.path = strdup(path))) {
+    slab_free(&g_msg_cache, slot);
+    return NULL;
+  }
+  return &slot->msg;
+}
+
+void storage_msg_free(storage_msg_t *msg) {
+  if (!msg)
+    return;
+  if (msg->data) {
+    free(msg->data);
+    hot_release(msg->size);
+  }
+  bitmap_free(&msg->rcpt_done);
+  storage_msg_slot_t *slot = (storage_msg_slot_t *)msg; // First member
+  if (msg->path != slot->path)
+    free(msg->path);
+  slab_free(&g_msg_cache, slot);
+}
+
 storage_ctx_t *storage_open(const char *queue_id) {
   if (!base_spool_path)
     return NULL;
 
-  storage_ctx_t *ctx = calloc(1, sizeof(storage_ctx_t));
+  storage_ctx_t *ctx = slab_alloc(&g_ctx_cache);
   if (!ctx)
     return NULL;
+  ctx->fh = NULL;
+  ctx->offset = 0;
+  ctx->error = 0;
+  ctx->hot_buf = NULL;
+  ctx->hot_cap = 0;
 
   // Generate filename if queue_id is NULL
   char id_buf[64];
@@ -76,23 +215,28 @@ storage_ctx_t *storage_open(const char *queue_id) {
   }
 
   // Path: base/tmp/ID.eml
-  size_t path_len = strlen(base_spool_path) + strlen(queue_id) + 20;
-  ctx->path = malloc(path_len);
-  ctx->final_path = malloc(path_len);
-
-  snprintf(ctx->path, path_len, "%s/tmp/%s.eml", base_spool_path, queue_id);
-  snprintf(ctx->final_path, path_len, "%s/new/%s.eml", base_spool_path,
-           queue_id);
+  int len = snprintf(ctx->path, sizeof(ctx->path), "%s/tmp/%s.eml",
+                     base_spool_path, queue_id);
+  snprintf(ctx->final_path, sizeof(ctx->final_path), "%s/new/%s.eml",
+           base_spool_path, queue_id);
+  if (len < 0 || (size_t)len >= sizeof(ctx->path)) {
+    LOG_ERROR("Spool path too long for %s", queue_id);
+    slab_free(&g_ctx_cache, ctx);
+    return NULL;
+  }
 
   ctx->fh = fopen(ctx->path, "wb");
   if (!ctx->fh) {
     LOG_ERROR("Failed to open storage file %s: %s", ctx->path, strerror(errno));
-    free(ctx->path);
-    free(ctx->final_path);
-    free(ctx);
+    slab_free(&g_ctx_cache, ctx);
     return NULL;
   }
 
+  if (hot_max_msg_size > 0 && atomic_load(&commit_hook)) {
+    ctx->hot_cap = hot_max_msg_size < 4096 ? hot_max_msg_size : 4096;
+    ctx->hot_buf = malloc(ctx->hot_cap);
+  }
+
   return ctx;
 }
 
@@ -100,23 +244,98 @@ int storage_write(storage_ctx_t *ctx, const char *data, size_t len) {
   if (!ctx || !ctx->fh)
     return -1;
   if (fwrite(data, 1, len, ctx->fh) != len) {
+    ctx->error = 1;
     return -1;
   }
+  hot_append(ctx, data, len);
+  ctx->offset += len;
   return 0;
 }
 
+int storage_mark_body(storage_ctx_t *ctx) {
+  if (!ctx || !ctx->fh)
+    return -1;
+
+  // The offset field is fixed width, so the block length is known up front
+  char hdr[64];
+  int len = snprintf(hdr, sizeof(hdr), "X-Body-Offset: %010zu\r\n\r\n",
+                     (size_t)0);
+  snprintf(hdr, sizeof(hdr), "X-Body-Offset: %010zu\r\n\r\n",
+           ctx->offset + (size_t)len);
+  return storage_write(ctx, hdr, (size_t)len);
+}
+
+// Helper: Move a message into queue/ and hand it to hook
+static int storage_hand_off(storage_ctx_t *ctx, storage_commit_hook_t hook) {
+  // final_path is "<base>/new/<id>.eml", the queue path only swaps the dir
+  char queue_path[1024];
+  const char *name = strrchr(ctx->final_path, '/');
+  snprintf(queue_path, sizeof(queue_path), "%s/queue%s", base_spool_path,
+           name ? name : "/");
+
+  storage_msg_t *msg = storage_msg_create(queue_path);
+  if (!msg)
+    return -1;
+
+  if (rename(ctx->path, queue_path) != 0) {
+    LOG_ERROR("Failed to commit mail %s -> %s: %s", ctx->path, queue_path,
+              strerror(errno));
+    storage_msg_free(msg);
+    return -1;
+  }
+
+  if (ctx->hot_buf && hot_reserve(ctx->offset) == 0) {
+    msg->data = ctx->hot_buf;
+    msg->size = ctx->offset;
+    ctx->hot_buf = NULL;
+  }
+
+  int hot = msg->data != NULL;
+  if (hook(msg) != 0) {
+    // The relay is backed up, the scanner picks the message up from new/
+    storage_msg_free(msg);
+    if (rename(queue_path, ctx->path) != 0) {
+      LOG_ERROR("Failed to take back mail %s: %s (delivered after restart)",
+                queue_path, strerror(errno));
+      return 0;
+    }
+    return -1;
+  }
+  LOG_INFO("Mail committed: %s%s", queue_path, hot ? " (hot)" : "");
+  return 0;
+}
+
+// Commit a message straight into queue/ and hand it to the relay, which
+// avoids the scanner round trip through new/. Small messages also carry
+// their hot tier copy. Returns 0 when the message was handed off, -1 to
+// fall back to new/.
+static int storage_commit_queue(storage_ctx_t *ctx) {
+  atomic_fetch_add(&commit_hook_users, 1);
+  storage_commit_hook_t hook = atomic_load(&commit_hook);
+  int rc = hook ? storage_hand_off(ctx, hook) : -1;
+  atomic_fetch_sub(&commit_hook_users, 1);
+  return rc;
+}
+
 int storage_close(storage_ctx_t *ctx) {
   if (!ctx)
     return -1;
 
   int ret = 0;
   if (ctx->fh) {
-    fclose(ctx->fh);
+    if (fclose(ctx->fh) != 0)
+      ctx->error = 1;
     ctx->fh = NULL;
   }
 
-  // Move from tmp to new
-  if (rename(ctx->path, ctx->final_path) != 0) {
+  if (ctx->error) {
+    LOG_ERROR("Refusing to commit incomplete mail %s", ctx->path);
+    unlink(ctx->path);
+    ret = -1;
+  } else if (storage_commit_queue(ctx) == 0) {
+    // Handed to the relay in process
+  } else if (rename(ctx->path, ctx->final_path) != 0) {
+    // Move from tmp to new
     LOG_ERROR("Failed to commit mail %s -> %s: %s", ctx->path, ctx->final_path,
               strerror(errno));
     ret = -1;
@@ -126,11 +345,8 @@ int storage_close(storage_ctx_t *ctx) {
     LOG_INFO("Mail committed: %s", ctx->final_path);
   }
 
-  if (ctx->path)
-    free(ctx->path);
-  if (ctx->final_path)
-    free(ctx->final_path);
-  free(ctx);
+  free(ctx->hot_buf);
+  slab_free(&g_ctx_cache, ctx);
   return ret;
 }
 
@@ -139,11 +355,7 @@ void storage_abort(storage_ctx_t *ctx) {
     return;
   if (ctx->fh)
     fclose(ctx->fh);
-  if (ctx->path) {
-    unlink(ctx->path);
-    free(ctx->path);
-  }
-  if (ctx->final_path)
-    free(ctx->final_path);
-  free(ctx);
+  unlink(ctx->path);
+  free(ctx->hot_buf);
+  slab_free(&g_ctx_cache, ctx);
 }
@@ -0,0 +1,229 @@
+#include "upstream_pool.h"
+#include "logger.h"
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Upstream connect/read timeout
+#define UPSTREAM_IO_TIMEOUT 60
+// Seconds a resolved upstream address is reused before looking it up again
+#define UPSTREAM_DNS_TTL 300
+// Seconds opportunistic TLS stays off for an upstream after a failed
+// handshake
+#define UPSTREAM_NO_TLS_TIME 3600
+
+// One destination: cached address and idle sessions (most recently used
+// first)
+typedef struct upstream_dest {
+  char host[SMTP_CLIENT_HOST_MAX];
+  int port;
+  struct sockaddr_storage addr;
+  socklen_t addrlen; // 0: not resolved
+  time_t resolved_at;
+  time_t no_tls_until; // Opportunistic TLS failed: plaintext until then
+  list_t idle;
+  struct upstream_dest *next;
+} upstream_dest_t;
+
+struct upstream_pool {
+  event_loop_t *loop;
+  upstream_dest_t *dests;
+  list_t busy; // Sessions running a transaction
+  int max_idle;
+  int idle_timeout;
+  int max_msgs;
+  char helo_name[SMTP_CLIENT_HOST_MAX];
+  SSL_CTX *tls_ctx; // STARTTLS for new sessions, NULL: plaintext
+  int tls_required;
+};
+
+upstream_pool_t *upstream_pool_create(event_loop_t *loop, int max_idle,
+                                      int idle_timeout, int max_msgs,
+                                      const char *helo_name) {
+  upstream_pool_t *pool = calloc(1, sizeof(upstream_pool_t));
+  if (!pool)
+    return NULL;
+
+  pool->loop = loop;
+  list_init(&pool->busy);
+  pool->max_idle = max_idle;
+  pool->idle_timeout = idle_timeout;
+  pool->max_msgs = max_msgs;
+  snprintf(pool->helo_name, sizeof(pool->helo_name), "%s", helo_name);
+  return pool;
+}
+
+void upstream_pool_set_tls(upstream_pool_t *pool, SSL_CTX *ctx,
+                           int required) {
+  pool->tls_ctx = ctx;
+  pool->tls_required = ctx ? required : 0;
+}
+
+void upstream_pool_destroy(upstream_pool_t *pool) {
+  if (!pool)
+    return;
+
+  list_node_t *node;
+  while ((node = list_pop_front(&pool->busy)) != NULL)
+    smtp_client_close(list_entry(node, smtp_client_t, node));
+
+  upstream_dest_t *d = pool->dests;
+  while (d) {
+    upstream_dest_t *next = d->next;
+    while ((node = list_pop_front(&d->idle)) != NULL)
+      smtp_client_quit(list_entry(node, smtp_client_t, node));
+    free(d);
+    d = next;
+  }
+
+  free(pool);
+}
+
+// Helper: Find (or create) the destination entry
+static upstream_dest_t *find_dest(upstream_pool_t *pool, const char *host,
+                                  int port) {
+  for (upstream_dest_t *d = pool->dests; d; d = d->next) {
+    if (d->port == port && strcmp(d->host, host) == 0)
+      return d;
+  }
+
+  upstream_dest_t *d = calloc(1, sizeof(upstream_dest_t));
+  if (!d)
+    return NULL;
+  snprintf(d->host, sizeof(d->host), "%s", host);
+  d->port = port;
+  list_init(&d->idle);
+  d->next = pool->dests;
+  pool->dests = d;
+  return d;
+}
+
+// Helper: Resolve the destination, cached for UPSTREAM_DNS_TTL.
+// getaddrinfo blocks, so it must not run once per message.
+static int resolve_dest(upstream_dest_t *d, time_t now) {
+  if (d->addrlen > 0 && now - d->resolved_at < UPSTREAM_DNS_TTL)
+    return 0;
+
+  char port_str[16];
+  snprintf(port_str, sizeof(port_str), "%d", d->port);
+
+  struct addrinfo hints, *res = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  int rc = getaddrinfo(d->host, port_str, &hints, &res);
+  if (rc != 0 || !res) {
+    LOG_ERROR("Upstream pool: Failed to resolve host %s: %s", d->host,
+              gai_strerror(rc));
+    // Keep using a previously known address
+    return d->addrlen > 0 ? 0 : -1;
+  }
+
+  memcpy(&d->addr, res->ai_addr, res->ai_addrlen);
+  d->addrlen = res->ai_addrlen;
+  d->resolved_at = now;
+  freeaddrinfo(res);
+  return 0;
+}
+
+smtp_client_t *upstream_pool_checkout(upstream_pool_t *pool, const char *host,
+                                      int port) {
+  time_t now = time(NULL);
+  upstream_dest_t *d = find_dest(pool, host, port);
+  if (!d)
+    return NULL;
+
+  list_node_t *node;
+  while ((node = list_pop_front(&d->idle)) != NULL) {
+    smtp_client_t *c = list_entry(node, smtp_client_t, node);
+    if (now - c->last_used < pool->idle_timeout && smtp_client_idle_ok(c)) {
+      LOG_DEBUG("Upstream pool: Reusing session to %s:%d (fd=%d, msgs=%d)",
+                host, port, c->fd, c->msgs_sent);
+      list_push_back(&pool->busy, &c->node);
+      return c;
+    }
+
+    LOG_DEBUG("Upstream pool: Discarding stale session to %s:%d (fd=%d)",
+              host, port, c->fd);
+    smtp_client_close(c);
+  }
+
+  if (resolve_dest(d, now) != 0)
+    return NULL;
+
+  smtp_client_t *c =
+      smtp_client_open(pool->loop, (struct sockaddr *)&d->addr, d->addrlen,
+                       host, port, pool->helo_name, UPSTREAM_IO_TIMEOUT);
+  if (!c) {
+    d->addrlen = 0; // Look the address up again next time
+    return NULL;
+  }
+
+  if (pool->tls_ctx && (pool->tls_required || now >= d->no_tls_until))
+    smtp_client_set_tls(c, pool->tls_ctx, pool->tls_required);
+
+  c->pool_ctx = d;
+  list_push_back(&pool->busy, &c->node);
+  return c;
+}
+
+void upstream_pool_release(upstream_pool_t *pool, smtp_client_t *c) {
+  if (!c)
+    return;
+
+  list_remove(&pool->busy, &c->node);
+
+  upstream_dest_t *d = c->pool_ctx;
+  if (c->tls_failed && d && !c->tls_required) {
+    LOG_WARN("Upstream pool: TLS to %s:%d failed, using plaintext for %ds",
+             c->host, c->port, UPSTREAM_NO_TLS_TIME);
+    d->no_tls_until = time(NULL) + UPSTREAM_NO_TLS_TIME;
+  }
+
+  if (c->state != SMTP_CLIENT_READY) {
+    smtp_client_close(c);
+    return;
+  }
+
+  if (c->msgs_sent >= pool->max_msgs || !d ||
+      (int)list_size(&d->idle) >= pool->max_idle) {
+    smtp_client_quit(c);
+    return;
+  }
+
+  // Idle sessions are not watched by the loop, checkout probes them instead
+  smtp_client_detach(c);
+  c->last_used = time(NULL);
+  list_push_front(&d->idle, &c->node);
+}
+
+void upstream_pool_tick(upstream_pool_t *pool, time_t now) {
+  if (!pool)
+    return;
+
+  // Stalled transactions. The done callback releases the session (and may
+  // check out another one, which is appended behind the cursor).
+  list_node_t *node, *next;
+  list_for_each_safe(node, next, &pool->busy) {
+    smtp_client_check_timeout(list_entry(node, smtp_client_t, node), now);
+  }
+
+  // Most recently used first: expired sessions sit at the tail
+  for (upstream_dest_t *d = pool->dests; d; d = d->next) {
+    while (d->idle.tail) {
+      smtp_client_t *c = list_entry(d->idle.tail, smtp_client_t, node);
+      if (now - c->last_used < pool->idle_timeout)
+        break;
+      list_remove(&d->idle, &c->node);
+      LOG_DEBUG("Upstream pool: Closing idle session to %s:%d (fd=%d)",
+                c->host, c->port, c->fd);
+      smtp_client_quit(c);
+    }
+  }
+}
+
+int upstream_pool_busy(upstream_pool_t *pool) {
+  return (int)list_size(&pool->busy);
+}
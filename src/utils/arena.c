@@ -0,0 +1,104 @@
+#include "arena.h"
+#include "logger.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define ARENA_HUGE_PAGE (2 * 1024 * 1024)
+#define ARENA_GRANULE 512            // Size class step, and block alignment
+#define ARENA_MAX_BLOCK (64 * 1024)  // Larger blocks come from malloc
+#define ARENA_CLASSES (ARENA_MAX_BLOCK / ARENA_GRANULE)
+
+static struct {
+  char *base; // NULL: not initialized, everything goes to malloc
+  size_t size;
+  size_t used; // Carved so far, from base up
+  void *free[ARENA_CLASSES]; // Freed blocks by class, linked by first word
+  pthread_mutex_t lock;      // Guards used and the free lists
+} g_arena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Helper: Map a region backed by transparent huge pages, aligned on a huge
+// page so that none of it straddles a small-page edge
+static char *map_transparent(size_t size) {
+  size_t span = size + ARENA_HUGE_PAGE;
+  char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (raw == MAP_FAILED)
+    return NULL;
+
+  uintptr_t start = ((uintptr_t)raw + ARENA_HUGE_PAGE - 1) &
+                    ~(uintptr_t)(ARENA_HUGE_PAGE - 1);
+  char *base = (char *)start;
+  if (base > raw)
+    munmap(raw, (size_t)(base - raw));
+  if (raw + span > base + size)
+    munmap(base + size, (size_t)(raw + span - (base + size)));
+
+  if (madvise(base, size, MADV_HUGEPAGE) != 0)
+    LOG_WARN("Arena: Transparent huge pages unavailable (%s), using small "
+             "pages",
+             strerror(errno));
+  return base;
+}
+
+int arena_init(size_t size) {
+  if (g_arena.base || size == 0)
+    return -1;
+  size = (size + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+
+  const char *backing = "huge pages";
+  char *base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (base == MAP_FAILED) {
+    backing = "transparent huge pages";
+    base = map_transparent(size);
+    if (!base) {
+      LOG_ERROR("Arena: Failed to reserve %zu MB: %s", size >> 20,
+                strerror(errno));
+      return -1;
+    }
+  }
+
+  g_arena.base = base;
+  g_arena.size = size;
+  LOG_INFO("Arena: %zu MB reserved in %s", size >> 20, backing);
+  return 0;
+}
+
+void *arena_alloc(size_t size) {
+  if (!g_arena.base || size == 0 || size > ARENA_MAX_BLOCK)
+    return malloc(size);
+
+  size_t cls = (size - 1) / ARENA_GRANULE;
+  size_t block = (cls + 1) * ARENA_GRANULE;
+  void *ptr = NULL;
+  pthread_mutex_lock(&g_arena.lock);
+  if (g_arena.free[cls]) {
+    ptr = g_arena.free[cls];
+    g_arena.free[cls] = *(void **)ptr;
+  } else if (g_arena.size - g_arena.used >= block) {
+    ptr = g_arena.base + g_arena.used;
+    g_arena.used += block;
+  }
+  pthread_mutex_unlock(&g_arena.lock);
+  return ptr ? ptr : malloc(size);
+}
+
+void arena_free(void *ptr, size_t size) {
+  if (!ptr)
+    return;
+  char *p = ptr;
+  if (!g_arena.base || p < g_arena.base || p >= g_arena.base + g_arena.size) {
+    free(ptr);
+    return;
+  }
+
+  size_t cls = (size - 1) / ARENA_GRANULE;
+  pthread_mutex_lock(&g_arena.lock);
+  *(void **)ptr = g_arena.free[cls];
+  g_arena.free[cls] = ptr;
+  pthread_mutex_unlock(&g_arena.lock);
+}
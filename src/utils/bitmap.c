@@ -0,0 +1,87 @@
+#include "bitmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+int bitmap_set(bitmap_t *b, size_t bit) {
+  size_t word = bit / 64;
+  if (word >= b->nwords) {
+    size_t nwords = b->nwords ? b->nwords : 1;
+    while (nwords <= word)
+      nwords *= 2;
+    uint64_t *words = realloc(b->words, nwords * sizeof(uint64_t));
+    if (!words)
+      return -1;
+    memset(words + b->nwords, 0, (nwords - b->nwords) * sizeof(uint64_t));
+    b->words = words;
+    b->nwords = nwords;
+  }
+  b->words[word] |= (uint64_t)1 << (bit % 64);
+  return 0;
+}
+
+int bitmap_test(const bitmap_t *b, size_t bit) {
+  size_t word = bit / 64;
+  return word < b->nwords && (b->words[word] >> (bit % 64) & 1);
+}
+
+int bitmap_empty(const bitmap_t *b) {
+  for (size_t i = 0; i < b->nwords; i++)
+    if (b->words[i])
+      return 0;
+  return 1;
+}
+
+int bitmap_copy(bitmap_t *dst, const bitmap_t *src) {
+  if (dst == src)
+    return 0;
+  uint64_t *words = NULL;
+  if (src->nwords) {
+    words = malloc(src->nwords * sizeof(uint64_t));
+    if (!words)
+      return -1;
+    memcpy(words, src->words, src->nwords * sizeof(uint64_t));
+  }
+  free(dst->words);
+  dst->words = words;
+  dst->nwords = src->nwords;
+  return 0;
+}
+
+int bitmap_load(bitmap_t *b, const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  size_t nwords = (len + 7) / 8;
+  uint64_t *words = NULL;
+  if (nwords) {
+    words = calloc(nwords, sizeof(uint64_t));
+    if (!words)
+      return -1;
+    for (size_t i = 0; i < len; i++)
+      words[i / 8] |= (uint64_t)bytes[i] << (i % 8 * 8);
+  }
+  free(b->words);
+  b->words = words;
+  b->nwords = nwords;
+  return 0;
+}
+
+void *bitmap_bytes(const bitmap_t *b, size_t *len) {
+  size_t nwords = b->nwords;
+  while (nwords && !b->words[nwords - 1])
+    nwords--;
+  *len = 0;
+  if (!nwords)
+    return NULL;
+  unsigned char *bytes = malloc(nwords * 8);
+  if (!bytes)
+    return NULL;
+  for (size_t i = 0; i < nwords * 8; i++)
+    bytes[i] = (unsigned char)(b->words[i / 8] >> (i % 8 * 8));
+  *len = nwords * 8;
+  return bytes;
+}
+
+void bitmap_free(bitmap_t *b) {
+  free(b->words);
+  b->words = NULL;
+  b->nwords = 0;
+}
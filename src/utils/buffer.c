@@ -1,14 +1,19 @@
 #include "buffer.h"
+#include "arena.h"
 #include <stdlib.h>
 #include <string.h>
 #include <sys/param.h> // For MIN
 
+#ifdef STATS_MEM_DEBUG
+#undef buffer_create // Sites are recorded where it is called from
+#endif
+
 buffer_t *buffer_create(size_t size) {
   buffer_t *buf = malloc(sizeof(buffer_t));
   if (!buf)
     return NULL;
 
-  buf->data = malloc(size);
+  buf->data = arena_alloc(size);
   if (!buf->data) {
     free(buf);
     return NULL;
@@ -19,12 +24,15 @@ buffer_t *buffer_create(size_t size) {
   buf->write = 0;
   buf->count = 0;
 
+  stats_mem_alloc(STATS_MEM_BUFFERS, sizeof(buffer_t) + size);
+  stats_mem_count(STATS_MEM_BUFFERS, size);
   return buf;
 }
 
 void buffer_destroy(buffer_t *buf) {
   if (buf) {
-    free(buf->data);
+    stats_mem_free(STATS_MEM_BUFFERS, sizeof(buffer_t) + buf->size);
+    arena_free(buf->data, buf->size);
     free(buf);
   }
 }
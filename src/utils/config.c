@@ -10,12 +10,12 @@ static void process_server_section(yaml_document_t *doc, yaml_node_t *node,
   if (node->type != YAML_MAPPING_NODE)
     return;
 
-  for (yaml_node_item_t *item = node->data.mapping.pairs.start;
+  for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
        item < node->data.mapping.pairs.top; ++item) {
     yaml_node_t *key = yaml_document_get_node(doc, item->key);
     yaml_node_t *value = yaml_document_get_node(doc, item->value);
 
-    if (!key || !value)
+    if (!key || key->type != YAML_SCALAR_NODE || !value)
       continue;
     const char *k = (const char *)key->data.scalar.value;
 
@@ -26,6 +26,8 @@ static void process_server_section(yaml_document_t *doc, yaml_node_t *node,
     } else if (strcmp(k, "max_connections") == 0) {
       cfg->server.max_connections =
           atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "arena_mb") == 0) {
+      cfg->server.arena_mb = atoi((const char *)value->data.scalar.value);
     } else if (strcmp(k, "bind_address") == 0) {
       if (cfg->server.bind_address)
         free(cfg->server.bind_address);
@@ -47,12 +49,12 @@ static void process_logging_section(yaml_document_t *doc, yaml_node_t *node,
   if (node->type != YAML_MAPPING_NODE)
     return;
 
-  for (yaml_node_item_t *item = node->data.mapping.pairs.start;
+  for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
        item < node->data.mapping.pairs.top; ++item) {
     yaml_node_t *key = yaml_document_get_node(doc, item->key);
     yaml_node_t *value = yaml_document_get_node(doc, item->value);
 
-    if (!key || !value)
+    if (!key || key->type != YAML_SCALAR_NODE || !value)
       continue;
     const char *k = (const char *)key->data.scalar.value;
 
@@ -73,12 +75,12 @@ static void process_storage_section(yaml_document_t *doc, yaml_node_t *node,
   if (node->type != YAML_MAPPING_NODE)
     return;
 
-  for (yaml_node_item_t *item = node->data.mapping.pairs.start;
+  for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
        item < node->data.mapping.pairs.top; ++item) {
     yaml_node_t *key = yaml_document_get_node(doc, item->key);
     yaml_node_t *value = yaml_document_get_node(doc, item->value);
 
-    if (!key || !value)
+    if (!key || key->type != YAML_SCALAR_NODE || !value)
       continue;
     const char *k = (const char *)key->data.scalar.value;
 
@@ -88,6 +90,10 @@ static void process_storage_section(yaml_document_t *doc, yaml_node_t *node,
       cfg->storage.path = strdup((const char *)value->data.scalar.value);
     } else if (strcmp(k, "max_size_mb") == 0) {
       cfg->storage.max_size_mb = atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "hot_max_kb") == 0) {
+      cfg->storage.hot_max_kb = atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "hot_cache_mb") == 0) {
+      cfg->storage.hot_cache_mb = atoi((const char *)value->data.scalar.value);
     }
   }
 }
@@ -97,12 +103,12 @@ static void process_upstream_section(yaml_document_t *doc, yaml_node_t *node,
   if (node->type != YAML_MAPPING_NODE)
     return;
 
-  for (yaml_node_item_t *item = node->data.mapping.pairs.start;
+  for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
        item < node->data.mapping.pairs.top; ++item) {
     yaml_node_t *key = yaml_document_get_node(doc, item->key);
     yaml_node_t *value = yaml_document_get_node(doc, item->value);
 
-    if (!key || !value)
+    if (!key || key->type != YAML_SCALAR_NODE || !value)
       continue;
     const char *k = (const char *)key->data.scalar.value;
 
@@ -115,6 +121,248 @@ static void process_upstream_section(yaml_document_t *doc, yaml_node_t *node,
     } else if (strcmp(k, "relay_threads") == 0) {
       cfg->upstream.relay_threads =
           atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "relay_threads_min") == 0) {
+      cfg->upstream.relay_threads_min =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "relay_threads_max") == 0) {
+      cfg->upstream.relay_threads_max =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "max_inflight") == 0) {
+      cfg->upstream.max_inflight =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "large_msg_kb") == 0) {
+      cfg->upstream.large_msg_kb =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "large_max_inflight") == 0) {
+      cfg->upstream.large_max_inflight =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "health_interval") == 0) {
+      cfg->upstream.health_interval =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "pool_max_idle") == 0) {
+      cfg->upstream.pool_max_idle =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "pool_idle_timeout") == 0) {
+      cfg->upstream.pool_idle_timeout =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "pool_max_msgs") == 0) {
+      cfg->upstream.pool_max_msgs =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "retry_interval") == 0) {
+      cfg->upstream.retry_interval =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "retry_max_interval") == 0) {
+      cfg->upstream.retry_max_interval =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "retry_max_age") == 0) {
+      cfg->upstream.retry_max_age =
+          atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "tls") == 0) {
+      if (cfg->upstream.tls)
+        free(cfg->upstream.tls);
+      cfg->upstream.tls = strdup((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "tls_verify") == 0) {
+      const char *v = (const char *)value->data.scalar.value;
+      cfg->upstream.tls_verify = strcasecmp(v, "true") == 0 ||
+                                 strcasecmp(v, "yes") == 0 ||
+                                 strcmp(v, "1") == 0;
+    } else if (strcmp(k, "tls_ca_file") == 0) {
+      if (cfg->upstream.tls_ca_file)
+        free(cfg->upstream.tls_ca_file);
+      cfg->upstream.tls_ca_file =
+          strdup((const char *)value->data.scalar.value);
+    }
+  }
+}
+
+// Append a gateway ("host:port" scalar or {address, weight, max_concurrency,
+// rate} mapping)
+static void add_route_gateway(yaml_document_t *doc, yaml_node_t *node,
+                              config_route_t *route) {
+  config_gateway_t gw = {NULL, 1, 0, 0};
+
+  if (node->type == YAML_SCALAR_NODE) {
+    gw.address = strdup((const char *)node->data.scalar.value);
+  } else if (node->type == YAML_MAPPING_NODE) {
+    for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
+         item < node->data.mapping.pairs.top; ++item) {
+      yaml_node_t *key = yaml_document_get_node(doc, item->key);
+      yaml_node_t *value = yaml_document_get_node(doc, item->value);
+
+      if (!key || key->type != YAML_SCALAR_NODE || !value ||
+          value->type != YAML_SCALAR_NODE)
+        continue;
+      const char *k = (const char *)key->data.scalar.value;
+
+      if (strcmp(k, "address") == 0) {
+        if (gw.address)
+          free(gw.address);
+        gw.address = strdup((const char *)value->data.scalar.value);
+      } else if (strcmp(k, "weight") == 0) {
+        gw.weight = atoi((const char *)value->data.scalar.value);
+      } else if (strcmp(k, "max_concurrency") == 0) {
+        gw.max_concurrency = atoi((const char *)value->data.scalar.value);
+      } else if (strcmp(k, "rate") == 0) {
+        gw.rate = atof((const char *)value->data.scalar.value);
+      }
+    }
+  }
+  if (!gw.address)
+    return;
+
+  config_gateway_t *gws =
+      realloc(route->gateways,
+              (size_t)(route->gateway_count + 1) * sizeof(config_gateway_t));
+  if (!gws) {
+    free(gw.address);
+    return;
+  }
+  gws[route->gateway_count++] = gw;
+  route->gateways = gws;
+}
+
+static void process_route_item(yaml_document_t *doc, yaml_node_t *node,
+                               config_route_t *route) {
+  if (node->type != YAML_MAPPING_NODE)
+    return;
+
+  for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
+       item < node->data.mapping.pairs.top; ++item) {
+    yaml_node_t *key = yaml_document_get_node(doc, item->key);
+    yaml_node_t *value = yaml_document_get_node(doc, item->value);
+
+    if (!key || key->type != YAML_SCALAR_NODE || !value)
+      continue;
+    const char *k = (const char *)key->data.scalar.value;
+
+    if (strcmp(k, "gateways") == 0 && value->type == YAML_SEQUENCE_NODE) {
+      for (yaml_node_item_t *it = value->data.sequence.items.start;
+           it < value->data.sequence.items.top; ++it) {
+        yaml_node_t *gw = yaml_document_get_node(doc, *it);
+        if (gw)
+          add_route_gateway(doc, gw, route);
+      }
+      continue;
+    }
+    if (value->type != YAML_SCALAR_NODE)
+      continue;
+
+    if (strcmp(k, "domain") == 0) {
+      if (route->domain)
+        free(route->domain);
+      route->domain = strdup((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "gateway") == 0) {
+      add_route_gateway(doc, value, route);
+    } else if (strcmp(k, "max_concurrency") == 0) {
+      route->max_concurrency = atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "rate") == 0) {
+      route->rate = atof((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "burst") == 0) {
+      route->burst = atoi((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "priority") == 0) {
+      if (route->priority)
+        free(route->priority);
+      route->priority = strdup((const char *)value->data.scalar.value);
+    }
+  }
+}
+
+// {flow, weight} entry of policy.fair_weights
+static void process_fair_weight(yaml_document_t *doc, yaml_node_t *node,
+                                config_fair_weight_t *fw) {
+  fw->weight = 1;
+  if (node->type != YAML_MAPPING_NODE)
+    return;
+
+  for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
+       item < node->data.mapping.pairs.top; ++item) {
+    yaml_node_t *key = yaml_document_get_node(doc, item->key);
+    yaml_node_t *value = yaml_document_get_node(doc, item->value);
+
+    if (!key || key->type != YAML_SCALAR_NODE || !value ||
+        value->type != YAML_SCALAR_NODE)
+      continue;
+    const char *k = (const char *)key->data.scalar.value;
+
+    if (strcmp(k, "flow") == 0) {
+      if (fw->flow)
+        free(fw->flow);
+      fw->flow = strdup((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "weight") == 0) {
+      fw->weight = atoi((const char *)value->data.scalar.value);
+    }
+  }
+}
+
+static void process_policy_section(yaml_document_t *doc, yaml_node_t *node,
+                                   config_t *cfg) {
+  if (node->type != YAML_MAPPING_NODE)
+    return;
+
+  for (yaml_node_pair_t *item = node->data.mapping.pairs.start;
+       item < node->data.mapping.pairs.top; ++item) {
+    yaml_node_t *key = yaml_document_get_node(doc, item->key);
+    yaml_node_t *value = yaml_document_get_node(doc, item->value);
+
+    if (!key || key->type != YAML_SCALAR_NODE || !value)
+      continue;
+    const char *k = (const char *)key->data.scalar.value;
+
+    if (strcmp(k, "route") == 0 && value->type == YAML_SEQUENCE_NODE) {
+      int n = (int)(value->data.sequence.items.top -
+                    value->data.sequence.items.start);
+      config_route_t *routes = calloc(n > 0 ? n : 1, sizeof(config_route_t));
+      if (!routes)
+        continue;
+      int count = 0;
+      for (yaml_node_item_t *it = value->data.sequence.items.start;
+           it < value->data.sequence.items.top; ++it) {
+        yaml_node_t *route = yaml_document_get_node(doc, *it);
+        if (route)
+          process_route_item(doc, route, &routes[count++]);
+      }
+      cfg->policy.routes = routes;
+      cfg->policy.route_count = count;
+    } else if (strcmp(k, "priority_senders") == 0 &&
+               value->type == YAML_SEQUENCE_NODE) {
+      int n = (int)(value->data.sequence.items.top -
+                    value->data.sequence.items.start);
+      char **senders = calloc(n > 0 ? n : 1, sizeof(char *));
+      if (!senders)
+        continue;
+      int count = 0;
+      for (yaml_node_item_t *it = value->data.sequence.items.start;
+           it < value->data.sequence.items.top; ++it) {
+        yaml_node_t *sender = yaml_document_get_node(doc, *it);
+        if (!sender || sender->type != YAML_SCALAR_NODE)
+          continue;
+        senders[count] = strdup((const char *)sender->data.scalar.value);
+        if (senders[count])
+          count++;
+      }
+      cfg->policy.priority_senders = senders;
+      cfg->policy.priority_sender_count = count;
+    } else if (strcmp(k, "fair_key") == 0 &&
+               value->type == YAML_SCALAR_NODE) {
+      free(cfg->policy.fair_key);
+      cfg->policy.fair_key = strdup((const char *)value->data.scalar.value);
+    } else if (strcmp(k, "fair_weights") == 0 &&
+               value->type == YAML_SEQUENCE_NODE) {
+      int n = (int)(value->data.sequence.items.top -
+                    value->data.sequence.items.start);
+      config_fair_weight_t *weights =
+          calloc(n > 0 ? n : 1, sizeof(config_fair_weight_t));
+      if (!weights)
+        continue;
+      int count = 0;
+      for (yaml_node_item_t *it = value->data.sequence.items.start;
+           it < value->data.sequence.items.top; ++it) {
+        yaml_node_t *entry = yaml_document_get_node(doc, *it);
+        if (entry)
+          process_fair_weight(doc, entry, &weights[count++]);
+      }
+      cfg->policy.fair_weights = weights;
+      cfg->policy.fair_weight_count = count;
     }
   }
 }
@@ -150,16 +398,30 @@ config_t *config_load(const char *path) {
   cfg->server.max_connections = 1000;
   cfg->server.bind_address = strdup("0.0.0.0");
   cfg->storage.max_size_mb = 10240;
+  cfg->storage.hot_max_kb = 64;
+  cfg->storage.hot_cache_mb = 64;
+  cfg->upstream.max_inflight = 256;
+  cfg->upstream.large_msg_kb = 1024;
+  cfg->upstream.large_max_inflight = 16;
+  cfg->upstream.pool_max_idle = 8;
+  cfg->upstream.pool_idle_timeout = 30;
+  cfg->upstream.pool_max_msgs = 100;
+  cfg->upstream.health_interval = 10;
+  cfg->upstream.retry_interval = 60;
+  cfg->upstream.retry_max_interval = 3600;
+  cfg->upstream.retry_max_age = 5 * 24 * 3600;
+  cfg->upstream.tls = strdup("opportunistic");
+  cfg->policy.fair_key = strdup("sender_domain");
   cfg->logging.level = strdup("INFO");
 
   yaml_node_t *root = yaml_document_get_root_node(&doc);
   if (root && root->type == YAML_MAPPING_NODE) {
-    for (yaml_node_item_t *item = root->data.mapping.pairs.start;
+    for (yaml_node_pair_t *item = root->data.mapping.pairs.start;
          item < root->data.mapping.pairs.top; ++item) {
       yaml_node_t *key = yaml_document_get_node(&doc, item->key);
       yaml_node_t *value = yaml_document_get_node(&doc, item->value);
 
-      if (!key || !value)
+      if (!key || key->type != YAML_SCALAR_NODE || !value)
         continue;
       const char *k = (const char *)key->data.scalar.value;
 
@@ -171,6 +433,8 @@ config_t *config_load(const char *path) {
         process_storage_section(&doc, value, cfg);
       } else if (strcmp(k, "upstream") == 0) {
         process_upstream_section(&doc, value, cfg);
+      } else if (strcmp(k, "policy") == 0) {
+        process_policy_section(&doc, value, cfg);
       }
     }
   }
@@ -201,6 +465,25 @@ void config_destroy(config_t *config) {
     free(config->logging.file);
   if (config->upstream.host)
     free(config->upstream.host);
+  if (config->upstream.tls)
+    free(config->upstream.tls);
+  if (config->upstream.tls_ca_file)
+    free(config->upstream.tls_ca_file);
+  for (int i = 0; i < config->policy.route_count; i++) {
+    free(config->policy.routes[i].domain);
+    for (int j = 0; j < config->policy.routes[i].gateway_count; j++)
+      free(config->policy.routes[i].gateways[j].address);
+    free(config->policy.routes[i].gateways);
+    free(config->policy.routes[i].priority);
+  }
+  free(config->policy.routes);
+  for (int i = 0; i < config->policy.priority_sender_count; i++)
+    free(config->policy.priority_senders[i]);
+  free(config->policy.priority_senders);
+  free(config->policy.fair_key);
+  for (int i = 0; i < config->policy.fair_weight_count; i++)
+    free(config->policy.fair_weights[i].flow);
+  free(config->policy.fair_weights);
   free(config);
 }
 
@@ -312,6 +595,16 @@ int config_validate(const config_t *cfg, config_validation_result_t *result) {
     return -1;
   }
 
+  // Validate arena_mb
+  if (cfg->server.arena_mb < 0) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "server.arena_mb");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "server.arena_mb cannot be negative (got %d)",
+             cfg->server.arena_mb);
+    return -1;
+  }
+
   // Validate bind_address
   if (!cfg->server.bind_address || strlen(cfg->server.bind_address) == 0) {
     snprintf(result->error_field, sizeof(result->error_field),
@@ -336,6 +629,15 @@ int config_validate(const config_t *cfg, config_validation_result_t *result) {
     return -1;
   }
 
+  // Validate storage hot tier
+  if (cfg->storage.hot_max_kb < 0 || cfg->storage.hot_cache_mb < 0) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "storage.hot_max_kb");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "storage.hot_max_kb and storage.hot_cache_mb cannot be negative");
+    return -1;
+  }
+
   // Validate logging.level
   if (!validate_log_level(cfg->logging.level, "logging.level", result)) {
     return -1;
@@ -364,6 +666,138 @@ int config_validate(const config_t *cfg, config_validation_result_t *result) {
     return -1;
   }
 
+  // Validate upstream.relay_threads_min/max (0: relay_threads)
+  int min_threads = cfg->upstream.relay_threads_min
+                        ? cfg->upstream.relay_threads_min
+                        : cfg->upstream.relay_threads;
+  int max_threads = cfg->upstream.relay_threads_max
+                        ? cfg->upstream.relay_threads_max
+                        : cfg->upstream.relay_threads;
+  if (min_threads < 1 || min_threads > cfg->upstream.relay_threads ||
+      max_threads < cfg->upstream.relay_threads || max_threads > 64) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "upstream.relay_threads_min");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "upstream.relay_threads_min must be between 1 and "
+             "relay_threads, relay_threads_max between relay_threads and 64");
+    return -1;
+  }
+
+  // Validate upstream.max_inflight
+  if (cfg->upstream.max_inflight < 1 || cfg->upstream.max_inflight > 10000) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "upstream.max_inflight");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "upstream.max_inflight must be between 1 and 10000 (got %d)",
+             cfg->upstream.max_inflight);
+    return -1;
+  }
+
+  // Validate upstream.large_*
+  if (cfg->upstream.large_msg_kb < 0 || cfg->upstream.large_max_inflight < 1 ||
+      cfg->upstream.large_max_inflight > cfg->upstream.max_inflight) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "upstream.large_max_inflight");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "upstream.large_msg_kb cannot be negative, large_max_inflight "
+             "must be between 1 and max_inflight");
+    return -1;
+  }
+
+  // Validate upstream connection pool
+  if (cfg->upstream.pool_max_idle < 0 || cfg->upstream.pool_idle_timeout < 1 ||
+      cfg->upstream.pool_max_msgs < 1) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "upstream.pool_max_idle");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "upstream.pool_max_idle cannot be negative, pool_idle_timeout "
+             "and pool_max_msgs must be greater than 0");
+    return -1;
+  }
+
+  // Validate upstream.health_interval
+  if (cfg->upstream.health_interval < 0) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "upstream.health_interval");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "upstream.health_interval cannot be negative (0 disables)");
+    return -1;
+  }
+
+  // Validate upstream.tls
+  const char *tls = cfg->upstream.tls;
+  if (!tls || (strcasecmp(tls, "none") != 0 &&
+               strcasecmp(tls, "opportunistic") != 0 &&
+               strcasecmp(tls, "required") != 0)) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "upstream.tls");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "upstream.tls must be none, opportunistic or required");
+    return -1;
+  }
+
+  // Validate upstream.retry_*
+  if (cfg->upstream.retry_interval < 1 ||
+      cfg->upstream.retry_max_interval < cfg->upstream.retry_interval ||
+      cfg->upstream.retry_max_age < 1) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "upstream.retry_interval");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "upstream.retry_interval and retry_max_age must be positive, "
+             "retry_max_interval at least retry_interval");
+    return -1;
+  }
+
+  // Validate policy.route
+  for (int i = 0; i < cfg->policy.route_count; i++) {
+    const config_route_t *r = &cfg->policy.routes[i];
+    int valid = r->domain && strlen(r->domain) > 0 && r->gateway_count > 0 &&
+                r->max_concurrency >= 0 && r->rate >= 0 && r->burst >= 0 &&
+                (!r->priority || strcasecmp(r->priority, "high") == 0 ||
+                 strcasecmp(r->priority, "normal") == 0 ||
+                 strcasecmp(r->priority, "low") == 0);
+    for (int j = 0; valid && j < r->gateway_count; j++) {
+      const char *gw = r->gateways[j].address;
+      const char *colon = strrchr(gw, ':');
+      valid = colon && colon != gw && atoi(colon + 1) >= 1 &&
+              atoi(colon + 1) <= 65535 && r->gateways[j].weight >= 1 &&
+              r->gateways[j].max_concurrency >= 0 && r->gateways[j].rate >= 0;
+    }
+    if (!valid) {
+      snprintf(result->error_field, sizeof(result->error_field),
+               "policy.route[%d]", i);
+      snprintf(result->error_msg, sizeof(result->error_msg),
+               "policy.route[%d] needs a domain and gateways \"host:port\" "
+               "with weight >= 1 (limits cannot be negative, priority is "
+               "high, normal or low)",
+               i);
+      return -1;
+    }
+  }
+
+  // Validate policy.fair_key and policy.fair_weights
+  const char *fair_key = cfg->policy.fair_key;
+  if (!fair_key || (strcasecmp(fair_key, "sender") != 0 &&
+                    strcasecmp(fair_key, "sender_domain") != 0 &&
+                    strcasecmp(fair_key, "client") != 0 &&
+                    strcasecmp(fair_key, "none") != 0)) {
+    snprintf(result->error_field, sizeof(result->error_field),
+             "policy.fair_key");
+    snprintf(result->error_msg, sizeof(result->error_msg),
+             "policy.fair_key must be sender, sender_domain, client or none");
+    return -1;
+  }
+  for (int i = 0; i < cfg->policy.fair_weight_count; i++) {
+    const config_fair_weight_t *fw = &cfg->policy.fair_weights[i];
+    if (!fw->flow || strlen(fw->flow) == 0 || fw->weight < 1) {
+      snprintf(result->error_field, sizeof(result->error_field),
+               "policy.fair_weights[%d]", i);
+      snprintf(result->error_msg, sizeof(result->error_msg),
+               "policy.fair_weights[%d] needs a flow and a weight >= 1", i);
+      return -1;
+    }
+  }
+
   result->valid = 1;
   return 0;
 }
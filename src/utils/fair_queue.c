@@ -0,0 +1,283 @@
+#include "fair_queue.h"
+#include "hash.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Queued item, from the queue's preallocated array
+typedef struct fq_item {
+  void *data;
+  struct fq_item *next;
+} fq_item_t;
+
+// Flow with items queued; it is freed as soon as it runs empty, so a
+// sender coming back after a quiet spell starts a new turn at the tail
+typedef struct fq_flow {
+  struct fq_flow *hash_next; // Bucket chain
+  struct fq_flow *next;      // Round robin order
+  fq_item_t *head;
+  fq_item_t *tail;
+  int count;
+  int weight;
+  int deficit; // Items left in the flow's current turn, 0: not started
+  uint32_t hash;
+  char key[];
+} fq_flow_t;
+
+struct fair_queue {
+  pthread_mutex_t lock;
+
+  fq_item_t *items; // capacity items, unused ones on the free list
+  fq_item_t *free_items;
+  int capacity;
+  int flow_capacity;
+
+  fq_flow_t **buckets; // Flows by key
+  size_t mask;
+  fq_flow_t *active; // Flow whose turn it is, then the rest in order
+  fq_flow_t *active_tail;
+
+  int stop;
+  atomic_int size;
+  stats_mem_tag_t tag;
+};
+
+// Helper: Flow of a key, NULL if it has nothing queued
+static fq_flow_t *flow_find(fair_queue_t *fq, const char *key, uint32_t hash) {
+  fq_flow_t *f = fq->buckets[hash & fq->mask];
+  while (f && (f->hash != hash || strcmp(f->key, key) != 0))
+    f = f->hash_next;
+  return f;
+}
+
+// Helper: Unlink an emptied flow and free it
+static void flow_remove(fair_queue_t *fq, fq_flow_t *f) {
+  fq_flow_t **link = &fq->buckets[f->hash & fq->mask];
+  while (*link != f)
+    link = &(*link)->hash_next;
+  *link = f->hash_next;
+
+  // Usually the flow whose turn it is, at the head of the round
+  fq_flow_t *prev = NULL;
+  for (link = &fq->active; *link != f; link = &(*link)->next)
+    prev = *link;
+  *link = f->next;
+  if (fq->active_tail == f)
+    fq->active_tail = prev;
+  stats_mem_free(fq->tag, sizeof(fq_flow_t) + strlen(f->key) + 1);
+  free(f);
+}
+
+// Helper: Queue one item, under the lock
+// Returns 0 if queued, -1 if full (queue or flow), -2 if out of memory
+static int push_locked(fair_queue_t *fq, const char *key, int weight,
+                       void *data) {
+  if (!fq->free_items)
+    return -1;
+
+  uint32_t hash = hash_fnv1a(key);
+  fq_flow_t *f = flow_find(fq, key, hash);
+  if (f && f->count >= fq->flow_capacity)
+    return -1;
+  if (!f) {
+    size_t len = strlen(key);
+    f = malloc(sizeof(fq_flow_t) + len + 1);
+    if (!f)
+      return -2;
+    stats_mem_alloc(fq->tag, sizeof(fq_flow_t) + len + 1);
+    memcpy(f->key, key, len + 1);
+    f->hash = hash;
+    f->head = f->tail = NULL;
+    f->count = 0;
+    f->deficit = 0;
+    f->hash_next = fq->buckets[hash & fq->mask];
+    fq->buckets[hash & fq->mask] = f;
+
+    // A new flow waits for the others' current round
+    f->next = NULL;
+    if (fq->active_tail)
+      fq->active_tail->next = f;
+    else
+      fq->active = f;
+    fq->active_tail = f;
+  }
+  f->weight = weight > 0 ? weight : 1;
+
+  fq_item_t *item = fq->free_items;
+  fq->free_items = item->next;
+  item->data = data;
+  item->next = NULL;
+  if (f->tail)
+    f->tail->next = item;
+  else
+    f->head = item;
+  f->tail = item;
+  f->count++;
+  atomic_fetch_add(&fq->size, 1);
+  stats_mem_count(fq->tag, sizeof(fq_item_t));
+  return 0;
+}
+
+// Helper: Bytes of a queue's own allocations (the struct, items, buckets)
+static size_t queue_bytes(int capacity, size_t buckets) {
+  return sizeof(fair_queue_t) + (size_t)capacity * sizeof(fq_item_t) +
+         buckets * sizeof(fq_flow_t *);
+}
+
+fair_queue_t *fair_queue_create(int capacity, int flow_capacity,
+                                stats_mem_tag_t tag) {
+  if (capacity < 1)
+    return NULL;
+  fair_queue_t *fq = calloc(1, sizeof(fair_queue_t));
+  if (!fq)
+    return NULL;
+
+  // A bucket per four items at most: there are never more flows than items
+  size_t buckets = 16;
+  while (buckets * 4 < (size_t)capacity)
+    buckets *= 2;
+  fq->items = malloc((size_t)capacity * sizeof(fq_item_t));
+  fq->buckets = calloc(buckets, sizeof(fq_flow_t *));
+  if (!fq->items || !fq->buckets) {
+    free(fq->items);
+    free(fq->buckets);
+    free(fq);
+    return NULL;
+  }
+  fq->mask = buckets - 1;
+  fq->tag = tag;
+
+  for (int i = 0; i < capacity; i++)
+    fq->items[i].next = i + 1 < capacity ? &fq->items[i + 1] : NULL;
+  fq->free_items = fq->items;
+  fq->flow_capacity = flow_capacity > 0 && flow_capacity < capacity
+                          ? flow_capacity
+                          : capacity;
+
+  pthread_mutex_init(&fq->lock, NULL);
+  atomic_init(&fq->size, 0);
+  fq->capacity = capacity;
+  stats_mem_alloc(tag, queue_bytes(capacity, buckets));
+  return fq;
+}
+
+void fair_queue_destroy(fair_queue_t *fq) {
+  if (!fq)
+    return;
+  fair_queue_stop(fq);
+  while (fq->active)
+    flow_remove(fq, fq->active);
+  pthread_mutex_destroy(&fq->lock);
+  stats_mem_free(fq->tag, queue_bytes(fq->capacity, fq->mask + 1));
+  free(fq->buckets);
+  free(fq->items);
+  free(fq);
+}
+
+int fair_queue_try_push(fair_queue_t *fq, const char *key, int weight,
+                        void *item) {
+  pthread_mutex_lock(&fq->lock);
+  int ret = fq->stop ? -1 : push_locked(fq, key, weight, item);
+  pthread_mutex_unlock(&fq->lock);
+  return ret == 0 ? 0 : -1;
+}
+
+int fair_queue_push_batch(fair_queue_t *fq, const char **keys,
+                          const int *weights, void **items, int count) {
+  int refused = 0;
+  pthread_mutex_lock(&fq->lock);
+  for (int i = 0; i < count; i++) {
+    if (fq->stop || push_locked(fq, keys[i], weights[i], items[i]) != 0)
+      items[refused++] = items[i];
+  }
+  pthread_mutex_unlock(&fq->lock);
+  return count - refused;
+}
+
+int fair_queue_pop_batch(fair_queue_t *fq, void **items, int max) {
+  if (max <= 0 || atomic_load(&fq->size) == 0)
+    return 0;
+
+  int n = 0;
+  pthread_mutex_lock(&fq->lock);
+  while (n < max && fq->active) {
+    fq_flow_t *f = fq->active;
+    if (f->deficit == 0)
+      f->deficit = f->weight; // Its turn starts
+
+    fq_item_t *item = f->head;
+    f->head = item->next;
+    if (!f->head)
+      f->tail = NULL;
+    f->count--;
+    f->deficit--;
+    items[n++] = item->data;
+    item->next = fq->free_items;
+    fq->free_items = item;
+
+    if (f->count == 0) {
+      flow_remove(fq, f);
+    } else if (f->deficit == 0 && f->next) {
+      // Turn over: to the back of the round
+      fq->active = f->next;
+      f->next = NULL;
+      fq->active_tail->next = f;
+      fq->active_tail = f;
+    }
+  }
+  atomic_fetch_sub(&fq->size, n);
+  pthread_mutex_unlock(&fq->lock);
+  return n;
+}
+
+int fair_queue_steal_batch(fair_queue_t *fq, void **items, int max) {
+  if (max <= 0 || atomic_load(&fq->size) == 0)
+    return 0;
+
+  pthread_mutex_lock(&fq->lock);
+  fq_flow_t *f = fq->active;
+  for (fq_flow_t *o = f ? f->next : NULL; o; o = o->next) {
+    if (o->count > f->count)
+      f = o;
+  }
+  int n = 0;
+  if (f) {
+    // Singly linked: walk to the last item the flow keeps
+    n = max < f->count ? max : f->count;
+    fq_item_t *keep = NULL, *item = f->head;
+    for (int i = n; i < f->count; i++) {
+      keep = item;
+      item = item->next;
+    }
+    if (keep) {
+      keep->next = NULL;
+      f->tail = keep;
+    } else {
+      f->head = f->tail = NULL;
+    }
+    f->count -= n;
+
+    for (int i = 0; i < n; i++) {
+      fq_item_t *next = item->next;
+      items[i] = item->data;
+      item->next = fq->free_items;
+      fq->free_items = item;
+      item = next;
+    }
+    if (f->count == 0)
+      flow_remove(fq, f);
+    atomic_fetch_sub(&fq->size, n);
+  }
+  pthread_mutex_unlock(&fq->lock);
+  return n;
+}
+
+void fair_queue_stop(fair_queue_t *fq) {
+  pthread_mutex_lock(&fq->lock);
+  fq->stop = 1;
+  pthread_mutex_unlock(&fq->lock);
+}
+
+int fair_queue_size(fair_queue_t *fq) { return atomic_load(&fq->size); }
@@ -1,138 +1,172 @@
 #include "mempool.h"
+#include "arena.h"
 #include "logger.h"
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef STATS_MEM_DEBUG
+// Sites are recorded where the pool is called from, not in here
+#undef mempool_create
+#undef mempool_alloc
+#undef mempool_alloc0
+#undef mempool_strdup
+#undef mempool_realloc
+#endif
+
 #define DEFAULT_POOL_CHUNK_SIZE 4096
 #define ALIGNMENT 8
+#define POOL_FREE_CHUNKS_MAX 256 // Default-size chunks kept for reuse
 
+// Chunk header and data come from a single allocation
 typedef struct pool_chunk {
   struct pool_chunk *next;
-  char *data;
   size_t size; // Total size of data
   size_t used; // Used bytes
+  char data[];
 } pool_chunk_t;
 
+// The pool and its first chunk are also a single allocation: the first
+// chunk follows the struct and is kept across resets
 struct mempool {
-  pool_chunk_t *chunks;
-  pool_chunk_t *current;
+  pool_chunk_t *first;
+  pool_chunk_t *current; // Chunk allocations are carved from
+  pool_chunk_t *chunks;  // Chunks added since the last reset
   size_t default_chunk_size;
+  stats_mem_tag_t tag;
+
+  // Most recent allocation, which mempool_realloc can grow in place
+  char *last;
+  pool_chunk_t *last_chunk;
 };
 
-static pool_chunk_t *create_chunk(size_t size) {
-  pool_chunk_t *chunk = malloc(sizeof(pool_chunk_t));
-  if (!chunk)
-    return NULL;
+// Default-size chunks released by pools, shared by all threads
+static pool_chunk_t *g_free_chunks = NULL;
+static int g_free_chunk_count = 0;
+static pthread_mutex_t g_free_lock = PTHREAD_MUTEX_INITIALIZER;
 
-  chunk->data = malloc(size);
-  if (!chunk->data) {
-    free(chunk);
-    return NULL;
-  }
+static size_t align_size(size_t size) {
+  return (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
 
-  chunk->size = size;
+// Free-list chunks are accounted as spare until a pool takes them back
+static pool_chunk_t *create_chunk(size_t size, stats_mem_tag_t tag) {
+  pool_chunk_t *chunk = NULL;
+  if (size == DEFAULT_POOL_CHUNK_SIZE) {
+    pthread_mutex_lock(&g_free_lock);
+    chunk = g_free_chunks;
+    if (chunk) {
+      g_free_chunks = chunk->next;
+      g_free_chunk_count--;
+    }
+    pthread_mutex_unlock(&g_free_lock);
+    if (chunk)
+      stats_mem_free(STATS_MEM_SPARE, sizeof(pool_chunk_t) + size);
+  }
+  if (!chunk) {
+    chunk = arena_alloc(sizeof(pool_chunk_t) + size);
+    if (!chunk)
+      return NULL;
+    chunk->size = size;
+  }
+  stats_mem_alloc(tag, sizeof(pool_chunk_t) + size);
   chunk->used = 0;
   chunk->next = NULL;
   return chunk;
 }
 
-mempool_t *mempool_create(size_t size_hint) {
-  mempool_t *pool = malloc(sizeof(mempool_t));
+// Recycle a default-size chunk for the next pool that grows, free others
+static void release_chunk(pool_chunk_t *chunk, stats_mem_tag_t tag) {
+  size_t bytes = sizeof(pool_chunk_t) + chunk->size;
+  stats_mem_free(tag, bytes);
+  if (chunk->size == DEFAULT_POOL_CHUNK_SIZE) {
+    pthread_mutex_lock(&g_free_lock);
+    if (g_free_chunk_count < POOL_FREE_CHUNKS_MAX) {
+      chunk->next = g_free_chunks;
+      g_free_chunks = chunk;
+      g_free_chunk_count++;
+      chunk = NULL;
+    }
+    pthread_mutex_unlock(&g_free_lock);
+    if (!chunk)
+      stats_mem_alloc(STATS_MEM_SPARE, bytes);
+  }
+  if (chunk)
+    arena_free(chunk, bytes);
+}
+
+mempool_t *mempool_create(size_t size_hint, stats_mem_tag_t tag) {
+  size_t size = size_hint > 0 ? align_size(size_hint) : DEFAULT_POOL_CHUNK_SIZE;
+  mempool_t *pool =
+      arena_alloc(sizeof(mempool_t) + sizeof(pool_chunk_t) + size);
   if (!pool)
     return NULL;
 
-  pool->default_chunk_size =
-      size_hint > 0 ? size_hint : DEFAULT_POOL_CHUNK_SIZE;
-  pool->chunks = create_chunk(pool->default_chunk_size);
-  if (!pool->chunks) {
-    free(pool);
-    return NULL;
-  }
-  pool->current = pool->chunks;
+  pool->first = (pool_chunk_t *)(pool + 1);
+  pool->first->next = NULL;
+  pool->first->size = size;
+  pool->first->used = 0;
+  pool->current = pool->first;
+  pool->chunks = NULL;
+  pool->default_chunk_size = size;
+  pool->tag = tag;
+  pool->last = NULL;
+  pool->last_chunk = NULL;
+  stats_mem_alloc(tag, sizeof(mempool_t) + sizeof(pool_chunk_t) + size);
+  stats_mem_count(tag, sizeof(mempool_t));
   return pool;
 }
 
 void mempool_destroy(mempool_t *pool) {
   if (!pool)
     return;
+  mempool_reset(pool);
+  size_t bytes = sizeof(mempool_t) + sizeof(pool_chunk_t) + pool->first->size;
+  stats_mem_free(pool->tag, bytes);
+  arena_free(pool, bytes);
+}
 
+void mempool_reset(mempool_t *pool) {
+  if (!pool)
+    return;
   pool_chunk_t *chk = pool->chunks;
   while (chk) {
     pool_chunk_t *next = chk->next;
-    free(chk->data);
-    free(chk);
+    release_chunk(chk, pool->tag);
     chk = next;
   }
-  free(pool);
-}
-
-static void *alloc_from_chunk(pool_chunk_t *chunk, size_t size) {
-  // Align size
-  size_t aligned_size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
-
-  if (chunk->used + aligned_size <= chunk->size) {
-    void *ptr = chunk->data + chunk->used;
-    chunk->used += aligned_size;
-    return ptr;
-  }
-  return NULL;
+  pool->chunks = NULL;
+  pool->first->used = 0;
+  pool->current = pool->first;
+  pool->last = NULL;
+  pool->last_chunk = NULL;
 }
 
 void *mempool_alloc(mempool_t *pool, size_t size) {
   if (!pool)
     return NULL;
 
-  // Try current chunk
-  void *ptr = alloc_from_chunk(pool->current, size);
-  if (ptr)
-    return ptr;
-
-  // Allocate new chunk
-  // If size is larger than default chunk, likely a large object, give it its
-  // own chunk
-  size_t new_size =
-      size > pool->default_chunk_size ? size : pool->default_chunk_size;
-  pool_chunk_t *new_chunk = create_chunk(new_size);
-  if (!new_chunk)
-    return NULL;
-
-  // Link new chunk
-  if (size > pool->default_chunk_size) {
-    // For very large allocs, insert as second chunk to keep current "hot" if it
-    // has space? Or just append. Simple append for now. Actually, if it's
-    // large, we might want to put it elsewhere, but strictly append is O(1) if
-    // we tracked tail. We only track head and current. Let's insert after
-    // current.
-    new_chunk->next = pool->current->next;
-    pool->current->next = new_chunk;
-    // Don't update current if it's a large blob, unless we want to fill it?
-    // If it's exact size, it's full.
-  } else {
-    // Standard chunk, make it current
-    new_chunk->next = pool->chunks; // Push to head for simplicity or...
-    // Wait, if we push to head, we lose access to old chunks?
-    // No, chunks list head is pool->chunks.
-    // Let's prepend to list, but update current.
-    new_chunk->next = pool->chunks;
-    pool->chunks = new_chunk;
-    pool->current = new_chunk;
+  size_t aligned_size = align_size(size);
+  pool_chunk_t *chunk = pool->current;
+  if (chunk->size - chunk->used < aligned_size) {
+    // Larger than a chunk: a chunk of its own, the current one stays hot
+    int large = aligned_size > pool->default_chunk_size;
+    chunk = create_chunk(large ? aligned_size : pool->default_chunk_size,
+                         pool->tag);
+    if (!chunk)
+      return NULL;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+    if (!large)
+      pool->current = chunk;
   }
 
-  // Now alloc from the new chunk (which is either current or the large one)
-  // If we made it current:
-  if (pool->current == new_chunk) {
-    return alloc_from_chunk(new_chunk, size);
-  } else {
-    // It was a large chunk inserted after current, alloc from it
-    // (Wait, logic above was: insert after current. So it is reachable via
-    // current->next) But we want to return the ptr. Re-read logic: Large
-    // allocs: we want to alloc `size` bytes. We created `new_chunk` of `size`.
-    // `alloc_from_chunk` will succeed.
-    // The pointer is `new_chunk->data`.
-    // We already linked it.
-    ptr = alloc_from_chunk(new_chunk, size);
-    return ptr;
-  }
+  char *ptr = chunk->data + chunk->used;
+  chunk->used += aligned_size;
+  stats_mem_count(pool->tag, size);
+  pool->last = ptr;
+  pool->last_chunk = chunk;
+  return ptr;
 }
 
 void *mempool_alloc0(mempool_t *pool, size_t size) {
@@ -143,6 +177,29 @@ void *mempool_alloc0(mempool_t *pool, size_t size) {
   return ptr;
 }
 
+void *mempool_realloc(mempool_t *pool, void *ptr, size_t old_size,
+                      size_t size) {
+  if (!pool)
+    return NULL;
+  if (!ptr)
+    return mempool_alloc(pool, size);
+
+  if (ptr == pool->last) {
+    pool_chunk_t *chunk = pool->last_chunk;
+    size_t start = (size_t)((char *)ptr - chunk->data);
+    if (start + align_size(size) <= chunk->size) {
+      chunk->used = start + align_size(size);
+      stats_mem_count(pool->tag, size);
+      return ptr;
+    }
+  }
+
+  void *moved = mempool_alloc(pool, size);
+  if (moved)
+    memcpy(moved, ptr, old_size < size ? old_size : size);
+  return moved;
+}
+
 char *mempool_strdup(mempool_t *pool, const char *s) {
   if (!s)
     return NULL;
@@ -155,7 +212,9 @@ char *mempool_strdup(mempool_t *pool, const char *s) {
 }
 
 void mempool_free(mempool_t *pool, void *ptr) {
-  // No-op for this simple pool (arena/region based)
-  (void)pool;
-  (void)ptr;
+  if (!pool || !ptr || ptr != pool->last)
+    return; // Reclaimed by the next reset
+  pool->last_chunk->used = (size_t)((char *)ptr - pool->last_chunk->data);
+  pool->last = NULL;
+  pool->last_chunk = NULL;
 }
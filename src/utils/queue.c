@@ -1,13 +1,202 @@
 #include "queue.h"
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define QUEUE_CACHE_LINE 64
+
+// One slot of the ring. sequence == position: free for the producer of
+// that position; sequence == position + 1: holds its item for the consumer.
+typedef struct {
+  atomic_size_t sequence;
+  void *data;
+} queue_cell_t;
+
+// Futex a side of the queue sleeps on, bumped only while someone waits
+typedef struct {
+  _Alignas(QUEUE_CACHE_LINE) atomic_uint seq;
+  atomic_int waiters;
+} queue_waitq_t;
+
+struct queue {
+  queue_cell_t *cells;
+  size_t mask;
+  atomic_int stop;
+
+  // Producers and consumers each own a cache line
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t enqueue_pos;
+  _Alignas(QUEUE_CACHE_LINE) atomic_size_t dequeue_pos;
+
+  queue_waitq_t not_empty; // Blocked pops
+  queue_waitq_t not_full;  // Blocked pushes
+};
+
+// Items of a blocking call, and how many were moved so far
+typedef struct {
+  void **items;
+  int count;
+  int done;
+} queue_batch_t;
+
+static void futex_wait(atomic_uint *addr, unsigned int val,
+                       const struct timespec *timeout) {
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int count) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+// Helper: Wake up to count sleepers after items (or free cells) were
+// published. The fence orders the publication before the waiter check,
+// pairing with the registration in waitq_sleep.
+static void waitq_signal(queue_waitq_t *wq, int count) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load(&wq->waiters) > 0) {
+    atomic_fetch_add(&wq->seq, 1);
+    futex_wake(&wq->seq, count);
+  }
+}
+
+static void waitq_broadcast(queue_waitq_t *wq) {
+  atomic_fetch_add(&wq->seq, 1);
+  futex_wake(&wq->seq, INT32_MAX);
+}
+
+// Helper: Sleep until signalled (or for at most timeout, NULL: no limit),
+// unless ready() makes progress once registered.
+// Returns ready()'s result (0: went to sleep and woke up, retry).
+static int waitq_sleep(queue_waitq_t *wq, queue_t *q,
+                       int (*ready)(queue_t *q, queue_batch_t *b),
+                       queue_batch_t *b, const struct timespec *timeout) {
+  atomic_fetch_add(&wq->waiters, 1);
+  atomic_thread_fence(memory_order_seq_cst);
+  unsigned int seq = atomic_load(&wq->seq);
+  int ret = ready(q, b);
+  if (ret == 0 && !atomic_load(&q->stop))
+    futex_wait(&wq->seq, seq, timeout);
+  atomic_fetch_sub(&wq->waiters, 1);
+  return ret;
+}
+
+// Helper: Claim up to max consecutive cells at *cursor with a single CAS.
+// The cell of position pos is claimable when its sequence is pos + ready
+// (0: free for a producer, 1: holds an item for a consumer).
+// Returns the number of cells claimed (0: full or empty), from *start
+static int ring_claim(queue_t *q, atomic_size_t *cursor, size_t ready,
+                      int max, size_t *start) {
+  size_t pos = atomic_load_explicit(cursor, memory_order_relaxed);
+  for (;;) {
+    int n = 0;
+    while (n < max) {
+      queue_cell_t *cell = &q->cells[(pos + n) & q->mask];
+      size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+      if (seq != pos + n + ready)
+        break;
+      n++;
+    }
+
+    if (n == 0) {
+      queue_cell_t *cell = &q->cells[pos & q->mask];
+      size_t seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+      if ((intptr_t)(seq - (pos + ready)) < 0)
+        return 0; // Full: the cell still holds the previous lap (or empty)
+      pos = atomic_load_explicit(cursor, memory_order_relaxed);
+      continue;   // Another thread claimed it since we read the cursor
+    }
+
+    if (atomic_compare_exchange_weak_explicit(cursor, &pos, pos + n,
+                                              memory_order_relaxed,
+                                              memory_order_relaxed)) {
+      *start = pos;
+      return n;
+    }
+  }
+}
+
+// Helper: Push up to count items without blocking, in order
+// Returns the number pushed
+static int ring_push(queue_t *q, void **items, int count) {
+  if (count <= 0 || atomic_load_explicit(&q->stop, memory_order_relaxed))
+    return 0;
+
+  size_t pos;
+  int n = ring_claim(q, &q->enqueue_pos, 0, count, &pos);
+  for (int i = 0; i < n; i++) {
+    queue_cell_t *cell = &q->cells[(pos + i) & q->mask];
+    cell->data = items[i];
+    atomic_store_explicit(&cell->sequence, pos + i + 1, memory_order_release);
+  }
+  if (n > 0)
+    waitq_signal(&q->not_empty, n);
+  return n;
+}
+
+// Helper: Pop up to max items without blocking
+// Returns the number popped
+static int ring_pop(queue_t *q, void **items, int max) {
+  if (max <= 0)
+    return 0;
+
+  size_t pos;
+  int n = ring_claim(q, &q->dequeue_pos, 1, max, &pos);
+  for (int i = 0; i < n; i++) {
+    queue_cell_t *cell = &q->cells[(pos + i) & q->mask];
+    items[i] = cell->data;
+    atomic_store_explicit(&cell->sequence, pos + i + q->mask + 1,
+                          memory_order_release);
+  }
+  if (n > 0)
+    waitq_signal(&q->not_full, n);
+  return n;
+}
+
+// Helpers: waitq_sleep conditions
+static int push_ready(queue_t *q, queue_batch_t *b) {
+  int n = ring_push(q, b->items + b->done, b->count - b->done);
+  b->done += n;
+  return n;
+}
+
+static int pop_ready(queue_t *q, queue_batch_t *b) {
+  b->done = ring_pop(q, b->items, b->count);
+  return b->done;
+}
 
 queue_t *queue_create(void) {
-  queue_t *q = calloc(1, sizeof(queue_t));
+  return queue_create_bounded(QUEUE_DEFAULT_CAPACITY);
+}
+
+queue_t *queue_create_bounded(size_t capacity) {
+  size_t size = 2;
+  while (size < capacity)
+    size *= 2;
+
+  queue_t *q = aligned_alloc(QUEUE_CACHE_LINE,
+                             (sizeof(queue_t) + QUEUE_CACHE_LINE - 1) /
+                                 QUEUE_CACHE_LINE * QUEUE_CACHE_LINE);
   if (!q)
     return NULL;
+  q->cells = malloc(size * sizeof(queue_cell_t));
+  if (!q->cells) {
+    free(q);
+    return NULL;
+  }
 
-  pthread_mutex_init(&q->mutex, NULL);
-  pthread_cond_init(&q->cond, NULL);
+  for (size_t i = 0; i < size; i++)
+    atomic_init(&q->cells[i].sequence, i);
+  q->mask = size - 1;
+  atomic_init(&q->stop, 0);
+  atomic_init(&q->enqueue_pos, 0);
+  atomic_init(&q->dequeue_pos, 0);
+  atomic_init(&q->not_empty.seq, 0);
+  atomic_init(&q->not_empty.waiters, 0);
+  atomic_init(&q->not_full.seq, 0);
+  atomic_init(&q->not_full.waiters, 0);
   return q;
 }
 
@@ -15,72 +204,83 @@ void queue_destroy(queue_t *q) {
   if (!q)
     return;
   queue_stop(q);
-  pthread_mutex_destroy(&q->mutex);
-  pthread_cond_destroy(&q->cond);
-
-  // Free remaining nodes
-  queue_node_t *current = q->head;
-  while (current) {
-    queue_node_t *next = current->next;
-    free(current);
-    current = next;
-  }
+  free(q->cells);
   free(q);
 }
 
-void queue_push(queue_t *q, void *data) {
-  queue_node_t *node = malloc(sizeof(queue_node_t));
-  if (!node)
-    return;
-  node->data = data;
-  node->next = NULL;
-
-  pthread_mutex_lock(&q->mutex);
-  if (q->tail) {
-    q->tail->next = node;
-    q->tail = node;
-  } else {
-    q->head = q->tail = node;
-  }
-  q->count++;
-  pthread_cond_signal(&q->cond);
-  pthread_mutex_unlock(&q->mutex);
+int queue_push(queue_t *q, void *data) {
+  return queue_push_batch(q, &data, 1) == 1 ? 0 : -1;
+}
+
+int queue_try_push(queue_t *q, void *data) {
+  return ring_push(q, &data, 1) == 1 ? 0 : -1;
+}
+
+int queue_push_batch(queue_t *q, void **items, int count) {
+  queue_batch_t b = {items, count, 0};
+  push_ready(q, &b);
+  while (b.done < count && !atomic_load(&q->stop))
+    waitq_sleep(&q->not_full, q, push_ready, &b, NULL);
+  return b.done;
 }
 
 void *queue_pop(queue_t *q) {
-  pthread_mutex_lock(&q->mutex);
-  while (q->head == NULL && !q->stop) {
-    pthread_cond_wait(&q->cond, &q->mutex);
-  }
+  void *data;
+  return queue_pop_batch(q, &data, 1, -1) == 1 ? data : NULL;
+}
 
-  if (q->stop && q->head == NULL) {
-    pthread_mutex_unlock(&q->mutex);
-    return NULL;
+void *queue_try_pop(queue_t *q) {
+  void *data;
+  return ring_pop(q, &data, 1) == 1 ? data : NULL;
+}
+
+int queue_pop_batch(queue_t *q, void **items, int max, int timeout_ms) {
+  queue_batch_t b = {items, max, 0};
+  if (pop_ready(q, &b) > 0 || timeout_ms == 0)
+    return b.done;
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000;
   }
 
-  queue_node_t *node = q->head;
-  void *data = node->data;
-  q->head = node->next;
-  if (q->head == NULL) {
-    q->tail = NULL;
+  while (!atomic_load(&q->stop)) {
+    struct timespec left, *timeout = NULL;
+    if (timeout_ms > 0) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      left.tv_sec = deadline.tv_sec - now.tv_sec;
+      left.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+      if (left.tv_nsec < 0) {
+        left.tv_sec--;
+        left.tv_nsec += 1000000000;
+      }
+      if (left.tv_sec < 0)
+        break;
+      timeout = &left;
+    }
+    if (waitq_sleep(&q->not_empty, q, pop_ready, &b, timeout) > 0)
+      return b.done;
   }
-  q->count--;
-  pthread_mutex_unlock(&q->mutex);
 
-  free(node);
-  return data;
+  // Timed out or stopped: items still queued are handed out regardless
+  return pop_ready(q, &b);
 }
 
 void queue_stop(queue_t *q) {
-  pthread_mutex_lock(&q->mutex);
-  q->stop = 1;
-  pthread_cond_broadcast(&q->cond);
-  pthread_mutex_unlock(&q->mutex);
+  atomic_store(&q->stop, 1);
+  waitq_broadcast(&q->not_empty);
+  waitq_broadcast(&q->not_full);
 }
 
-int queue_is_empty(queue_t *q) {
-  pthread_mutex_lock(&q->mutex);
-  int empty = (q->head == NULL);
-  pthread_mutex_unlock(&q->mutex);
-  return empty;
+int queue_is_empty(queue_t *q) { return queue_size(q) == 0; }
+
+int queue_size(queue_t *q) {
+  size_t head = atomic_load(&q->dequeue_pos);
+  size_t tail = atomic_load(&q->enqueue_pos);
+  return tail > head ? (int)(tail - head) : 0;
 }
@@ -0,0 +1,38 @@
+#include "rate_limit.h"
+#include <time.h>
+
+void rate_limit_init(rate_limit_t *rl, double rate, double burst) {
+  rl->rate = rate > 0 ? rate : 0;
+  if (burst <= 0)
+    burst = rl->rate < 1 ? 1 : rl->rate;
+  rl->burst = burst;
+  rl->tokens = burst;
+  rl->last = rate_limit_now();
+}
+
+double rate_limit_wait(rate_limit_t *rl, double now) {
+  if (rl->rate <= 0)
+    return 0;
+
+  // Refill for the time elapsed since the last call
+  if (now > rl->last) {
+    rl->tokens += (now - rl->last) * rl->rate;
+    if (rl->tokens > rl->burst)
+      rl->tokens = rl->burst;
+    rl->last = now;
+  }
+  return rl->tokens >= 1 ? 0 : (1 - rl->tokens) / rl->rate;
+}
+
+double rate_limit_take(rate_limit_t *rl, double now) {
+  double wait = rate_limit_wait(rl, now);
+  if (wait == 0 && rl->rate > 0)
+    rl->tokens -= 1;
+  return wait;
+}
+
+double rate_limit_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
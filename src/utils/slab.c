@@ -0,0 +1,287 @@
+#include "slab.h"
+#include "arena.h"
+#include "logger.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef STATS_MEM_DEBUG
+// Sites are recorded where the cache is called from, not in here
+#undef slab_alloc
+#undef slab_zalloc
+#endif
+
+#define SLAB_SIZE (64 * 1024)  // Bytes carved at once
+#define SLAB_MIN_OBJECTS 8     // Per slab, for objects over SLAB_SIZE / 8
+#define SLAB_ALIGN 16          // Object alignment (max_align_t)
+#define SLAB_MAGAZINE_SIZE 32  // Free objects a thread keeps per cache
+#define SLAB_MAX_CACHES 16     // Caches with thread magazines
+#define SLAB_KEEP_EMPTY 4      // Empty slabs a cache keeps for reuse
+
+// Free objects of a cache kept by one thread
+typedef struct {
+  int count;
+  void *objs[SLAB_MAGAZINE_SIZE];
+} slab_magazine_t;
+
+// Header of a slab, followed by its objects
+typedef struct slab {
+  struct slab *next;
+  size_t objects;
+  size_t free; // Objects in the depot, counted while trimming
+} slab_t;
+
+#define SLAB_HEADER                                                            \
+  ((sizeof(slab_t) + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1))
+
+static _Thread_local slab_magazine_t t_magazines[SLAB_MAX_CACHES];
+static _Thread_local int t_registered = 0;
+
+static slab_cache_t *g_caches[SLAB_MAX_CACHES]; // By id - 1
+static atomic_int g_cache_count = 0;
+static pthread_key_t g_exit_key;
+static pthread_once_t g_exit_once = PTHREAD_ONCE_INIT;
+
+// Helper: Size objects of a cache take in a slab
+static size_t object_size(const slab_cache_t *cache) {
+  size_t size = cache->size < sizeof(void *) ? sizeof(void *) : cache->size;
+  return (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+}
+
+// Helper: Objects carved from each slab of a cache
+static size_t slab_objects(const slab_cache_t *cache) {
+  size_t n = (SLAB_SIZE - SLAB_HEADER) / object_size(cache);
+  return n < SLAB_MIN_OBJECTS ? SLAB_MIN_OBJECTS : n;
+}
+
+// Helper: Depot size at which empty slabs are looked for, as long as the
+// depot has not grown past twice what the last trim left in it
+static size_t trim_floor(const slab_cache_t *cache) {
+  return 2 * SLAB_KEEP_EMPTY * slab_objects(cache);
+}
+
+// Helper: Carve a new slab into the depot, under the cache lock
+// Returns 0 on success, -1 when out of memory
+static int slab_grow(slab_cache_t *cache) {
+  size_t size = object_size(cache);
+  size_t n = slab_objects(cache);
+
+  // From the arena (or malloc): both align on at least SLAB_ALIGN
+  slab_t *slab = arena_alloc(SLAB_HEADER + n * size);
+  if (!slab) {
+    LOG_ERROR("Slab: Out of memory for %s objects", cache->name);
+    return -1;
+  }
+  slab->objects = n;
+  slab->next = cache->slabs;
+  cache->slabs = slab;
+  cache->slab_count++;
+  stats_mem_alloc(cache->tag, SLAB_HEADER + n * size);
+
+  // Free objects are linked through their first word
+  char *obj = (char *)slab + SLAB_HEADER;
+  for (size_t i = 0; i < n; i++, obj += size) {
+    *(void **)obj = cache->depot;
+    cache->depot = obj;
+  }
+  cache->depot_count += n;
+  cache->trim_at = trim_floor(cache); // The depot ran dry
+  return 0;
+}
+
+static int slab_addr_cmp(const void *a, const void *b) {
+  uintptr_t x = (uintptr_t)*(slab_t *const *)a;
+  uintptr_t y = (uintptr_t)*(slab_t *const *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Helper: Slab an object was carved from (slabs sorted by address)
+static slab_t *slab_of(slab_t **sorted, size_t count, const void *obj) {
+  size_t lo = 0, hi = count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if ((const char *)sorted[mid] <= (const char *)obj)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo > 0 ? sorted[lo - 1] : NULL;
+}
+
+// Helper: Release the slabs whose objects are all in the depot, past the
+// SLAB_KEEP_EMPTY first ones, under the cache lock. Objects held in thread
+// magazines keep their slab.
+static void slab_trim(slab_cache_t *cache) {
+  size_t size = object_size(cache);
+  slab_t **sorted = malloc(cache->slab_count * sizeof(slab_t *));
+  if (!sorted)
+    return;
+  size_t count = 0;
+  for (slab_t *slab = cache->slabs; slab; slab = slab->next) {
+    slab->free = 0;
+    sorted[count++] = slab;
+  }
+  qsort(sorted, count, sizeof(slab_t *), slab_addr_cmp);
+
+  for (void *obj = cache->depot; obj; obj = *(void **)obj)
+    slab_of(sorted, count, obj)->free++;
+
+  // Released slabs are marked by free = 0 from here on
+  size_t kept = 0, released = 0;
+  for (slab_t *slab = cache->slabs; slab; slab = slab->next) {
+    if (slab->free == slab->objects && kept++ >= SLAB_KEEP_EMPTY) {
+      slab->free = 0;
+      released++;
+    } else if (slab->free == 0) {
+      slab->free = 1; // Not empty either way
+    }
+  }
+
+  if (released > 0) {
+    void **link = &cache->depot;
+    while (*link) {
+      if (slab_of(sorted, count, *link)->free == 0) {
+        *link = *(void **)*link;
+        cache->depot_count--;
+      } else {
+        link = (void **)*link;
+      }
+    }
+    slab_t **prev = (slab_t **)&cache->slabs;
+    while (*prev) {
+      slab_t *slab = *prev;
+      if (slab->free == 0) {
+        *prev = slab->next;
+        cache->slab_count--;
+        stats_mem_free(cache->tag, SLAB_HEADER + slab->objects * size);
+        arena_free(slab, SLAB_HEADER + slab->objects * size);
+      } else {
+        prev = &slab->next;
+      }
+    }
+    LOG_DEBUG("Slab: Released %zu empty %s slabs, %zu left", released,
+              cache->name, cache->slab_count);
+  }
+  free(sorted);
+
+  cache->trim_at = 2 * cache->depot_count;
+  if (cache->trim_at < trim_floor(cache))
+    cache->trim_at = trim_floor(cache);
+}
+
+// Helper: Fill a magazine up to count objects from the depot
+static void depot_take(slab_cache_t *cache, slab_magazine_t *mag, int count) {
+  pthread_mutex_lock(&cache->lock);
+  if (cache->depot_count == 0)
+    slab_grow(cache);
+  while (mag->count < count && cache->depot) {
+    void *obj = cache->depot;
+    cache->depot = *(void **)obj;
+    cache->depot_count--;
+    mag->objs[mag->count++] = obj;
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Helper: Move objects from the top of a magazine to the depot, leaving
+// count of them
+static void depot_give(slab_cache_t *cache, slab_magazine_t *mag, int count) {
+  pthread_mutex_lock(&cache->lock);
+  while (mag->count > count) {
+    void *obj = mag->objs[--mag->count];
+    *(void **)obj = cache->depot;
+    cache->depot = obj;
+    cache->depot_count++;
+  }
+  if (cache->depot_count >= cache->trim_at &&
+      cache->depot_count >= trim_floor(cache))
+    slab_trim(cache);
+  pthread_mutex_unlock(&cache->lock);
+}
+
+// Thread exit: hand the thread's free objects to the other threads
+static void slab_thread_exit(void *arg) {
+  (void)arg;
+  int count = atomic_load(&g_cache_count);
+  for (int i = 0; i < count && i < SLAB_MAX_CACHES; i++) {
+    if (t_magazines[i].count > 0)
+      depot_give(g_caches[i], &t_magazines[i], 0);
+  }
+}
+
+static void slab_exit_key_create(void) {
+  pthread_key_create(&g_exit_key, slab_thread_exit);
+}
+
+// Helper: This thread's magazine of a cache, NULL if the cache has none
+// (more than SLAB_MAX_CACHES caches: it then goes through the depot)
+static slab_magazine_t *slab_magazine(slab_cache_t *cache) {
+  int id = atomic_load_explicit(&cache->id, memory_order_acquire);
+  if (id == 0) {
+    pthread_mutex_lock(&cache->lock);
+    id = atomic_load(&cache->id);
+    if (id == 0) {
+      int index = atomic_fetch_add(&g_cache_count, 1);
+      if (index < SLAB_MAX_CACHES) {
+        g_caches[index] = cache;
+        id = index + 1;
+      } else {
+        LOG_WARN("Slab: No thread magazines left for %s objects",
+                 cache->name);
+        id = -1;
+      }
+      atomic_store_explicit(&cache->id, id, memory_order_release);
+    }
+    pthread_mutex_unlock(&cache->lock);
+  }
+  if (id < 0)
+    return NULL;
+
+  if (!t_registered) {
+    // Any non-NULL value makes the key's destructor run at thread exit
+    pthread_once(&g_exit_once, slab_exit_key_create);
+    pthread_setspecific(g_exit_key, &t_registered);
+    t_registered = 1;
+  }
+  return &t_magazines[id - 1];
+}
+
+void *slab_alloc(slab_cache_t *cache) {
+  void *obj = NULL;
+  slab_magazine_t *mag = slab_magazine(cache);
+  if (!mag) {
+    slab_magazine_t one = {0};
+    depot_take(cache, &one, 1);
+    if (one.count)
+      obj = one.objs[0];
+  } else {
+    if (mag->count == 0)
+      depot_take(cache, mag, SLAB_MAGAZINE_SIZE / 2);
+    if (mag->count)
+      obj = mag->objs[--mag->count];
+  }
+  if (obj)
+    stats_mem_count(cache->tag, cache->size);
+  return obj;
+}
+
+void *slab_zalloc(slab_cache_t *cache) {
+  void *obj = slab_alloc(cache);
+  if (obj)
+    memset(obj, 0, cache->size);
+  return obj;
+}
+
+void slab_free(slab_cache_t *cache, void *obj) {
+  if (!obj)
+    return;
+  slab_magazine_t *mag = slab_magazine(cache);
+  if (!mag) {
+    slab_magazine_t one = {1, {obj}};
+    depot_give(cache, &one, 0);
+    return;
+  }
+  if (mag->count == SLAB_MAGAZINE_SIZE)
+    depot_give(cache, mag, SLAB_MAGAZINE_SIZE / 2);
+  mag->objs[mag->count++] = obj;
+}
@@ -1,17 +1,75 @@
 #include "stats.h"
 #include "logger.h"
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-// 全局统计实例
+// 全局统计实例: 计数器的基数, 加上各线程分片才是当前值
 static stats_t g_stats_instance;
 stats_t *g_stats = &g_stats_instance;
 
+// 计数器区: stats_t 开头连续的 atomic_counter_t, 至 start_time 为止
+#define STATS_COUNTERS                                                         \
+  (offsetof(stats_t, start_time) / sizeof(atomic_counter_t))
+#define STATS_CACHE_LINE 64
+
+_Static_assert(offsetof(stats_t, active_connections) == 0,
+               "stats_t must start with its counters");
+
+// 线程分片: 每个线程只写自己的一份计数器, 对齐并填充到整缓存行,
+// 热路径上既无原子读改写也无缓存行在核间来回
+typedef struct stats_shard {
+  _Alignas(STATS_CACHE_LINE) atomic_counter_t counters[STATS_COUNTERS];
+  struct stats_shard *next;
+} stats_shard_t;
+
+static stats_shard_t *g_shards = NULL;      // 各线程正在使用的分片
+static stats_shard_t *g_free_shards = NULL; // 已退出线程留下的分片
+static pthread_mutex_t g_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_shard_key;
+static pthread_once_t g_shard_once = PTHREAD_ONCE_INIT;
+static _Thread_local stats_shard_t *t_shard = NULL;
+
+static const char *g_mem_names[STATS_MEM_TAGS] = {
+    "connections", "buffers", "sessions", "storage",
+    "relay_queue", "relay",   "spare"};
+
+// 上次输出时各子系统的累计分配次数, 用于计算每秒分配数
+static uint64_t g_mem_allocs_mark[STATS_MEM_TAGS];
+static struct timespec g_mem_mark_time;
+static pthread_mutex_t g_mem_mark_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef STATS_MEM_DEBUG
+#define MEM_SITES_MAX 256   // 记录的调用点上限, 满后新调用点被忽略
+#define MEM_SITES_REPORT 10 // 文本输出列出的调用点数
+
+// 一个分配调用点的累计分配
+typedef struct {
+  const char *file; // NULL: 空槽
+  int line;
+  stats_mem_tag_t tag;
+  uint64_t allocs;
+  uint64_t bytes;
+} mem_site_t;
+
+static mem_site_t g_mem_sites[MEM_SITES_MAX];
+static pthread_mutex_t g_mem_sites_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// 本线程即将进入分配器的调用点 (由 STATS_MEM_SITE 设置)
+static _Thread_local const char *t_site_file = NULL;
+static _Thread_local int t_site_line = 0;
+#endif
+
 // ========== 初始化与销毁 ==========
 
 int stats_init(void) {
+  pthread_mutex_lock(&g_shards_lock);
   memset(g_stats, 0, sizeof(stats_t));
+  for (stats_shard_t *shard = g_shards; shard; shard = shard->next)
+    memset(shard->counters, 0, sizeof(shard->counters));
+  pthread_mutex_unlock(&g_shards_lock);
   g_stats->start_time = time(NULL);
   g_stats->last_reset = g_stats->start_time;
   LOG_INFO("Statistics module initialized");
@@ -23,22 +81,197 @@ void stats_destroy(void) {
   // 原子变量无需显式销毁
 }
 
-// ========== 原子操作 ==========
+// ========== 线程分片 ==========
+
+// 线程退出: 分片计入全局基数后留给后来的线程
+static void shard_release(void *arg) {
+  stats_shard_t *shard = arg;
+  atomic_counter_t *base = (atomic_counter_t *)g_stats;
+
+  pthread_mutex_lock(&g_shards_lock);
+  for (size_t i = 0; i < STATS_COUNTERS; i++) {
+    atomic_fetch_add(&base[i].value, atomic_load(&shard->counters[i].value));
+    atomic_store(&shard->counters[i].value, 0);
+  }
+  stats_shard_t **link = &g_shards;
+  while (*link != shard)
+    link = &(*link)->next;
+  *link = shard->next;
+  shard->next = g_free_shards;
+  g_free_shards = shard;
+  pthread_mutex_unlock(&g_shards_lock);
 
-void stats_inc(atomic_counter_t *counter) {
-  atomic_fetch_add(&counter->value, 1);
+  // 之后的更新 (其他线程退出回调中) 另取分片
+  t_shard = NULL;
 }
 
-void stats_dec(atomic_counter_t *counter) {
-  atomic_fetch_sub(&counter->value, 1);
+static void shard_key_create(void) {
+  pthread_key_create(&g_shard_key, shard_release);
 }
 
+// 辅助: 本线程的分片, 首次使用时分配; 内存不足时为 NULL
+static stats_shard_t *shard_get(void) {
+  if (t_shard)
+    return t_shard;
+  pthread_once(&g_shard_once, shard_key_create);
+
+  pthread_mutex_lock(&g_shards_lock);
+  stats_shard_t *shard = g_free_shards;
+  if (shard) {
+    g_free_shards = shard->next;
+  } else {
+    shard = aligned_alloc(STATS_CACHE_LINE, sizeof(stats_shard_t));
+    if (shard)
+      memset(shard, 0, sizeof(stats_shard_t));
+  }
+  if (shard) {
+    shard->next = g_shards;
+    g_shards = shard;
+  }
+  pthread_mutex_unlock(&g_shards_lock);
+
+  if (shard) {
+    pthread_setspecific(g_shard_key, shard);
+    t_shard = shard;
+  }
+  return shard;
+}
+
+// 辅助: g_stats 计数器的下标, 不属于 g_stats (如快照) 时为 -1
+static long counter_index(const atomic_counter_t *counter) {
+  uintptr_t base = (uintptr_t)g_stats;
+  uintptr_t addr = (uintptr_t)counter;
+  if (addr < base || addr >= base + STATS_COUNTERS * sizeof(atomic_counter_t))
+    return -1;
+  return (long)((addr - base) / sizeof(atomic_counter_t));
+}
+
+// 辅助: 计数器当前值 = 基数 + 各分片, 调用者持有 g_shards_lock
+static uint64_t counter_sum(size_t index) {
+  const atomic_counter_t *base = (const atomic_counter_t *)g_stats;
+  uint64_t sum = atomic_load(&base[index].value);
+  for (stats_shard_t *shard = g_shards; shard; shard = shard->next)
+    sum += atomic_load_explicit(&shard->counters[index].value,
+                                memory_order_relaxed);
+  return sum;
+}
+
+// ========== 计数器操作 ==========
+
+void stats_inc(atomic_counter_t *counter) { stats_add(counter, 1); }
+
+// 分片按 2^64 取模累加, 减一即加上 -1
+void stats_dec(atomic_counter_t *counter) { stats_add(counter, UINT64_MAX); }
+
 void stats_add(atomic_counter_t *counter, uint64_t value) {
-  atomic_fetch_add(&counter->value, value);
+  long index = counter_index(counter);
+  stats_shard_t *shard = index >= 0 ? shard_get() : NULL;
+  if (!shard) {
+    atomic_fetch_add(&counter->value, value);
+    return;
+  }
+  // 分片只有本线程写入: 普通的读加写即可, 汇总方以 relaxed 读取
+  atomic_counter_t *c = &shard->counters[index];
+  uint64_t v = atomic_load_explicit(&c->value, memory_order_relaxed);
+  atomic_store_explicit(&c->value, v + value, memory_order_relaxed);
 }
 
 uint64_t stats_get(const atomic_counter_t *counter) {
-  return atomic_load(&counter->value);
+  long index = counter_index(counter);
+  if (index < 0)
+    return atomic_load(&counter->value);
+  pthread_mutex_lock(&g_shards_lock);
+  uint64_t value = counter_sum((size_t)index);
+  pthread_mutex_unlock(&g_shards_lock);
+  return value;
+}
+
+// ========== 内存统计 ==========
+
+// bytes 与 peak 不分片: 峰值需要实时总量, 而它们只随内存块变化
+void stats_mem_alloc(stats_mem_tag_t tag, size_t bytes) {
+  stats_mem_t *m = &g_stats->memory[tag];
+  uint64_t now = atomic_fetch_add(&m->bytes.value, bytes) + bytes;
+  stats_inc(&m->chunks);
+
+  uint64_t peak = atomic_load(&m->peak.value);
+  while (now > peak &&
+         !atomic_compare_exchange_weak(&m->peak.value, &peak, now))
+    ;
+}
+
+void stats_mem_free(stats_mem_tag_t tag, size_t bytes) {
+  stats_mem_t *m = &g_stats->memory[tag];
+  atomic_fetch_sub(&m->bytes.value, bytes);
+  stats_dec(&m->chunks);
+}
+
+#ifdef STATS_MEM_DEBUG
+void stats_mem_site(const char *file, int line) {
+  t_site_file = file;
+  t_site_line = line;
+}
+
+// 将一次分配计入本线程设置的调用点
+static void mem_site_record(stats_mem_tag_t tag, size_t size) {
+  const char *file = t_site_file;
+  int line = t_site_line;
+  if (!file)
+    return;
+  t_site_file = NULL;
+
+  size_t h = ((uintptr_t)file >> 4) * 31 + (size_t)line;
+  pthread_mutex_lock(&g_mem_sites_lock);
+  for (int i = 0; i < MEM_SITES_MAX; i++) {
+    mem_site_t *site = &g_mem_sites[(h + (size_t)i) % MEM_SITES_MAX];
+    if (!site->file) {
+      site->file = file;
+      site->line = line;
+      site->tag = tag;
+    } else if (site->file != file || site->line != line) {
+      continue;
+    }
+    site->allocs++;
+    site->bytes += size;
+    break;
+  }
+  pthread_mutex_unlock(&g_mem_sites_lock);
+}
+#endif
+
+void stats_mem_count(stats_mem_tag_t tag, size_t size) {
+  stats_inc(&g_stats->memory[tag].allocs);
+#ifdef STATS_MEM_DEBUG
+  mem_site_record(tag, size);
+#else
+  (void)size;
+#endif
+}
+
+const char *stats_mem_name(stats_mem_tag_t tag) {
+  return tag >= 0 && tag < STATS_MEM_TAGS ? g_mem_names[tag] : "unknown";
+}
+
+// 辅助: 自上次输出以来各子系统的每秒分配数 (首次: 自启动以来)
+static void mem_rates(const stats_t *snap, double rates[STATS_MEM_TAGS]) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  pthread_mutex_lock(&g_mem_mark_lock);
+  double elapsed;
+  if (g_mem_mark_time.tv_sec == 0)
+    elapsed = (double)(time(NULL) - g_stats->start_time);
+  else
+    elapsed = (double)(now.tv_sec - g_mem_mark_time.tv_sec) +
+              (double)(now.tv_nsec - g_mem_mark_time.tv_nsec) / 1e9;
+  for (int i = 0; i < STATS_MEM_TAGS; i++) {
+    uint64_t allocs = stats_get(&snap->memory[i].allocs);
+    rates[i] = elapsed > 0 ? (double)(allocs - g_mem_allocs_mark[i]) / elapsed
+                           : 0.0;
+    g_mem_allocs_mark[i] = allocs;
+  }
+  g_mem_mark_time = now;
+  pthread_mutex_unlock(&g_mem_mark_lock);
 }
 
 // ========== 快照与重置 ==========
@@ -47,34 +280,12 @@ void stats_snapshot(stats_t *snapshot) {
   if (!snapshot)
     return;
 
-  // 原子读取所有计数器
-  snapshot->active_connections =
-      (atomic_counter_t){.value = stats_get(&g_stats->active_connections)};
-  snapshot->total_connections =
-      (atomic_counter_t){.value = stats_get(&g_stats->total_connections)};
-  snapshot->rejected_connections =
-      (atomic_counter_t){.value = stats_get(&g_stats->rejected_connections)};
-
-  snapshot->emails_received =
-      (atomic_counter_t){.value = stats_get(&g_stats->emails_received)};
-  snapshot->emails_stored =
-      (atomic_counter_t){.value = stats_get(&g_stats->emails_stored)};
-  snapshot->emails_rejected =
-      (atomic_counter_t){.value = stats_get(&g_stats->emails_rejected)};
-
-  snapshot->relay_success =
-      (atomic_counter_t){.value = stats_get(&g_stats->relay_success)};
-  snapshot->relay_failed =
-      (atomic_counter_t){.value = stats_get(&g_stats->relay_failed)};
-  snapshot->relay_retrying =
-      (atomic_counter_t){.value = stats_get(&g_stats->relay_retrying)};
-  snapshot->relay_queue_depth =
-      (atomic_counter_t){.value = stats_get(&g_stats->relay_queue_depth)};
-
-  snapshot->tls_handshakes =
-      (atomic_counter_t){.value = stats_get(&g_stats->tls_handshakes)};
-  snapshot->tls_errors =
-      (atomic_counter_t){.value = stats_get(&g_stats->tls_errors)};
+  // 汇总基数与所有分片
+  atomic_counter_t *dst = (atomic_counter_t *)snapshot;
+  pthread_mutex_lock(&g_shards_lock);
+  for (size_t i = 0; i < STATS_COUNTERS; i++)
+    atomic_store(&dst[i].value, counter_sum(i));
+  pthread_mutex_unlock(&g_shards_lock);
 
   snapshot->start_time = g_stats->start_time;
   snapshot->last_reset = g_stats->last_reset;
@@ -82,8 +293,21 @@ void stats_snapshot(stats_t *snapshot) {
 
 void stats_reset(void) {
   // 保留累计值 (total_connections 等)，重置瞬时值
-  atomic_store(&g_stats->active_connections.value, 0);
-  atomic_store(&g_stats->relay_queue_depth.value, 0);
+  // 分片由各线程所有: 调整基数使总和归零
+  pthread_mutex_lock(&g_shards_lock);
+  size_t gauges[] = {counter_index(&g_stats->active_connections),
+                     counter_index(&g_stats->relay_queue_depth)};
+  for (size_t i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++) {
+    atomic_counter_t *base = (atomic_counter_t *)g_stats + gauges[i];
+    atomic_fetch_sub(&base->value, counter_sum(gauges[i]));
+  }
+  pthread_mutex_unlock(&g_shards_lock);
+
+  // 内存占用是实时值, 只将峰值重新从当前值开始
+  for (int i = 0; i < STATS_MEM_TAGS; i++) {
+    stats_mem_t *m = &g_stats->memory[i];
+    atomic_store(&m->peak.value, atomic_load(&m->bytes.value));
+  }
 
   g_stats->last_reset = time(NULL);
   LOG_INFO("Statistics reset (keeping cumulative counters)");
@@ -91,15 +315,56 @@ void stats_reset(void) {
 
 // ========== 格式化输出 ==========
 
+// 辅助: 追加格式化文本到 buf 的 *off 处, 空间不足时截断
+static void append(char *buf, size_t size, size_t *off, const char *fmt, ...) {
+  if (*off >= size - 1)
+    return;
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf + *off, size - *off, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    *off = (size_t)n < size - *off ? *off + (size_t)n : size - 1;
+}
+
+#ifdef STATS_MEM_DEBUG
+// 辅助: 按分配字节数降序
+static int site_cmp(const void *a, const void *b) {
+  const mem_site_t *x = a, *y = b;
+  return x->bytes < y->bytes ? 1 : x->bytes > y->bytes ? -1 : 0;
+}
+
+// 辅助: 列出分配字节最多的调用点
+static void format_sites_text(char *buf, size_t size, size_t *off) {
+  static mem_site_t sites[MEM_SITES_MAX];
+  pthread_mutex_lock(&g_mem_sites_lock);
+  memcpy(sites, g_mem_sites, sizeof(sites));
+  pthread_mutex_unlock(&g_mem_sites_lock);
+  qsort(sites, MEM_SITES_MAX, sizeof(mem_site_t), site_cmp);
+
+  append(buf, size, off, "[Allocation Sites]\n");
+  for (int i = 0; i < MEM_SITES_REPORT && sites[i].file; i++) {
+    append(buf, size, off, "  %s:%d (%s): %lu allocs, %lu KB\n",
+           sites[i].file, sites[i].line, stats_mem_name(sites[i].tag),
+           sites[i].allocs, sites[i].bytes / 1024);
+  }
+  append(buf, size, off, "\n");
+}
+#endif
+
 void stats_format_text(char *buf, size_t size) {
   if (!buf || size == 0)
     return;
 
+  stats_t snap;
+  stats_snapshot(&snap);
   time_t now = time(NULL);
-  time_t uptime = now - g_stats->start_time;
+  time_t uptime = now - snap.start_time;
+  size_t off = 0;
+  buf[0] = '\0';
 
-  snprintf(
-      buf, size,
+  append(
+      buf, size, &off,
       "=== SMTP Relay Statistics ===\n"
       "Uptime: %lds (%ldh %ldm)\n"
       "\n"
@@ -116,33 +381,54 @@ void stats_format_text(char *buf, size_t size) {
       "[Relay]\n"
       "  Success:     %lu\n"
       "  Failed:      %lu\n"
+      "  Retrying:    %lu\n"
       "  Queue Depth: %lu\n"
       "\n"
       "[TLS]\n"
       "  Handshakes: %lu\n"
       "  Errors:     %lu\n"
-      "\n"
-      "Last Reset: %lds ago\n",
+      "\n",
       uptime, uptime / 3600, (uptime % 3600) / 60,
-      stats_get(&g_stats->active_connections),
-      stats_get(&g_stats->total_connections),
-      stats_get(&g_stats->rejected_connections),
-      stats_get(&g_stats->emails_received), stats_get(&g_stats->emails_stored),
-      stats_get(&g_stats->emails_rejected), stats_get(&g_stats->relay_success),
-      stats_get(&g_stats->relay_failed), stats_get(&g_stats->relay_queue_depth),
-      stats_get(&g_stats->tls_handshakes), stats_get(&g_stats->tls_errors),
-      now - g_stats->last_reset);
+      stats_get(&snap.active_connections),
+      stats_get(&snap.total_connections),
+      stats_get(&snap.rejected_connections),
+      stats_get(&snap.emails_received), stats_get(&snap.emails_stored),
+      stats_get(&snap.emails_rejected), stats_get(&snap.relay_success),
+      stats_get(&snap.relay_failed), stats_get(&snap.relay_retrying),
+      stats_get(&snap.relay_queue_depth),
+      stats_get(&snap.tls_handshakes), stats_get(&snap.tls_errors));
+
+  double rates[STATS_MEM_TAGS];
+  mem_rates(&snap, rates);
+  append(buf, size, &off,
+         "[Memory]          Now KB    Peak KB  Chunks  Allocs/s\n");
+  for (int i = 0; i < STATS_MEM_TAGS; i++) {
+    const stats_mem_t *m = &snap.memory[i];
+    append(buf, size, &off, "  %-12s %9lu  %9lu  %6lu  %8.1f\n",
+           g_mem_names[i], stats_get(&m->bytes) / 1024,
+           stats_get(&m->peak) / 1024, stats_get(&m->chunks), rates[i]);
+  }
+  append(buf, size, &off, "\n");
+#ifdef STATS_MEM_DEBUG
+  format_sites_text(buf, size, &off);
+#endif
+
+  append(buf, size, &off, "Last Reset: %lds ago\n", now - snap.last_reset);
 }
 
 void stats_format_json(char *buf, size_t size) {
   if (!buf || size == 0)
     return;
 
+  stats_t snap;
+  stats_snapshot(&snap);
   time_t now = time(NULL);
-  time_t uptime = now - g_stats->start_time;
+  time_t uptime = now - snap.start_time;
+  size_t off = 0;
+  buf[0] = '\0';
 
-  snprintf(
-      buf, size,
+  append(
+      buf, size, &off,
       "{\n"
       "  \"uptime_seconds\": %ld,\n"
       "  \"connections\": {\n"
@@ -158,24 +444,42 @@ void stats_format_json(char *buf, size_t size) {
       "  \"relay\": {\n"
       "    \"success\": %lu,\n"
       "    \"failed\": %lu,\n"
+      "    \"retrying\": %lu,\n"
       "    \"queue_depth\": %lu\n"
       "  },\n"
       "  \"tls\": {\n"
       "    \"handshakes\": %lu,\n"
       "    \"errors\": %lu\n"
-      "  },\n"
-      "  \"timestamps\": {\n"
-      "    \"start_time\": %ld,\n"
-      "    \"last_reset\": %ld,\n"
-      "    \"current_time\": %ld\n"
-      "  }\n"
-      "}",
-      uptime, stats_get(&g_stats->active_connections),
-      stats_get(&g_stats->total_connections),
-      stats_get(&g_stats->rejected_connections),
-      stats_get(&g_stats->emails_received), stats_get(&g_stats->emails_stored),
-      stats_get(&g_stats->emails_rejected), stats_get(&g_stats->relay_success),
-      stats_get(&g_stats->relay_failed), stats_get(&g_stats->relay_queue_depth),
-      stats_get(&g_stats->tls_handshakes), stats_get(&g_stats->tls_errors),
-      g_stats->start_time, g_stats->last_reset, now);
+      "  },\n",
+      uptime, stats_get(&snap.active_connections),
+      stats_get(&snap.total_connections),
+      stats_get(&snap.rejected_connections),
+      stats_get(&snap.emails_received), stats_get(&snap.emails_stored),
+      stats_get(&snap.emails_rejected), stats_get(&snap.relay_success),
+      stats_get(&snap.relay_failed), stats_get(&snap.relay_retrying),
+      stats_get(&snap.relay_queue_depth),
+      stats_get(&snap.tls_handshakes), stats_get(&snap.tls_errors));
+
+  double rates[STATS_MEM_TAGS];
+  mem_rates(&snap, rates);
+  append(buf, size, &off, "  \"memory\": {\n");
+  for (int i = 0; i < STATS_MEM_TAGS; i++) {
+    const stats_mem_t *m = &snap.memory[i];
+    append(buf, size, &off,
+           "    \"%s\": {\"bytes\": %lu, \"peak\": %lu, \"chunks\": %lu, "
+           "\"allocs\": %lu, \"allocs_per_sec\": %.1f}%s\n",
+           g_mem_names[i], stats_get(&m->bytes), stats_get(&m->peak),
+           stats_get(&m->chunks), stats_get(&m->allocs), rates[i],
+           i + 1 < STATS_MEM_TAGS ? "," : "");
+  }
+  append(buf, size, &off, "  },\n");
+
+  append(buf, size, &off,
+         "  \"timestamps\": {\n"
+         "    \"start_time\": %ld,\n"
+         "    \"last_reset\": %ld,\n"
+         "    \"current_time\": %ld\n"
+         "  }\n"
+         "}",
+         snap.start_time, snap.last_reset, now);
 }
@@ -1,7 +1,29 @@
 #include "tls.h"
+#include "hash.h"
 #include "logger.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Client sessions kept for resumption, one per upstream (direct mapped)
+#define TLS_CLIENT_CACHE_SIZE 256
+#define TLS_CLIENT_KEY_MAX 272
+
+typedef struct {
+  char key[TLS_CLIENT_KEY_MAX]; // "host:port"
+  SSL_SESSION *session;
+} tls_cache_entry_t;
+
+static tls_cache_entry_t g_client_cache[TLS_CLIENT_CACHE_SIZE];
+static pthread_mutex_t g_client_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int g_key_index = -1; // SSL ex_data slot holding the cache key
+static pthread_once_t g_key_once = PTHREAD_ONCE_INIT;
 
 
 void tls_init_library(void) {
@@ -52,4 +74,127 @@ SSL_CTX *tls_create_context(const char *cert_file, const char *key_file) {
   return ctx;
 }
 
-void tls_cleanup(void) { EVP_cleanup(); }
+// Helper: Free the cache key attached to an SSL
+static void cache_key_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad,
+                           int idx, long argl, void *argp) {
+  (void)parent;
+  (void)ad;
+  (void)idx;
+  (void)argl;
+  (void)argp;
+  free(ptr);
+}
+
+static void cache_key_init(void) {
+  g_key_index = SSL_get_ex_new_index(0, NULL, NULL, NULL, cache_key_free);
+}
+
+static tls_cache_entry_t *cache_slot(const char *key) {
+  return &g_client_cache[hash_fnv1a(key) % TLS_CLIENT_CACHE_SIZE];
+}
+
+// New session (TLS 1.3: possibly several tickets, after the handshake)
+// Returns 1: the cache keeps the reference
+static int cache_new_session(SSL *ssl, SSL_SESSION *session) {
+  const char *key = SSL_get_ex_data(ssl, g_key_index);
+  if (!key)
+    return 0;
+
+  pthread_mutex_lock(&g_client_cache_lock);
+  tls_cache_entry_t *e = cache_slot(key);
+  if (e->session)
+    SSL_SESSION_free(e->session);
+  snprintf(e->key, sizeof(e->key), "%s", key);
+  e->session = session;
+  pthread_mutex_unlock(&g_client_cache_lock);
+  return 1;
+}
+
+SSL_CTX *tls_create_client_context(const char *ca_file, int verify) {
+  pthread_once(&g_key_once, cache_key_init);
+  if (g_key_index < 0) {
+    LOG_ERROR("Unable to allocate TLS session cache index");
+    return NULL;
+  }
+
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  if (!ctx) {
+    LOG_ERROR("Unable to create client SSL context");
+    return NULL;
+  }
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION); // TLS 1.2+
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  // Sessions live in our per-upstream cache, not OpenSSL's internal one
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT |
+                                          SSL_SESS_CACHE_NO_INTERNAL_STORE);
+  SSL_CTX_sess_set_new_cb(ctx, cache_new_session);
+
+  if (verify) {
+    int ok = ca_file ? SSL_CTX_load_verify_locations(ctx, ca_file, NULL)
+                     : SSL_CTX_set_default_verify_paths(ctx);
+    if (ok != 1) {
+      LOG_ERROR("Failed to load CA certificates%s%s", ca_file ? ": " : "",
+                ca_file ? ca_file : "");
+      SSL_CTX_free(ctx);
+      return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+  }
+
+  LOG_INFO("Client TLS context created (certificate verification %s)",
+           verify ? "on" : "off");
+  return ctx;
+}
+
+SSL *tls_client_new(SSL_CTX *ctx, int fd, const char *host, int port) {
+  SSL *ssl = SSL_new(ctx);
+  if (!ssl)
+    return NULL;
+
+  char *key = malloc(TLS_CLIENT_KEY_MAX);
+  if (!key || SSL_set_fd(ssl, fd) != 1) {
+    free(key);
+    SSL_free(ssl);
+    return NULL;
+  }
+  snprintf(key, TLS_CLIENT_KEY_MAX, "%s:%d", host, port);
+  SSL_set_ex_data(ssl, g_key_index, key);
+
+  // SNI only carries host names (RFC 6066); an IP literal gateway is
+  // verified against the certificate's IP addresses instead
+  unsigned char addr[sizeof(struct in6_addr)];
+  int ip = inet_pton(AF_INET, host, addr) == 1 ||
+           inet_pton(AF_INET6, host, addr) == 1;
+  if (!ip)
+    SSL_set_tlsext_host_name(ssl, host);
+  if ((SSL_CTX_get_verify_mode(ctx) & SSL_VERIFY_PEER) &&
+      (ip ? X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host)
+          : SSL_set1_host(ssl, host)) != 1) {
+    LOG_ERROR("TLS: Cannot verify the certificate of %s", host);
+    SSL_free(ssl); // Frees key through the ex_data callback
+    return NULL;
+  }
+
+  pthread_mutex_lock(&g_client_cache_lock);
+  tls_cache_entry_t *e = cache_slot(key);
+  if (e->session && strcmp(e->key, key) == 0 &&
+      SSL_SESSION_is_resumable(e->session))
+    SSL_set_session(ssl, e->session); // Takes its own reference
+  pthread_mutex_unlock(&g_client_cache_lock);
+
+  SSL_set_connect_state(ssl);
+  return ssl;
+}
+
+void tls_cleanup(void) {
+  pthread_mutex_lock(&g_client_cache_lock);
+  for (int i = 0; i < TLS_CLIENT_CACHE_SIZE; i++) {
+    if (g_client_cache[i].session)
+      SSL_SESSION_free(g_client_cache[i].session);
+    g_client_cache[i].session = NULL;
+  }
+  pthread_mutex_unlock(&g_client_cache_lock);
+  EVP_cleanup();
+}
@@ -0,0 +1,234 @@
+#include "balancer.h"
+#include "route.h"
+#include "test.h"
+#include <string.h>
+#include <unistd.h>
+
+// Must match balancer.c
+#define FAIL_THRESHOLD 5
+#define COOLDOWN 30
+#define SLOW_START 30
+
+// Clock handed to the balancer: no test depends on the wall clock
+#define T0 ((time_t)1000000)
+
+// Table with one route "test" over the given gateways
+static route_table_t *table_create(config_gateway_t *gws, int n) {
+  config_route_t routes[] = {{"test", gws, n, 0, 0, 0, NULL}};
+  config_t config;
+  memset(&config, 0, sizeof(config));
+  config.upstream.host = "default.test";
+  config.upstream.port = 25;
+  config.policy.routes = routes;
+  config.policy.route_count = 1;
+  route_table_t *t = route_table_create(&config);
+  CHECK(t);
+  return t;
+}
+
+// Pick without reporting back, so the picks pile up in flight
+static void pick_many(route_t *r, int n, time_t now, int *counts) {
+  for (int i = 0; i < n; i++) {
+    double wait;
+    upstream_t *u = balancer_pick(r, NULL, now, &wait);
+    CHECK(u && wait == 0);
+    counts[u - r->upstreams]++;
+  }
+}
+
+static void drain(route_t *r, time_t now) {
+  for (int i = 0; i < r->upstream_count; i++)
+    while (r->upstreams[i].inflight > 0)
+      balancer_report(r, &r->upstreams[i], UPSTREAM_NEUTRAL, -1, now);
+}
+
+// Load spreads by weight, and a faster gateway takes the next delivery
+static void test_weighted(void) {
+  config_gateway_t gws[] = {{"10.0.0.1:25", 1, 0, 0}, {"10.0.0.2:25", 3, 0, 0}};
+  route_table_t *t = table_create(gws, 2);
+  route_t *r = route_lookup(t, "test");
+
+  int counts[2] = {0, 0};
+  pick_many(r, 400, T0, counts);
+  CHECK(counts[0] >= 95 && counts[0] <= 105);
+  CHECK(counts[0] + counts[1] == 400);
+  CHECK(r->upstreams[0].inflight == counts[0]);
+  drain(r, T0);
+  CHECK(r->upstreams[0].inflight == 0 && r->upstreams[1].inflight == 0);
+
+  balancer_report(r, &r->upstreams[0], UPSTREAM_OK, 10, T0);
+  balancer_report(r, &r->upstreams[1], UPSTREAM_OK, 1000, T0);
+  CHECK(r->upstreams[1].ewma_ms == 1000);
+  balancer_report(r, &r->upstreams[1], UPSTREAM_OK, 0, T0);
+  CHECK(r->upstreams[1].ewma_ms == 800);
+  CHECK(balancer_latency(t) == (10 + 800) / 2.0);
+  double wait;
+  upstream_t *u = balancer_pick(r, NULL, T0, &wait);
+  CHECK(u == &r->upstreams[0]);
+  route_table_destroy(t);
+}
+
+// The gateway that just failed a delivery is avoided unless it is the only
+// one left; a gateway at its concurrency limit is skipped
+static void test_exclude_and_limits(void) {
+  config_gateway_t gws[] = {{"10.0.0.1:25", 1, 1, 0}, {"10.0.0.2:25", 1, 0, 0}};
+  route_table_t *t = table_create(gws, 2);
+  route_t *r = route_lookup(t, "test");
+  upstream_t *a = &r->upstreams[0], *b = &r->upstreams[1];
+
+  double wait;
+  for (int i = 0; i < 20; i++) {
+    CHECK(balancer_pick(r, a, T0, &wait) == b);
+    balancer_report(r, b, UPSTREAM_OK, -1, T0);
+  }
+
+  // a is busy: the rest goes to b, but an excluded b is no better than
+  // waiting for a's slot
+  CHECK(balancer_pick(r, b, T0, &wait) == a);
+  CHECK(balancer_pick(r, NULL, T0, &wait) == b);
+  CHECK(balancer_pick(r, b, T0, &wait) == NULL);
+  CHECK(wait == 0);
+  drain(r, T0);
+
+  // With b open, a is the only candidate: it takes one delivery, then the
+  // route waits for a slot
+  for (int i = 0; i < FAIL_THRESHOLD; i++)
+    balancer_report(r, b, UPSTREAM_FAIL, -1, T0);
+  CHECK(b->circuit == CIRCUIT_OPEN);
+  CHECK(balancer_pick(r, a, T0, &wait) == a);
+  CHECK(balancer_pick(r, NULL, T0, &wait) == NULL);
+  CHECK(wait == 0);
+  route_table_destroy(t);
+}
+
+// Closed -> open after repeated failures -> half-open after the cooldown,
+// one trial at a time -> open again on failure, closed on success
+static void test_circuit(void) {
+  config_gateway_t gws[] = {{"10.0.0.1:25", 1, 0, 0}};
+  route_table_t *t = table_create(gws, 1);
+  route_t *r = route_lookup(t, "test");
+  upstream_t *u = &r->upstreams[0];
+  double wait;
+
+  // Failures only count when consecutive
+  for (int i = 0; i < FAIL_THRESHOLD - 1; i++)
+    balancer_report(r, u, UPSTREAM_FAIL, -1, T0);
+  balancer_report(r, u, UPSTREAM_OK, -1, T0);
+  balancer_report(r, u, UPSTREAM_NEUTRAL, -1, T0);
+  CHECK(u->circuit == CIRCUIT_CLOSED && u->failures == 0);
+
+  for (int i = 0; i < FAIL_THRESHOLD - 1; i++)
+    balancer_report(r, u, UPSTREAM_FAIL, -1, T0);
+  CHECK(u->circuit == CIRCUIT_CLOSED);
+  balancer_report(r, u, UPSTREAM_FAIL, -1, T0);
+  CHECK(u->circuit == CIRCUIT_OPEN);
+
+  CHECK(balancer_pick(r, NULL, T0 + COOLDOWN - 1, &wait) == NULL);
+  CHECK(wait == -1);
+
+  // Half-open: a single trial, the next pick finds nothing
+  CHECK(balancer_pick(r, NULL, T0 + COOLDOWN, &wait) == u);
+  CHECK(u->circuit == CIRCUIT_HALF_OPEN && u->trial);
+  CHECK(balancer_pick(r, NULL, T0 + COOLDOWN, &wait) == NULL);
+  CHECK(wait == -1);
+
+  // A failed trial opens the circuit for another cooldown
+  time_t t1 = T0 + COOLDOWN + 5;
+  balancer_report(r, u, UPSTREAM_FAIL, -1, t1);
+  CHECK(u->circuit == CIRCUIT_OPEN && u->opened_at == t1);
+  CHECK(balancer_pick(r, NULL, t1 + COOLDOWN - 1, &wait) == NULL);
+
+  // A neutral outcome ends the trial without deciding anything
+  CHECK(balancer_pick(r, NULL, t1 + COOLDOWN, &wait) == u);
+  balancer_report(r, u, UPSTREAM_NEUTRAL, -1, t1 + COOLDOWN);
+  CHECK(u->circuit == CIRCUIT_HALF_OPEN && !u->trial);
+
+  time_t t2 = t1 + COOLDOWN + 1;
+  CHECK(balancer_pick(r, NULL, t2, &wait) == u);
+  balancer_report(r, u, UPSTREAM_OK, 50, t2);
+  CHECK(u->circuit == CIRCUIT_CLOSED && u->closed_at == t2);
+  CHECK(u->inflight == 0);
+  route_table_destroy(t);
+}
+
+// A recovered gateway ramps up from a tenth of its weight
+static void test_slow_start(void) {
+  config_gateway_t gws[] = {{"10.0.0.1:25", 1, 0, 0}, {"10.0.0.2:25", 1, 0, 0}};
+  route_table_t *t = table_create(gws, 2);
+  route_t *r = route_lookup(t, "test");
+  upstream_t *a = &r->upstreams[0];
+  double wait;
+
+  for (int i = 0; i < FAIL_THRESHOLD; i++)
+    balancer_report(r, a, UPSTREAM_FAIL, -1, T0);
+  time_t closed = T0 + COOLDOWN;
+  CHECK(balancer_pick(r, &r->upstreams[1], closed, &wait) == a);
+  balancer_report(r, a, UPSTREAM_OK, -1, closed);
+  CHECK(a->circuit == CIRCUIT_CLOSED);
+
+  // Just closed: weight 0.1 against 1
+  int counts[2] = {0, 0};
+  pick_many(r, 220, closed, counts);
+  CHECK(counts[0] >= 18 && counts[0] <= 22);
+  drain(r, closed);
+
+  // Halfway: 0.5 against 1
+  memset(counts, 0, sizeof(counts));
+  pick_many(r, 300, closed + SLOW_START / 2, counts);
+  CHECK(counts[0] >= 98 && counts[0] <= 102);
+  drain(r, closed);
+
+  // Full weight again
+  memset(counts, 0, sizeof(counts));
+  pick_many(r, 200, closed + SLOW_START, counts);
+  CHECK(counts[0] >= 99 && counts[0] <= 101);
+  drain(r, closed);
+  route_table_destroy(t);
+}
+
+// Every gateway answers
+static int fake_probe(const char *host, int port, int timeout_ms) {
+  (void)host;
+  (void)port;
+  (void)timeout_ms;
+  return 0;
+}
+
+// A healthy probe lets a trial through before the cooldown is over
+static void test_probe(void) {
+  config_gateway_t gws[] = {{"10.0.0.1:25", 1, 0, 0}};
+  route_table_t *t = table_create(gws, 1);
+  route_t *r = route_lookup(t, "test");
+  upstream_t *u = &r->upstreams[0];
+
+  time_t now = time(NULL);
+  for (int i = 0; i < FAIL_THRESHOLD; i++)
+    balancer_report(r, u, UPSTREAM_FAIL, -1, now);
+  CHECK(u->circuit == CIRCUIT_OPEN);
+
+  balancer_set_probe(fake_probe);
+  CHECK(balancer_start(t, 1) == 0);
+  circuit_state_t state = CIRCUIT_OPEN;
+  for (int i = 0; i < 200 && state == CIRCUIT_OPEN; i++) {
+    usleep(10000);
+    pthread_mutex_lock(&r->lock);
+    state = u->circuit;
+    pthread_mutex_unlock(&r->lock);
+  }
+  balancer_stop();
+  balancer_set_probe(NULL);
+  CHECK(state == CIRCUIT_HALF_OPEN);
+
+  double wait;
+  CHECK(balancer_pick(r, NULL, now, &wait) == u);
+  route_table_destroy(t);
+}
+
+int main(void) {
+  test_weighted();
+  test_exclude_and_limits();
+  test_circuit();
+  test_slow_start();
+  test_probe();
+  return 0;
+}
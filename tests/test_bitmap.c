@@ -0,0 +1,68 @@
+#include "bitmap.h"
+#include "test.h"
+#include <string.h>
+
+// Bits past the tenth (and past a word) are kept; tests past the end are
+// clear
+static void test_set_test(void) {
+  bitmap_t b = {0};
+  CHECK(bitmap_empty(&b));
+  CHECK(!bitmap_test(&b, 0) && !bitmap_test(&b, 1000));
+
+  static const size_t bits[] = {0, 9, 10, 63, 64, 200};
+  for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++)
+    CHECK(bitmap_set(&b, bits[i]) == 0);
+  CHECK(!bitmap_empty(&b));
+  for (size_t i = 0; i < sizeof(bits) / sizeof(bits[0]); i++)
+    CHECK(bitmap_test(&b, bits[i]));
+  CHECK(!bitmap_test(&b, 11) && !bitmap_test(&b, 199));
+  CHECK(!bitmap_test(&b, 201) && !bitmap_test(&b, 100000));
+
+  bitmap_free(&b);
+  CHECK(bitmap_empty(&b));
+}
+
+// bitmap_bytes and bitmap_load round-trip the little-endian image, and a
+// short image loads as its low bytes
+static void test_bytes_load(void) {
+  bitmap_t b = {0};
+  size_t len = 1;
+  CHECK(bitmap_bytes(&b, &len) == NULL && len == 0);
+
+  CHECK(bitmap_set(&b, 1) == 0);
+  CHECK(bitmap_set(&b, 130) == 0);
+  unsigned char *data = bitmap_bytes(&b, &len);
+  CHECK(data && len == 24);
+  CHECK(data[0] == 0x02 && data[16] == 0x04);
+
+  bitmap_t copy = {0};
+  CHECK(bitmap_load(&copy, data, len) == 0);
+  CHECK(bitmap_test(&copy, 1) && bitmap_test(&copy, 130));
+  CHECK(!bitmap_test(&copy, 0) && !bitmap_test(&copy, 129));
+  free(data);
+
+  // Trailing zero words are trimmed
+  bitmap_t sparse = {0};
+  CHECK(bitmap_set(&sparse, 3) == 0);
+  CHECK(bitmap_set(&sparse, 300) == 0);
+  CHECK(bitmap_load(&sparse, "\x09", 1) == 0);
+  CHECK(bitmap_test(&sparse, 0) && bitmap_test(&sparse, 3));
+  CHECK(!bitmap_test(&sparse, 300));
+  data = bitmap_bytes(&sparse, &len);
+  CHECK(data && len == 8);
+  free(data);
+
+  CHECK(bitmap_copy(&sparse, &b) == 0);
+  CHECK(bitmap_test(&sparse, 130) && !bitmap_test(&sparse, 3));
+
+  bitmap_free(&b);
+  bitmap_free(&copy);
+  bitmap_free(&sparse);
+}
+
+int main(void) {
+  test_set_test();
+  test_bytes_load();
+  printf("bitmap: OK\n");
+  return 0;
+}
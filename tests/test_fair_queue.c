@@ -0,0 +1,124 @@
+#include "fair_queue.h"
+#include "test.h"
+#include <string.h>
+
+static int g_items[64];
+
+// Weights split each round: one item of a, two of b, until b runs dry
+static void test_round_robin(void) {
+  fair_queue_t *fq = fair_queue_create(16, 0, STATS_MEM_RELAY_QUEUE);
+  CHECK(fq);
+  for (int i = 0; i < 6; i++)
+    CHECK(fair_queue_try_push(fq, "a", 1, &g_items[i]) == 0);
+  for (int i = 0; i < 6; i++)
+    CHECK(fair_queue_try_push(fq, "b", 2, &g_items[10 + i]) == 0);
+  CHECK(fair_queue_size(fq) == 12);
+
+  static const int order[] = {0, 10, 11, 1, 12, 13, 2, 14, 15, 3, 4, 5};
+  for (int i = 0; i < 12; i++) {
+    void *item = NULL;
+    CHECK(fair_queue_pop_batch(fq, &item, 1) == 1);
+    CHECK(item == &g_items[order[i]]);
+  }
+  void *item = NULL;
+  CHECK(fair_queue_pop_batch(fq, &item, 1) == 0);
+  CHECK(fair_queue_size(fq) == 0);
+  fair_queue_destroy(fq);
+}
+
+// A flow that comes back after running empty waits for the current round
+static void test_new_flow_waits(void) {
+  fair_queue_t *fq = fair_queue_create(16, 0, STATS_MEM_RELAY_QUEUE);
+  CHECK(fq);
+  CHECK(fair_queue_try_push(fq, "a", 1, &g_items[0]) == 0);
+  CHECK(fair_queue_try_push(fq, "b", 1, &g_items[1]) == 0);
+  CHECK(fair_queue_try_push(fq, "b", 1, &g_items[2]) == 0);
+
+  void *items[4];
+  CHECK(fair_queue_pop_batch(fq, items, 1) == 1 && items[0] == &g_items[0]);
+  CHECK(fair_queue_try_push(fq, "a", 1, &g_items[3]) == 0);
+  CHECK(fair_queue_pop_batch(fq, items, 4) == 3);
+  CHECK(items[0] == &g_items[1]);
+  CHECK(items[1] == &g_items[3]);
+  CHECK(items[2] == &g_items[2]);
+  fair_queue_destroy(fq);
+}
+
+// Pushes past the queue or flow capacity are refused, never blocked
+static void test_capacity(void) {
+  fair_queue_t *fq = fair_queue_create(8, 3, STATS_MEM_RELAY_QUEUE);
+  CHECK(fq);
+  for (int i = 0; i < 3; i++)
+    CHECK(fair_queue_try_push(fq, "a", 1, &g_items[i]) == 0);
+  CHECK(fair_queue_try_push(fq, "a", 1, &g_items[3]) == -1);
+  for (int i = 0; i < 3; i++)
+    CHECK(fair_queue_try_push(fq, "b", 1, &g_items[4 + i]) == 0);
+  CHECK(fair_queue_try_push(fq, "", 1, &g_items[7]) == 0);
+  CHECK(fair_queue_try_push(fq, "", 1, &g_items[8]) == 0);
+  CHECK(fair_queue_try_push(fq, "c", 1, &g_items[9]) == -1);
+  CHECK(fair_queue_size(fq) == 8);
+
+  // Refused batch items end up at the front, in order: one of a's three
+  // places is free again, so a's second item is refused, then the queue
+  // fills up
+  void *out[8];
+  CHECK(fair_queue_pop_batch(fq, out, 2) == 2);
+  CHECK(out[0] == &g_items[0] && out[1] == &g_items[4]);
+  const char *keys[] = {"a", "a", "c", "d"};
+  const int weights[] = {1, 1, 1, 1};
+  void *batch[] = {&g_items[20], &g_items[21], &g_items[22], &g_items[23]};
+  CHECK(fair_queue_push_batch(fq, keys, weights, batch, 4) == 2);
+  CHECK(batch[0] == &g_items[21]);
+  CHECK(batch[1] == &g_items[23]);
+
+  fair_queue_stop(fq);
+  CHECK(fair_queue_pop_batch(fq, out, 1) == 1);
+  CHECK(fair_queue_try_push(fq, "d", 1, &g_items[24]) == -1);
+  fair_queue_destroy(fq);
+}
+
+// Stealing takes the newest items of the longest flow, oldest first
+static void test_steal(void) {
+  fair_queue_t *fq = fair_queue_create(16, 0, STATS_MEM_RELAY_QUEUE);
+  CHECK(fq);
+  CHECK(fair_queue_try_push(fq, "a", 1, &g_items[0]) == 0);
+  for (int i = 0; i < 5; i++)
+    CHECK(fair_queue_try_push(fq, "b", 1, &g_items[10 + i]) == 0);
+  CHECK(fair_queue_try_push(fq, "c", 1, &g_items[20]) == 0);
+
+  void *items[8];
+  CHECK(fair_queue_steal_batch(fq, items, 3) == 3);
+  CHECK(items[0] == &g_items[12]);
+  CHECK(items[1] == &g_items[13]);
+  CHECK(items[2] == &g_items[14]);
+  CHECK(fair_queue_size(fq) == 4);
+
+  // The owner still gets the oldest, in round robin order
+  CHECK(fair_queue_try_push(fq, "b", 1, &g_items[15]) == 0);
+  static const int order[] = {0, 10, 20, 11, 15};
+  CHECK(fair_queue_pop_batch(fq, items, 8) == 5);
+  for (int i = 0; i < 5; i++)
+    CHECK(items[i] == &g_items[order[i]]);
+
+  // A flow stolen empty leaves the round, wherever it was in it
+  CHECK(fair_queue_try_push(fq, "a", 1, &g_items[0]) == 0);
+  CHECK(fair_queue_try_push(fq, "b", 1, &g_items[10]) == 0);
+  CHECK(fair_queue_try_push(fq, "b", 1, &g_items[11]) == 0);
+  CHECK(fair_queue_steal_batch(fq, items, 8) == 2);
+  CHECK(items[0] == &g_items[10] && items[1] == &g_items[11]);
+  CHECK(fair_queue_try_push(fq, "c", 1, &g_items[20]) == 0);
+  CHECK(fair_queue_pop_batch(fq, items, 8) == 2);
+  CHECK(items[0] == &g_items[0] && items[1] == &g_items[20]);
+  CHECK(fair_queue_steal_batch(fq, items, 8) == 0);
+  fair_queue_destroy(fq);
+}
+
+int main(void) {
+  stats_init();
+  test_round_robin();
+  test_new_flow_waits();
+  test_capacity();
+  test_steal();
+  printf("fair_queue: OK\n");
+  return 0;
+}
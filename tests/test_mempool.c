@@ -0,0 +1,89 @@
+#include "mempool.h"
+#include "test.h"
+#include <stdint.h>
+#include <string.h>
+
+#define TAG STATS_MEM_SESSIONS
+
+static uint64_t mem_bytes(stats_mem_tag_t tag) {
+  return stats_get(&g_stats->memory[tag].bytes);
+}
+
+// The latest block grows and shrinks in place; others are copied
+static void test_realloc(void) {
+  mempool_t *pool = mempool_create(0, TAG);
+  CHECK(pool);
+
+  char *p = mempool_realloc(pool, NULL, 0, 10);
+  CHECK(p && ((uintptr_t)p & 7) == 0);
+  memcpy(p, "0123456789", 10);
+  CHECK(mempool_realloc(pool, p, 10, 100) == p);
+  CHECK(mempool_realloc(pool, p, 100, 20) == p);
+  CHECK(memcmp(p, "0123456789", 10) == 0);
+
+  // Past the chunk: moved, contents kept
+  char *big = mempool_realloc(pool, p, 20, 8000);
+  CHECK(big && big != p);
+  CHECK(memcmp(big, "0123456789", 10) == 0);
+
+  char *a = mempool_strdup(pool, "first");
+  char *b = mempool_alloc(pool, 16);
+  CHECK(a && b && b != a);
+  char *moved = mempool_realloc(pool, a, 6, 32);
+  CHECK(moved && moved != a && moved != b);
+  CHECK(strcmp(moved, "first") == 0);
+  mempool_destroy(pool);
+}
+
+// Only the latest block is given back at once
+static void test_free_last(void) {
+  mempool_t *pool = mempool_create(256, TAG);
+  CHECK(pool);
+  char *a = mempool_alloc(pool, 64);
+  char *b = mempool_alloc(pool, 64);
+  mempool_free(pool, a); // Not the latest: kept
+  CHECK(mempool_alloc(pool, 64) == b + 64);
+  char *c = mempool_alloc0(pool, 64);
+  CHECK(c && c[0] == 0 && c[63] == 0);
+  mempool_free(pool, c);
+  CHECK(mempool_alloc(pool, 64) == c);
+  mempool_destroy(pool);
+}
+
+// A reset keeps the first chunk and recycles the others as spare chunks
+static void test_reset(void) {
+  uint64_t before = mem_bytes(TAG);
+  mempool_t *pool = mempool_create(0, TAG);
+  CHECK(pool);
+  uint64_t created = mem_bytes(TAG);
+  char *first = mempool_alloc(pool, 100);
+
+  for (int i = 0; i < 64; i++)
+    CHECK(mempool_alloc(pool, 1000));
+  CHECK(mempool_alloc(pool, 100000)); // A chunk of its own
+  CHECK(mem_bytes(TAG) > created);
+
+  uint64_t spare = mem_bytes(STATS_MEM_SPARE);
+  mempool_reset(pool);
+  CHECK(mem_bytes(TAG) == created);
+  CHECK(mem_bytes(STATS_MEM_SPARE) > spare);
+  CHECK(mempool_alloc(pool, 100) == first);
+
+  // Growing takes the spare chunks back
+  spare = mem_bytes(STATS_MEM_SPARE);
+  for (int i = 0; i < 8; i++)
+    CHECK(mempool_alloc(pool, 1000));
+  CHECK(mem_bytes(STATS_MEM_SPARE) < spare);
+
+  mempool_destroy(pool);
+  CHECK(mem_bytes(TAG) == before);
+}
+
+int main(void) {
+  stats_init();
+  test_realloc();
+  test_free_last();
+  test_reset();
+  printf("mempool: OK\n");
+  return 0;
+}
@@ -0,0 +1,204 @@
+#include "queue.h"
+#include "test.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PRODUCERS 4
+#define CONSUMERS 4
+#define PER_PRODUCER 100000
+
+// FIFO order, capacity rounded up to a power of two, refused pushes when
+// full and pops when empty
+static void test_bounded(void) {
+  queue_t *q = queue_create_bounded(5);
+  CHECK(q);
+  CHECK(queue_is_empty(q));
+  for (uintptr_t i = 1; i <= 8; i++)
+    CHECK(queue_try_push(q, (void *)i) == 0);
+  CHECK(queue_try_push(q, (void *)9) == -1);
+  CHECK(queue_size(q) == 8);
+
+  for (uintptr_t i = 1; i <= 8; i++) {
+    CHECK(queue_try_pop(q) == (void *)i);
+    CHECK(queue_try_push(q, (void *)(i + 8)) == 0); // Wraps around
+  }
+  for (uintptr_t i = 9; i <= 16; i++)
+    CHECK(queue_try_pop(q) == (void *)i);
+  CHECK(queue_try_pop(q) == NULL);
+  queue_destroy(q);
+}
+
+static void *pop_one(void *arg) { return queue_pop(arg); }
+
+// A stop wakes blocked pops; pushes are refused from then on
+static void test_stop(void) {
+  queue_t *q = queue_create_bounded(4);
+  CHECK(q);
+  pthread_t t;
+  CHECK(pthread_create(&t, NULL, pop_one, q) == 0);
+  queue_stop(q);
+  void *item = (void *)1;
+  pthread_join(t, &item);
+  CHECK(item == NULL);
+  CHECK(queue_push(q, (void *)1) == -1);
+  CHECK(queue_try_push(q, (void *)1) == -1);
+  queue_destroy(q);
+}
+
+static long elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000 +
+         (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Batches keep their order and pops take what is there, up to max
+static void test_batch(void) {
+  queue_t *q = queue_create_bounded(8);
+  CHECK(q);
+  void *items[12];
+  for (uintptr_t i = 0; i < 12; i++)
+    items[i] = (void *)(i + 1);
+  CHECK(queue_push_batch(q, items, 5) == 5);
+
+  void *out[8];
+  CHECK(queue_pop_batch(q, out, 3, 0) == 3);
+  CHECK(out[0] == (void *)1 && out[2] == (void *)3);
+  CHECK(queue_pop_batch(q, out, 8, 0) == 2);
+  CHECK(out[0] == (void *)4 && out[1] == (void *)5);
+  CHECK(queue_pop_batch(q, out, 8, 0) == 0);
+  queue_destroy(q);
+}
+
+// An empty pop waits for its timeout, not longer
+static void test_pop_timeout(void) {
+  queue_t *q = queue_create_bounded(8);
+  CHECK(q);
+  void *out[4];
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  CHECK(queue_pop_batch(q, out, 4, 0) == 0);
+  CHECK(elapsed_ms(&start) < 20);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  CHECK(queue_pop_batch(q, out, 4, 50) == 0);
+  long waited = elapsed_ms(&start);
+  CHECK(waited >= 49 && waited < 1000);
+  queue_destroy(q);
+}
+
+static void *push_later(void *arg) {
+  usleep(20 * 1000);
+  void *items[3] = {(void *)1, (void *)2, (void *)3};
+  CHECK(queue_push_batch(arg, items, 3) == 3);
+  return NULL;
+}
+
+// A waiting pop returns as soon as a batch arrives
+static void test_pop_wakeup(void) {
+  queue_t *q = queue_create_bounded(8);
+  CHECK(q);
+  pthread_t t;
+  CHECK(pthread_create(&t, NULL, push_later, q) == 0);
+  void *out[4];
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int n = queue_pop_batch(q, out, 4, 5000);
+  CHECK(n >= 1 && out[0] == (void *)1);
+  CHECK(elapsed_ms(&start) < 2000);
+  pthread_join(t, NULL);
+  n += queue_pop_batch(q, out + n, 4 - n, 0);
+  CHECK(n == 3 && out[2] == (void *)3);
+  queue_destroy(q);
+}
+
+static void *push_ten(void *arg) {
+  void *items[10];
+  for (uintptr_t i = 0; i < 10; i++)
+    items[i] = (void *)(i + 1);
+  return (void *)(intptr_t)queue_push_batch(arg, items, 10);
+}
+
+// A batch larger than the ring goes in as room is made; a stop cuts it
+// short
+static void test_push_blocking(void) {
+  queue_t *q = queue_create_bounded(4);
+  CHECK(q);
+  pthread_t t;
+  CHECK(pthread_create(&t, NULL, push_ten, q) == 0);
+
+  // Each pop makes room for one more
+  void *out[1];
+  for (uintptr_t next = 1; next <= 3; next++) {
+    CHECK(queue_pop_batch(q, out, 1, 1000) == 1);
+    CHECK(out[0] == (void *)next);
+  }
+  while (queue_size(q) < 4)
+    usleep(1000);
+  usleep(10 * 1000);
+  CHECK(queue_size(q) == 4);
+
+  // Three items are still waiting for room when the queue stops
+  queue_stop(q);
+  void *pushed;
+  pthread_join(t, &pushed);
+  CHECK((intptr_t)pushed == 7);
+  queue_destroy(q);
+}
+
+static queue_t *g_q;
+static _Atomic int g_seen[PRODUCERS * PER_PRODUCER];
+
+static void *produce(void *arg) {
+  uintptr_t base = (uintptr_t)arg * PER_PRODUCER;
+  for (uintptr_t i = 0; i < PER_PRODUCER; i++)
+    CHECK(queue_push(g_q, (void *)(base + i + 1)) == 0);
+  return NULL;
+}
+
+static void *consume(void *arg) {
+  (void)arg;
+  void *item;
+  while ((item = queue_pop(g_q)) != NULL)
+    atomic_fetch_add(&g_seen[(uintptr_t)item - 1], 1);
+  return NULL;
+}
+
+// Every item pushed by concurrent producers into a small ring is popped
+// exactly once, with producers blocking while it is full
+static void test_mpmc(void) {
+  g_q = queue_create_bounded(64);
+  CHECK(g_q);
+  pthread_t producers[PRODUCERS], consumers[CONSUMERS];
+  for (uintptr_t i = 0; i < CONSUMERS; i++)
+    CHECK(pthread_create(&consumers[i], NULL, consume, NULL) == 0);
+  for (uintptr_t i = 0; i < PRODUCERS; i++)
+    CHECK(pthread_create(&producers[i], NULL, produce, (void *)i) == 0);
+  for (int i = 0; i < PRODUCERS; i++)
+    pthread_join(producers[i], NULL);
+
+  // Items still queued at the stop are handed out before pops fail
+  queue_stop(g_q);
+  for (int i = 0; i < CONSUMERS; i++)
+    pthread_join(consumers[i], NULL);
+  for (int i = 0; i < PRODUCERS * PER_PRODUCER; i++)
+    CHECK(atomic_load(&g_seen[i]) == 1);
+  CHECK(queue_is_empty(g_q));
+  queue_destroy(g_q);
+}
+
+int main(void) {
+  test_bounded();
+  test_stop();
+  test_batch();
+  test_pop_timeout();
+  test_pop_wakeup();
+  test_push_blocking();
+  test_mpmc();
+  printf("queue: OK\n");
+  return 0;
+}
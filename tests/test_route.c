@@ -0,0 +1,195 @@
+#include "route.h"
+#include "test.h"
+#include <string.h>
+
+static config_gateway_t g_gw_internal[] = {{"10.0.0.1:25", 1, 0, 0}};
+static config_gateway_t g_gw_sub[] = {{"10.0.0.2:2525", 1, 0, 0}};
+static config_gateway_t g_gw_star[] = {{"10.0.0.3:25", 1, 0, 0},
+                                       {"10.0.0.4:25", 3, 0, 0}};
+static config_gateway_t g_gw_example[] = {{"10.0.0.5:25", 1, 0, 0}};
+
+static void config_init(config_t *config, config_route_t *routes, int n) {
+  memset(config, 0, sizeof(*config));
+  config->upstream.host = "smtp.upstream.test";
+  config->upstream.port = 25;
+  config->policy.routes = routes;
+  config->policy.route_count = n;
+}
+
+static const char *gateway(route_t *r) { return r->upstreams[0].host; }
+
+// The longest domain suffix wins, at label boundaries only
+static void test_lookup(void) {
+  config_route_t routes[] = {
+      {"Internal.COM.", g_gw_internal, 1, 0, 0, 0, NULL},
+      {"eu.internal.com", g_gw_sub, 1, 0, 0, 0, "low"},
+      {"*.example.org", g_gw_example, 1, 0, 0, 0, NULL},
+  };
+  config_t config;
+  config_init(&config, routes, 3);
+  route_table_t *t = route_table_create(&config);
+  CHECK(t);
+  CHECK(route_count(t) == 4);
+
+  CHECK(strcmp(gateway(route_lookup(t, "internal.com")), "10.0.0.1") == 0);
+  CHECK(strcmp(gateway(route_lookup(t, "a.b.INTERNAL.com")), "10.0.0.1") ==
+        0);
+  CHECK(strcmp(gateway(route_lookup(t, "eu.internal.com")), "10.0.0.2") == 0);
+  CHECK(route_lookup(t, "x.eu.internal.com")->upstreams[0].port == 2525);
+  CHECK(strcmp(gateway(route_lookup(t, "internal.com.")), "10.0.0.1") == 0);
+  // "*.example.org" covers the domain itself too
+  CHECK(strcmp(gateway(route_lookup(t, "example.org")), "10.0.0.5") == 0);
+  CHECK(strcmp(gateway(route_lookup(t, "mx.example.org")), "10.0.0.5") == 0);
+
+  // Not at a label boundary, or no match at all: the default route, which
+  // is upstream.host without a "*" entry
+  route_t *def = route_at(t, 0);
+  CHECK(strcmp(def->domain, "*") == 0);
+  CHECK(route_lookup(t, "xinternal.com") == def);
+  CHECK(route_lookup(t, "internal.com.evil.test") == def);
+  CHECK(route_lookup(t, "com") == def);
+  CHECK(route_lookup(t, "") == def);
+  CHECK(route_lookup(t, NULL) == def);
+  CHECK(strcmp(gateway(def), "smtp.upstream.test") == 0);
+  CHECK(def->upstreams[0].port == 25);
+
+  CHECK(route_lookup(t, "eu.internal.com")->priority == ROUTE_PRIORITY_LOW);
+  CHECK(route_lookup(t, "internal.com")->priority == ROUTE_PRIORITY_NORMAL);
+  route_table_destroy(t);
+}
+
+// A "*" entry replaces upstream.host as the fallback; duplicates keep the
+// first entry
+static void test_fallback(void) {
+  config_route_t routes[] = {
+      {"internal.com", g_gw_internal, 1, 0, 0, 0, NULL},
+      {"*", g_gw_star, 2, 10, 0, 0, "high"},
+      {"INTERNAL.com", g_gw_sub, 1, 0, 0, 0, NULL},
+  };
+  config_t config;
+  config_init(&config, routes, 3);
+  route_table_t *t = route_table_create(&config);
+  CHECK(t);
+  CHECK(route_count(t) == 2);
+
+  route_t *def = route_lookup(t, "elsewhere.test");
+  CHECK(def == route_at(t, 0));
+  CHECK(def->upstream_count == 2);
+  CHECK(strcmp(def->upstreams[0].host, "10.0.0.3") == 0);
+  CHECK(def->upstreams[1].weight == 3);
+  CHECK(def->max_concurrency == 10);
+  CHECK(def->priority == ROUTE_PRIORITY_HIGH);
+  CHECK(strcmp(gateway(route_lookup(t, "internal.com")), "10.0.0.1") == 0);
+  route_table_destroy(t);
+}
+
+// Enough routes to wrap the open addressing probes around the table
+static void test_many(void) {
+  enum { N = 200 };
+  static char names[N][32];
+  config_route_t routes[N];
+  for (int i = 0; i < N; i++) {
+    snprintf(names[i], sizeof(names[i]), "d%d.test", i);
+    routes[i] = (config_route_t){names[i], g_gw_internal, 1, i, 0, 0, NULL};
+  }
+  config_t config;
+  config_init(&config, routes, N);
+  route_table_t *t = route_table_create(&config);
+  CHECK(t);
+  CHECK(route_count(t) == N + 1);
+  for (int i = 0; i < N; i++) {
+    char domain[64];
+    snprintf(domain, sizeof(domain), "mx.d%d.test", i);
+    route_t *r = route_lookup(t, domain);
+    CHECK(strcmp(r->domain, names[i]) == 0 && r->max_concurrency == i);
+  }
+  CHECK(route_lookup(t, "d200.test") == route_at(t, 0));
+  route_table_destroy(t);
+}
+
+static void test_invalid_gateway(void) {
+  config_gateway_t bad[] = {{"10.0.0.1", 1, 0, 0}};
+  config_route_t routes[] = {{"internal.com", bad, 1, 0, 0, 0, NULL}};
+  config_t config;
+  config_init(&config, routes, 1);
+  CHECK(route_table_create(&config) == NULL);
+}
+
+static void test_priority_and_flow(void) {
+  char *senders[] = {"VIP@a.test", "b.test"};
+  config_fair_weight_t weights[] = {{"big.test", 4}};
+  config_t config;
+  config_init(&config, NULL, 0);
+  config.policy.priority_senders = senders;
+  config.policy.priority_sender_count = 2;
+  config.policy.fair_weights = weights;
+  config.policy.fair_weight_count = 1;
+  route_table_t *t = route_table_create(&config);
+  CHECK(t);
+  route_t *def = route_at(t, 0);
+
+  CHECK(route_priority(t, def, "vip@A.test") == ROUTE_PRIORITY_HIGH);
+  CHECK(route_priority(t, def, "other@a.test") == ROUTE_PRIORITY_NORMAL);
+  CHECK(route_priority(t, def, "anyone@b.test") == ROUTE_PRIORITY_HIGH);
+  CHECK(route_priority(t, def, "") == ROUTE_PRIORITY_NORMAL);
+
+  // Default fair key: the sender's domain
+  char flow[ROUTE_DOMAIN_MAX];
+  CHECK(route_flow(t, "Joe@Big.test", "192.0.2.1", flow, sizeof(flow)) == 4);
+  CHECK(strcmp(flow, "big.test") == 0);
+  CHECK(route_flow(t, "joe@small.test", "192.0.2.1", flow, sizeof(flow)) ==
+        1);
+  CHECK(strcmp(flow, "small.test") == 0);
+  route_table_destroy(t);
+
+  config.policy.fair_key = "client";
+  t = route_table_create(&config);
+  CHECK(t);
+  CHECK(route_flow(t, "joe@big.test", "192.0.2.1", flow, sizeof(flow)) == 1);
+  CHECK(strcmp(flow, "192.0.2.1") == 0);
+  route_table_destroy(t);
+
+  config.policy.fair_key = "none";
+  t = route_table_create(&config);
+  CHECK(t);
+  route_flow(t, "joe@big.test", "192.0.2.1", flow, sizeof(flow));
+  CHECK(flow[0] == '\0');
+  route_table_destroy(t);
+}
+
+// Reload: any change compiled into the table is noticed
+static void test_config_changed(void) {
+  config_gateway_t gw_a[] = {{"10.0.0.1:25", 1, 0, 0}};
+  config_gateway_t gw_b[] = {{"10.0.0.1:25", 2, 0, 0}};
+  config_route_t routes_a[] = {{"internal.com", gw_a, 1, 0, 0, 0, NULL}};
+  config_route_t routes_b[] = {{"internal.com", gw_a, 1, 0, 0, 0, NULL}};
+  config_t a, b;
+  config_init(&a, routes_a, 1);
+  config_init(&b, routes_b, 1);
+  CHECK(!route_config_changed(&a, &b));
+
+  routes_b[0].gateways = gw_b;
+  CHECK(route_config_changed(&a, &b));
+  routes_b[0].gateways = gw_a;
+  routes_b[0].priority = "high";
+  CHECK(route_config_changed(&a, &b));
+  routes_b[0].priority = NULL;
+  b.upstream.port = 2525;
+  CHECK(route_config_changed(&a, &b));
+  b.upstream.port = 25;
+  b.policy.fair_key = "client";
+  CHECK(route_config_changed(&a, &b));
+  b.policy.fair_key = NULL;
+  b.policy.route_count = 0;
+  CHECK(route_config_changed(&a, &b));
+}
+
+int main(void) {
+  test_lookup();
+  test_fallback();
+  test_many();
+  test_invalid_gateway();
+  test_priority_and_flow();
+  test_config_changed();
+  return 0;
+}
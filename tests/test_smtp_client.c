@@ -0,0 +1,301 @@
+#include "reactor.h"
+#include "smtp_client.h"
+#include "test.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// The client runs on a real event loop against a loopback socket; the test
+// plays the server, checking the commands it reads and answering with
+// canned reply buffers
+
+#define WAIT_MS 2000
+
+typedef struct {
+  event_loop_t *loop;
+  smtp_client_t *c;
+  int server; // Our end of the session
+  int done;   // Transaction completion callbacks seen
+} peer_t;
+
+static long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+static void on_done(smtp_client_t *c, smtp_tx_t *tx, void *arg) {
+  (void)c;
+  (void)tx;
+  ((peer_t *)arg)->done++;
+}
+
+static void peer_open(peer_t *p) {
+  memset(p, 0, sizeof(*p));
+  int lfd = socket(AF_INET, SOCK_STREAM, 0);
+  CHECK(lfd >= 0);
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t len = sizeof(sin);
+  CHECK(bind(lfd, (struct sockaddr *)&sin, len) == 0);
+  CHECK(listen(lfd, 1) == 0);
+  CHECK(getsockname(lfd, (struct sockaddr *)&sin, &len) == 0);
+
+  p->loop = event_loop_create(16);
+  CHECK(p->loop);
+  p->c = smtp_client_open(p->loop, (struct sockaddr *)&sin, len, "mx.test",
+                          ntohs(sin.sin_port), "relay.test", 30);
+  CHECK(p->c);
+  p->server = accept(lfd, NULL, NULL);
+  CHECK(p->server >= 0);
+  CHECK(fcntl(p->server, F_SETFL, O_NONBLOCK) == 0);
+  close(lfd);
+}
+
+static void peer_close(peer_t *p) {
+  if (p->c)
+    smtp_client_close(p->c);
+  close(p->server);
+  event_loop_destroy(p->loop);
+}
+
+static void peer_send(peer_t *p, const char *s) {
+  size_t len = strlen(s);
+  CHECK(write(p->server, s, len) == (ssize_t)len);
+}
+
+// Run the loop until the client has sent exactly `expected`
+static void peer_expect(peer_t *p, const char *expected) {
+  size_t want = strlen(expected);
+  char buf[4096];
+  size_t got = 0;
+  long end = now_ms() + WAIT_MS;
+  CHECK(want < sizeof(buf));
+  while (got < want) {
+    CHECK(now_ms() < end);
+    event_loop_run_once(p->loop, 10);
+    ssize_t n = read(p->server, buf + got, want - got);
+    if (n > 0)
+      got += (size_t)n;
+    else
+      CHECK(n < 0 && errno == EAGAIN);
+  }
+  CHECK(memcmp(buf, expected, want) == 0);
+  // Nothing more than that
+  event_loop_run_once(p->loop, 10);
+  CHECK(read(p->server, buf, 1) < 0 && errno == EAGAIN);
+}
+
+// Run the loop until the transaction is over
+static void peer_wait_done(peer_t *p) {
+  long end = now_ms() + WAIT_MS;
+  while (!p->done) {
+    CHECK(now_ms() < end);
+    event_loop_run_once(p->loop, 10);
+  }
+  CHECK(p->done == 1);
+}
+
+static void tx_init(smtp_tx_t *tx, const char *const *rcpts, int count,
+                    int *codes) {
+  memset(tx, 0, sizeof(*tx));
+  tx->sender = "s@a.test";
+  tx->rcpts = rcpts;
+  tx->rcpt_count = count;
+  tx->rcpt_codes = codes;
+  tx->body = "Subject: t\r\n\r\nhi\r\n.\r\n";
+  tx->body_fd = -1;
+  tx->body_end = (off_t)strlen(tx->body);
+}
+
+// Greeting and EHLO, both multi-line and delivered in pieces that split
+// lines and reply codes
+static void peer_greet(peer_t *p, const char *caps) {
+  peer_send(p, "220-mx.test ESMTP\r\n22");
+  event_loop_run_once(p->loop, 10);
+  peer_send(p, "0 ready\r\n");
+  peer_expect(p, "EHLO relay.test\r\n");
+  peer_send(p, "250-mx.test\r\n250-SI");
+  event_loop_run_once(p->loop, 10);
+  peer_send(p, caps);
+}
+
+static void test_plain_envelope(void) {
+  peer_t p;
+  peer_open(&p);
+  const char *rcpts[] = {"a@b.test", "c@b.test"};
+  int codes[2];
+  smtp_tx_t tx;
+  tx_init(&tx, rcpts, 2, codes);
+  CHECK(smtp_client_start(p.c, &tx, on_done, &p) == 0);
+
+  peer_greet(&p, "ZE 1000\r\n250 8BITMIME\r\n");
+  // Without PIPELINING each command waits for the previous reply
+  peer_expect(&p, "MAIL FROM: <s@a.test>\r\n");
+  CHECK(p.c->caps == (SMTP_CAP_SIZE | SMTP_CAP_8BITMIME));
+  peer_send(&p, "250 ok\r\n");
+  peer_expect(&p, "RCPT TO: <a@b.test>\r\n");
+  peer_send(&p, "550 no such user\r\n");
+  peer_expect(&p, "RCPT TO: <c@b.test>\r\n");
+  peer_send(&p, "250 ok\r\n");
+  peer_expect(&p, "DATA\r\n");
+  peer_send(&p, "354 go\r\n");
+  peer_expect(&p, tx.body);
+  peer_send(&p, "250 queued\r\n");
+  peer_wait_done(&p);
+
+  CHECK(tx.result == SMTP_TX_OK);
+  CHECK(tx.code == 250 && strcmp(tx.reply, "250 queued") == 0);
+  CHECK(tx.data_started);
+  CHECK(codes[0] == 550 && codes[1] == 250);
+  CHECK(p.c->state == SMTP_CLIENT_READY);
+  CHECK(smtp_client_idle_ok(p.c));
+  peer_close(&p);
+}
+
+// Pipelined replies arrive as one buffer and are matched up in order
+static void test_pipelined(void) {
+  peer_t p;
+  peer_open(&p);
+  const char *rcpts[] = {"a@b.test", "c@b.test", "d@b.test"};
+  int codes[3];
+  smtp_tx_t tx;
+  tx_init(&tx, rcpts, 3, codes);
+  CHECK(smtp_client_start(p.c, &tx, on_done, &p) == 0);
+
+  peer_greet(&p, "ZE 1000\r\n250-PIPELINING\r\n250 8BITMIME\r\n");
+  peer_expect(&p, "MAIL FROM: <s@a.test>\r\n"
+                  "RCPT TO: <a@b.test>\r\n"
+                  "RCPT TO: <c@b.test>\r\n"
+                  "RCPT TO: <d@b.test>\r\n"
+                  "DATA\r\n");
+  CHECK(p.c->caps & SMTP_CAP_PIPELINING);
+  peer_send(&p, "250 ok\r\n550 no a\r\n250 ok\r\n451 later\r\n354 go\r\n");
+  peer_expect(&p, tx.body);
+  CHECK(codes[0] == 550 && codes[1] == 250 && codes[2] == 451);
+  peer_send(&p, "250 queued\r\n");
+  peer_wait_done(&p);
+  CHECK(tx.result == SMTP_TX_OK);
+
+  // The reused session is reset, the envelope following in the same write
+  p.done = 0;
+  tx_init(&tx, rcpts, 1, codes);
+  CHECK(smtp_client_start(p.c, &tx, on_done, &p) == 0);
+  peer_expect(&p, "RSET\r\n"
+                  "MAIL FROM: <s@a.test>\r\n"
+                  "RCPT TO: <a@b.test>\r\n"
+                  "DATA\r\n");
+  peer_send(&p, "250 reset\r\n250 ok\r\n250 ok\r\n354 go\r\n");
+  peer_expect(&p, tx.body);
+  peer_send(&p, "250 queued\r\n");
+  peer_wait_done(&p);
+  CHECK(tx.result == SMTP_TX_OK && codes[0] == 250);
+  CHECK(p.c->msgs_sent == 2);
+  peer_close(&p);
+}
+
+// Every RCPT refused, yet the pipelined DATA got a 354: no body may be
+// sent, the session is dropped and the first refusal decides the outcome
+static void test_pipelined_no_rcpts(void) {
+  const char *rcpts[] = {"a@b.test", "c@b.test"};
+  int codes[2];
+  smtp_tx_t tx;
+  for (int temp = 0; temp < 2; temp++) {
+    peer_t p;
+    peer_open(&p);
+    tx_init(&tx, rcpts, 2, codes);
+    CHECK(smtp_client_start(p.c, &tx, on_done, &p) == 0);
+    peer_greet(&p, "ZE 1000\r\n250 PIPELINING\r\n");
+    peer_expect(&p, "MAIL FROM: <s@a.test>\r\n"
+                    "RCPT TO: <a@b.test>\r\n"
+                    "RCPT TO: <c@b.test>\r\n"
+                    "DATA\r\n");
+    peer_send(&p, temp ? "250 ok\r\n550 no a\r\n452 full\r\n354 go\r\n"
+                       : "250 ok\r\n550 no a\r\n553 no c\r\n354 go\r\n");
+    peer_wait_done(&p);
+
+    CHECK(tx.result == (temp ? SMTP_TX_TEMPFAIL : SMTP_TX_PERMFAIL));
+    CHECK(tx.code == 550 && strcmp(tx.reply, "550 no a") == 0);
+    CHECK(!tx.data_started);
+    CHECK(codes[0] == 550 && codes[1] == (temp ? 452 : 553));
+    CHECK(p.c->state == SMTP_CLIENT_BROKEN);
+    // Nothing was written after DATA
+    char c;
+    CHECK(read(p.server, &c, 1) < 0 && errno == EAGAIN);
+    peer_close(&p);
+  }
+}
+
+// A refused MAIL: the RCPT replies are consumed but say nothing
+static void test_pipelined_mail_refused(void) {
+  peer_t p;
+  peer_open(&p);
+  const char *rcpts[] = {"a@b.test"};
+  int codes[1];
+  smtp_tx_t tx;
+  tx_init(&tx, rcpts, 1, codes);
+  CHECK(smtp_client_start(p.c, &tx, on_done, &p) == 0);
+  peer_greet(&p, "ZE 1000\r\n250 PIPELINING\r\n");
+  peer_expect(&p, "MAIL FROM: <s@a.test>\r\n"
+                  "RCPT TO: <a@b.test>\r\n"
+                  "DATA\r\n");
+  peer_send(&p, "451 try later\r\n503 need MAIL\r\n503 need RCPT\r\n");
+  peer_wait_done(&p);
+  CHECK(tx.result == SMTP_TX_TEMPFAIL);
+  CHECK(tx.code == 451 && codes[0] == 0);
+  CHECK(p.c->state == SMTP_CLIENT_READY);
+  CHECK(smtp_client_idle_ok(p.c));
+  peer_close(&p);
+}
+
+static void test_malformed(void) {
+  peer_t p;
+  peer_open(&p);
+  const char *rcpts[] = {"a@b.test"};
+  smtp_tx_t tx;
+  tx_init(&tx, rcpts, 1, NULL);
+  CHECK(smtp_client_start(p.c, &tx, on_done, &p) == 0);
+  peer_send(&p, "2x0 hello\r\n");
+  peer_wait_done(&p);
+  CHECK(tx.result == SMTP_TX_TEMPFAIL);
+  CHECK(p.c->state == SMTP_CLIENT_BROKEN);
+  peer_close(&p);
+}
+
+// Anything sent behind the final reply makes the idle session unusable
+static void test_unsolicited(void) {
+  peer_t p;
+  peer_open(&p);
+  const char *rcpts[] = {"a@b.test"};
+  smtp_tx_t tx;
+  tx_init(&tx, rcpts, 1, NULL);
+  CHECK(smtp_client_start(p.c, &tx, on_done, &p) == 0);
+  peer_greet(&p, "ZE 1000\r\n250 PIPELINING\r\n");
+  peer_expect(&p, "MAIL FROM: <s@a.test>\r\n"
+                  "RCPT TO: <a@b.test>\r\n"
+                  "DATA\r\n");
+  peer_send(&p, "250 ok\r\n250 ok\r\n354 go\r\n");
+  peer_expect(&p, tx.body);
+  peer_send(&p, "250 queued\r\n421 closing\r\n");
+  peer_wait_done(&p);
+  CHECK(tx.result == SMTP_TX_OK);
+  CHECK(!smtp_client_idle_ok(p.c));
+  peer_close(&p);
+}
+
+int main(void) {
+  test_plain_envelope();
+  test_pipelined();
+  test_pipelined_no_rcpts();
+  test_pipelined_mail_refused();
+  test_malformed();
+  test_unsolicited();
+  return 0;
+}
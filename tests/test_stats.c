@@ -0,0 +1,97 @@
+#include "stats.h"
+#include "test.h"
+#include <pthread.h>
+#include <string.h>
+
+#define THREADS 8
+#define COUNT 100000
+
+static pthread_barrier_t g_barrier;
+
+static void *count(void *arg) {
+  (void)arg;
+  for (int i = 0; i < COUNT; i++) {
+    STATS_INC_CONNECTIONS();
+    STATS_INC_ACTIVE_CONN();
+  }
+  // Shards are read while their threads are alive, then folded at exit
+  pthread_barrier_wait(&g_barrier);
+  pthread_barrier_wait(&g_barrier);
+  return NULL;
+}
+
+static void run_threads(uint64_t expected) {
+  pthread_t threads[THREADS];
+  pthread_barrier_init(&g_barrier, NULL, THREADS + 1);
+  for (int i = 0; i < THREADS; i++)
+    CHECK(pthread_create(&threads[i], NULL, count, NULL) == 0);
+  pthread_barrier_wait(&g_barrier);
+  CHECK(stats_get(&g_stats->total_connections) == expected);
+  pthread_barrier_wait(&g_barrier);
+  for (int i = 0; i < THREADS; i++)
+    pthread_join(threads[i], NULL);
+  pthread_barrier_destroy(&g_barrier);
+  CHECK(stats_get(&g_stats->total_connections) == expected);
+}
+
+// Per-thread shards add up, live and after their threads exit; a second
+// batch of threads reuses the shards left behind
+static void test_sharded_counters(void) {
+  run_threads((uint64_t)THREADS * COUNT);
+  run_threads((uint64_t)2 * THREADS * COUNT);
+  CHECK(stats_get(&g_stats->active_connections) ==
+        (uint64_t)2 * THREADS * COUNT);
+
+  // A gauge decremented by other threads than those that raised it
+  for (int i = 0; i < 2 * THREADS * COUNT; i++)
+    STATS_DEC_ACTIVE_CONN();
+  CHECK(stats_get(&g_stats->active_connections) == 0);
+}
+
+// Snapshots fold every counter at once; a reset clears the gauges only
+static void test_snapshot_reset(void) {
+  STATS_INC_ACTIVE_CONN();
+  STATS_INC_QUEUE_DEPTH();
+  stats_add(&g_stats->relay_success, 5);
+
+  stats_t snap;
+  stats_snapshot(&snap);
+  CHECK(stats_get(&snap.total_connections) == (uint64_t)2 * THREADS * COUNT);
+  CHECK(stats_get(&snap.active_connections) == 1);
+  CHECK(stats_get(&snap.relay_queue_depth) == 1);
+  CHECK(stats_get(&snap.relay_success) == 5);
+
+  // Counters outside g_stats are updated in place
+  stats_inc(&snap.relay_success);
+  CHECK(stats_get(&snap.relay_success) == 6);
+  CHECK(stats_get(&g_stats->relay_success) == 5);
+
+  stats_reset();
+  CHECK(stats_get(&g_stats->active_connections) == 0);
+  CHECK(stats_get(&g_stats->relay_queue_depth) == 0);
+  CHECK(stats_get(&g_stats->total_connections) ==
+        (uint64_t)2 * THREADS * COUNT);
+  CHECK(stats_get(&g_stats->relay_success) == 5);
+}
+
+// Both formats report the retry backlog next to the relay outcomes
+static void test_format(void) {
+  for (int i = 0; i < 3; i++)
+    STATS_INC_RELAY_RETRYING();
+  STATS_DEC_RELAY_RETRYING();
+
+  char buf[8192];
+  stats_format_text(buf, sizeof(buf));
+  CHECK(strstr(buf, "  Retrying:    2\n"));
+  stats_format_json(buf, sizeof(buf));
+  CHECK(strstr(buf, "\"retrying\": 2,"));
+}
+
+int main(void) {
+  stats_init();
+  test_sharded_counters();
+  test_snapshot_reset();
+  test_format();
+  printf("stats: OK\n");
+  return 0;
+}